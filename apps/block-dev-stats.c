@@ -1,7 +1,7 @@
 /**
  * @brief Show block device statistics, where available.
  *
- * Shows cache hit/miss/write counts for ATA devices, mostly.
+ * Shows block cache hit/miss/write counts for disk devices.
  *
  * @copyright
  * This file is part of ToaruOS and is released under the terms
@@ -24,19 +24,23 @@ int main(int argc, char * argv[]) {
 		return 2;
 	}
 
-	uint64_t stats[4] = {-1};
+	struct block_dev_stats stats;
 
-	long res = ioctl(fd, 0x2A01234UL, &stats);
+	long res = ioctl(fd, IOCTL_BLOCK_STATS, &stats);
 
 	if (res < 0) {
 		fprintf(stderr, "ioctl: %ld\n", res);
 		return 3;
 	}
 
-	fprintf(stderr, "hits:\t%zu\n", stats[0]);
-	fprintf(stderr, "misses:\t%zu\n", stats[1]);
-	fprintf(stderr, "evicts:\t%zu\n", stats[2]);
-	fprintf(stderr, "writes:\t%zu\n", stats[3]);
+	fprintf(stderr, "hits:\t%zu\n", stats.hits);
+	fprintf(stderr, "misses:\t%zu\n", stats.misses);
+	fprintf(stderr, "evicts:\t%zu\n", stats.evictions);
+	fprintf(stderr, "writes:\t%zu\n", stats.writes);
+	fprintf(stderr, "flushed:\t%zu\n", stats.writebacks);
+	fprintf(stderr, "cached:\t%zu\n", stats.cached);
+	fprintf(stderr, "dirty:\t%zu\n", stats.dirty);
+	fprintf(stderr, "ahead:\t%zu\n", stats.readahead);
 
 	return 0;
 }
@@ -133,6 +133,15 @@ static int print_interface(const char * if_name) {
 		fprintf(stdout,"        TX packets %zu  bytes %zu (%s)\n", counts.tx_count, counts.tx_bytes, _buf);
 	}
 
+	netif_queue_counters_t qcounts = {0};
+	while (!ioctl(netdev, SIOCGIFQCOUNTS, &qcounts)) {
+		fprintf(stdout,"        queue %u: RX packets %zu  errors %zu  interrupts %zu  polls %zu  full polls %zu\n",
+			qcounts.queue, qcounts.rx_packets, qcounts.rx_errors, qcounts.rx_interrupts, qcounts.rx_polls, qcounts.rx_budget_hits);
+		fprintf(stdout,"                 TX packets %zu  doorbells %zu  reclaimed %zu  ring full %zu\n",
+			qcounts.tx_packets, qcounts.tx_doorbells, qcounts.tx_reclaimed, qcounts.tx_ring_full);
+		if (++qcounts.queue >= qcounts.queue_count) break;
+	}
+
 	/* TODO stats */
 
 	fprintf(stdout,"\n");
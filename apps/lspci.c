@@ -89,8 +89,12 @@ struct {
 
 	/* Red Hat */
 	{0x1af4, 0x1000, "virtio-net"},
+	{0x1af4, 0x1001, "virtio-blk"},
+	{0x1af4, 0x1041, "virtio-net"},
+	{0x1af4, 0x1042, "virtio-blk"},
 	{0x1af4, 0x1052, "virtio-input"},
 	{0x1b36, 0x000d, "QEMU XHCI Host Controller"},
+	{0x1b36, 0x0010, "QEMU NVM Express Controller"},
 
 	/* Intel */
 	{0x8086, 0x0044, "DRAM Controller"},
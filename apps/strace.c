@@ -22,6 +22,7 @@
 #include <sys/time.h>
 #include <sys/socket.h>
 #include <sys/uregs.h>
+#include <sys/futex.h>
 #include <syscall_nums.h>
 
 static FILE * logfile;
@@ -101,6 +102,11 @@ const char * syscall_names[] = {
 	[SYS_SHUTDOWN]     = "shutdown",
 	[SYS_PREAD]        = "pread",
 	[SYS_PWRITE]       = "pwrite",
+	[SYS_FUTEX]        = "futex",
+	[SYS_MMAP]         = "mmap",
+	[SYS_MUNMAP]       = "munmap",
+	[SYS_MPROTECT]     = "mprotect",
+	[SYS_GETDENTS]     = "getdents",
 };
 
 char syscall_mask[] = {
@@ -177,6 +183,11 @@ char syscall_mask[] = {
 	[SYS_SHUTDOWN]     = 1,
 	[SYS_PREAD]        = 1,
 	[SYS_PWRITE]       = 1,
+	[SYS_FUTEX]        = 1,
+	[SYS_MMAP]         = 1,
+	[SYS_MUNMAP]       = 1,
+	[SYS_MPROTECT]     = 1,
+	[SYS_GETDENTS]     = 1,
 };
 
 #define M(e) [e] = #e
@@ -599,6 +610,28 @@ static void handle_syscall(pid_t pid, struct URegs * r) {
 		case SYS_CLOSE:
 			fd_arg(pid, uregs_syscall_arg1(r));
 			break;
+		case SYS_FUTEX:
+			pointer_arg(uregs_syscall_arg1(r)); COMMA;
+			switch (uregs_syscall_arg2(r)) {
+				case FUTEX_WAIT: fprintf(logfile, "FUTEX_WAIT"); break;
+				case FUTEX_WAKE: fprintf(logfile, "FUTEX_WAKE"); break;
+				default: int_arg(uregs_syscall_arg2(r)); break;
+			}
+			COMMA;
+			int_arg(uregs_syscall_arg3(r));
+			break;
+		case SYS_MMAP:
+			pointer_arg(uregs_syscall_arg1(r));
+			break;
+		case SYS_MUNMAP:
+			pointer_arg(uregs_syscall_arg1(r)); COMMA;
+			uint_arg(uregs_syscall_arg2(r));
+			break;
+		case SYS_MPROTECT:
+			pointer_arg(uregs_syscall_arg1(r)); COMMA;
+			uint_arg(uregs_syscall_arg2(r)); COMMA;
+			int_arg(uregs_syscall_arg3(r));
+			break;
 		case SYS_SBRK:
 			uint_arg(uregs_syscall_arg1(r));
 			break;
@@ -625,6 +658,11 @@ static void handle_syscall(pid_t pid, struct URegs * r) {
 			int_arg(uregs_syscall_arg2(r)); COMMA;
 			pointer_arg(uregs_syscall_arg3(r));
 			break;
+		case SYS_GETDENTS:
+			fd_arg(pid, uregs_syscall_arg1(r)); COMMA;
+			pointer_arg(uregs_syscall_arg2(r)); COMMA;
+			uint_arg(uregs_syscall_arg3(r));
+			break;
 		case SYS_KILL:
 			int_arg(uregs_syscall_arg1(r)); COMMA; /* pid_arg? */
 			int_arg(uregs_syscall_arg2(r)); /* TODO signal name */
@@ -908,7 +946,7 @@ int main(int argc, char * argv[]) {
 								int syscalls[] = {
 									SYS_OPEN, SYS_READ, SYS_WRITE, SYS_CLOSE, SYS_STAT, SYS_FSWAIT,
 									SYS_FSWAIT2, SYS_FSWAIT3, SYS_SEEK, SYS_IOCTL, SYS_PIPE, SYS_MKPIPE,
-									SYS_DUP2, SYS_READDIR, SYS_OPENPTY, SYS_PREAD, SYS_PWRITE,
+									SYS_DUP2, SYS_READDIR, SYS_GETDENTS, SYS_OPENPTY, SYS_PREAD, SYS_PWRITE,
 									0
 								};
 								for (int *i = syscalls; *i; i++) {
@@ -0,0 +1,194 @@
+/**
+ * @brief Measure TCP throughput
+ *
+ * Connects to a remote host and either sends a fixed amount
+ * of data or reads until the remote end closes, then reports
+ * the achieved rate. With QEMU user networking, run something
+ * like `nc -l 5001 > /dev/null` on the host and then
+ * `tcpperf 10.0.2.2` in the guest.
+ *
+ * With -s, listens instead and drains every connection it
+ * accepts, so `tcpperf -s & tcpperf 127.0.0.1` measures the
+ * stack over the loopback interface.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2021 K. Lange
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+
+#define DEFAULT_PORT  5001
+#define DEFAULT_BYTES (64 * 1024 * 1024)
+#define CHUNK_SIZE    (64 * 1024)
+
+static unsigned long clocktime(void) {
+	struct timeval tv;
+	gettimeofday(&tv,NULL);
+	return tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static int usage(char * argv[]) {
+	fprintf(stderr,
+			"usage: %s [-r] [-p PORT] [-n BYTES] HOST\n"
+			"       %s -s [-p PORT]\n"
+			"\n"
+			" -s        accept connections and receive from each until it closes\n"
+			" -r        receive until the remote closes instead of sending\n"
+			" -p PORT   port to connect to or listen on (default %d)\n"
+			" -n BYTES  bytes to send (default %d)\n"
+			" -?        show this help text\n",
+			argv[0], argv[0], DEFAULT_PORT, DEFAULT_BYTES);
+	return 1;
+}
+
+static void report(size_t total, unsigned long start) {
+	unsigned long elapsed = clocktime() - start;
+	if (!elapsed) elapsed = 1;
+	double seconds = (double)elapsed / 1000000.0;
+	double rate = (double)total / seconds;
+	printf("%zu bytes in %.3f seconds: %.2f MB/s, %.2f Mbit/s\n",
+		total, seconds, rate / (1024.0 * 1024.0), rate * 8.0 / 1000000.0);
+}
+
+static size_t drain(int sock, char * buf, const char * name) {
+	size_t total = 0;
+	while (1) {
+		ssize_t r = recv(sock, buf, CHUNK_SIZE, 0);
+		if (r < 0) {
+			fprintf(stderr, "%s: recv: %s\n", name, strerror(errno));
+			break;
+		}
+		if (r == 0) break;
+		total += r;
+	}
+	return total;
+}
+
+static int serve(int port, char * argv[]) {
+	int sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (sock < 0) {
+		fprintf(stderr, "%s: socket: %s\n", argv[0], strerror(errno));
+		return 1;
+	}
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = INADDR_ANY;
+
+	if (bind(sock, (struct sockaddr*)&addr, sizeof(struct sockaddr_in)) < 0) {
+		fprintf(stderr, "%s: bind: %s\n", argv[0], strerror(errno));
+		return 1;
+	}
+
+	if (listen(sock, 8) < 0) {
+		fprintf(stderr, "%s: listen: %s\n", argv[0], strerror(errno));
+		return 1;
+	}
+
+	char * buf = malloc(CHUNK_SIZE);
+
+	while (1) {
+		struct sockaddr_in peer;
+		socklen_t peer_len = sizeof(peer);
+		int conn = accept(sock, (struct sockaddr*)&peer, &peer_len);
+		if (conn < 0) {
+			fprintf(stderr, "%s: accept: %s\n", argv[0], strerror(errno));
+			return 1;
+		}
+		printf("connection from %s:%d\n", inet_ntoa(peer.sin_addr), ntohs(peer.sin_port));
+		unsigned long start = clocktime();
+		size_t total = drain(conn, buf, argv[0]);
+		report(total, start);
+		close(conn);
+	}
+}
+
+int main(int argc, char * argv[]) {
+	int receive = 0;
+	int server = 0;
+	int port = DEFAULT_PORT;
+	size_t bytes = DEFAULT_BYTES;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "?srp:n:")) != -1) {
+		switch (opt) {
+			case 's':
+				server = 1;
+				break;
+			case 'r':
+				receive = 1;
+				break;
+			case 'p':
+				port = atoi(optarg);
+				break;
+			case 'n':
+				bytes = strtoul(optarg, NULL, 0);
+				break;
+			case '?':
+			default:
+				return usage(argv);
+		}
+	}
+
+	if (server) return serve(port, argv);
+	if (optind >= argc) return usage(argv);
+
+	struct hostent * host = gethostbyname(argv[optind]);
+	if (!host) {
+		fprintf(stderr, "%s: %s: not found\n", argv[0], argv[optind]);
+		return 1;
+	}
+
+	int sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (sock < 0) {
+		fprintf(stderr, "%s: socket: %s\n", argv[0], strerror(errno));
+		return 1;
+	}
+
+	struct sockaddr_in addr;
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	memcpy(&addr.sin_addr.s_addr, host->h_addr, host->h_length);
+
+	if (connect(sock, (struct sockaddr*)&addr, sizeof(struct sockaddr_in)) < 0) {
+		fprintf(stderr, "%s: connect: %s\n", argv[0], strerror(errno));
+		return 1;
+	}
+
+	char * buf = malloc(CHUNK_SIZE);
+	for (int i = 0; i < CHUNK_SIZE; ++i) buf[i] = i;
+
+	size_t total = 0;
+	unsigned long start = clocktime();
+
+	if (receive) {
+		total = drain(sock, buf, argv[0]);
+	} else {
+		while (total < bytes) {
+			size_t chunk = bytes - total > CHUNK_SIZE ? CHUNK_SIZE : bytes - total;
+			ssize_t r = send(sock, buf, chunk, 0);
+			if (r < 0) {
+				fprintf(stderr, "%s: send: %s\n", argv[0], strerror(errno));
+				break;
+			}
+			total += r;
+		}
+	}
+
+	report(total, start);
+	close(sock);
+	return 0;
+}
@@ -14,6 +14,10 @@ if lspci -q 8086:0046 then insmod /mod/i965.ko
 if lspci -q 1274:1371 then insmod /mod/es1371.ko
 
 if lspci -q 8086:100e,8086:1004,8086:100f,8086:10ea,8086:10d3 then insmod /mod/e1000.ko
+if lspci -q 1AF4:1000,1AF4:1041 then insmod /mod/virtio-net.ko
 
 # Device drivers
 if lspci -q 8086:7111,8086:7010 then insmod /mod/ata.ko
+if lspci -q 8086:2922,8086:2829,8086:2681,8086:3A22,8086:1C02,8086:1E02 then insmod /mod/ahci.ko
+if lspci -q 1AF4:1001,1AF4:1042 then insmod /mod/virtio-blk.ko
+if lspci -q 1B36:0010 then insmod /mod/nvme.ko
@@ -12,7 +12,9 @@ typedef struct dirent {
 
 typedef struct DIR {
 	int fd;
-	int cur_entry;
+	int cur_entry;          /* Next entry in buffer to return */
+	int entries;            /* Entries in buffer */
+	struct dirent * buffer; /* Filled by getdents */
 } DIR;
 
 DIR * opendir (const char * dirname);
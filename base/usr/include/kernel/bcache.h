@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <kernel/vfs.h>
+#include <sys/ioctl.h>
+
+#define BCACHE_BLOCK_SIZE 4096
+
+struct bcache_device;
+
+/**
+ * Transfer @p count blocks starting at @p block between the device
+ * and @p buffer. Returns 0 on success or a negative error.
+ */
+typedef int (*bcache_io_t)(struct bcache_device * dev, uint64_t block, size_t count, uint8_t * buffer);
+
+struct bcache_device {
+	const char * name;
+	void * driver;           /* The driver's own state for this device */
+	uint64_t size;           /* In bytes */
+	bcache_io_t read_blocks;
+	bcache_io_t write_blocks; /* NULL for read-only devices */
+	int (*flush)(struct bcache_device * dev); /* Optional; flush the device's own write cache */
+	struct block_dev_stats stats;
+};
+
+extern void bcache_register(struct bcache_device * dev);
+extern ssize_t bcache_read(struct bcache_device * dev, off_t offset, size_t size, uint8_t * buffer);
+extern ssize_t bcache_write(struct bcache_device * dev, off_t offset, size_t size, uint8_t * buffer);
+extern int bcache_sync(struct bcache_device * dev);
+extern int bcache_ioctl(struct bcache_device * dev, unsigned long request, void * argp);
+
+/* For block device nodes whose @c device is a @c struct @c bcache_device */
+extern ssize_t bcache_node_read(fs_node_t * node, off_t offset, size_t size, uint8_t * buffer);
+extern ssize_t bcache_node_write(fs_node_t * node, off_t offset, size_t size, uint8_t * buffer);
+extern int bcache_node_ioctl(fs_node_t * node, unsigned long request, void * argp);
@@ -0,0 +1,9 @@
+#pragma once
+
+#include <kernel/vfs.h>
+
+int dcache_lookup(fs_node_t * dir, const char * name, fs_node_t ** out, unsigned long * gen);
+void dcache_insert(fs_node_t * dir, const char * name, fs_node_t * node, unsigned long gen);
+void dcache_invalidate(fs_node_t * dir, const char * name);
+void dcache_purge(void * device);
+void dcache_initialize(void);
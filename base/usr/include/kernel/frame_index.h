@@ -0,0 +1,12 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define FRAME_INDEX_NONE ((uintptr_t)-1)
+
+void frame_index_init(volatile uint32_t * bitmap, size_t nframes);
+int frame_index_ready(void);
+void frame_index_update(uintptr_t frame);
+uintptr_t frame_index_find(size_t n);
+size_t frame_index_largest(void);
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdint.h>
+#include <kernel/types.h>
+#include <kernel/process.h>
+
+/* Where mappings go when the caller doesn't ask for an address */
+#define USER_MMAP_LOW  0x0000200000000000UL
+#define USER_MMAP_HIGH 0x0000300000000000UL
+
+struct __mmap_args;
+
+/* Demand paging counters, reported in /proc/execstat */
+struct mmap_stats {
+	uint64_t file_pages;  /* Pages read in from files */
+	uint64_t anon_pages;  /* Zeroed pages given to private memory */
+	uint64_t zero_maps;   /* Reads satisfied by mapping the zero page */
+	uint64_t zero_breaks; /* Writes that replaced the zero page with a fresh one */
+};
+
+extern struct mmap_stats mmap_stats;
+
+/* Syscalls */
+extern long sys_mmap(struct __mmap_args * args);
+extern long sys_munmap(void * addr, size_t length);
+extern long sys_mprotect(void * addr, size_t length, int prot);
+
+/* Other exposed functions */
+extern void mmap_install(void);
+extern long mmap_map(uintptr_t addr, size_t length, int prot, int flags, fs_node_t * file, off_t offset, uint64_t file_end, int may_write);
+extern int mmap_page_fault(uintptr_t address, int write);
+extern int mmap_populate(page_directory_t * dir, uintptr_t address, int write);
+extern void mmap_clone(page_directory_t * from, page_directory_t * to);
+extern void mmap_release(page_directory_t * dir);
@@ -44,6 +44,10 @@ void mmu_set_directory(union PML * new_pml);
 void mmu_free(union PML * from);
 union PML * mmu_clone(union PML * from);
 void mmu_invalidate(uintptr_t addr);
+void mmu_invalidate_range(uintptr_t start, uintptr_t end);
+
+/* Ranges longer than this flush the whole TLB instead of going page by page. */
+#define MMU_INVALIDATE_MAX_PAGES 32
 uintptr_t mmu_allocate_a_frame(void);
 uintptr_t mmu_allocate_n_frames(int n);
 union PML * mmu_get_kernel_directory(void);
@@ -58,6 +62,10 @@ size_t mmu_total_memory(void);
 size_t mmu_used_memory(void);
 
 void * sbrk(size_t);
+size_t sbrk_release(void * start, size_t bytes);
+size_t sbrk_restore(void * start, size_t bytes);
 
 union PML * mmu_get_page_other(union PML * root, uintptr_t virtAddr);
 int mmu_validate_user_pointer(const void * addr, size_t size, int flags);
+void mmu_page_protect(union PML * page, uintptr_t address, unsigned int flags);
+void mmu_unmap_user(uintptr_t addr, size_t size);
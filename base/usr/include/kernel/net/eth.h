@@ -1,6 +1,7 @@
 #pragma once
 
 #include <kernel/vfs.h>
+#include <kernel/net/netbuf.h>
 
 #define ETHERNET_TYPE_IPV4 0x0800
 #define ETHERNET_TYPE_ARP  0x0806
@@ -16,7 +17,7 @@ struct ethernet_packet {
 	uint8_t payload[];
 } __attribute__((packed)) __attribute__((aligned(2)));
 
-void net_eth_handle(struct ethernet_packet * frame, fs_node_t * nic, size_t size);
+void net_eth_handle(struct netbuf * nb, fs_node_t * nic);
 
 struct EthernetDevice {
 	char if_name[32];
@@ -33,9 +34,17 @@ struct EthernetDevice {
 	/* TODO: Address lists? */
 
 	fs_node_t * device_node;
+
+	/* Queue a frame, taking over the caller's reference; if unset, frames are written to device_node */
+	void (*transmit)(struct EthernetDevice * nic, struct netbuf * nb);
+
+	int offloads;
 };
 
-void net_eth_send(struct EthernetDevice *, size_t, void*, uint16_t, uint8_t*);
+/* Offloads */
+#define NETIF_OFFLOAD_TX_CSUM 0x01 /* transmit can finish NETBUF_CSUM_PARTIAL checksums */
+
+void net_eth_send(struct EthernetDevice *, struct netbuf *, uint16_t, uint8_t*);
 
 struct ArpCacheEntry {
 	uint8_t hwaddr[6];
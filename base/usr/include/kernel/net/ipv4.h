@@ -1,5 +1,7 @@
 #pragma once
 #include <stdint.h>
+#include <kernel/vfs.h>
+#include <kernel/net/netbuf.h>
 
 struct ipv4_packet {
 	uint8_t  version_ihl;
@@ -58,3 +60,10 @@ struct tcp_check_header {
 #define IPV4_PROT_UDP 17
 #define IPV4_PROT_TCP 6
 
+uint16_t calculate_ipv4_checksum(struct ipv4_packet * p);
+uint16_t calculate_tcp_checksum(struct tcp_check_header * p, struct tcp_header * h, void * d, size_t payload_size);
+int net_ipv4_send(struct netbuf * nb, fs_node_t * nic);
+
+void tcp_install(void);
+void net_tcp_handle(struct netbuf * nb, struct ipv4_packet * packet, fs_node_t * nic, size_t size);
+long net_tcp_socket(void);
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Reference counted packet buffers.
+ *
+ * A netbuf holds one packet. Space is reserved in front of the data
+ * so each layer on the way out can prepend its header in place, and
+ * on the way in a buffer filled by a NIC is handed up the stack and
+ * queued on sockets by reference rather than copied.
+ *
+ * Buffers that fit in a page come from a pool of physically contiguous
+ * pages, so drivers can point descriptors straight at them. Larger
+ * ones (eg. for the loopback interface) come from the heap and have
+ * no physical address.
+ *
+ * Once a buffer has been handed to another layer or queued, @c data
+ * and @c len belong to whoever created it; anyone else holding a
+ * reference should keep their own pointer into it.
+ */
+
+#define NETBUF_HEADROOM 128   /* Ethernet, IPv4 and TCP with options */
+#define NETBUF_PAGE     4096
+
+/* Flags */
+#define NETBUF_MORE         0x01  /* Another frame follows at once; the driver may hold off telling the device */
+#define NETBUF_CSUM_PARTIAL 0x02  /* Transmit: the NIC finishes the checksum described by csum_start/csum_offset */
+#define NETBUF_CSUM_VALID   0x04  /* Receive: the NIC has already checked the transport checksum */
+
+struct netbuf {
+	volatile int refs;
+	uint8_t * data;           /* Start of the packet */
+	size_t len;               /* Bytes of packet from data */
+	size_t size;              /* Bytes available in buf */
+	uintptr_t phys;           /* Physical address of this structure, or 0 */
+	int flags;
+	uint16_t csum_start;      /* Offset in buf of the data to checksum, which runs to the end of the packet */
+	uint16_t csum_offset;     /* ...and where in that data the result goes */
+	struct netbuf * next;     /* Free list */
+	uint8_t buf[];
+};
+
+/* Largest packet a pooled buffer can hold after the headroom */
+#define NETBUF_POOL_MTU (NETBUF_PAGE - sizeof(struct netbuf) - NETBUF_HEADROOM)
+
+extern struct netbuf * netbuf_alloc(size_t size);
+extern void netbuf_ref(struct netbuf * nb);
+extern void netbuf_release(struct netbuf * nb);
+extern struct netbuf * netbuf_copy(struct netbuf * nb);
+
+/**
+ * @brief Make room for a header in front of the data.
+ */
+static inline void * netbuf_push(struct netbuf * nb, size_t len) {
+	nb->data -= len;
+	nb->len += len;
+	return nb->data;
+}
+
+/**
+ * @brief Strip a header from the front of the data.
+ */
+static inline void * netbuf_pull(struct netbuf * nb, size_t len) {
+	nb->data += len;
+	nb->len -= len;
+	return nb->data;
+}
+
+/**
+ * @brief Extend the data at the end, returning the new space.
+ */
+static inline void * netbuf_put(struct netbuf * nb, size_t len) {
+	void * out = nb->data + nb->len;
+	nb->len += len;
+	return out;
+}
+
+/**
+ * @brief Physical address of @p ptr within a pooled buffer.
+ */
+static inline uintptr_t netbuf_phys(struct netbuf * nb, void * ptr) {
+	return nb->phys + ((uintptr_t)ptr - (uintptr_t)nb);
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <kernel/vfs.h>
+#include <kernel/net/netbuf.h>
 #include <sys/socket.h>
 
 #define htonl(l)  ( (((l) & 0xFF) << 24) | (((l) & 0xFF00) << 8) | (((l) & 0xFF0000) >> 8) | (((l) & 0xFF000000) >> 24))
@@ -27,6 +28,8 @@ typedef struct SockData {
 	void (*sock_close)(struct SockData * sock);
 	long (*sock_connect)(struct SockData * sock, const struct sockaddr *addr, socklen_t addrlen);
 	long (*sock_bind)(struct SockData * sock, const struct sockaddr *addr, socklen_t addrlen);
+	long (*sock_listen)(struct SockData * sock, int backlog);
+	long (*sock_accept)(struct SockData * sock, struct sockaddr *addr, socklen_t *addrlen);
 	long (*sock_getsockname)(struct SockData * sock, struct sockaddr *addr, socklen_t *addrlen);
 	long (*sock_getpeername)(struct SockData * sock, struct sockaddr *addr, socklen_t *addrlen);
 
@@ -36,11 +39,21 @@ typedef struct SockData {
 	size_t unread;
 	char * buf;
 	int nonblocking;
+
+	void * proto; /* Protocol control block, eg. for TCP */
 } sock_t;
 
+/* A packet waiting in a socket's receive queue */
+struct sock_packet {
+	struct netbuf * nb;  /* Holds a reference */
+	void * data;         /* What the socket wanted out of it */
+	size_t size;
+};
+
 void net_sock_alert(sock_t * sock);
-void net_sock_add(sock_t * sock, void * frame, size_t size);
-void * net_sock_get(sock_t * sock);
+void net_sock_add(sock_t * sock, struct netbuf * nb, void * data, size_t size);
+struct sock_packet * net_sock_get(sock_t * sock);
+void net_sock_packet_free(struct sock_packet * packet);
 sock_t * net_sock_create(void);
 
 extern long net_socket(int,int,int);
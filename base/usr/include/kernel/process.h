@@ -23,11 +23,13 @@
 #define PROC_REUSE_FDS 0x0001
 #define KERNEL_STACK_SIZE 0x9000
 #define USER_ROOT_UID 0
+#define PROCESSOR_MAX 32
 
 typedef struct {
 	intptr_t refcount;
 	union PML * directory;
 	spin_lock_t lock;
+	list_t * mappings; /* struct mmap_region, sorted by address; protected by lock */
 } page_directory_t;
 
 typedef struct {
@@ -90,6 +92,22 @@ struct signal_config {
 #define PROC_FLAG_TRACE_SYSCALLS     0x40
 #define PROC_FLAG_TRACE_SIGNALS      0x80
 
+/**
+ * @brief Timed sleep.
+ *
+ * Every process carries one of these for timed sleeps and fswait
+ * timeouts. While armed, it sits in the timer heap of the core
+ * that armed it.
+ */
+typedef struct sleeper {
+	uint64_t end_tick;
+	uint64_t end_subtick;
+	struct process * process;
+	int is_fswait; /* 0 for sleep_until, 1 for an fswait timeout, -1 once that timeout has fired */
+	int cpu;       /* Core whose timer heap holds this timer, or -1 if not armed */
+	size_t index;  /* Position in that heap */
+} sleeper_t;
+
 typedef struct process {
 	pid_t id;    /* PID */
 	pid_t group; /* thread group */
@@ -123,8 +141,7 @@ typedef struct process {
 
 	node_t sched_node;
 	node_t sleep_node;
-	node_t * timed_sleep_node;
-	node_t * timeout_node;
+	sleeper_t timer;
 
 	struct timeval start;
 	int awoken_index;
@@ -159,14 +176,14 @@ typedef struct process {
 
 	/* Syscall restarting */
 	long interrupted_system_call;
+
+	/* Set while this process sits in one of the per-CPU ready queues */
+	volatile int sched_queued;
+
+	/* perf timer stamp of when the current exec() started, for /proc/execstat */
+	uint64_t exec_start;
 } process_t;
 
-typedef struct {
-	uint64_t end_tick;
-	uint64_t end_subtick;
-	process_t * process;
-	int is_fswait;
-} sleeper_t;
 
 struct ProcessorLocal {
 	/**
@@ -218,7 +235,7 @@ struct ProcessorLocal {
 #endif
 };
 
-extern struct ProcessorLocal processor_local_data[];
+extern struct ProcessorLocal processor_local_data[PROCESSOR_MAX];
 extern int processor_count;
 
 /**
@@ -241,6 +258,7 @@ extern process_t * process_from_pid(pid_t pid);
 extern void process_delete(process_t * proc);
 extern void make_process_ready(volatile process_t * proc);
 extern volatile process_t * next_ready_process(void);
+extern int process_ready_available(void);
 extern int wakeup_queue(list_t * queue);
 extern int wakeup_queue_interrupted(list_t * queue);
 extern int sleep_on(list_t * queue);
@@ -267,8 +285,6 @@ extern void update_process_times_on_exit(void);
 
 extern tree_t * process_tree;  /* Parent->Children tree */
 extern list_t * process_list;  /* Flat storage */
-extern list_t * process_queue; /* Ready queue */
-extern list_t * sleep_queue;
 
 extern void arch_enter_tasklet(void);
 extern __attribute__((noreturn)) void arch_resume_user(void);
@@ -281,5 +297,6 @@ extern void arch_enter_user(uintptr_t entrypoint, int argc, char * argv[], char
 __attribute__((noreturn))
 extern void arch_enter_signal_handler(uintptr_t,int,struct regs*);
 extern void arch_wakeup_others(void);
+extern void arch_wakeup_core(int cpu);
 extern int arch_return_from_signal_handler(struct regs *r);
 
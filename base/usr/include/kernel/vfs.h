@@ -51,6 +51,7 @@ typedef int (*selectcheck_type_t) (struct fs_node *);
 typedef int (*selectwait_type_t) (struct fs_node *, void * process);
 typedef int (*chown_type_t) (struct fs_node *, uid_t, gid_t);
 typedef int (*truncate_type_t) (struct fs_node *);
+typedef int (*refresh_type_t) (struct fs_node *);
 
 typedef struct fs_node {
 	char name[256];         /* The filename. */
@@ -94,6 +95,9 @@ typedef struct fs_node {
 	selectwait_type_t selectwait;
 
 	chown_type_t chown;
+
+	/* Reload attributes of a node copied out of the dentry cache; nonzero if it no longer exists */
+	refresh_type_t refresh;
 } fs_node_t;
 
 struct vfs_entry {
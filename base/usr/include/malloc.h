@@ -0,0 +1,11 @@
+#pragma once
+
+#include <_cheader.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+_Begin_C_Header
+
+extern int malloc_trim(size_t pad);
+
+_End_C_Header
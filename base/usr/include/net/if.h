@@ -21,6 +21,7 @@ _Begin_C_Header
 #define SIOCGIFGATEWAY  0x12340007
 #define SIOCSIFGATEWAY  0x12340017
 #define SIOCGIFCOUNTS   0x12340018
+#define SIOCGIFQCOUNTS  0x12340019 /* Get counters for one queue pair */
 
 /**
  * Flags for interface status
@@ -39,4 +40,27 @@ typedef struct {
 	size_t rx_bytes;
 } netif_counters_t;
 
+/**
+ * Counters for one RX/TX queue pair. Set @c queue before the
+ * call; the driver fills in the rest, including how many
+ * queue pairs it has.
+ */
+typedef struct {
+	uint32_t queue;
+	uint32_t queue_count;
+
+	size_t rx_packets;
+	size_t rx_bytes;
+	size_t rx_errors;
+	size_t rx_interrupts;   /* Interrupts that started polling */
+	size_t rx_polls;        /* Polling passes */
+	size_t rx_budget_hits;  /* Passes that used their whole budget */
+
+	size_t tx_packets;
+	size_t tx_bytes;
+	size_t tx_doorbells;    /* Tail register writes */
+	size_t tx_reclaimed;    /* Descriptors given back by the device */
+	size_t tx_ring_full;    /* Sends that found the ring full */
+} netif_queue_counters_t;
+
 _End_C_Header
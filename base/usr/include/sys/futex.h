@@ -0,0 +1,14 @@
+#pragma once
+
+#include <_cheader.h>
+
+_Begin_C_Header
+
+#define FUTEX_WAIT 0
+#define FUTEX_WAKE 1
+
+#ifndef _KERNEL_
+extern int futex(volatile int * addr, int op, int val);
+#endif
+
+_End_C_Header
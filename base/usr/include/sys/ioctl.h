@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stdint.h>
 #include <termios.h>
 
 #define IOCTLDTYPE 0x4F00
@@ -14,5 +15,27 @@
 
 #define IOCTL_PACKETFS_QUEUED 0x5050
 
+#define IOCTL_BLOCK_STATS 0x2A01234UL
+
+/* Filled in by IOCTL_BLOCK_STATS on cached block devices. */
+struct block_dev_stats {
+	uint64_t hits;       /* Lookups satisfied from the cache */
+	uint64_t misses;     /* Lookups that had to read the device */
+	uint64_t evictions;  /* Dirty blocks written back to make room */
+	uint64_t writes;     /* Writes into cached blocks */
+	uint64_t writebacks; /* Dirty blocks written to the device */
+	uint64_t cached;     /* Blocks currently in the cache */
+	uint64_t dirty;      /* Blocks currently waiting to be written */
+	uint64_t readahead;  /* Blocks read before anyone asked for them */
+};
+
+#define IOCTL_BLOCK_READAHEAD 0x2A01235UL
+
+/* Hint for IOCTL_BLOCK_READAHEAD: bytes that will be read soon. */
+struct block_readahead {
+	uint64_t offset;
+	uint64_t length;
+};
+
 #define FIONBIO  0x4e424c4b
 
@@ -234,6 +234,11 @@ DECL_SYSCALL2(setgroups, int, const int*);
 DECL_SYSCALL1(times, struct tms*);
 DECL_SYSCALL4(ptrace, int, int, void*, void*);
 DECL_SYSCALL2(settimeofday, void *, void *);
+DECL_SYSCALL3(futex, volatile int *, int, int);
+DECL_SYSCALL1(mmap, void *);
+DECL_SYSCALL2(munmap, void *, size_t);
+DECL_SYSCALL3(mprotect, void *, size_t, int);
+DECL_SYSCALL3(getdents, int, void *, size_t);
 
 _End_C_Header
 
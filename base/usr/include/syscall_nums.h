@@ -82,3 +82,8 @@
 #define SYS_GETPEERNAME 79
 #define SYS_PREAD 80
 #define SYS_PWRITE 81
+#define SYS_FUTEX 82
+#define SYS_MMAP 83
+#define SYS_MUNMAP 84
+#define SYS_MPROTECT 85
+#define SYS_GETDENTS 86
@@ -290,6 +290,11 @@ void arch_wakeup_others(void) {
 	#endif
 }
 
+void arch_wakeup_core(int cpu) {
+	if (cpu == this_core->cpu_id) return;
+	gic_send_sgi(1,cpu);
+}
+
 
 /**
  * @brief Reboot the computer.
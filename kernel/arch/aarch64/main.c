@@ -18,6 +18,7 @@
 #include <kernel/ramdisk.h>
 #include <kernel/vfs.h>
 #include <kernel/mmu.h>
+#include <kernel/mmap.h>
 #include <kernel/generic.h>
 #include <kernel/video.h>
 #include <kernel/signal.h>
@@ -321,6 +322,11 @@ void aarch64_sync_enter(struct regs * r) {
 		goto _resume_user;
 	}
 
+	/* Translation or permission fault from EL0; might be a mapping that hasn't been touched yet, or the zero page. */
+	if (((esr >> 26) == 0x24 || (esr >> 26) == 0x20) && ((esr & 0x3C) == 0x04 || (esr & 0x3C) == 0x0C)) {
+		if (!mmap_page_fault(far, (esr >> 26) == 0x24 && (esr & (1 << 6)))) goto _resume_user;
+	}
+
 	/* Unexpected fault, eg. page fault. */
 	dprintf("In process %d (%s)\n", this_core->current_process->id, this_core->current_process->name);
 	dprintf("ESR: %#zx FAR: %#zx ELR: %#zx SPSR: %#zx\n", esr, far, elr, spsr);
@@ -15,6 +15,8 @@
 #include <kernel/spinlock.h>
 #include <kernel/misc.h>
 #include <kernel/mmu.h>
+#include <kernel/mmap.h>
+#include <kernel/frame_index.h>
 
 static volatile uint32_t *frames;
 static size_t nframes;
@@ -84,8 +86,9 @@ void mmu_frame_set(uintptr_t frame_addr) {
 		uint64_t frame  = frame_addr >> 12;
 		uint64_t index  = INDEX_FROM_BIT(frame);
 		uint32_t offset = OFFSET_FROM_BIT(frame);
-		__sync_or_and_fetch(&frames[index], ((uint32_t)1 << offset));
+		uint32_t old = __sync_fetch_and_or(&frames[index], ((uint32_t)1 << offset));
 		asm ("isb" ::: "memory");
+		if (!(old & ((uint32_t)1 << offset))) frame_index_update(frame);
 	}
 }
 
@@ -98,9 +101,10 @@ void mmu_frame_clear(uintptr_t frame_addr) {
 		uint64_t frame  = frame_addr >> PAGE_SHIFT;
 		uint64_t index  = INDEX_FROM_BIT(frame);
 		uint32_t offset = OFFSET_FROM_BIT(frame);
-		__sync_and_and_fetch(&frames[index], ~((uint32_t)1 << offset));
+		uint32_t old = __sync_fetch_and_and(&frames[index], ~((uint32_t)1 << offset));
 		asm ("isb" ::: "memory");
 		if (frame < lowest_available) lowest_available = frame;
+		if (old & ((uint32_t)1 << offset)) frame_index_update(frame);
 	}
 }
 
@@ -120,13 +124,76 @@ static spin_lock_t kheap_lock = { 0 };
 static spin_lock_t mmio_space_lock = { 0 };
 static spin_lock_t module_space_lock = { 0 };
 
+/* Per-CPU caches of free frames, see the x86-64 implementation. */
+#define FRAME_CACHE_SIZE  64
+#define FRAME_CACHE_BATCH 32
+
+static struct frame_cache {
+	spin_lock_t lock;
+	size_t count;
+	uintptr_t frames[FRAME_CACHE_SIZE];
+} __attribute__((aligned(64))) frame_caches[PROCESSOR_MAX];
+
+static void frame_cache_drain(void) {
+	for (int i = 0; i < PROCESSOR_MAX; ++i) {
+		spin_lock(frame_caches[i].lock);
+		while (frame_caches[i].count) {
+			mmu_frame_clear(frame_caches[i].frames[--frame_caches[i].count] << PAGE_SHIFT);
+		}
+		spin_unlock(frame_caches[i].lock);
+	}
+}
+
+static size_t frame_cache_count(void) {
+	size_t count = 0;
+	for (int i = 0; i < PROCESSOR_MAX; ++i) {
+		count += frame_caches[i].count;
+	}
+	return count;
+}
+
 void mmu_frame_release(uintptr_t frame_addr) {
+	if (frame_index_ready() && frame_addr >= ram_starts_at && frame_addr - ram_starts_at < nframes * PAGE_SIZE) {
+		struct frame_cache * cache = &frame_caches[this_core->cpu_id];
+		uintptr_t batch[FRAME_CACHE_BATCH];
+		size_t count = 0;
+
+		spin_lock(cache->lock);
+		if (cache->count == FRAME_CACHE_SIZE) {
+			memcpy(batch, cache->frames, sizeof(batch));
+			memmove(cache->frames, cache->frames + FRAME_CACHE_BATCH, sizeof(uintptr_t) * (FRAME_CACHE_SIZE - FRAME_CACHE_BATCH));
+			cache->count -= FRAME_CACHE_BATCH;
+			count = FRAME_CACHE_BATCH;
+		}
+		cache->frames[cache->count++] = frame_addr >> PAGE_SHIFT;
+		spin_unlock(cache->lock);
+
+		if (count) {
+			spin_lock(frame_alloc_lock);
+			for (size_t i = 0; i < count; ++i) {
+				mmu_frame_clear(batch[i] << PAGE_SHIFT);
+			}
+			spin_unlock(frame_alloc_lock);
+		}
+		return;
+	}
+
 	spin_lock(frame_alloc_lock);
 	mmu_frame_clear(frame_addr);
 	spin_unlock(frame_alloc_lock);
 }
 
 uintptr_t mmu_first_n_frames(int n) {
+	if (frame_index_ready()) {
+		uintptr_t index = frame_index_find(n);
+		if (index == FRAME_INDEX_NONE) {
+			frame_cache_drain();
+			index = frame_index_find(n);
+		}
+		if (index != FRAME_INDEX_NONE) return index + (ram_starts_at >> 12);
+		goto _fail;
+	}
+
 	for (uint64_t i = 0; i < nframes * PAGE_SIZE; i += PAGE_SIZE) {
 		int bad = 0;
 		for (int j = 0; j < n; ++j) {
@@ -139,6 +206,7 @@ uintptr_t mmu_first_n_frames(int n) {
 		}
 	}
 
+_fail:
 	arch_fatal_prepare();
 	dprintf("Failed to allocate %d contiguous frames.\n", n);
 	arch_dump_traceback();
@@ -147,6 +215,16 @@ uintptr_t mmu_first_n_frames(int n) {
 }
 
 uintptr_t mmu_first_frame(void) {
+	if (frame_index_ready()) {
+		uintptr_t index = frame_index_find(1);
+		if (index == FRAME_INDEX_NONE) {
+			frame_cache_drain();
+			index = frame_index_find(1);
+		}
+		if (index != FRAME_INDEX_NONE) return index + (ram_starts_at >> 12);
+		goto _oom;
+	}
+
 	uintptr_t i, j;
 	for (i = INDEX_FROM_BIT(lowest_available); i < INDEX_FROM_BIT(nframes); ++i) {
 		if (frames[i] != (uint32_t)-1) {
@@ -166,6 +244,7 @@ uintptr_t mmu_first_frame(void) {
 		return mmu_first_frame();
 	}
 
+_oom:
 	arch_fatal_prepare();
 	dprintf("Out of memory.\n");
 	arch_dump_traceback();
@@ -176,11 +255,7 @@ uintptr_t mmu_first_frame(void) {
 void mmu_frame_allocate(union PML * page, unsigned int flags) {
 	/* If page is not set... */
 	if (page->bits.page == 0) {
-		spin_lock(frame_alloc_lock);
-		uintptr_t index = mmu_first_frame();
-		mmu_frame_set(index << PAGE_SHIFT);
-		page->bits.page     = index;
-		spin_unlock(frame_alloc_lock);
+		page->bits.page = mmu_allocate_a_frame();
 	}
 
 	page->bits.table_page = 1;
@@ -214,7 +289,9 @@ void mmu_frame_allocate(union PML * page, unsigned int flags) {
 
 void mmu_frame_map_address(union PML * page, unsigned int flags, uintptr_t physAddr) {
 	/* frame set physAddr, set page in entry, call frame_allocate to set attribute bits */
+	spin_lock(frame_alloc_lock);
 	mmu_frame_set(physAddr);
+	spin_unlock(frame_alloc_lock);
 	page->bits.page = physAddr >> PAGE_SHIFT;
 	mmu_frame_allocate(page, flags);
 }
@@ -460,13 +537,13 @@ union PML * mmu_clone(union PML * from) {
 								uintptr_t address = ((i << (9 * 3 + 12)) | (j << (9*2 + 12)) | (k << (9 + 12)) | (l << PAGE_SHIFT));
 								if (address >= USER_DEVICE_MAP && address <= USER_SHM_HIGH) continue;
 								if (pt_in[l].bits.present) {
-									if (1) { //pt_in[l].bits.user) {
+									if (!pt_in[l].bits.shared) { //pt_in[l].bits.user) {
 										copy_page_maybe(pt_in, pt_out, l, address);
 									} else {
-										/* If it's not a user page, just copy directly */
+										/* Shared mappings own their frames, just copy directly */
 										pt_out[l].raw = pt_in[l].raw;
 									}
-								} /* Else, mmap'd files? */
+								} /* Else, not faulted in yet */
 							}
 						}
 					}
@@ -479,6 +556,44 @@ union PML * mmu_clone(union PML * from) {
 }
 
 uintptr_t mmu_allocate_a_frame(void) {
+	if (frame_index_ready()) {
+		struct frame_cache * cache = &frame_caches[this_core->cpu_id];
+		spin_lock(cache->lock);
+		if (!cache->count) {
+			spin_unlock(cache->lock);
+
+			uintptr_t batch[FRAME_CACHE_BATCH];
+			size_t count = 0;
+			spin_lock(frame_alloc_lock);
+			while (count < FRAME_CACHE_BATCH) {
+				uintptr_t index = frame_index_find(1);
+				if (index == FRAME_INDEX_NONE) break;
+				index += ram_starts_at >> 12;
+				mmu_frame_set(index << PAGE_SHIFT);
+				batch[count++] = index;
+			}
+			spin_unlock(frame_alloc_lock);
+
+			spin_lock(cache->lock);
+			while (count && cache->count < FRAME_CACHE_SIZE) {
+				cache->frames[cache->count++] = batch[--count];
+			}
+			if (count) {
+				spin_unlock(cache->lock);
+				spin_lock(frame_alloc_lock);
+				while (count) mmu_frame_clear(batch[--count] << PAGE_SHIFT);
+				spin_unlock(frame_alloc_lock);
+				spin_lock(cache->lock);
+			}
+		}
+		if (cache->count) {
+			uintptr_t index = cache->frames[--cache->count];
+			spin_unlock(cache->lock);
+			return index;
+		}
+		spin_unlock(cache->lock);
+	}
+
 	spin_lock(frame_alloc_lock);
 	uintptr_t index = mmu_first_frame();
 	mmu_frame_set(index << PAGE_SHIFT);
@@ -517,7 +632,7 @@ size_t mmu_count_user(union PML * from) {
 								uintptr_t address = ((i << (9 * 3 + 12)) | (j << (9*2 + 12)) | (k << (9 + 12)) | (l << PAGE_SHIFT));
 								if (address >= USER_DEVICE_MAP && address <= USER_SHM_HIGH) continue;
 								if (pt_in[l].bits.present) {
-									if (pt_in[l].bits.ap & 1) {
+									if ((pt_in[l].bits.ap & 1) && !pt_in[l].bits.shared) {
 										out++;
 									}
 								}
@@ -578,7 +693,7 @@ size_t mmu_used_memory(void) {
 			}
 		}
 	}
-	return ret * 4 - unavailable_memory;
+	return (ret - frame_cache_count()) * 4 - unavailable_memory;
 }
 
 void mmu_free(union PML * from) {
@@ -603,8 +718,8 @@ void mmu_free(union PML * from) {
 								/* Do not free shared mappings; SHM subsystem does that for SHM, devices don't need it. */
 								if (address >= USER_DEVICE_MAP && address <= USER_SHM_HIGH) continue;
 								if (pt_in[l].bits.present) {
-									/* Free only user pages */
-									if (pt_in[l].bits.ap & 1) {
+									/* Free only user pages; shared mappings own their frames */
+									if ((pt_in[l].bits.ap & 1) && !pt_in[l].bits.shared) {
 										mmu_frame_clear((uintptr_t)pt_in[l].bits.page << PAGE_SHIFT);
 										pt_in[l].raw = 0;
 										//free_page_maybe(pt_in,l,address);
@@ -654,6 +769,25 @@ void mmu_set_directory(union PML * new_pml) {
 void mmu_invalidate(uintptr_t addr) {
 }
 
+/**
+ * @brief Invalidate a range of virtual addresses in the TLB.
+ *
+ * Broadcast to the inner shareable domain, so one barrier covers
+ * every core; large ranges drop the whole TLB instead.
+ */
+void mmu_invalidate_range(uintptr_t start, uintptr_t end) {
+	if (end <= start) return;
+	asm volatile ("dsb ishst" ::: "memory");
+	if (end - start > MMU_INVALIDATE_MAX_PAGES * PAGE_SIZE) {
+		asm volatile ("tlbi vmalle1is" ::: "memory");
+	} else {
+		for (uintptr_t a = start; a < end; a += PAGE_SIZE) {
+			asm volatile ("tlbi vaae1is, %0" :: "r"((a >> 12) & 0xFFFFFFFFFFFUL) : "memory");
+		}
+	}
+	asm volatile ("dsb ish\nisb" ::: "memory");
+}
+
 int mmu_get_page_deep(uintptr_t virtAddr, union PML ** pml4_out, union PML ** pdp_out, union PML ** pd_out, union PML ** pt_out) {
 	/* This is all the same as x86, thankfully? */
 	uintptr_t realBits = virtAddr & CANONICAL_MASK;
@@ -708,6 +842,7 @@ static int maybe_release_directory(union PML * parent, union PML * child) {
 }
 
 void mmu_unmap_user(uintptr_t addr, size_t size) {
+	uintptr_t first = 0, last = 0;
 	for (uintptr_t a = addr; a < addr + size; a += PAGE_SIZE) {
 		union PML * pml4, * pdp, * pd, * pt;
 
@@ -719,9 +854,10 @@ void mmu_unmap_user(uintptr_t addr, size_t size) {
 		/* Free this page if it was present */
 		if (pt && pt->bits.present) {
 			if (pt->bits.ap & 1) {
-				mmu_frame_clear((uintptr_t)pt->bits.page << PAGE_SHIFT);
+				if (!pt->bits.shared) mmu_frame_clear((uintptr_t)pt->bits.page << PAGE_SHIFT);
 				pt->bits.present = 0;
 				pt->bits.ap = 0;
+				pt->bits.shared = 0;
 			}
 
 			if (maybe_release_directory(pd, pt)) {
@@ -730,11 +866,14 @@ void mmu_unmap_user(uintptr_t addr, size_t size) {
 				}
 			}
 
-			mmu_invalidate(a);
+			if (!last) first = a;
+			last = a + PAGE_SIZE;
 		}
 
 		spin_unlock(frame_alloc_lock);
 	}
+
+	if (last) mmu_invalidate_range(first, last);
 }
 
 
@@ -774,6 +913,63 @@ void * sbrk(size_t bytes) {
 	return out;
 }
 
+/**
+ * @brief Return the frames behind part of the kernel heap.
+ *
+ * Used by the heap allocator for the interior of large free blocks.
+ * The address range stays part of the heap; @ref sbrk_restore must
+ * be called on it before it is touched again. Pages that are already
+ * unbacked are skipped.
+ *
+ * @param start Page-aligned start of the range.
+ * @param bytes Length of the range, a multiple of PAGE_SIZE.
+ * @returns The number of frames that were released.
+ */
+size_t sbrk_release(void * start, size_t bytes) {
+	uintptr_t end = (uintptr_t)start + bytes;
+	size_t released = 0;
+
+	for (uintptr_t p = (uintptr_t)start; p < end; ) {
+		/* Unmap a batch everywhere before any of its frames can be reused. */
+		uintptr_t batch[32];
+		size_t count = 0;
+		uintptr_t batch_start = p;
+		for (; p < end && count < 32; p += PAGE_SIZE) {
+			union PML * page = mmu_get_page(p, 0);
+			if (!page || !page->bits.present) continue;
+			batch[count++] = (uintptr_t)page->bits.page << PAGE_SHIFT;
+			page->raw = 0;
+		}
+		if (!count) continue;
+		mmu_invalidate_range(batch_start, p);
+		for (size_t i = 0; i < count; ++i) {
+			mmu_frame_release(batch[i]);
+		}
+		released += count;
+	}
+
+	return released;
+}
+
+/**
+ * @brief Back a range of the kernel heap with frames again.
+ *
+ * @returns The number of pages that needed a new frame.
+ */
+size_t sbrk_restore(void * start, size_t bytes) {
+	uintptr_t end = (uintptr_t)start + bytes;
+	size_t restored = 0;
+
+	for (uintptr_t p = (uintptr_t)start; p < end; p += PAGE_SIZE) {
+		union PML * page = mmu_get_page(p, MMU_GET_MAKE);
+		if (page->bits.present) continue;
+		mmu_frame_allocate(page, MMU_FLAG_WRITABLE | MMU_FLAG_KERNEL);
+		restored++;
+	}
+
+	return restored;
+}
+
 static uintptr_t mmio_base_address = MMIO_BASE_START;
 void * mmu_map_mmio_region(uintptr_t physical_address, size_t size) {
 	if (size & PAGE_LOW_MASK) {
@@ -822,6 +1018,12 @@ int mmu_copy_on_write(uintptr_t address) {
 	return 1;
 }
 
+void mmu_page_protect(union PML * page, uintptr_t address, unsigned int flags) {
+	/* No COW here, so this is just the access bits. */
+	page->bits.ap = (!(flags & MMU_FLAG_WRITABLE) ? 2 : 0) | 1;
+	asm volatile ("dsb ishst\ntlbi vmalle1is\ndsb ish\nisb" ::: "memory");
+}
+
 int mmu_validate_user_pointer(const void * addr, size_t size, int flags) {
 	//printf("mmu_validate_user_pointer(%#zx, %lu, %u);\n", (uintptr_t)addr, size, flags);
 	if (addr == NULL && !(flags & MMU_PTR_NULL)) return 0;
@@ -837,17 +1039,20 @@ int mmu_validate_user_pointer(const void * addr, size_t size, int flags) {
 	for (uintptr_t page = page_base; page <= page_end; ++page) {
 		if ((page & 0xffff800000000) != 0 && (page & 0xffff800000000) != 0xffff800000000) return 0;
 		union PML * page_entry = mmu_get_page_other(this_core->current_process->thread.page_directory->directory, page << 12);
-		if (!page_entry) {
-			return 0;
-		}
-		if (!page_entry->bits.present) {
-			return 0;
+		if (!page_entry || !page_entry->bits.present) {
+			/* Might be part of a mapping that hasn't been touched yet. */
+			if (mmap_page_fault(page << 12, flags & MMU_PTR_WRITE)) return 0;
+			page_entry = mmu_get_page_other(this_core->current_process->thread.page_directory->directory, page << 12);
+			if (!page_entry || !page_entry->bits.present) return 0;
 		}
 		if (!(page_entry->bits.ap & 1)) {
 			return 0;
 		}
 		if ((page_entry->bits.ap & 2) && (flags & MMU_PTR_WRITE)) {
-			return 0;
+			/* Writes to the zero page get a fresh page. */
+			if (mmap_page_fault(page << 12, 1)) return 0;
+			page_entry = mmu_get_page_other(this_core->current_process->thread.page_directory->directory, page << 12);
+			if (!page_entry || (page_entry->bits.ap & 2)) return 0;
 			//if (mmu_copy_on_write((uintptr_t)(page << 12))) return 0;
 		}
 	}
@@ -951,4 +1156,7 @@ void mmu_init(uintptr_t memaddr, size_t memsize, uintptr_t firstFreePage, uintpt
 	if (module_base_address & PAGE_LOW_MASK) {
 		module_base_address = (module_base_address & PAGE_SIZE_MASK) + PAGE_SIZE;
 	}
+
+	/* Switch over from scanning the bitmap. */
+	frame_index_init(frames, nframes);
 }
@@ -24,6 +24,7 @@
 #include <kernel/module.h>
 #include <kernel/ksym.h>
 #include <kernel/mmu.h>
+#include <kernel/mmap.h>
 #include <kernel/syscall.h>
 
 #include <sys/time.h>
@@ -110,7 +111,7 @@ void idt_install(void) {
 	idt_set_gate(47, _irq15, 0x08, 0x8E, 0);
 
 	idt_set_gate(123, _isr123, 0x08, 0x8E, 0); /* Clock interrupt for other processors */
-	idt_set_gate(124, _isr124, 0x08, 0x8E, 0); /* Bad TLB shootdown. */
+	idt_set_gate(124, _isr124, 0x08, 0x8E, 0); /* TLB shootdown. */
 	idt_set_gate(125, _isr125, 0x08, 0x8E, 0); /* Halts everyone. */
 	idt_set_gate(126, _isr126, 0x08, 0x8E, 0); /* Does nothing, used to exit wait-for-interrupt sleep. */
 	idt_set_gate(127, _isr127, 0x08, 0x8E, 1); /* Legacy system call entry point, called by userspace. */
@@ -511,6 +512,11 @@ static void _page_fault(struct regs * r) {
 		if (!mmu_copy_on_write(faulting_address)) return;
 	}
 
+	/* Might be a mapping that hasn't been touched yet, or a write to the zero page. */
+	if (this_core->current_process && faulting_address < 0x800000000000) {
+		if (!mmap_page_fault(faulting_address, r->err_code & 2)) return;
+	}
+
 	/* Was this a kernel page fault? Those are always a panic. */
 	if (!this_core->current_process || r->cs == 0x08) {
 		panic("Page fault in kernel", r, faulting_address);
@@ -541,6 +547,8 @@ static void _local_timer(struct regs * r) {
 	if (r->cs != 0x08) switch_task(1);
 }
 
+extern void arch_tlb_shootdown_handler(void);
+
 /**
  * @brief Handle an exception interrupt.
  *
@@ -627,10 +635,10 @@ void isr_handler_inner(struct regs * r) {
 
 		/* Local interrupts that make it here. */
 		case 123: _local_timer(r); return;
+		case 124: arch_tlb_shootdown_handler(); return;
 		case 127: syscall_handler(r); return;
 
 		/* Other interrupts that don't make it here:
-		 *   124: TLB shootdown, we just reload CR3 in the handler.
 		 *   125: Fatal signal, jumps straight to a cli/hlt loop, though I think this just yields an NMI instead?
 		 *   126: Quiet wakeup, do we even use this anymore?
 		 */
@@ -638,7 +646,7 @@ void isr_handler_inner(struct regs * r) {
 		default: panic("Unexpected interrupt",r,0);
 	}
 
-	if (this_core->current_process == this_core->kernel_idle_task && process_queue && process_queue->head) {
+	if (this_core->current_process == this_core->kernel_idle_task && process_ready_available()) {
 		/* If this is kidle and we got here, instead of finishing the interrupt
 		 * we can just switch task and there will probably be something else
 		 * to run that was awoken by the interrupt. */
@@ -17,12 +17,16 @@
 #include <kernel/spinlock.h>
 #include <kernel/misc.h>
 #include <kernel/mmu.h>
+#include <kernel/mmap.h>
+#include <kernel/frame_index.h>
 #include <kernel/arch/x86_64/pml.h>
 
 extern void arch_tlb_shootdown(uintptr_t);
+extern void arch_tlb_shootdown_range(uintptr_t, uintptr_t);
 
 /**
- * bitmap page allocator for 4KiB pages
+ * bitmap page allocator for 4KiB pages, searched through the
+ * free-run index in kernel/misc/frame_index.c once it is built
  */
 static volatile uint32_t *frames;
 static size_t nframes;
@@ -65,8 +69,10 @@ void mmu_frame_set(uintptr_t frame_addr) {
 		uint64_t frame  = frame_addr >> 12;
 		uint64_t index  = INDEX_FROM_BIT(frame);
 		uint32_t offset = OFFSET_FROM_BIT(frame);
+		if (frames[index] & ((uint32_t)1 << offset)) return;
 		frames[index]  |= ((uint32_t)1 << offset);
 		asm ("" ::: "memory");
+		frame_index_update(frame);
 	}
 }
 
@@ -85,9 +91,11 @@ void mmu_frame_clear(uintptr_t frame_addr) {
 		uint64_t frame  = frame_addr >> PAGE_SHIFT;
 		uint64_t index  = INDEX_FROM_BIT(frame);
 		uint32_t offset = OFFSET_FROM_BIT(frame);
+		if (!(frames[index] & ((uint32_t)1 << offset))) return;
 		frames[index]  &= ~((uint32_t)1 << offset);
 		asm ("" ::: "memory");
 		if (frame < lowest_available) lowest_available = frame;
+		frame_index_update(frame);
 	}
 }
 
@@ -111,7 +119,74 @@ static spin_lock_t kheap_lock = { 0 };
 static spin_lock_t mmio_space_lock = { 0 };
 static spin_lock_t module_space_lock = { 0 };
 
+/**
+ * Per-CPU caches of free frames.
+ *
+ * Single frames are handed out from and returned to the current core's
+ * cache without touching the global allocator lock. Frames sitting in
+ * a cache are still marked in use in the bitmap. A cache is never held
+ * while taking @c frame_alloc_lock, so the allocator can empty them all
+ * when it runs out of memory.
+ */
+#define FRAME_CACHE_SIZE  64
+#define FRAME_CACHE_BATCH 32
+
+static struct frame_cache {
+	spin_lock_t lock;
+	size_t count;
+	uintptr_t frames[FRAME_CACHE_SIZE];
+} __attribute__((aligned(64))) frame_caches[PROCESSOR_MAX];
+
+/**
+ * @brief Return every cached frame to the bitmap.
+ *
+ * @c frame_alloc_lock must be held.
+ */
+static void frame_cache_drain(void) {
+	for (int i = 0; i < PROCESSOR_MAX; ++i) {
+		spin_lock(frame_caches[i].lock);
+		while (frame_caches[i].count) {
+			mmu_frame_clear(frame_caches[i].frames[--frame_caches[i].count] << PAGE_SHIFT);
+		}
+		spin_unlock(frame_caches[i].lock);
+	}
+}
+
+static size_t frame_cache_count(void) {
+	size_t count = 0;
+	for (int i = 0; i < PROCESSOR_MAX; ++i) {
+		count += frame_caches[i].count;
+	}
+	return count;
+}
+
 void mmu_frame_release(uintptr_t frame_addr) {
+	if (frame_index_ready() && frame_addr < nframes * PAGE_SIZE) {
+		struct frame_cache * cache = &frame_caches[this_core->cpu_id];
+		uintptr_t batch[FRAME_CACHE_BATCH];
+		size_t count = 0;
+
+		spin_lock(cache->lock);
+		if (cache->count == FRAME_CACHE_SIZE) {
+			/* Full, send the older half back to the bitmap. */
+			memcpy(batch, cache->frames, sizeof(batch));
+			memmove(cache->frames, cache->frames + FRAME_CACHE_BATCH, sizeof(uintptr_t) * (FRAME_CACHE_SIZE - FRAME_CACHE_BATCH));
+			cache->count -= FRAME_CACHE_BATCH;
+			count = FRAME_CACHE_BATCH;
+		}
+		cache->frames[cache->count++] = frame_addr >> PAGE_SHIFT;
+		spin_unlock(cache->lock);
+
+		if (count) {
+			spin_lock(frame_alloc_lock);
+			for (size_t i = 0; i < count; ++i) {
+				mmu_frame_clear(batch[i] << PAGE_SHIFT);
+			}
+			spin_unlock(frame_alloc_lock);
+		}
+		return;
+	}
+
 	spin_lock(frame_alloc_lock);
 	mmu_frame_clear(frame_addr);
 	spin_unlock(frame_alloc_lock);
@@ -123,6 +198,16 @@ void mmu_frame_release(uintptr_t frame_addr) {
  * If a large enough region could not be found, results are fatal.
  */
 uintptr_t mmu_first_n_frames(int n) {
+	if (frame_index_ready()) {
+		uintptr_t index = frame_index_find(n);
+		if (index == FRAME_INDEX_NONE) {
+			frame_cache_drain();
+			index = frame_index_find(n);
+		}
+		if (index != FRAME_INDEX_NONE) return index;
+		goto _fail;
+	}
+
 	for (uint64_t i = 0; i < nframes * PAGE_SIZE; i += PAGE_SIZE) {
 		int bad = 0;
 		for (int j = 0; j < n; ++j) {
@@ -135,6 +220,7 @@ uintptr_t mmu_first_n_frames(int n) {
 		}
 	}
 
+_fail:
 	arch_fatal_prepare();
 	dprintf("Failed to allocate %d contiguous frames.\n", n);
 	arch_dump_traceback();
@@ -146,6 +232,16 @@ uintptr_t mmu_first_n_frames(int n) {
  * @brief Find the first available frame from the bitmap.
  */
 uintptr_t mmu_first_frame(void) {
+	if (frame_index_ready()) {
+		uintptr_t index = frame_index_find(1);
+		if (index == FRAME_INDEX_NONE) {
+			frame_cache_drain();
+			index = frame_index_find(1);
+		}
+		if (index != FRAME_INDEX_NONE) return index;
+		goto _oom;
+	}
+
 	uintptr_t i, j;
 	for (i = INDEX_FROM_BIT(lowest_available); i < INDEX_FROM_BIT(nframes); ++i) {
 		if (frames[i] != (uint32_t)-1) {
@@ -160,6 +256,7 @@ uintptr_t mmu_first_frame(void) {
 		}
 	}
 
+_oom:
 	arch_fatal_prepare();
 	dprintf("Out of memory.\n");
 	arch_dump_traceback();
@@ -175,11 +272,7 @@ uintptr_t mmu_first_frame(void) {
  */
 void mmu_frame_allocate(union PML * page, unsigned int flags) {
 	if (page->bits.page == 0) {
-		spin_lock(frame_alloc_lock);
-		uintptr_t index = mmu_first_frame();
-		mmu_frame_set(index << PAGE_SHIFT);
-		page->bits.page     = index;
-		spin_unlock(frame_alloc_lock);
+		page->bits.page = mmu_allocate_a_frame();
 	}
 	page->bits.size     = 0;
 	page->bits.present  = 1;
@@ -195,7 +288,9 @@ void mmu_frame_allocate(union PML * page, unsigned int flags) {
  * @brief Map the given page to the requested physical address.
  */
 void mmu_frame_map_address(union PML * page, unsigned int flags, uintptr_t physAddr) {
+	spin_lock(frame_alloc_lock);
 	mmu_frame_set(physAddr);
+	spin_unlock(frame_alloc_lock);
 	page->bits.page = physAddr >> PAGE_SHIFT;
 	mmu_frame_allocate(page, flags);
 }
@@ -585,13 +680,13 @@ union PML * mmu_clone(union PML * from) {
 								uintptr_t address = ((i << (9 * 3 + 12)) | (j << (9*2 + 12)) | (k << (9 + 12)) | (l << PAGE_SHIFT));
 								if (address >= USER_DEVICE_MAP && address <= USER_SHM_HIGH) continue;
 								if (pt_in[l].bits.present) {
-									if (pt_in[l].bits.user) {
+									if (pt_in[l].bits.user && !pt_in[l].bits.shared) {
 										copy_page_maybe(pt_in, pt_out, l, address);
 									} else {
-										/* If it's not a user page, just copy directly */
+										/* If it's not a user page, or it belongs to a shared mapping, just copy directly */
 										pt_out[l].raw = pt_in[l].raw;
 									}
-								} /* Else, mmap'd files? */
+								} /* Else, not faulted in yet */
 							}
 						}
 					}
@@ -609,6 +704,45 @@ union PML * mmu_clone(union PML * from) {
  * @returns a frame index, not an address
  */
 uintptr_t mmu_allocate_a_frame(void) {
+	if (frame_index_ready()) {
+		struct frame_cache * cache = &frame_caches[this_core->cpu_id];
+		spin_lock(cache->lock);
+		if (!cache->count) {
+			spin_unlock(cache->lock);
+
+			/* Take a batch from the bitmap, stopping short if memory is tight. */
+			uintptr_t batch[FRAME_CACHE_BATCH];
+			size_t count = 0;
+			spin_lock(frame_alloc_lock);
+			while (count < FRAME_CACHE_BATCH) {
+				uintptr_t index = frame_index_find(1);
+				if (index == FRAME_INDEX_NONE) break;
+				mmu_frame_set(index << PAGE_SHIFT);
+				batch[count++] = index;
+			}
+			spin_unlock(frame_alloc_lock);
+
+			spin_lock(cache->lock);
+			/* Hand out the lowest frame first. */
+			while (count && cache->count < FRAME_CACHE_SIZE) {
+				cache->frames[cache->count++] = batch[--count];
+			}
+			if (count) {
+				spin_unlock(cache->lock);
+				spin_lock(frame_alloc_lock);
+				while (count) mmu_frame_clear(batch[--count] << PAGE_SHIFT);
+				spin_unlock(frame_alloc_lock);
+				spin_lock(cache->lock);
+			}
+		}
+		if (cache->count) {
+			uintptr_t index = cache->frames[--cache->count];
+			spin_unlock(cache->lock);
+			return index;
+		}
+		spin_unlock(cache->lock);
+	}
+
 	spin_lock(frame_alloc_lock);
 	uintptr_t index = mmu_first_frame();
 	mmu_frame_set(index << PAGE_SHIFT);
@@ -664,7 +798,7 @@ size_t mmu_count_user(union PML * from) {
 								uintptr_t address = ((i << (9 * 3 + 12)) | (j << (9*2 + 12)) | (k << (9 + 12)) | (l << PAGE_SHIFT));
 								if (address >= USER_DEVICE_MAP && address <= USER_SHM_HIGH) continue;
 								if (pt_in[l].bits.present) {
-									if (pt_in[l].bits.user) {
+									if (pt_in[l].bits.user && !pt_in[l].bits.shared) {
 										out++;
 									}
 								}
@@ -745,7 +879,7 @@ size_t mmu_used_memory(void) {
 			}
 		}
 	}
-	return ret * 4 - unavailable_memory;
+	return (ret - frame_cache_count()) * 4 - unavailable_memory;
 }
 
 /**
@@ -777,8 +911,8 @@ void mmu_free(union PML * from) {
 								/* Do not free shared mappings; SHM subsystem does that for SHM, devices don't need it. */
 								if (address >= USER_DEVICE_MAP && address <= USER_SHM_HIGH) continue;
 								if (pt_in[l].bits.present) {
-									/* Free only user pages */
-									if (pt_in[l].bits.user) {
+									/* Free only user pages; shared mappings own their frames */
+									if (pt_in[l].bits.user && !pt_in[l].bits.shared) {
 										free_page_maybe(pt_in,l,address);
 									}
 								}
@@ -839,6 +973,31 @@ void mmu_invalidate(uintptr_t addr) {
 	arch_tlb_shootdown(addr);
 }
 
+/**
+ * @brief Invalidate a range of virtual addresses in the TLB.
+ *
+ * Small ranges are flushed page by page; anything larger than
+ * @c MMU_INVALIDATE_MAX_PAGES drops the whole TLB instead. Other
+ * cores get a single request for the entire range.
+ *
+ * @param start Page-aligned start of the range.
+ * @param end   End of the range, exclusive.
+ */
+void mmu_invalidate_range(uintptr_t start, uintptr_t end) {
+	if (end <= start) return;
+	if (end - start > MMU_INVALIDATE_MAX_PAGES * PAGE_SIZE) {
+		asm volatile (
+			"mov %%cr3, %%rax\n"
+			"mov %%rax, %%cr3\n"
+			: : : "rax", "memory");
+	} else {
+		for (uintptr_t a = start; a < end; a += PAGE_SIZE) {
+			asm volatile ("invlpg (%0)" : : "r"(a) : "memory");
+		}
+	}
+	arch_tlb_shootdown_range(start, end);
+}
+
 int mmu_get_page_deep(uintptr_t virtAddr, union PML ** pml4_out, union PML ** pdp_out, union PML ** pd_out, union PML ** pt_out) {
 	/* This is all the same as x86, thankfully? */
 	uintptr_t realBits = virtAddr & CANONICAL_MASK;
@@ -893,6 +1052,7 @@ static int maybe_release_directory(union PML * parent, union PML * child) {
 }
 
 void mmu_unmap_user(uintptr_t addr, size_t size) {
+	uintptr_t first = 0, last = 0;
 	for (uintptr_t a = addr; a < addr + size; a += PAGE_SIZE) {
 		union PML * pml4, * pdp, * pd, * pt;
 
@@ -902,7 +1062,9 @@ void mmu_unmap_user(uintptr_t addr, size_t size) {
 		spin_lock(frame_alloc_lock);
 
 		if (pt && pt->bits.present && pt->bits.user) {
-			if (pt->bits.writable) {
+			if (pt->bits.shared) {
+				/* Frame belongs to a shared mapping, which will release it. */
+			} else if (pt->bits.writable) {
 				assert(mem_refcounts[pt->bits.page] == 0);
 				mmu_frame_clear((uintptr_t)pt->bits.page << PAGE_SHIFT);
 			} else if (refcount_dec(pt->bits.page) == 0) {
@@ -910,6 +1072,8 @@ void mmu_unmap_user(uintptr_t addr, size_t size) {
 			}
 			pt->bits.present = 0;
 			pt->bits.writable = 0;
+			pt->bits.shared = 0;
+			pt->bits.cow_pending = 0;
 
 			if (maybe_release_directory(pd, pt)) {
 				if (maybe_release_directory(pdp, pd)) {
@@ -917,11 +1081,15 @@ void mmu_unmap_user(uintptr_t addr, size_t size) {
 				}
 			}
 
-			mmu_invalidate(a);
+			if (!last) first = a;
+			last = a + PAGE_SIZE;
 		}
 
 		spin_unlock(frame_alloc_lock);
 	}
+
+	/* One flush for everything that was unmapped. */
+	if (last) mmu_invalidate_range(first, last);
 }
 
 
@@ -1052,6 +1220,9 @@ void mmu_init(size_t memsize, uintptr_t firstFreePage) {
 	size_t size_of_refcounts = (nframes & PAGE_LOW_MASK) ? (nframes + PAGE_SIZE - (nframes & PAGE_LOW_MASK)) : nframes;
 	mem_refcounts = sbrk(size_of_refcounts);
 	memset(mem_refcounts, 0, size_of_refcounts);
+
+	/* Everything is in place, switch over from scanning the bitmap. */
+	frame_index_init(frames, nframes);
 }
 
 /**
@@ -1106,6 +1277,63 @@ void * sbrk(size_t bytes) {
 	return out;
 }
 
+/**
+ * @brief Return the frames behind part of the kernel heap.
+ *
+ * Used by the heap allocator for the interior of large free blocks.
+ * The address range stays part of the heap; @ref sbrk_restore must
+ * be called on it before it is touched again. Pages that are already
+ * unbacked are skipped.
+ *
+ * @param start Page-aligned start of the range.
+ * @param bytes Length of the range, a multiple of PAGE_SIZE.
+ * @returns The number of frames that were released.
+ */
+size_t sbrk_release(void * start, size_t bytes) {
+	uintptr_t end = (uintptr_t)start + bytes;
+	size_t released = 0;
+
+	for (uintptr_t p = (uintptr_t)start; p < end; ) {
+		/* Unmap a batch everywhere before any of its frames can be reused. */
+		uintptr_t batch[32];
+		size_t count = 0;
+		uintptr_t batch_start = p;
+		for (; p < end && count < 32; p += PAGE_SIZE) {
+			union PML * page = mmu_get_page(p, 0);
+			if (!page || !page->bits.present) continue;
+			batch[count++] = (uintptr_t)page->bits.page << PAGE_SHIFT;
+			page->raw = 0;
+		}
+		if (!count) continue;
+		mmu_invalidate_range(batch_start, p);
+		for (size_t i = 0; i < count; ++i) {
+			mmu_frame_release(batch[i]);
+		}
+		released += count;
+	}
+
+	return released;
+}
+
+/**
+ * @brief Back a range of the kernel heap with frames again.
+ *
+ * @returns The number of pages that needed a new frame.
+ */
+size_t sbrk_restore(void * start, size_t bytes) {
+	uintptr_t end = (uintptr_t)start + bytes;
+	size_t restored = 0;
+
+	for (uintptr_t p = (uintptr_t)start; p < end; p += PAGE_SIZE) {
+		union PML * page = mmu_get_page(p, MMU_GET_MAKE);
+		if (page->bits.present) continue;
+		mmu_frame_allocate(page, MMU_FLAG_WRITABLE | MMU_FLAG_KERNEL);
+		restored++;
+	}
+
+	return restored;
+}
+
 static uintptr_t mmio_base_address = MMIO_BASE_START;
 
 /**
@@ -1191,7 +1419,9 @@ void mmu_unmap_module(uintptr_t start_address, size_t size) {
 	/* Unmap all pages we just allocated */
 	for (uintptr_t i = start_address; i < end_address; i += 0x1000) {
 		union PML * p = mmu_get_page(i, 0);
+		spin_lock(frame_alloc_lock);
 		mmu_frame_clear(p->bits.page << 12);
+		spin_unlock(frame_alloc_lock);
 	}
 
 	/* Reset module base address if it was at the end, to avoid wasting address space */
@@ -1258,6 +1488,39 @@ int mmu_copy_on_write(uintptr_t address) {
 	return 0;
 }
 
+/**
+ * @brief Change whether a user page may be written to.
+ *
+ * Private pages take part in copy-on-write, so a page losing write
+ * access becomes a read-only page holding a single reference, and a
+ * read-only page gaining it is marked as pending a COW so the next
+ * write either takes the page back or makes a private copy. Pages
+ * of shared mappings have their frames owned by the mapping, so
+ * only the bit changes.
+ *
+ * @param page Page entry to update.
+ * @param address Virtual address of the page, for invalidation.
+ * @param flags MMU_FLAG_WRITABLE to allow writes.
+ */
+void mmu_page_protect(union PML * page, uintptr_t address, unsigned int flags) {
+	spin_lock(frame_alloc_lock);
+	if (page->bits.shared) {
+		page->bits.writable = (flags & MMU_FLAG_WRITABLE) ? 1 : 0;
+	} else if (flags & MMU_FLAG_WRITABLE) {
+		if (!page->bits.writable) page->bits.cow_pending = 1;
+	} else {
+		if (page->bits.writable) {
+			assert(mem_refcounts[page->bits.page] == 0);
+			mem_refcounts[page->bits.page] = 1;
+			page->bits.writable = 0;
+		}
+		page->bits.cow_pending = 0;
+	}
+	asm ("" ::: "memory");
+	mmu_invalidate(address);
+	spin_unlock(frame_alloc_lock);
+}
+
 /**
  * @brief Check if the current user process can access address space.
  *
@@ -1286,11 +1549,15 @@ int mmu_validate_user_pointer(const void * addr, size_t size, int flags) {
 	for (uintptr_t page = page_base; page <= page_end; ++page) {
 		if ((page & 0xffff800000000) != 0 && (page & 0xffff800000000) != 0xffff800000000) return 0;
 		union PML * page_entry = mmu_get_page_other(this_core->current_process->thread.page_directory->directory, page << 12);
-		if (!page_entry) return 0;
-		if (!page_entry->bits.present) return 0;
+		if (!page_entry || !page_entry->bits.present) {
+			/* Might be part of a mapping that hasn't been touched yet. */
+			if (mmap_page_fault(page << 12, flags & MMU_PTR_WRITE)) return 0;
+			page_entry = mmu_get_page_other(this_core->current_process->thread.page_directory->directory, page << 12);
+			if (!page_entry || !page_entry->bits.present) return 0;
+		}
 		if (!page_entry->bits.user) return 0;
 		if (!page_entry->bits.writable && (flags & MMU_PTR_WRITE)) {
-			if (mmu_copy_on_write((uintptr_t)(page << 12))) return 0;
+			if (mmu_copy_on_write((uintptr_t)(page << 12)) && mmap_page_fault(page << 12, 1)) return 0;
 		}
 	}
 
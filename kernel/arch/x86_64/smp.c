@@ -18,6 +18,8 @@
 #include <kernel/time.h>
 #include <kernel/multiboot.h>
 #include <kernel/mmu.h>
+#include <kernel/spinlock.h>
+#include <kernel/procfs.h>
 #include <kernel/arch/x86_64/acpi.h>
 
 __attribute__((used))
@@ -305,6 +307,8 @@ uintptr_t xtoi(const char * c) {
 	return out;
 }
 
+static struct procfs_entry tlb_entry;
+
 /**
  * @brief Called on main startup to initialize other cores.
  *
@@ -407,7 +411,7 @@ void smp_initialize(void) {
 				switch (entry[0]) {
 					case 0:
 						if (entry[4] & 0x01) {
-							if (cores == 32) { /* TODO define this somewhere better */
+							if (cores == PROCESSOR_MAX) {
 								printf("smp: too many cores\n");
 								goto _toomany;
 							}
@@ -467,7 +471,9 @@ _toomany:
 
 	/* Copy data back */
 	memcpy(mmu_map_from_physical(0x1000), mmu_map_from_physical(tmp_space), 0x1000);
-	mmu_frame_clear(tmp_space);
+	mmu_frame_release(tmp_space);
+
+	procfs_install(&tlb_entry);
 
 	dprintf("smp: enabled with %d cores\n", cores);
 	return;
@@ -498,21 +504,153 @@ void arch_wakeup_others(void) {
 	lapic_send_ipi(0, 0x7E | (3 << 18));
 }
 
+/**
+ * @brief Send a soft IPI to one other core.
+ *
+ * Used by the scheduler to wake an idle core when a process is
+ * placed in its ready queue, or when there is work it could steal.
+ * Same vector as @ref arch_wakeup_others, but directed at a single
+ * LAPIC so busy cores are left alone.
+ *
+ * @param cpu Index of the core in @c processor_local_data
+ */
+void arch_wakeup_core(int cpu) {
+	if (!lapic_final || processor_count < 2) return;
+	lapic_send_ipi(processor_local_data[cpu].lapic_id, 0x7E);
+}
+
+/*
+ * TLB shootdowns
+ *
+ * Every core has a queue of address ranges that other cores want it to
+ * drop from its TLB. A shootdown adds its range to the queue of each core
+ * that could have it cached and sends only those cores an IPI; the IPI
+ * handler invalidates the queued pages one at a time, or reloads CR3 if
+ * the queue overflowed or a range was too big to be worth it.
+ *
+ * Kernel mappings are shared, so every core is a target. For user
+ * addresses, only cores that have the same page directory loaded are;
+ * any other core flushed its TLB when it last wrote CR3.
+ */
+#define TLB_QUEUE_SIZE 8
+
+static struct tlb_queue {
+	spin_lock_t lock;
+	int full;
+	unsigned int count;
+	uintptr_t start[TLB_QUEUE_SIZE];
+	uintptr_t end[TLB_QUEUE_SIZE];
+} __attribute__((aligned(64))) tlb_queues[PROCESSOR_MAX];
+
+static struct {
+	uint64_t shootdowns;  /* Calls that could have needed other cores */
+	uint64_t ipis_sent;
+	uint64_t ipis_avoided; /* Cores skipped for not having the address space loaded */
+	uint64_t received;
+	uint64_t pages;       /* Pages invalidated by IPI handlers */
+	uint64_t full;        /* IPI handlers that reloaded CR3 */
+} tlb_stats;
+
+#define TLB_STAT(field, n) __atomic_add_fetch(&tlb_stats.field, n, __ATOMIC_RELAXED)
+
 /**
  * @brief Trigger a TLB shootdown on other cores.
  *
- * XXX This is really dumb; we just send an IPI to everyone else
- *     and they reload CR3...
+ * The caller has already updated the page tables and invalidated the
+ * range locally. This does not wait for the other cores to finish.
  *
- * @param vaddr Should have the address to flush, but not actually used.
+ * @param start First address in the range.
+ * @param end   Address after the end of the range.
  */
-void arch_tlb_shootdown(uintptr_t vaddr) {
+void arch_tlb_shootdown_range(uintptr_t start, uintptr_t end) {
 	if (!lapic_final || processor_count < 2) return;
 
-	/*
-	 * We should be checking if this address can be sensibly
-	 * mapped somewhere else before IPIing everyone...
-	 */
+	start &= ~0xFFFUL;
+	int kernel = start >= 0x800000000000UL;
+	int whole = (end - start) > MMU_INVALIDATE_MAX_PAGES * 0x1000UL;
+	union PML * dir = this_core->current_pml;
+
+	/* Page table updates must be visible before we look at what other cores have loaded. */
+	__sync_synchronize();
+	TLB_STAT(shootdowns, 1);
+
+	for (int i = 0; i < processor_count; ++i) {
+		if (i == this_core->cpu_id) continue;
+		if (!kernel && processor_local_data[i].current_pml != dir) {
+			TLB_STAT(ipis_avoided, 1);
+			continue;
+		}
+
+		struct tlb_queue * queue = &tlb_queues[i];
+		spin_lock(queue->lock);
+		if (whole || queue->count == TLB_QUEUE_SIZE) {
+			queue->full = 1;
+		} else {
+			queue->start[queue->count] = start;
+			queue->end[queue->count] = end;
+			queue->count++;
+		}
+		spin_unlock(queue->lock);
 
-	lapic_send_ipi(0, 0x7C | (3 << 18));
+		lapic_send_ipi(processor_local_data[i].lapic_id, 0x7C);
+		TLB_STAT(ipis_sent, 1);
+	}
+}
+
+/**
+ * @brief Trigger a TLB shootdown of one page on other cores.
+ */
+void arch_tlb_shootdown(uintptr_t vaddr) {
+	arch_tlb_shootdown_range(vaddr, vaddr + 0x1000);
 }
+
+/**
+ * @brief Handle a TLB shootdown IPI.
+ *
+ * Drains this core's queue of ranges to invalidate.
+ */
+void arch_tlb_shootdown_handler(void) {
+	struct tlb_queue * queue = &tlb_queues[this_core->cpu_id];
+	uint64_t pages = 0;
+
+	spin_lock(queue->lock);
+	if (queue->full) {
+		asm volatile ("mov %%cr3, %%rax\nmov %%rax, %%cr3" ::: "rax", "memory");
+		TLB_STAT(full, 1);
+	} else {
+		for (unsigned int i = 0; i < queue->count; ++i) {
+			for (uintptr_t a = queue->start[i]; a < queue->end[i]; a += 0x1000) {
+				asm volatile ("invlpg (%0)" : : "r"(a) : "memory");
+				pages++;
+			}
+		}
+	}
+	queue->full = 0;
+	queue->count = 0;
+	spin_unlock(queue->lock);
+
+	TLB_STAT(received, 1);
+	TLB_STAT(pages, pages);
+}
+
+static void tlb_func(fs_node_t * node) {
+	procfs_printf(node,
+		"Shootdowns: %lu\n"
+		"IPIsSent:   %lu\n"
+		"IPIsAvoided: %lu\n"
+		"Received:   %lu\n"
+		"Pages:      %lu\n"
+		"Full:       %lu\n",
+		tlb_stats.shootdowns,
+		tlb_stats.ipis_sent,
+		tlb_stats.ipis_avoided,
+		tlb_stats.received,
+		tlb_stats.pages,
+		tlb_stats.full);
+}
+
+static struct procfs_entry tlb_entry = {
+	0,
+	"tlb",
+	tlb_func,
+};
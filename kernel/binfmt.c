@@ -14,6 +14,7 @@
 #include <kernel/string.h>
 #include <kernel/mmu.h>
 #include <kernel/elf.h>
+#include <kernel/time.h>
 #include <sys/time.h>
 
 extern int elf_exec(const char * path, fs_node_t * file, int argc, char *const argv[], char *const env[], int interp);
@@ -112,6 +113,8 @@ static int matches(unsigned char * a, unsigned char * b, unsigned int len) {
  * @returns Either never or -ENOEXEC on failure.
  */
 int exec(const char * path, int argc, char *const argv[], char *const env[], int interp_depth) {
+	if (!interp_depth) this_core->current_process->exec_start = arch_perf_timer();
+
 	fs_node_t * file = kopen(path, 0);
 	if (!file) return -ENOENT;
 	if (!has_permission(file, 01)) return -EACCES;
@@ -147,6 +150,7 @@ int system(const char * path, int argc, char *const argv[], char *const envin[])
 	this_core->current_process->thread.page_directory->directory = mmu_clone(NULL); /* base PML? for exec? */
 	this_core->current_process->thread.page_directory->refcount = 1;
 	spin_init(this_core->current_process->thread.page_directory->lock);
+	this_core->current_process->thread.page_directory->mappings = NULL;
 	mmu_set_directory(this_core->current_process->thread.page_directory->directory);
 	this_core->current_process->cmdline = (char**)argv_;
 	exec(path,argc,argv_,envin ? envin : env,0);
@@ -29,16 +29,21 @@ extern void packetfs_initialize(void);
 extern void zero_initialize(void);
 extern void procfs_initialize(void);
 extern void shm_install(void);
+extern void mmap_install(void);
+extern void malloc_install(void);
 extern void random_initialize(void);
 extern void snd_install(void);
 extern void net_install(void);
 extern void console_initialize(void);
 extern void modules_install(void);
+extern void elf_install(void);
 
 void generic_startup(void) {
 	args_parse(arch_get_cmdline());
 	initialize_process_tree();
+	malloc_install();
 	shm_install();
+	mmap_install();
 	vfs_install();
 	tarfs_register_init();
 	tmpfs_register_init();
@@ -52,6 +57,7 @@ void generic_startup(void) {
 	net_install();
 	tasking_start();
 	modules_install();
+	elf_install();
 }
 
 int generic_main(void) {
@@ -7,6 +7,11 @@
  * is loaded, which should generally be /lib/ld.so, which should itself
  * be a static binary. This loader is platform-generic.
  *
+ * Program segments are normally not loaded at all: they are mapped
+ * privately from the executable and paged in as they are touched,
+ * with the BSS backed by the zero page until it is written. Binaries
+ * whose segments don't line up with pages are loaded eagerly.
+ *
  * @copyright
  * This file is part of ToaruOS and is released under the terms
  * of the NCSA / University of Illinois License - see LICENSE.md
@@ -26,6 +31,11 @@
 #include <kernel/module.h>
 #include <kernel/hashmap.h>
 #include <kernel/mutex.h>
+#include <kernel/mmap.h>
+#include <kernel/procfs.h>
+#include <kernel/spinlock.h>
+#include <kernel/time.h>
+#include <sys/mman.h>
 
 hashmap_t * _modules_table = NULL;
 sched_mutex_t * _modules_mutex = NULL;
@@ -248,6 +258,120 @@ _unmap_module:
 	return -error;
 }
 
+static spin_lock_t exec_stats_lock = { 0 };
+static struct {
+	uint64_t execs;
+	uint64_t lazy;     /* Execs that mapped their segments on demand */
+	uint64_t eager;    /* Execs that read everything in up front */
+	uint64_t last_us;
+	uint64_t total_us;
+	uint64_t max_us;
+} exec_stats;
+
+static void execstat_func(fs_node_t * node) {
+	spin_lock(exec_stats_lock);
+	procfs_printf(node,
+		"Execs:\t%lu\n"
+		"Lazy:\t%lu\n"
+		"Eager:\t%lu\n"
+		"LastUs:\t%lu\n"
+		"AvgUs:\t%lu\n"
+		"MaxUs:\t%lu\n",
+		exec_stats.execs,
+		exec_stats.lazy,
+		exec_stats.eager,
+		exec_stats.last_us,
+		exec_stats.execs ? exec_stats.total_us / exec_stats.execs : 0,
+		exec_stats.max_us);
+	spin_unlock(exec_stats_lock);
+	procfs_printf(node,
+		"FilePages:\t%lu\n"
+		"AnonPages:\t%lu\n"
+		"ZeroMaps:\t%lu\n"
+		"ZeroBreaks:\t%lu\n",
+		mmap_stats.file_pages,
+		mmap_stats.anon_pages,
+		mmap_stats.zero_maps,
+		mmap_stats.zero_breaks);
+}
+
+static struct procfs_entry execstat_entry = {
+	0,
+	"execstat",
+	execstat_func,
+};
+
+void elf_install(void) {
+	procfs_install(&execstat_entry);
+}
+
+/**
+ * @brief Record how long the exec() that is about to finish took.
+ */
+static void elf_exec_account(int lazy) {
+	uint64_t start = this_core->current_process->exec_start;
+	if (!start) return;
+	this_core->current_process->exec_start = 0;
+	uint64_t elapsed = (arch_perf_timer() - start) / arch_cpu_mhz();
+
+	spin_lock(exec_stats_lock);
+	exec_stats.execs++;
+	if (lazy) exec_stats.lazy++;
+	else exec_stats.eager++;
+	exec_stats.last_us = elapsed;
+	exec_stats.total_us += elapsed;
+	if (elapsed > exec_stats.max_us) exec_stats.max_us = elapsed;
+	spin_unlock(exec_stats_lock);
+}
+
+/**
+ * @brief Check whether the segments of an executable can be mapped on demand.
+ *
+ * Each loadable segment must sit at the same offset within its page
+ * as it does in the file, and segments can't share a page, as every
+ * page belongs to exactly one mapping.
+ */
+static int elf_can_map(fs_node_t * file, Elf64_Header * header) {
+	uintptr_t last_end = 0;
+	for (int i = 0; i < header->e_phnum; ++i) {
+		Elf64_Phdr phdr;
+		read_fs(file, header->e_phoff + header->e_phentsize * i, sizeof(Elf64_Phdr), (uint8_t*)&phdr);
+		if (phdr.p_type != PT_LOAD || !phdr.p_memsz) continue;
+		if ((phdr.p_vaddr & 0xFFF) != (phdr.p_offset & 0xFFF)) return 0;
+		if (phdr.p_filesz > phdr.p_memsz) return 0;
+		uintptr_t start = phdr.p_vaddr & ~0xFFFUL;
+		uintptr_t end   = (phdr.p_vaddr + phdr.p_memsz + 0xFFF) & ~0xFFFUL;
+		if (start < last_end || start < 0x1000 || end <= start || end > USER_DEVICE_MAP) return 0;
+		last_end = end;
+	}
+	return 1;
+}
+
+/**
+ * @brief Map a loadable segment to be paged in as it is touched.
+ *
+ * The file part is a private mapping of the executable that stops at the
+ * end of the segment's file data, so the rest of its last page reads as
+ * zero; the remainder of the BSS is anonymous memory. Everything stays
+ * writable and executable as with the eager loader, which the debugger
+ * relies on to set breakpoints.
+ */
+static void elf_map_segment(fs_node_t * file, Elf64_Phdr * phdr) {
+	int prot = PROT_READ | PROT_WRITE | PROT_EXEC;
+	uintptr_t start    = phdr->p_vaddr & ~0xFFFUL;
+	uintptr_t file_end = phdr->p_filesz ? (phdr->p_vaddr + phdr->p_filesz + 0xFFF) & ~0xFFFUL : start;
+	uintptr_t mem_end  = (phdr->p_vaddr + phdr->p_memsz + 0xFFF) & ~0xFFFUL;
+
+	if (file_end > start) {
+		mmap_map(start, file_end - start, prot, MAP_PRIVATE | MAP_FIXED, file,
+			phdr->p_offset & ~0xFFFUL, phdr->p_offset + phdr->p_filesz, 1);
+	}
+
+	if (mem_end > file_end) {
+		mmap_map(file_end, mem_end - file_end, prot, MAP_PRIVATE | MAP_FIXED | MAP_ANONYMOUS, NULL, 0, 0, 1);
+	}
+}
+
 int elf_exec(const char * path, fs_node_t * file, int argc, const char *const argv[], const char *const env[], int interp) {
 	Elf64_Header header;
 
@@ -303,12 +427,14 @@ int elf_exec(const char * path, fs_node_t * file, int argc, const char *const ar
 
 	uintptr_t execBase = -1;
 	uintptr_t heapBase = 0;
+	int lazy = elf_can_map(file, &header);
 
 	mmu_set_directory(NULL);
 	page_directory_t * this_directory = this_core->current_process->thread.page_directory;
 	this_core->current_process->thread.page_directory = malloc(sizeof(page_directory_t));
 	this_core->current_process->thread.page_directory->refcount = 1;
 	spin_init(this_core->current_process->thread.page_directory->lock);
+	this_core->current_process->thread.page_directory->mappings = NULL;
 	this_core->current_process->thread.page_directory->directory = mmu_clone(NULL);
 	mmu_set_directory(this_core->current_process->thread.page_directory->directory);
 	process_release_directory(this_directory);
@@ -323,20 +449,24 @@ int elf_exec(const char * path, fs_node_t * file, int argc, const char *const ar
 		Elf64_Phdr phdr;
 		read_fs(file, header.e_phoff + header.e_phentsize * i, sizeof(Elf64_Phdr), (uint8_t*)&phdr);
 		if (phdr.p_type == PT_LOAD) {
-			for (uintptr_t i = phdr.p_vaddr; i < phdr.p_vaddr + phdr.p_memsz; i += 0x1000) {
-				union PML * page = mmu_get_page(i, MMU_GET_MAKE);
-				mmu_frame_allocate(page, MMU_FLAG_WRITABLE);
-			}
+			if (lazy) {
+				elf_map_segment(file, &phdr);
+			} else {
+				for (uintptr_t i = phdr.p_vaddr; i < phdr.p_vaddr + phdr.p_memsz; i += 0x1000) {
+					union PML * page = mmu_get_page(i, MMU_GET_MAKE);
+					mmu_frame_allocate(page, MMU_FLAG_WRITABLE);
+				}
 
-			read_fs(file, phdr.p_offset, phdr.p_filesz, (void*)phdr.p_vaddr);
-			for (size_t i = phdr.p_filesz; i < phdr.p_memsz; ++i) {
-				*(char*)(phdr.p_vaddr + i) = 0;
-			}
+				read_fs(file, phdr.p_offset, phdr.p_filesz, (void*)phdr.p_vaddr);
+				for (size_t i = phdr.p_filesz; i < phdr.p_memsz; ++i) {
+					*(char*)(phdr.p_vaddr + i) = 0;
+				}
 
-			#ifdef __aarch64__
-			extern void arch_clear_icache(uintptr_t,uintptr_t);
-			arch_clear_icache(phdr.p_vaddr, phdr.p_vaddr + phdr.p_memsz);
-			#endif
+				#ifdef __aarch64__
+				extern void arch_clear_icache(uintptr_t,uintptr_t);
+				arch_clear_icache(phdr.p_vaddr, phdr.p_vaddr + phdr.p_memsz);
+				#endif
+			}
 
 			if (phdr.p_vaddr + phdr.p_memsz > heapBase) {
 				heapBase = phdr.p_vaddr + phdr.p_memsz;
@@ -422,6 +552,8 @@ int elf_exec(const char * path, fs_node_t * file, int argc, const char *const ar
 	char ** _argv = (char**)userstack;
 	PUSH(uintptr_t, argc);
 
+	elf_exec_account(lazy);
+
 	arch_set_kernel_stack(this_core->current_process->image.stack);
 	arch_enter_user(header.e_entry, argc, _argv, _envp, userstack);
 
@@ -0,0 +1,188 @@
+/**
+ * @file  kernel/misc/frame_index.c
+ * @brief Free-run index over the physical frame bitmap.
+ *
+ * The MMU tracks physical frames with a bitmap, one bit per frame,
+ * which stays the authority on what is in use. This builds a tree
+ * over the words of that bitmap where every node knows the longest
+ * run of free frames below it, as well as how many free frames its
+ * range starts and ends with. Runs crossing from one half of a node
+ * into the other can be found from those, so finding the first run
+ * of any length, including a single frame, walks one path from the
+ * root to a leaf instead of scanning the bitmap.
+ *
+ * The MMU calls @ref frame_index_update whenever a bit changes, with
+ * its frame allocation lock held; this file does no locking of its own.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2023 K. Lange
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include <kernel/string.h>
+#include <kernel/mmu.h>
+#include <kernel/frame_index.h>
+
+struct frame_run {
+	uint32_t pre;  /* Free frames at the start of the range */
+	uint32_t suf;  /* Free frames at the end of the range */
+	uint32_t max;  /* Longest free run anywhere in the range */
+};
+
+static volatile uint32_t * bitmap = NULL;
+static size_t words = 0;
+static size_t total = 0;
+static size_t leaves = 0;          /* Power of two >= words */
+static struct frame_run * nodes = NULL; /* 1-indexed, leaves start at [leaves] */
+static volatile int ready = 0;
+
+/**
+ * @brief Get a word of the bitmap, with frames past the end marked used.
+ */
+static uint32_t frame_index_word(size_t word) {
+	if (word >= words) return (uint32_t)-1;
+	uint32_t used = bitmap[word];
+	if (word == words - 1 && (total & 31)) used |= ~(((uint32_t)1 << (total & 31)) - 1);
+	return used;
+}
+
+static void frame_index_leaf(size_t word) {
+	struct frame_run * node = &nodes[leaves + word];
+	uint32_t used = frame_index_word(word);
+	if (!used) {
+		node->pre = node->suf = node->max = 32;
+		return;
+	} else if (used == (uint32_t)-1) {
+		node->pre = node->suf = node->max = 0;
+		return;
+	}
+
+	/* Bit 0 is the lowest frame. */
+	node->pre = __builtin_ctz(used);
+	node->suf = __builtin_clz(used);
+
+	/* Each step shortens every run of free bits by one. */
+	uint32_t avail = ~used;
+	uint32_t max = 0;
+	while (avail) {
+		avail &= avail << 1;
+		max++;
+	}
+	node->max = max;
+}
+
+static void frame_index_combine(size_t index, uint32_t half) {
+	struct frame_run * l = &nodes[index * 2];
+	struct frame_run * r = &nodes[index * 2 + 1];
+	struct frame_run * node = &nodes[index];
+
+	node->pre = (l->pre == half) ? half + r->pre : l->pre;
+	node->suf = (r->suf == half) ? half + l->suf : r->suf;
+	node->max = l->suf + r->pre;
+	if (l->max > node->max) node->max = l->max;
+	if (r->max > node->max) node->max = r->max;
+}
+
+/**
+ * @brief Build the index for the current state of @p frames.
+ *
+ * Storage comes from the kernel heap, so this is called once the
+ * MMU is far enough along for @ref sbrk to work; until then every
+ * lookup fails and the MMU scans the bitmap itself.
+ */
+void frame_index_init(volatile uint32_t * frames, size_t nframes) {
+	size_t count = (nframes + 31) / 32;
+	size_t size = 1;
+	while (size < count) size <<= 1;
+
+	size_t bytes = (sizeof(struct frame_run) * size * 2 + 0xFFF) & ~0xFFFUL;
+	nodes = sbrk(bytes);
+
+	bitmap = frames;
+	total  = nframes;
+	words  = count;
+	leaves = size;
+
+	for (size_t i = 0; i < leaves; ++i) {
+		frame_index_leaf(i);
+	}
+
+	uint32_t half = 32;
+	for (size_t level = leaves / 2; level; level /= 2, half *= 2) {
+		for (size_t i = level; i < level * 2; ++i) {
+			frame_index_combine(i, half);
+		}
+	}
+
+	asm volatile ("" ::: "memory");
+	ready = 1;
+}
+
+int frame_index_ready(void) {
+	return ready;
+}
+
+/**
+ * @brief Note that the bit for @p frame changed.
+ */
+void frame_index_update(uintptr_t frame) {
+	if (!ready) return;
+	size_t index = leaves + frame / 32;
+	frame_index_leaf(frame / 32);
+
+	uint32_t half = 32;
+	for (index /= 2; index; index /= 2, half *= 2) {
+		frame_index_combine(index, half);
+	}
+}
+
+/**
+ * @brief Find the first run of @p n free frames.
+ *
+ * The frames are not marked used; that is up to the caller.
+ *
+ * @returns the index of the first frame within the bitmap, or @c FRAME_INDEX_NONE
+ */
+uintptr_t frame_index_find(size_t n) {
+	if (!ready || !n || nodes[1].max < n) return FRAME_INDEX_NONE;
+
+	size_t index = 1;
+	uintptr_t base = 0;
+	uint32_t half = leaves * 16;
+
+	while (index < leaves) {
+		struct frame_run * l = &nodes[index * 2];
+		struct frame_run * r = &nodes[index * 2 + 1];
+		if (l->max >= n) {
+			index = index * 2;
+		} else if (l->suf + r->pre >= n) {
+			return base + half - l->suf;
+		} else {
+			index = index * 2 + 1;
+			base += half;
+		}
+		half /= 2;
+	}
+
+	/* Runs at this level fit within one word. */
+	uint32_t used = frame_index_word(index - leaves);
+	size_t run = 0;
+	for (size_t bit = 0; bit < 32; ++bit) {
+		if (used & ((uint32_t)1 << bit)) {
+			run = 0;
+		} else if (++run == n) {
+			return base + bit + 1 - n;
+		}
+	}
+
+	return FRAME_INDEX_NONE;
+}
+
+/**
+ * @brief Length of the longest run of free frames.
+ */
+size_t frame_index_largest(void) {
+	return ready ? nodes[1].max : 0;
+}
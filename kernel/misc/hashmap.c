@@ -147,7 +147,7 @@ void * hashmap_remove(hashmap_t * map, const void * key) {
 		} else {
 			hashmap_entry_t * p = x;
 			x = x->next;
-			do {
+			while (x) {
 				if (map->hash_comp(x->key, key)) {
 					void * out = x->value;
 					p->next = x->next;
@@ -157,7 +157,7 @@ void * hashmap_remove(hashmap_t * map, const void * key) {
 				}
 				p = x;
 				x = x->next;
-			} while (x);
+			}
 		}
 		return NULL;
 	}
@@ -11,8 +11,18 @@
  * for making it thread-safe in userspace applications (not necessarily
  * tested in the kernel).
  *
- * FIXME The heap allocator has long been lacking an ability to merge large
- *       freed blocks. There's #if 0'd code dating back over a decade in here.
+ * In the kernel, small allocations go through per-CPU magazines: each core
+ * keeps a short stack of free objects for every small bin, refilled from and
+ * flushed to the bins in batches, so most calls never take the global lock.
+ * Per-bin statistics are available in /proc/kmalloc.
+ *
+ * Big allocations are runs of whole pages. Free runs are kept in a skip list
+ * ordered by size and address, and linked to their physical neighbours, so
+ * an allocation splits off only the pages it needs and a free merges with
+ * any free run on either side. Once enough free memory is sitting in the
+ * heap, the interior pages of large free runs are given back to the frame
+ * allocator and mapped again when they are reused. The free runs are
+ * summarized at the end of /proc/kmalloc.
  *
  * @copyright
  * This file is part of ToaruOS and is released under the terms
@@ -36,6 +46,8 @@
 #include <kernel/spinlock.h>
 #include <kernel/mmu.h>
 #include <kernel/misc.h>
+#include <kernel/process.h>
+#include <kernel/procfs.h>
 /* }}} */
 /* Definitions {{{ */
 
@@ -85,44 +97,56 @@ static void * __attribute__ ((malloc)) klcalloc(uintptr_t nmemb, uintptr_t size)
 static void * __attribute__ ((malloc)) klvalloc(uintptr_t size);
 static void klfree(void * ptr);
 
+static void * klmalloc_magazine_alloc(uintptr_t size);
+static int klmalloc_magazine_free(void * ptr);
+static void klmalloc_lock(uintptr_t bin);
+
 static spin_lock_t mem_lock =  { 0 };
 
 void * __attribute__ ((malloc)) malloc(uintptr_t size) {
-	spin_lock(mem_lock);
-	void * out = klmalloc(size);
+	void * out = klmalloc_magazine_alloc(size);
+	if (out) return out;
+	klmalloc_lock(BIG_BIN);
+	out = klmalloc(size);
 	spin_unlock(mem_lock);
 	return out;
 }
 
 void * __attribute__ ((malloc)) realloc(void * ptr, uintptr_t size) {
-	spin_lock(mem_lock);
+	klmalloc_lock(BIG_BIN);
 	void * out = klrealloc(ptr, size);
 	spin_unlock(mem_lock);
 	return out;
 }
 
 void * __attribute__ ((malloc)) calloc(uintptr_t nmemb, uintptr_t size) {
-	spin_lock(mem_lock);
-	void * out = klcalloc(nmemb, size);
+	void * out = klmalloc_magazine_alloc(nmemb * size);
+	if (out) {
+		memset(out, 0x00, nmemb * size);
+		return out;
+	}
+	klmalloc_lock(BIG_BIN);
+	out = klcalloc(nmemb, size);
 	spin_unlock(mem_lock);
 	return out;
 }
 
 void * __attribute__ ((malloc)) valloc(uintptr_t size) {
-	spin_lock(mem_lock);
+	klmalloc_lock(BIG_BIN);
 	void * out = klvalloc(size);
 	spin_unlock(mem_lock);
 	return out;
 }
 
 void free(void * ptr) {
-	spin_lock(mem_lock);
 #ifndef __aarch64__
 	if (ptr < (void*)0xffffff0000000000) {
 		printf("Invalid free detected (%p)\n", ptr);
 		while (1) {};
 	}
 #endif
+	if (!klmalloc_magazine_free(ptr)) return;
+	klmalloc_lock(BIG_BIN);
 	klfree(ptr);
 	spin_unlock(mem_lock);
 }
@@ -180,6 +204,7 @@ typedef struct _klmalloc_big_bin_header {
 	uintptr_t size;
 	uintptr_t bin_magic;
 	struct _klmalloc_big_bin_header * prev;
+	uintptr_t released;						/* Free block whose pages past the header may be unbacked. */
 	struct _klmalloc_big_bin_header * forward[SKIP_MAX_LEVEL+1];
 } klmalloc_big_bin_header;
 
@@ -201,6 +226,29 @@ static struct _klmalloc_big_bins {
 } klmalloc_big_bins;
 static klmalloc_big_bin_header * klmalloc_newest_big = NULL;		/* Newest big bin */
 
+/*
+ * Per-bin statistics, protected by mem_lock except for the
+ * contention counters, which are bumped before taking it.
+ */
+static struct klmalloc_bin_stats {
+	uintptr_t pages;		/* Pages obtained from sbrk for this bin */
+	uintptr_t out;			/* Objects taken out of the bin and not yet returned */
+	uintptr_t contended;	/* Times mem_lock was found held */
+} klmalloc_stats[NUM_BINS];
+
+/*
+ * Big block bookkeeping, protected by mem_lock.
+ */
+static struct klmalloc_big_stats {
+	uintptr_t free_blocks;		/* Blocks in the skip list */
+	uintptr_t free_pages;		/* Pages spanned by those blocks */
+	uintptr_t released_pages;	/* Of those, pages currently given back */
+	uintptr_t returned;			/* Pages given back, ever */
+	uintptr_t reclaimed;		/* Pages mapped again on reuse, ever */
+	uintptr_t splits;
+	uintptr_t merges;
+} klmalloc_big;
+
 /* }}} Bin management */
 /* Doubly-Linked List {{{ */
 
@@ -282,6 +330,15 @@ static inline int __attribute__ ((pure, always_inline)) klmalloc_random_level(vo
 	return level;
 }
 
+/*
+ * Free big blocks are ordered by size and then by address, so every
+ * block has a unique place in the list and the best fit is also the
+ * lowest in memory.
+ */
+static inline int __attribute__ ((always_inline)) klmalloc_skip_before(klmalloc_big_bin_header * node, klmalloc_big_bin_header * value) {
+	return node->size < value->size || (node->size == value->size && node < value);
+}
+
 /*
  * Find best fit for a given value.
  */
@@ -342,7 +399,7 @@ static void klmalloc_skip_list_insert(klmalloc_big_bin_header * value) {
 	 */
 	int i;
 	for (i = klmalloc_big_bins.level; i >= 0; --i) {
-		while (node->forward[i] && node->forward[i]->size < value->size) {
+		while (node->forward[i] && klmalloc_skip_before(node->forward[i], value)) {
 			node = node->forward[i];
 			if (node)
 				assert((node->size + sizeof(klmalloc_big_bin_header)) % PAGE_SIZE == 0);
@@ -413,7 +470,7 @@ static void klmalloc_skip_list_delete(klmalloc_big_bin_header * value) {
 	 */
 	int i;
 	for (i = klmalloc_big_bins.level; i >= 0; --i) {
-		while (node->forward[i] && node->forward[i]->size < value->size) {
+		while (node->forward[i] && klmalloc_skip_before(node->forward[i], value)) {
 			node = node->forward[i];
 			if (node)
 				assert((node->size + sizeof(klmalloc_big_bin_header)) % PAGE_SIZE == 0);
@@ -421,17 +478,7 @@ static void klmalloc_skip_list_delete(klmalloc_big_bin_header * value) {
 		update[i] = node;
 	}
 	node = node->forward[0];
-	while (node != value) {
-		node = node->forward[0];
-	}
 
-	if (node != value) {
-		node = klmalloc_big_bins.head.forward[0];
-		while (node->forward[0] && node->forward[0] != value) {
-			node = node->forward[0];
-		}
-		node = node->forward[0];
-	}
 	/*
 	 * If we found the node, delete it;
 	 * otherwise, we do nothing.
@@ -519,6 +566,180 @@ static inline int __attribute__ ((always_inline)) klmalloc_stack_empty(klmalloc_
 
 /* }}} Stack */
 
+/* Big blocks {{{ */
+
+#define BIG_RELEASE_PAGES 32	/* Smallest free interior worth giving back, in pages */
+#define BIG_RETAIN_PAGES 1024	/* Free pages to keep backed before giving any back */
+
+/*
+ * Pages needed for a big block with @size usable bytes.
+ */
+static inline uintptr_t __attribute__ ((always_inline, pure)) klmalloc_big_pages(uintptr_t size) {
+	return (size + sizeof(klmalloc_big_bin_header) + PAGE_MASK) / PAGE_SIZE;
+}
+
+/*
+ * Total bytes covered by a big block, header included.
+ */
+static inline uintptr_t __attribute__ ((always_inline)) klmalloc_big_span(klmalloc_big_bin_header * header) {
+	return header->size + sizeof(klmalloc_big_bin_header);
+}
+
+/*
+ * Does @b start right where @a ends?
+ */
+static inline int __attribute__ ((always_inline)) klmalloc_big_adjacent(klmalloc_big_bin_header * a, klmalloc_big_bin_header * b) {
+	return (uintptr_t)a + klmalloc_big_span(a) == (uintptr_t)b;
+}
+
+/*
+ * Big blocks are linked in address order; the newest block from
+ * sbrk is always the last one.
+ */
+static void klmalloc_big_link_after(klmalloc_big_bin_header * a, klmalloc_big_bin_header * b) {
+	b->prev = a;
+	b->next = a->next;
+	if (a->next) {
+		a->next->prev = b;
+	} else {
+		klmalloc_newest_big = b;
+	}
+	a->next = b;
+}
+
+static void klmalloc_big_unlink(klmalloc_big_bin_header * header) {
+	if (header->prev) {
+		header->prev->next = header->next;
+	}
+	if (header->next) {
+		header->next->prev = header->prev;
+	} else {
+		klmalloc_newest_big = header->prev;
+	}
+}
+
+/*
+ * Make sure a range of a (possibly) released block is backed.
+ */
+static void klmalloc_big_restore(klmalloc_big_bin_header * header, void * start, uintptr_t bytes) {
+	if (!header->released) return;
+	uintptr_t restored = sbrk_restore(start, bytes);
+	klmalloc_big.released_pages -= restored;
+	klmalloc_big.reclaimed += restored;
+}
+
+/*
+ * Mark a big block free, merge it with free blocks on either side,
+ * and put the result in the skip list. If enough free memory is
+ * already backed, the interior of the merged block is given back.
+ */
+static void klmalloc_big_insert_free(klmalloc_big_bin_header * header) {
+	klmalloc_stack_push((klmalloc_bin_header *)header, (void *)((uintptr_t)header + sizeof(klmalloc_big_bin_header)));
+	assert(header->head != NULL);
+	klmalloc_big.free_blocks++;
+	klmalloc_big.free_pages += klmalloc_big_span(header) / PAGE_SIZE;
+
+	/*
+	 * Coalesce forward blocks into us.
+	 */
+	klmalloc_big_bin_header * next = header->next;
+	if (next && next->head && klmalloc_big_adjacent(header, next)) {
+		klmalloc_skip_list_delete(next);
+		klmalloc_big_unlink(next);
+		header->size += klmalloc_big_span(next);
+		header->released |= next->released;
+		klmalloc_big.free_blocks--;
+		klmalloc_big.merges++;
+	}
+
+	/*
+	 * Coalesce ourselves into the block behind us.
+	 */
+	klmalloc_big_bin_header * prev = header->prev;
+	if (prev && prev->head && klmalloc_big_adjacent(prev, header)) {
+		klmalloc_skip_list_delete(prev);
+		klmalloc_big_unlink(header);
+		prev->size += klmalloc_big_span(header);
+		prev->released |= header->released;
+		klmalloc_big.free_blocks--;
+		klmalloc_big.merges++;
+		header = prev;
+	}
+	assert((header->size + sizeof(klmalloc_big_bin_header)) % PAGE_SIZE == 0);
+
+	/*
+	 * The header page stays mapped so the block can still be found
+	 * and merged; everything after it can go.
+	 */
+	uintptr_t interior = klmalloc_big_span(header) / PAGE_SIZE - 1;
+	if (interior >= BIG_RELEASE_PAGES && klmalloc_big.free_pages - klmalloc_big.released_pages > BIG_RETAIN_PAGES) {
+		uintptr_t released = sbrk_release((void *)((uintptr_t)header + PAGE_SIZE), interior * PAGE_SIZE);
+		klmalloc_big.released_pages += released;
+		klmalloc_big.returned += released;
+		header->released = 1;
+	}
+
+	klmalloc_skip_list_insert(header);
+}
+
+/*
+ * Cut an in-use big block down to @pages pages and free the rest.
+ */
+static void klmalloc_big_split(klmalloc_big_bin_header * header, uintptr_t pages) {
+	uintptr_t total = klmalloc_big_span(header) / PAGE_SIZE;
+	if (total <= pages) return;
+
+	klmalloc_big_bin_header * tail = (klmalloc_big_bin_header *)((uintptr_t)header + pages * PAGE_SIZE);
+	klmalloc_big_restore(header, tail, PAGE_SIZE);
+	tail->bin_magic = BIN_MAGIC;
+	tail->size = (total - pages) * PAGE_SIZE - sizeof(klmalloc_big_bin_header);
+	tail->released = header->released;
+	tail->head = NULL;
+	header->size = pages * PAGE_SIZE - sizeof(klmalloc_big_bin_header);
+	klmalloc_big_link_after(header, tail);
+	klmalloc_big.splits++;
+	klmalloc_big_insert_free(tail);
+}
+
+/*
+ * Take a free big block out of the skip list for use, keeping
+ * only the first @pages pages of it.
+ */
+static void klmalloc_big_take(klmalloc_big_bin_header * header, uintptr_t pages) {
+	klmalloc_skip_list_delete(header);
+	klmalloc_big.free_blocks--;
+	klmalloc_big.free_pages -= klmalloc_big_span(header) / PAGE_SIZE;
+	klmalloc_big_restore(header, header, pages * PAGE_SIZE);
+	header->head = NULL;
+	klmalloc_big_split(header, pages);
+	header->released = 0;
+}
+
+/*
+ * Resize an in-use big block to @pages pages without moving it, by
+ * freeing its tail or by taking over the free block after it.
+ * Returns 1 on success.
+ */
+static int klmalloc_big_resize(klmalloc_big_bin_header * header, uintptr_t pages) {
+	uintptr_t total = klmalloc_big_span(header) / PAGE_SIZE;
+	if (pages <= total) {
+		klmalloc_big_split(header, pages);
+		return 1;
+	}
+
+	klmalloc_big_bin_header * next = header->next;
+	if (!next || !next->head || !klmalloc_big_adjacent(header, next)) return 0;
+	if (total + klmalloc_big_span(next) / PAGE_SIZE < pages) return 0;
+
+	klmalloc_big_take(next, pages - total);
+	klmalloc_big_unlink(next);
+	header->size += klmalloc_big_span(next);
+	klmalloc_big.merges++;
+	return 1;
+}
+
+/* }}} Big blocks */
+
 /* malloc() {{{ */
 static void * __attribute__ ((malloc)) klmalloc(uintptr_t size) {
 	/*
@@ -547,6 +768,7 @@ static void * __attribute__ ((malloc)) klmalloc(uintptr_t size) {
 			bin_header = (klmalloc_bin_header*)sbrk(PAGE_SIZE);
 			bin_header->bin_magic = BIN_MAGIC;
 			assert((uintptr_t)bin_header % PAGE_SIZE == 0);
+			klmalloc_stats[bucket_id].pages++;
 
 			/*
 			 * Set the head of the stack.
@@ -586,94 +808,52 @@ static void * __attribute__ ((malloc)) klmalloc(uintptr_t size) {
 		if (klmalloc_stack_empty(bin_header)) {
 			klmalloc_list_decouple(&(klmalloc_bin_head[bucket_id]),bin_header);
 		}
+		klmalloc_stats[bucket_id].out++;
 		return item;
 	} else {
 		/*
 		 * Big bins.
 		 */
+		uintptr_t pages = klmalloc_big_pages(size);
 		klmalloc_big_bin_header * bin_header = klmalloc_skip_list_findbest(size);
 		if (bin_header) {
 			assert(bin_header->size >= size);
 			/*
-			 * If we found one, delete it from the skip list
+			 * If we found one, take it from the skip list,
+			 * splitting off whatever we don't need.
 			 */
-			klmalloc_skip_list_delete(bin_header);
-			/*
-			 * Retreive the head of the block.
-			 */
-			uintptr_t ** item = klmalloc_stack_pop((klmalloc_bin_header *)bin_header);
-#if 0
-			/*
-			 * Resize block, if necessary
-			 */
-			assert(bin_header->head == NULL);
-			uintptr_t old_size = bin_header->size;
-			//uintptr_t rsize = size;
-			/*
-			 * Round the requeste size to our full required size.
-			 */
-			size = ((size + sizeof(klmalloc_big_bin_header)) / PAGE_SIZE + 1) * PAGE_SIZE - sizeof(klmalloc_big_bin_header);
-			assert((size + sizeof(klmalloc_big_bin_header)) % PAGE_SIZE == 0);
-			if (bin_header->size > size * 2) {
-				assert(old_size != size);
-				/*
-				 * If we have extra space, start splitting.
-				 */
-				bin_header->size = size;
-				assert(sbrk(0) >= bin_header->size + (uintptr_t)bin_header);
-				/*
-				 * Make a new block at the end of the needed space.
-				 */
-				klmalloc_big_bin_header * header_new = (klmalloc_big_bin_header *)((uintptr_t)bin_header + sizeof(klmalloc_big_bin_header) + size);
-				assert((uintptr_t)header_new % PAGE_SIZE == 0);
-				memset(header_new, 0, sizeof(klmalloc_big_bin_header) + sizeof(void *));
-				header_new->prev = bin_header;
-				if (bin_header->next) {
-					bin_header->next->prev = header_new;
-				}
-				header_new->next = bin_header->next;
-				bin_header->next = header_new;
-				if (klmalloc_newest_big == bin_header) {
-					klmalloc_newest_big = header_new;
-				}
-				header_new->size = old_size - (size + sizeof(klmalloc_big_bin_header));
-				assert(((uintptr_t)header_new->size + sizeof(klmalloc_big_bin_header)) % PAGE_SIZE == 0);
-				fprintf(stderr, "Splitting %p [now %zx] at %p [%zx] from [%zx,%zx].\n", (void*)bin_header, bin_header->size, (void*)header_new, header_new->size, old_size, size);
-				/*
-				 * Free the new block.
-				 */
-				klfree((void *)((uintptr_t)header_new + sizeof(klmalloc_big_bin_header)));
-			}
-#endif
-			return item;
+			klmalloc_big_take(bin_header, pages);
 		} else {
 			/*
-			 * Round requested size to a set of pages, plus the header size.
+			 * Grow the heap by the pages we need.
 			 */
-			uintptr_t pages = (size + sizeof(klmalloc_big_bin_header)) / PAGE_SIZE + 1;
 			bin_header = (klmalloc_big_bin_header*)sbrk(PAGE_SIZE * pages);
 			bin_header->bin_magic = BIN_MAGIC;
 			assert((uintptr_t)bin_header % PAGE_SIZE == 0);
+			klmalloc_stats[BIG_BIN].pages += pages;
 			/*
 			 * Give the header the remaining space.
 			 */
 			bin_header->size = pages * PAGE_SIZE - sizeof(klmalloc_big_bin_header);
 			assert((bin_header->size + sizeof(klmalloc_big_bin_header)) % PAGE_SIZE == 0);
+			bin_header->released = 0;
+			bin_header->head = NULL;
 			/*
 			 * Link the block in physical memory.
 			 */
-			bin_header->prev = klmalloc_newest_big;
-			if (bin_header->prev) {
-				bin_header->prev->next = bin_header;
-			}
-			klmalloc_newest_big = bin_header;
+			bin_header->prev = NULL;
 			bin_header->next = NULL;
-			/*
-			 * Return the head of the block.
-			 */
-			bin_header->head = NULL;
-			return (void*)((uintptr_t)bin_header + sizeof(klmalloc_big_bin_header));
+			if (klmalloc_newest_big) {
+				klmalloc_big_link_after(klmalloc_newest_big, bin_header);
+			} else {
+				klmalloc_newest_big = bin_header;
+			}
 		}
+		klmalloc_stats[BIG_BIN].out++;
+		/*
+		 * Return the head of the block.
+		 */
+		return (void*)((uintptr_t)bin_header + sizeof(klmalloc_big_bin_header));
 	}
 }
 /* }}} */
@@ -720,86 +900,11 @@ static void klfree(void *ptr) {
 		assert(bheader);
 		assert(bheader->head == NULL);
 		assert((bheader->size + sizeof(klmalloc_big_bin_header)) % PAGE_SIZE == 0);
+		klmalloc_stats[BIG_BIN].out--;
 		/*
-		 * Coalesce forward blocks into us.
-		 */
-#if 0
-		if (bheader != klmalloc_newest_big) {
-			/*
-			 * If we are not the newest big bin, there is most definitely
-			 * something in front of us that we can read.
-			 */
-			assert((bheader->size + sizeof(klmalloc_big_bin_header)) % PAGE_SIZE == 0);
-			klmalloc_big_bin_header * next = (void *)((uintptr_t)bheader + sizeof(klmalloc_big_bin_header) + bheader->size);
-			assert((uintptr_t)next % PAGE_SIZE == 0);
-			if (next == bheader->next && next->head) { //next->size > NUM_BINS && next->head) {
-				/*
-				 * If that something is an available big bin, we can
-				 * coalesce it into us to form one larger bin.
-				 */
-
-				uintptr_t old_size = bheader->size;
-
-				klmalloc_skip_list_delete(next);
-				bheader->size = (uintptr_t)bheader->size + (uintptr_t)sizeof(klmalloc_big_bin_header) + next->size;
-				assert((bheader->size + sizeof(klmalloc_big_bin_header))  % PAGE_SIZE == 0);
-
-				if (next == klmalloc_newest_big) {
-					/*
-					 * If the guy in front of us was the newest,
-					 * we are now the newest (as we are him).
-					 */
-					klmalloc_newest_big = bheader;
-				} else {
-					if (next->next) {
-						next->next->prev = bheader;
-					}
-				}
-				fprintf(stderr,"Coelesced (forwards)  %p [%zx] <- %p [%zx] = %zx\n", (void*)bheader, old_size, (void*)next, next->size, bheader->size);
-			}
-		}
-#endif
-		/*
-		 * Coalesce backwards
-		 */
-#if 0
-		if (bheader->prev && bheader->prev->head) {
-			/*
-			 * If there is something behind us, it is available, and there is nothing between
-			 * it and us, we can coalesce ourselves into it to form a big block.
-			 */
-			if ((uintptr_t)bheader->prev + (bheader->prev->size + sizeof(klmalloc_big_bin_header)) == (uintptr_t)bheader) {
-
-				uintptr_t old_size = bheader->prev->size;
-
-				klmalloc_skip_list_delete(bheader->prev);
-				bheader->prev->size = (uintptr_t)bheader->prev->size + (uintptr_t)bheader->size + sizeof(klmalloc_big_bin_header);
-				assert((bheader->prev->size + sizeof(klmalloc_big_bin_header))  % PAGE_SIZE == 0);
-				klmalloc_skip_list_insert(bheader->prev);
-				if (klmalloc_newest_big == bheader) {
-					klmalloc_newest_big = bheader->prev;
-				} else {
-					if (bheader->next) {
-						bheader->next->prev = bheader->prev;
-					}
-				}
-				fprintf(stderr,"Coelesced (backwards) %p [%zx] <- %p [%zx] = %zx\n", (void*)bheader->prev, old_size, (void*)bheader, bheader->size, bheader->size);
-				/*
-				 * If we coalesced backwards, we are done.
-				 */
-				return;
-			}
-		}
-#endif
-		/*
-		 * Push new space back into the stack.
+		 * Merge with our neighbours and make the space available.
 		 */
-		klmalloc_stack_push((klmalloc_bin_header *)bheader, (void *)((uintptr_t)bheader + sizeof(klmalloc_big_bin_header)));
-		assert(bheader->head != NULL);
-		/*
-		 * Insert the block into list of available slabs.
-		 */
-		klmalloc_skip_list_insert(bheader);
+		klmalloc_big_insert_free(bheader);
 	} else {
 
 		/*
@@ -814,6 +919,7 @@ static void klfree(void *ptr) {
 		 * Push new space back into the stack.
 		 */
 		klmalloc_stack_push(header, ptr);
+		klmalloc_stats[bucket_id].out--;
 	}
 }
 /* }}} */
@@ -846,7 +952,7 @@ static void * __attribute__ ((malloc)) klrealloc(void *ptr, uintptr_t size) {
 	 */
 	if (__builtin_expect(size == 0, 0))
 	{
-		free(ptr);
+		klfree(ptr);
 		return NULL;
 	}
 
@@ -861,7 +967,18 @@ static void * __attribute__ ((malloc)) klrealloc(void *ptr, uintptr_t size) {
 	}
 
 	uintptr_t old_size = header_old->size;
-	if (old_size < (uintptr_t)BIG_BIN) {
+	if (old_size > (uintptr_t)NUM_BINS) {
+		/*
+		 * Big blocks can give back their tail pages, or grow
+		 * into a free block right behind them, in place.
+		 */
+		klmalloc_big_bin_header * bheader = (klmalloc_big_bin_header *)header_old;
+		uintptr_t offset = (uintptr_t)ptr - (uintptr_t)bheader;
+		if (klmalloc_big_resize(bheader, (offset + size + PAGE_MASK) / PAGE_SIZE)) {
+			return ptr;
+		}
+		old_size = klmalloc_big_span(bheader) - offset;
+	} else if (old_size < (uintptr_t)BIG_BIN) {
 		/*
 		 * If we are copying from a small bin,
 		 * we need to get the size of the bin
@@ -871,16 +988,10 @@ static void * __attribute__ ((malloc)) klrealloc(void *ptr, uintptr_t size) {
 	}
 
 	/*
-	 * (This will only happen for a big bin, mathematically speaking)
 	 * If we still have room in our bin for the additonal space,
 	 * we don't need to do anything.
 	 */
 	if (old_size >= size) {
-
-		/*
-		 * TODO: Break apart blocks here, which is far more important
-		 *       than breaking them up on allocations.
-		 */
 		return ptr;
 	}
 
@@ -926,5 +1037,170 @@ static void * __attribute__ ((malloc)) klcalloc(uintptr_t nmemb, uintptr_t size)
 	return ptr;
 }
 /* }}} */
+/* Per-CPU magazines {{{ */
+
+/*
+ * Each core has a magazine of free objects for every small bin.
+ * Allocations pop from the magazine and frees push to it; only
+ * when a magazine runs dry or overflows is mem_lock taken, to move
+ * a batch of objects between it and the bins. Objects sitting in a
+ * magazine count as allocated as far as the bins are concerned.
+ *
+ * A magazine lock is only ever contended by the statistics reader;
+ * it is held while taking mem_lock, never the other way around.
+ */
+#define MAG_SIZE  32
+#define MAG_BATCH 16
+
+struct klmalloc_magazine {
+	spin_lock_t lock;
+	uintptr_t count;
+	void * objects[MAG_SIZE];
+	uintptr_t allocs;
+	uintptr_t frees;
+	uintptr_t refills;
+	uintptr_t flushes;
+};
+
+static struct klmalloc_cpu_cache {
+	struct klmalloc_magazine bins[BIG_BIN];
+} __attribute__((aligned(64))) klmalloc_cpu_caches[PROCESSOR_MAX];
+
+static int klmalloc_magazines_ready = 0;
+
+static void klmalloc_lock(uintptr_t bin) {
+	if (mem_lock.latch[0]) __atomic_add_fetch(&klmalloc_stats[bin].contended, 1, __ATOMIC_RELAXED);
+	spin_lock(mem_lock);
+}
+
+/*
+ * Allocate from the current core's magazine.
+ * Returns NULL if the size is not served by magazines.
+ */
+static void * klmalloc_magazine_alloc(uintptr_t size) {
+	if (!klmalloc_magazines_ready || !size) return NULL;
+	uintptr_t bin = klmalloc_bin_size(size);
+	if (bin >= BIG_BIN) return NULL;
+
+	struct klmalloc_magazine * mag = &klmalloc_cpu_caches[this_core->cpu_id].bins[bin];
+	spin_lock(mag->lock);
+	if (!mag->count) {
+		klmalloc_lock(bin);
+		while (mag->count < MAG_BATCH) {
+			mag->objects[mag->count++] = klmalloc(1UL << (SMALLEST_BIN_LOG + bin));
+		}
+		spin_unlock(mem_lock);
+		mag->refills++;
+	}
+	mag->allocs++;
+	void * out = mag->objects[--mag->count];
+	spin_unlock(mag->lock);
+	return out;
+}
 
+/*
+ * Return an object to the current core's magazine.
+ * Returns 0 if it was taken, 1 if it needs to go through klfree.
+ */
+static int klmalloc_magazine_free(void * ptr) {
+	if (!klmalloc_magazines_ready || !ptr) return 1;
 
+	/* Page-aligned pointers only come from big bins. */
+	if (!((uintptr_t)ptr & PAGE_MASK)) return 1;
+	klmalloc_bin_header * header = (klmalloc_bin_header *)((uintptr_t)ptr & (uintptr_t)~PAGE_MASK);
+	if (header->bin_magic != BIN_MAGIC || header->size >= BIG_BIN) return 1;
+	uintptr_t bin = header->size;
+
+	struct klmalloc_magazine * mag = &klmalloc_cpu_caches[this_core->cpu_id].bins[bin];
+	spin_lock(mag->lock);
+	if (mag->count == MAG_SIZE) {
+		/* Send back the ones that have been sitting here the longest. */
+		klmalloc_lock(bin);
+		for (uintptr_t i = 0; i < MAG_BATCH; ++i) {
+			klfree(mag->objects[i]);
+		}
+		spin_unlock(mem_lock);
+		memmove(mag->objects, mag->objects + MAG_BATCH, sizeof(void*) * (MAG_SIZE - MAG_BATCH));
+		mag->count -= MAG_BATCH;
+		mag->flushes++;
+	}
+	mag->frees++;
+	mag->objects[mag->count++] = ptr;
+	spin_unlock(mag->lock);
+	return 0;
+}
+
+static void kmalloc_func(fs_node_t * node) {
+	procfs_printf(node, "bin    size  pages   in-use  cached  free  frag%%     allocs      frees  refills  flushes contended\n");
+	for (uintptr_t bin = 0; bin < NUM_BINS; ++bin) {
+		uintptr_t allocs = 0, frees = 0, refills = 0, flushes = 0, cached = 0;
+		if (bin < BIG_BIN) {
+			for (int i = 0; i < PROCESSOR_MAX; ++i) {
+				struct klmalloc_magazine * mag = &klmalloc_cpu_caches[i].bins[bin];
+				allocs  += mag->allocs;
+				frees   += mag->frees;
+				refills += mag->refills;
+				flushes += mag->flushes;
+				cached  += mag->count;
+			}
+		}
+
+		uintptr_t pages = klmalloc_stats[bin].pages;
+		uintptr_t out   = klmalloc_stats[bin].out;
+
+		if (bin < BIG_BIN) {
+			uintptr_t slots = pages * ((PAGE_SIZE - sizeof(klmalloc_bin_header)) >> (SMALLEST_BIN_LOG + bin));
+			uintptr_t avail = slots > out ? slots - out : 0;
+			procfs_printf(node, "%3zu %7zu %6zu %8zu %7zu %5zu %5zu %10zu %10zu %8zu %8zu %9zu\n",
+				bin, (uintptr_t)1 << (SMALLEST_BIN_LOG + bin), pages,
+				out > cached ? out - cached : 0, cached, avail,
+				slots ? avail * 100 / slots : 0,
+				allocs, frees, refills, flushes, klmalloc_stats[bin].contended);
+		} else {
+			procfs_printf(node, "big       - %6zu %8zu       -     -     -          -          -        -        - %9zu\n",
+				pages, out, klmalloc_stats[bin].contended);
+		}
+	}
+
+	/*
+	 * Free big blocks, by size in pages. Collect everything under
+	 * the lock first, as printing may need to allocate.
+	 */
+	uintptr_t sizes[8] = {0};
+	uintptr_t largest = 0;
+	spin_lock(mem_lock);
+	struct klmalloc_big_stats big = klmalloc_big;
+	for (klmalloc_big_bin_header * header = klmalloc_big_bins.head.forward[0]; header; header = header->forward[0]) {
+		uintptr_t span = klmalloc_big_span(header) / PAGE_SIZE;
+		uintptr_t order = 63 - __builtin_clzl(span);
+		sizes[order < 7 ? order : 7]++;
+		largest = span;
+	}
+	spin_unlock(mem_lock);
+
+	uintptr_t kb = PAGE_SIZE / 1024;
+	procfs_printf(node, "\nbig free: %zu blocks, %zu kB, largest %zu kB, fragmentation %zu%%\n",
+		big.free_blocks, big.free_pages * kb, largest * kb,
+		big.free_pages ? 100 - largest * 100 / big.free_pages : 0);
+	procfs_printf(node, "unbacked: %zu kB, %zu kB returned, %zu kB reclaimed\n",
+		big.released_pages * kb, big.returned * kb, big.reclaimed * kb);
+	procfs_printf(node, "splits: %zu, merges: %zu\n", big.splits, big.merges);
+	procfs_printf(node, "pages:       1     2-3     4-7    8-15   16-31   32-63  64-127    128+\n");
+	procfs_printf(node, "blocks: ");
+	for (int i = 0; i < 8; ++i) {
+		procfs_printf(node, " %7zu", sizes[i]);
+	}
+	procfs_printf(node, "\n");
+}
+
+static struct procfs_entry kmalloc_entry = {
+	0,
+	"kmalloc",
+	kmalloc_func,
+};
+
+void malloc_install(void) {
+	procfs_install(&kmalloc_entry);
+	klmalloc_magazines_ready = 1;
+}
+/* }}} */
@@ -28,11 +28,20 @@
 
 extern spin_lock_t net_raw_sockets_lock;
 extern list_t * net_raw_sockets_list;
-extern void net_ipv4_handle(void * packet, fs_node_t * nic, size_t);
+extern void net_ipv4_handle(struct netbuf * nb, void * packet, fs_node_t * nic, size_t);
 extern void net_arp_handle(void * packet, fs_node_t * nic);
 
-void net_eth_handle(struct ethernet_packet * frame, fs_node_t * nic, size_t size) {
+/**
+ * @brief Handle a received frame.
+ *
+ * @p nb holds the whole frame from @c data and still belongs to the
+ * caller; anything that wants to keep it past this call takes its
+ * own reference.
+ */
+void net_eth_handle(struct netbuf * nb, fs_node_t * nic) {
 	struct EthernetDevice * nic_eth = nic->device;
+	struct ethernet_packet * frame = (struct ethernet_packet*)nb->data;
+	size_t size = nb->len;
 
 	if (size < sizeof(struct ethernet_packet)) {
 		dprintf("eth: %s: invalid ethernet frame (too small)\n",
@@ -44,7 +53,7 @@ void net_eth_handle(struct ethernet_packet * frame, fs_node_t * nic, size_t size
 	foreach(node, net_raw_sockets_list) {
 		sock_t * sock = node->value;
 		if (!sock->_fnode.device || sock->_fnode.device == nic) {
-			net_sock_add(sock, frame, size);
+			net_sock_add(sock, nb, frame, size);
 		}
 	}
 	spin_unlock(net_raw_sockets_lock);
@@ -61,20 +70,30 @@ void net_eth_handle(struct ethernet_packet * frame, fs_node_t * nic, size_t size
 				if (packet->source != 0xFFFFFFFF) {
 					net_arp_cache_add(nic->device, packet->source, frame->source, 0);
 				}
-				net_ipv4_handle(packet, nic, size - sizeof(struct ethernet_packet));
+				net_ipv4_handle(nb, packet, nic, size - sizeof(struct ethernet_packet));
 				break;
 			}
 		}
 	}
 }
 
-void net_eth_send(struct EthernetDevice * nic, size_t len, void* data, uint16_t type, uint8_t * dest) {
-	size_t total_size = sizeof(struct ethernet_packet) + len;
-	struct ethernet_packet * packet = malloc(total_size);
-	memcpy(packet->payload, data, len);
+/**
+ * @brief Send the payload in @p nb as a frame of the given type.
+ *
+ * The Ethernet header goes into the buffer's headroom and the buffer
+ * is handed to the driver as-is. Takes over the caller's reference.
+ */
+void net_eth_send(struct EthernetDevice * nic, struct netbuf * nb, uint16_t type, uint8_t * dest) {
+	struct ethernet_packet * packet = netbuf_push(nb, sizeof(struct ethernet_packet));
 	memcpy(packet->destination, dest, 6);
 	memcpy(packet->source, nic->mac, 6);
 	packet->type = htons(type);
-	write_fs(nic->device_node, 0, total_size, (uint8_t*)packet);
-	free(packet);
+
+	if (nic->transmit) {
+		nic->transmit(nic, nb);
+		return;
+	}
+
+	write_fs(nic->device_node, 0, nb->len, nb->data);
+	netbuf_release(nb);
 }
@@ -84,14 +84,25 @@ static int ioctl_loop(fs_node_t * node, unsigned long request, void * argp) {
 	}
 }
 
-static ssize_t write_loop(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
-	struct loop_nic * nic = node->device;
+static void transmit_loop(struct EthernetDevice * eth, struct netbuf * nb) {
+	struct loop_nic * nic = (struct loop_nic*)eth;
 	nic->counts.rx_count++;
 	nic->counts.tx_count++;
-	nic->counts.rx_bytes += size;
-	nic->counts.tx_bytes += size;
+	nic->counts.rx_bytes += nb->len;
+	nic->counts.tx_bytes += nb->len;
+
+	/* The frame we were given is the frame we receive, so there's nothing to checksum. */
+	if (nb->flags & NETBUF_CSUM_PARTIAL) {
+		nb->flags = (nb->flags & ~NETBUF_CSUM_PARTIAL) | NETBUF_CSUM_VALID;
+	}
+	net_eth_handle(nb, eth->device_node);
+	netbuf_release(nb);
+}
 
-	net_eth_handle((void*)buffer, node, size);
+static ssize_t write_loop(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
+	struct netbuf * nb = netbuf_alloc(size);
+	memcpy(netbuf_put(nb, size), buffer, size);
+	transmit_loop(node->device, nb);
 	return size;
 }
 
@@ -103,6 +114,8 @@ static void loop_init(struct loop_nic * nic) {
 	nic->eth.device_node->ioctl = ioctl_loop;
 	nic->eth.device_node->write = write_loop;
 	nic->eth.device_node->device = nic;
+	nic->eth.transmit = transmit_loop;
+	nic->eth.offloads = NETIF_OFFLOAD_TX_CSUM;
 	nic->eth.mtu = 65536; /* guess */
 
 	nic->eth.ipv4_addr   = 0x0100007F;
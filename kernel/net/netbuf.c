@@ -0,0 +1,108 @@
+/**
+ * @file  kernel/net/netbuf.c
+ * @brief Packet buffer pool.
+ *
+ * Pooled buffers are whole pages taken from the frame allocator and
+ * accessed through the physical map, with the netbuf structure at the
+ * start of the page. Released buffers go back on a free list, up to
+ * a limit, so steady traffic doesn't touch the frame allocator at all.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2021 K. Lange
+ */
+#include <kernel/types.h>
+#include <kernel/string.h>
+#include <kernel/printf.h>
+#include <kernel/spinlock.h>
+#include <kernel/mmu.h>
+#include <kernel/net/netbuf.h>
+
+#define NETBUF_POOL_MAX 1024 /* Free pages we hold on to */
+
+static spin_lock_t netbuf_pool_lock = {0};
+static struct netbuf * netbuf_pool = NULL;
+static size_t netbuf_pool_free = 0;
+
+static struct netbuf * netbuf_pool_get(void) {
+	spin_lock(netbuf_pool_lock);
+	struct netbuf * nb = netbuf_pool;
+	if (nb) {
+		netbuf_pool = nb->next;
+		netbuf_pool_free--;
+	}
+	spin_unlock(netbuf_pool_lock);
+
+	if (!nb) {
+		uintptr_t phys = mmu_allocate_a_frame() << 12;
+		nb = mmu_map_from_physical(phys);
+		nb->phys = phys;
+		nb->size = NETBUF_PAGE - sizeof(struct netbuf);
+	}
+
+	return nb;
+}
+
+/**
+ * @brief Get a buffer for a packet of up to @p size bytes.
+ *
+ * The buffer starts empty, with NETBUF_HEADROOM bytes in front of
+ * @c data for headers, and with a single reference.
+ */
+struct netbuf * netbuf_alloc(size_t size) {
+	struct netbuf * nb;
+
+	if (size <= NETBUF_POOL_MTU) {
+		nb = netbuf_pool_get();
+	} else {
+		nb = malloc(sizeof(struct netbuf) + NETBUF_HEADROOM + size);
+		nb->phys = 0;
+		nb->size = NETBUF_HEADROOM + size;
+	}
+
+	nb->refs = 1;
+	nb->data = nb->buf + NETBUF_HEADROOM;
+	nb->len = 0;
+	nb->flags = 0;
+	nb->next = NULL;
+	return nb;
+}
+
+/**
+ * @brief Copy a packet into a new buffer, from the pool if it fits.
+ *
+ * For drivers handed a buffer they can't give to the device as-is.
+ */
+struct netbuf * netbuf_copy(struct netbuf * nb) {
+	struct netbuf * out = netbuf_alloc(nb->len);
+	memcpy(netbuf_put(out, nb->len), nb->data, nb->len);
+	out->flags = nb->flags;
+	out->csum_start = nb->csum_start - (nb->data - nb->buf) + (out->data - out->buf);
+	out->csum_offset = nb->csum_offset;
+	return out;
+}
+
+void netbuf_ref(struct netbuf * nb) {
+	__sync_add_and_fetch(&nb->refs, 1);
+}
+
+void netbuf_release(struct netbuf * nb) {
+	if (__sync_sub_and_fetch(&nb->refs, 1) != 0) return;
+
+	if (!nb->phys) {
+		free(nb);
+		return;
+	}
+
+	spin_lock(netbuf_pool_lock);
+	if (netbuf_pool_free < NETBUF_POOL_MAX) {
+		nb->next = netbuf_pool;
+		netbuf_pool = nb;
+		netbuf_pool_free++;
+		nb = NULL;
+	}
+	spin_unlock(netbuf_pool_lock);
+
+	if (nb) mmu_frame_release(nb->phys);
+}
@@ -47,18 +47,27 @@ void net_sock_alert(sock_t * sock) {
 	spin_unlock(sock->alert_lock);
 }
 
-void net_sock_add(sock_t * sock, void * frame, size_t size) {
+/**
+ * @brief Queue part of a received packet on a socket.
+ *
+ * The socket takes a reference to @p nb instead of copying
+ * @p size bytes from @p data, which must point into it.
+ */
+void net_sock_add(sock_t * sock, struct netbuf * nb, void * data, size_t size) {
+	struct sock_packet * packet = malloc(sizeof(struct sock_packet));
+	netbuf_ref(nb);
+	packet->nb = nb;
+	packet->data = data;
+	packet->size = size;
+
 	spin_lock(sock->rx_lock);
-	char * bleh = malloc(size + sizeof(size_t));
-	*(size_t*)bleh = size;
-	memcpy(bleh + sizeof(size_t), frame, size);
-	list_insert(sock->rx_queue, bleh);
+	list_insert(sock->rx_queue, packet);
 	wakeup_queue(sock->rx_wait);
 	net_sock_alert(sock);
 	spin_unlock(sock->rx_lock);
 }
 
-void * net_sock_get(sock_t * sock) {
+struct sock_packet * net_sock_get(sock_t * sock) {
 	while (!sock->rx_queue->length) {
 		if (sleep_on(sock->rx_wait)) {
 			if (!sock->rx_queue->length)
@@ -75,6 +84,11 @@ void * net_sock_get(sock_t * sock) {
 	return value;
 }
 
+void net_sock_packet_free(struct sock_packet * packet) {
+	netbuf_release(packet->nb);
+	free(packet);
+}
+
 int sock_generic_check(fs_node_t *node) {
 	sock_t * sock = (sock_t*)node;
 	if (sock->rx_queue->length) return 0;
@@ -99,7 +113,7 @@ void sock_generic_close(fs_node_t *node) {
 	sock->sock_close(sock);
 	while (sock->rx_queue->length) {
 		node_t * n = list_dequeue(sock->rx_queue);
-		free(n->value);
+		net_sock_packet_free(n->value);
 		free(n);
 	}
 	printf("net: socket closed\n");
@@ -143,12 +157,14 @@ static long sock_raw_recv(sock_t * sock, struct msghdr * msg, int flags) {
 		return -ENOTSUP;
 	}
 	if (msg->msg_iovlen == 0) return 0;
-	char * data = net_sock_get(sock);
-	if (!data) return -EINTR;
-	size_t packet_size = *(size_t*)data;
-	if (msg->msg_iov[0].iov_len < packet_size) return -EINVAL;
-	memcpy(msg->msg_iov[0].iov_base, data + sizeof(size_t), packet_size);
-	free(data);
+	struct sock_packet * packet = net_sock_get(sock);
+	if (!packet) return -EINTR;
+	if (msg->msg_iov[0].iov_len < packet->size) {
+		net_sock_packet_free(packet);
+		return -EINVAL;
+	}
+	memcpy(msg->msg_iov[0].iov_base, packet->data, packet->size);
+	net_sock_packet_free(packet);
 	return 4096;
 }
 
@@ -265,12 +281,17 @@ long net_bind(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
 
 long net_accept(int sockfd, struct sockaddr * addr, socklen_t * addrlen) {
 	CHECK_SOCK(sockfd);
-	return -EINVAL;
+	if (addr) CHECK_ADDR_ADDRLEN(addr,addrlen,ADDR_WR_ADDR|ADDR_WR_LEN);
+	sock_t * node = (sock_t*)FD_ENTRY(sockfd);
+	if (!node->sock_accept) return -EINVAL;
+	return node->sock_accept(node, addr, addrlen);
 }
 
 long net_listen(int sockfd, int backlog) {
 	CHECK_SOCK(sockfd);
-	return -EINVAL;
+	sock_t * node = (sock_t*)FD_ENTRY(sockfd);
+	if (!node->sock_listen) return -EINVAL;
+	return node->sock_listen(node, backlog);
 }
 
 long net_connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
@@ -0,0 +1,1940 @@
+/**
+ * @file  kernel/net/tcp.c
+ * @brief TCP protocol implementation.
+ *
+ * Each connection has a control block holding a send buffer and a
+ * receive buffer, both rings. Everything from SND.UNA onwards stays
+ * in the send buffer until it is acknowledged, so retransmissions
+ * are cut from the same ring as first transmissions. Segments that
+ * arrive out of order are written straight into the receive ring at
+ * their offset from RCV.NXT and tracked as a short list of ranges
+ * until the gap before them is filled.
+ *
+ * Congestion control is NewReno (RFC 5681, RFC 6582), the RTO is
+ * estimated as in RFC 6298, and we offer window scaling (RFC 7323)
+ * so the receive buffer can be larger than 64KiB.
+ *
+ * Connections are found by their address and port pair in a hash
+ * table; a segment that matches none is offered to whatever is
+ * listening on its destination port. A listener keeps connections
+ * that are still in the handshake on a SYN queue and moves them to
+ * its accept queue once established, both bounded by the backlog.
+ *
+ * Timers (retransmission, delayed ACK, TIME-WAIT) are run by a kernel
+ * thread. Arming one puts the connection on a list of its own, and
+ * each tick visits only what is on it; the thread sleeps while it is empty.
+ *
+ * Output never happens with a connection locked: each segment is
+ * built under the lock into a netbuf of its own by tcp_build and sent
+ * after it is released, since on the loopback interface sending a
+ * segment runs the receiving side, and its reply, before returning.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2021 K. Lange
+ */
+#include <errno.h>
+#include <kernel/types.h>
+#include <kernel/string.h>
+#include <kernel/printf.h>
+#include <kernel/syscall.h>
+#include <kernel/hashmap.h>
+#include <kernel/list.h>
+#include <kernel/process.h>
+#include <kernel/spinlock.h>
+#include <kernel/vfs.h>
+#include <kernel/time.h>
+#include <kernel/misc.h>
+
+#include <kernel/net/netif.h>
+#include <kernel/net/eth.h>
+#include <kernel/net/ipv4.h>
+
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#ifndef MISAKA_DEBUG_NET
+#define printf(...)
+#endif
+
+#define TCP_FLAGS_FIN (1 << 0)
+#define TCP_FLAGS_SYN (1 << 1)
+#define TCP_FLAGS_RST (1 << 2)
+#define TCP_FLAGS_PSH (1 << 3)
+#define TCP_FLAGS_ACK (1 << 4)
+#define TCP_FLAGS_URG (1 << 5)
+#define TCP_FLAGS_ECE (1 << 6)
+#define TCP_FLAGS_CWR (1 << 7)
+#define TCP_FLAGS_NS  (1 << 8)
+
+#define TCP_OPT_END    0
+#define TCP_OPT_NOP    1
+#define TCP_OPT_MSS    2
+#define TCP_OPT_WSCALE 3
+
+#define TCP_SNDBUF        (256 * 1024)
+#define TCP_RCVBUF        (256 * 1024)
+#define TCP_RCV_WSCALE    3       /* 65535 << 3 covers TCP_RCVBUF */
+#define TCP_DEFAULT_MSS   536
+#define TCP_OOO_MAX       8       /* Out-of-order ranges we remember */
+#define TCP_HASH_SIZE     4096    /* Buckets in the connection table */
+#define TCP_BACKLOG_MAX   1024
+
+/* Times are in microseconds */
+#define TCP_RTO_INITIAL   1000000
+#define TCP_RTO_MIN       200000
+#define TCP_RTO_MAX       60000000
+#define TCP_DELACK        40000
+#define TCP_MSL           30000000
+#define TCP_TICK          10000
+
+#define TCP_SYN_RETRIES   5
+#define TCP_MAX_RETRIES   12
+
+#define SEQ_LT(a,b)  ((int32_t)((uint32_t)(a) - (uint32_t)(b)) < 0)
+#define SEQ_LEQ(a,b) ((int32_t)((uint32_t)(a) - (uint32_t)(b)) <= 0)
+#define SEQ_GT(a,b)  ((int32_t)((uint32_t)(a) - (uint32_t)(b)) > 0)
+#define SEQ_GEQ(a,b) ((int32_t)((uint32_t)(a) - (uint32_t)(b)) >= 0)
+
+enum tcp_state {
+	TCP_CLOSED,
+	TCP_LISTEN,
+	TCP_SYN_SENT,
+	TCP_SYN_RECEIVED,
+	TCP_ESTABLISHED,
+	TCP_FIN_WAIT_1,
+	TCP_FIN_WAIT_2,
+	TCP_CLOSE_WAIT,
+	TCP_CLOSING,
+	TCP_LAST_ACK,
+	TCP_TIME_WAIT,
+};
+
+struct tcp_range {
+	uint32_t start;
+	uint32_t end;
+};
+
+/* Connection table key; addresses in network order, ports in host order */
+struct tcp_tuple {
+	uint32_t local_addr;
+	uint32_t remote_addr;
+	uint16_t local_port;
+	uint16_t remote_port;
+};
+
+struct tcp_conn {
+	spin_lock_t lock;
+	int refs;
+	int bound;                /* Owns local_port in tcp_ports */
+	int hashed;               /* In tcp_conns */
+	sock_t * sock;            /* NULL once the socket has been closed */
+	enum tcp_state state;
+	int error;                /* Reported by the next socket call */
+
+	fs_node_t * nic;
+	uint32_t local_addr;      /* Addresses are in network order, ports in host order */
+	uint32_t remote_addr;
+	uint16_t local_port;
+	uint16_t remote_port;
+	uint16_t ip_ident;
+
+	/* Send side: snd_buf holds snd_len bytes starting at SND.UNA */
+	uint32_t iss;
+	uint32_t snd_una;
+	uint32_t snd_nxt;
+	uint32_t snd_max;         /* Highest sequence number sent */
+	uint32_t snd_wnd;
+	uint32_t snd_wl1;
+	uint32_t snd_wl2;
+	uint8_t  snd_wscale;
+	uint8_t  rcv_wscale;
+	size_t   mss;
+	uint8_t * snd_buf;
+	size_t   snd_head;
+	size_t   snd_len;
+	int      fin_queued;      /* A FIN follows the last byte in snd_buf */
+
+	/* Congestion control */
+	uint32_t cwnd;
+	uint32_t ssthresh;
+	uint32_t recover;
+	int      dupacks;
+	int      in_recovery;
+	int      rexmt_one;       /* Retransmit the segment at SND.UNA */
+	int      probe;           /* Send a byte into a zero window */
+
+	/* Round trip estimation and timers */
+	int      rtt_timing;
+	uint32_t rtt_seq;
+	uint64_t rtt_start;
+	uint64_t srtt;
+	uint64_t rttvar;
+	uint64_t rto;
+	int      retries;
+	uint64_t rto_at;
+	uint64_t delack_at;
+	uint64_t timewait_at;
+	int      output_pending;
+	node_t   timer_node;      /* On tcp_timer_conns, holding a reference */
+
+	/* Receive side: rcv_buf holds rcv_len readable bytes, then the window */
+	uint32_t irs;
+	uint32_t rcv_nxt;
+	uint32_t rcv_adv;         /* Right edge of the last window we advertised */
+	uint8_t * rcv_buf;
+	size_t   rcv_head;
+	size_t   rcv_len;
+	int      rcv_closed;
+	int      ack_now;
+	int      unacked_segs;
+	struct tcp_range ooo[TCP_OOO_MAX];
+	int      ooo_count;
+
+	int      in_output;
+	int      rst_pending;     /* Tell the peer we've dropped the connection */
+
+	/* Listening: connections not yet accepted, each holding a reference to us */
+	struct tcp_conn * parent; /* Set on those connections until accepted */
+	list_t * syn_queue;
+	list_t * accept_queue;
+	int      backlog;
+
+	list_t * rx_wait;
+	list_t * tx_wait;
+};
+
+/* The segment we're looking at, host order */
+struct tcp_segment {
+	uint32_t seq;
+	uint32_t ack;
+	uint16_t flags;
+	uint16_t wnd;
+	uint8_t * data;
+	size_t len;
+	uint16_t opt_mss;         /* 0 if not present */
+	int opt_wscale;           /* -1 if not present */
+};
+
+static hashmap_t * tcp_conns = NULL;   /* struct tcp_tuple -> connection */
+static hashmap_t * tcp_ports = NULL;   /* local port -> socket bound to it */
+static spin_lock_t tcp_port_lock = {0};
+
+static process_t * tcp_timer_process = NULL;
+static list_t * tcp_timer_queue = NULL;
+static list_t * tcp_timer_conns = NULL; /* Connections the timer thread has to look at */
+static spin_lock_t tcp_timer_lock = {0};
+
+extern uint32_t rand(void);
+
+uint16_t calculate_tcp_checksum(struct tcp_check_header * p, struct tcp_header * h, void * d, size_t payload_size) {
+	uint32_t sum = 0;
+	uint16_t * s = (uint16_t *)p;
+
+	for (int i = 0; i < 6; ++i) {
+		sum += ntohs(s[i]);
+		if (sum > 0xFFFF) {
+			sum = (sum >> 16) + (sum & 0xFFFF);
+		}
+	}
+
+	s = (uint16_t *)h;
+	for (int i = 0; i < 10; ++i) {
+		sum += ntohs(s[i]);
+		if (sum > 0xFFFF) {
+			sum = (sum >> 16) + (sum & 0xFFFF);
+		}
+	}
+
+	/* Options and data, which follow the fixed header */
+	size_t d_words = payload_size / 2;
+
+	s = (uint16_t *)d;
+	for (size_t i = 0; i < d_words; ++i) {
+		sum += ntohs(s[i]);
+		if (sum > 0xFFFF) {
+			sum = (sum >> 16) + (sum & 0xFFFF);
+		}
+	}
+
+	if (d_words * 2 != payload_size) {
+		uint8_t * t = (uint8_t *)d;
+		uint8_t tmp[2];
+		tmp[0] = t[d_words * sizeof(uint16_t)];
+		tmp[1] = 0;
+
+		uint16_t * f = (uint16_t *)tmp;
+
+		sum += ntohs(f[0]);
+		if (sum > 0xFFFF) {
+			sum = (sum >> 16) + (sum & 0xFFFF);
+		}
+	}
+
+	return ~(sum & 0xFFFF) & 0xFFFF;
+}
+
+static uint64_t tcp_now(void) {
+	return arch_perf_timer() / arch_cpu_mhz();
+}
+
+static size_t tcp_nic_mss(fs_node_t * nic) {
+	size_t mtu = ((struct EthernetDevice*)nic->device)->mtu;
+	if (mtu > 0xFFFF) mtu = 0xFFFF;
+	return mtu - sizeof(struct ipv4_packet) - sizeof(struct tcp_header);
+}
+
+static struct tcp_conn * tcp_conn_create(void) {
+	struct tcp_conn * conn = calloc(1, sizeof(struct tcp_conn));
+	conn->refs = 1;
+	conn->rto = TCP_RTO_INITIAL;
+	conn->ssthresh = 0xFFFFFFFF;
+	conn->mss = TCP_DEFAULT_MSS;
+	conn->rx_wait = list_create("tcp rx wait", conn);
+	conn->tx_wait = list_create("tcp tx wait", conn);
+	return conn;
+}
+
+static void tcp_conn_put(struct tcp_conn * conn) {
+	if (__sync_sub_and_fetch(&conn->refs, 1) != 0) return;
+	if (conn->snd_buf) free(conn->snd_buf);
+	if (conn->rcv_buf) free(conn->rcv_buf);
+	if (conn->syn_queue) free(conn->syn_queue);
+	if (conn->accept_queue) free(conn->accept_queue);
+	free(conn->rx_wait);
+	free(conn->tx_wait);
+	free(conn);
+}
+
+static void tcp_conn_get(struct tcp_conn * conn) {
+	__sync_add_and_fetch(&conn->refs, 1);
+}
+
+/**
+ * @brief Pick a route for the connection and allocate its buffers.
+ *
+ * Listening sockets never get this far, so they don't carry buffers.
+ */
+static int tcp_conn_route(struct tcp_conn * conn) {
+	conn->nic = net_if_route(conn->remote_addr);
+	if (!conn->nic) return -ENONET;
+	conn->local_addr = ((struct EthernetDevice*)conn->nic->device)->ipv4_addr;
+	conn->mss = tcp_nic_mss(conn->nic);
+	if (!conn->snd_buf) conn->snd_buf = malloc(TCP_SNDBUF);
+	if (!conn->rcv_buf) conn->rcv_buf = malloc(TCP_RCVBUF);
+	return 0;
+}
+
+/**
+ * @brief Make sure the timer thread will look at @p conn.
+ *
+ * Called after arming a timer; the thread drops the connection
+ * from its list once it has none left.
+ */
+static void tcp_timer_kick(struct tcp_conn * conn) {
+	spin_lock(tcp_timer_lock);
+	if (!conn->timer_node.owner) {
+		tcp_conn_get(conn);
+		conn->timer_node.value = conn;
+		list_append(tcp_timer_conns, &conn->timer_node);
+		wakeup_queue(tcp_timer_queue);
+	}
+	spin_unlock(tcp_timer_lock);
+}
+
+static void tcp_arm(struct tcp_conn * conn, uint64_t * timer, uint64_t delay) {
+	*timer = tcp_now() + delay;
+	tcp_timer_kick(conn);
+}
+
+static void tcp_timer_thread(void * arg);
+
+static unsigned int tcp_tuple_hash(const void * key) {
+	const struct tcp_tuple * tuple = key;
+	uint32_t hash = tuple->remote_addr ^ tuple->local_addr;
+	hash ^= ((uint32_t)tuple->remote_port << 16) | tuple->local_port;
+	hash *= 0x9E3779B1;
+	return hash ^ (hash >> 16);
+}
+
+static int tcp_tuple_comp(const void * a, const void * b) {
+	return !memcmp(a, b, sizeof(struct tcp_tuple));
+}
+
+static void * tcp_tuple_dupe(const void * key) {
+	struct tcp_tuple * out = malloc(sizeof(struct tcp_tuple));
+	memcpy(out, key, sizeof(struct tcp_tuple));
+	return out;
+}
+
+static void tcp_conn_tuple(struct tcp_conn * conn, struct tcp_tuple * tuple) {
+	memset(tuple, 0, sizeof(struct tcp_tuple));
+	tuple->local_addr = conn->local_addr;
+	tuple->remote_addr = conn->remote_addr;
+	tuple->local_port = conn->local_port;
+	tuple->remote_port = conn->remote_port;
+}
+
+/**
+ * @brief Claim a local port for @p conn.
+ *
+ * @param port Port to use, or 0 for an ephemeral one
+ */
+static int next_tcp_port = 49152;
+static int tcp_bind_port(struct tcp_conn * conn, int port) {
+	spin_lock(tcp_port_lock);
+	if (!port) {
+		for (int i = 0; i < 65536 - 49152; ++i) {
+			int candidate = next_tcp_port++;
+			if (next_tcp_port == 65536) next_tcp_port = 49152;
+			if (!hashmap_has(tcp_ports, (void*)(uintptr_t)candidate)) {
+				port = candidate;
+				break;
+			}
+		}
+		if (!port) {
+			spin_unlock(tcp_port_lock);
+			return -EADDRINUSE;
+		}
+	} else if (hashmap_has(tcp_ports, (void*)(uintptr_t)port)) {
+		spin_unlock(tcp_port_lock);
+		return -EADDRINUSE;
+	}
+
+	conn->local_port = port;
+	conn->bound = 1;
+	tcp_conn_get(conn);
+	hashmap_set(tcp_ports, (void*)(uintptr_t)port, conn);
+	spin_unlock(tcp_port_lock);
+	return 0;
+}
+
+/**
+ * @brief Start delivering segments for the connection's addresses and ports to it.
+ */
+static int tcp_hash(struct tcp_conn * conn) {
+	struct tcp_tuple tuple;
+	tcp_conn_tuple(conn, &tuple);
+
+	spin_lock(tcp_port_lock);
+	if (hashmap_has(tcp_conns, &tuple)) {
+		spin_unlock(tcp_port_lock);
+		return -EADDRINUSE;
+	}
+
+	conn->hashed = 1;
+	tcp_conn_get(conn);
+	hashmap_set(tcp_conns, &tuple, conn);
+
+	if (!tcp_timer_process) {
+		tcp_timer_process = spawn_worker_thread(tcp_timer_thread, "[tcp]", NULL);
+	}
+	spin_unlock(tcp_port_lock);
+	return 0;
+}
+
+/**
+ * @brief Take a connection that was never accepted off its listener's queues.
+ */
+static void tcp_detach(struct tcp_conn * conn) {
+	spin_lock(conn->lock);
+	struct tcp_conn * parent = conn->parent;
+	conn->parent = NULL;
+	spin_unlock(conn->lock);
+	if (!parent) return;
+
+	spin_lock(parent->lock);
+	node_t * node = list_find(parent->syn_queue, conn);
+	if (node) {
+		list_delete(parent->syn_queue, node);
+	} else {
+		node = list_find(parent->accept_queue, conn);
+		if (node) list_delete(parent->accept_queue, node);
+	}
+	spin_unlock(parent->lock);
+
+	if (node) {
+		free(node);
+		tcp_conn_put(conn);
+	}
+	tcp_conn_put(parent);
+}
+
+/**
+ * @brief Stop delivering segments to @p conn and release its port.
+ *
+ * The caller must hold a reference.
+ */
+static void tcp_unregister(struct tcp_conn * conn) {
+	tcp_detach(conn);
+
+	spin_lock(tcp_port_lock);
+	int hashed = conn->hashed;
+	int bound = conn->bound;
+	if (hashed) {
+		struct tcp_tuple tuple;
+		tcp_conn_tuple(conn, &tuple);
+		conn->hashed = 0;
+		hashmap_remove(tcp_conns, &tuple);
+	}
+	if (bound) {
+		conn->bound = 0;
+		if (hashmap_get(tcp_ports, (void*)(uintptr_t)conn->local_port) == conn) {
+			hashmap_remove(tcp_ports, (void*)(uintptr_t)conn->local_port);
+		}
+	}
+	spin_unlock(tcp_port_lock);
+
+	if (hashed) tcp_conn_put(conn);
+	if (bound) tcp_conn_put(conn);
+}
+
+/**
+ * @brief Find the connection a segment belongs to, or failing that a listener for its port.
+ */
+static struct tcp_conn * tcp_lookup(struct tcp_tuple * tuple) {
+	spin_lock(tcp_port_lock);
+	struct tcp_conn * conn = hashmap_get(tcp_conns, tuple);
+	if (!conn) {
+		conn = hashmap_get(tcp_ports, (void*)(uintptr_t)tuple->local_port);
+		if (conn && conn->state != TCP_LISTEN) conn = NULL;
+	}
+	if (conn) tcp_conn_get(conn);
+	spin_unlock(tcp_port_lock);
+	return conn;
+}
+
+/**
+ * @brief Wake anyone waiting on the connection. Requires the lock.
+ */
+static void tcp_wake(struct tcp_conn * conn) {
+	wakeup_queue(conn->rx_wait);
+	wakeup_queue(conn->tx_wait);
+	if (conn->sock) net_sock_alert(conn->sock);
+}
+
+/**
+ * @brief Drop the connection without further exchange. Requires the lock.
+ *
+ * The caller should unregister it once the lock is released.
+ */
+static void tcp_abort(struct tcp_conn * conn, int error) {
+	conn->state = TCP_CLOSED;
+	conn->error = error;
+	conn->snd_len = 0;
+	conn->rto_at = 0;
+	conn->delack_at = 0;
+	conn->timewait_at = 0;
+	tcp_wake(conn);
+}
+
+static void tcp_enter_time_wait(struct tcp_conn * conn) {
+	conn->state = TCP_TIME_WAIT;
+	conn->rto_at = 0;
+	tcp_arm(conn, &conn->timewait_at, 2 * TCP_MSL);
+}
+
+static void tcp_fill_ip(struct ipv4_packet * packet, uint32_t source, uint32_t destination, uint16_t ident, size_t total_length) {
+	packet->length = htons(total_length);
+	packet->destination = destination;
+	packet->source = source;
+	packet->ttl = 64;
+	packet->protocol = IPV4_PROT_TCP;
+	packet->ident = htons(ident);
+	packet->flags_fragment = htons(0x0);
+	packet->version_ihl = 0x45;
+	packet->dscp_ecn = 0;
+	packet->checksum = 0;
+	packet->checksum = htons(calculate_ipv4_checksum(packet));
+}
+
+static void tcp_fill_checksum(struct ipv4_packet * packet, struct tcp_header * tcp, size_t tcp_length) {
+	struct tcp_check_header check_hd = {
+		.source = packet->source,
+		.destination = packet->destination,
+		.zeros = 0,
+		.protocol = IPV4_PROT_TCP,
+		.tcp_len = htons(tcp_length),
+	};
+	tcp->checksum = 0;
+	tcp->checksum = htons(calculate_tcp_checksum(&check_hd, tcp, tcp->payload, tcp_length - sizeof(struct tcp_header)));
+}
+
+/**
+ * @brief Leave the checksum for the NIC to finish.
+ *
+ * The field gets the sum of the pseudo-header, and the NIC adds in
+ * the TCP header and payload.
+ */
+static void tcp_fill_partial(struct netbuf * nb, struct ipv4_packet * packet, struct tcp_header * tcp, size_t tcp_length) {
+	struct tcp_check_header check_hd = {
+		.source = packet->source,
+		.destination = packet->destination,
+		.zeros = 0,
+		.protocol = IPV4_PROT_TCP,
+		.tcp_len = htons(tcp_length),
+	};
+	uint32_t sum = 0;
+	uint16_t * s = (uint16_t *)&check_hd;
+	for (int i = 0; i < 6; ++i) {
+		sum += ntohs(s[i]);
+	}
+	while (sum > 0xFFFF) {
+		sum = (sum >> 16) + (sum & 0xFFFF);
+	}
+	tcp->checksum = htons(sum);
+	nb->flags |= NETBUF_CSUM_PARTIAL;
+	nb->csum_start = (uint8_t*)tcp - nb->buf;
+	nb->csum_offset = offsetof(struct tcp_header, checksum);
+}
+
+/**
+ * @brief Answer a segment that doesn't belong to any connection.
+ */
+static void tcp_send_reset(struct ipv4_packet * packet, struct tcp_header * tcp, struct tcp_segment * seg, fs_node_t * nic) {
+	if (seg->flags & TCP_FLAGS_RST) return;
+
+	size_t length = sizeof(struct ipv4_packet) + sizeof(struct tcp_header);
+	struct netbuf * nb = netbuf_alloc(length);
+	struct ipv4_packet * response = netbuf_put(nb, length);
+	struct tcp_header * reset = (struct tcp_header*)&response->payload;
+
+	tcp_fill_ip(response, packet->destination, packet->source, 0, length);
+	reset->source_port = tcp->destination_port;
+	reset->destination_port = tcp->source_port;
+	if (seg->flags & TCP_FLAGS_ACK) {
+		reset->seq_number = htonl(seg->ack);
+		reset->ack_number = 0;
+		reset->flags = htons(TCP_FLAGS_RST | 0x5000);
+	} else {
+		uint32_t seg_len = seg->len + !!(seg->flags & TCP_FLAGS_SYN) + !!(seg->flags & TCP_FLAGS_FIN);
+		reset->seq_number = 0;
+		reset->ack_number = htonl(seg->seq + seg_len);
+		reset->flags = htons(TCP_FLAGS_RST | TCP_FLAGS_ACK | 0x5000);
+	}
+	reset->window_size = 0;
+	reset->urgent = 0;
+	tcp_fill_checksum(response, reset, sizeof(struct tcp_header));
+	net_ipv4_send(nb, nic);
+}
+
+/**
+ * @brief The window to advertise, in bytes.
+ */
+static size_t tcp_rcv_window(struct tcp_conn * conn) {
+	size_t window = TCP_RCVBUF - conn->rcv_len;
+	size_t max = (size_t)0xFFFF << conn->rcv_wscale;
+	return window > max ? max : window;
+}
+
+/**
+ * @brief Build a segment in a new packet buffer. Requires the lock.
+ *
+ * Payload is copied once, from the send ring straight into the buffer
+ * the NIC will transmit from.
+ */
+static struct netbuf * tcp_build(struct tcp_conn * conn, uint32_t seq, size_t len, int flags) {
+	struct netbuf * nb = netbuf_alloc(sizeof(struct ipv4_packet) + sizeof(struct tcp_header) + 40 + len);
+	struct ipv4_packet * packet = (struct ipv4_packet*)nb->data;
+	struct tcp_header * tcp = (struct tcp_header*)&packet->payload;
+	uint8_t * options = tcp->payload;
+	size_t optlen = 0;
+
+	if (flags & TCP_FLAGS_SYN) {
+		size_t mss = tcp_nic_mss(conn->nic);
+		options[0] = TCP_OPT_MSS;
+		options[1] = 4;
+		options[2] = mss >> 8;
+		options[3] = mss & 0xFF;
+		optlen = 4;
+		/* Answering a SYN, only offer scaling if the peer did */
+		if (!(flags & TCP_FLAGS_ACK) || conn->rcv_wscale) {
+			options[4] = TCP_OPT_NOP;
+			options[5] = TCP_OPT_WSCALE;
+			options[6] = 3;
+			options[7] = TCP_RCV_WSCALE;
+			optlen = 8;
+		}
+	}
+
+	if (len) {
+		size_t offset = (conn->snd_head + (seq - conn->snd_una)) % TCP_SNDBUF;
+		size_t first = TCP_SNDBUF - offset < len ? TCP_SNDBUF - offset : len;
+		memcpy(options + optlen, conn->snd_buf + offset, first);
+		if (first < len) memcpy(options + optlen + first, conn->snd_buf, len - first);
+	}
+
+	/* The window field in a SYN is never scaled */
+	size_t window = tcp_rcv_window(conn);
+	uint16_t window_field = (flags & TCP_FLAGS_SYN) ? (window > 0xFFFF ? 0xFFFF : window) : window >> conn->rcv_wscale;
+	if (flags & TCP_FLAGS_ACK) {
+		uint32_t edge = conn->rcv_nxt + ((flags & TCP_FLAGS_SYN) ? window_field : ((size_t)window_field << conn->rcv_wscale));
+		if (SEQ_GT(edge, conn->rcv_adv)) conn->rcv_adv = edge;
+		conn->ack_now = 0;
+		conn->unacked_segs = 0;
+		conn->delack_at = 0;
+	}
+
+	size_t tcp_length = sizeof(struct tcp_header) + optlen + len;
+	tcp_fill_ip(packet, conn->local_addr, conn->remote_addr, conn->ip_ident++, sizeof(struct ipv4_packet) + tcp_length);
+	tcp->source_port = htons(conn->local_port);
+	tcp->destination_port = htons(conn->remote_port);
+	tcp->seq_number = htonl(seq);
+	tcp->ack_number = (flags & TCP_FLAGS_ACK) ? htonl(conn->rcv_nxt) : 0;
+	tcp->flags = htons(flags | (((sizeof(struct tcp_header) + optlen) / 4) << 12));
+	tcp->window_size = htons(window_field);
+	tcp->urgent = 0;
+	if (((struct EthernetDevice*)conn->nic->device)->offloads & NETIF_OFFLOAD_TX_CSUM) {
+		tcp_fill_partial(nb, packet, tcp, tcp_length);
+	} else {
+		tcp_fill_checksum(packet, tcp, tcp_length);
+	}
+
+	netbuf_put(nb, sizeof(struct ipv4_packet) + tcp_length);
+	return nb;
+}
+
+/**
+ * @brief Decide what, if anything, to send next. Requires the lock.
+ *
+ * @returns The packet built, or NULL if there is nothing to send.
+ */
+static struct netbuf * tcp_next_segment(struct tcp_conn * conn) {
+	if (!conn->snd_buf) return NULL; /* Never routed */
+
+	switch (conn->state) {
+		case TCP_CLOSED:
+			if (!conn->rst_pending) return NULL;
+			conn->rst_pending = 0;
+			return tcp_build(conn, conn->snd_nxt, 0, TCP_FLAGS_RST | TCP_FLAGS_ACK);
+		case TCP_LISTEN:
+			return NULL;
+		case TCP_TIME_WAIT:
+			if (!conn->ack_now) return NULL;
+			return tcp_build(conn, conn->snd_nxt, 0, TCP_FLAGS_ACK);
+		case TCP_SYN_SENT:
+		case TCP_SYN_RECEIVED:
+			if (conn->snd_nxt != conn->iss) {
+				return NULL;
+			} else {
+				int flags = TCP_FLAGS_SYN | (conn->state == TCP_SYN_RECEIVED ? TCP_FLAGS_ACK : 0);
+				struct netbuf * nb = tcp_build(conn, conn->iss, 0, flags);
+				conn->snd_nxt = conn->iss + 1;
+				if (conn->snd_max == conn->iss) {
+					conn->snd_max = conn->snd_nxt;
+					conn->rtt_timing = 1;
+					conn->rtt_seq = conn->iss;
+					conn->rtt_start = tcp_now();
+				}
+				if (!conn->rto_at) tcp_arm(conn, &conn->rto_at, conn->rto);
+				return nb;
+			}
+		default:
+			break;
+	}
+
+	uint32_t fin_seq = conn->snd_una + conn->snd_len;
+
+	if (conn->rexmt_one) {
+		conn->rexmt_one = 0;
+		size_t outstanding = conn->snd_max - conn->snd_una;
+		size_t len = conn->snd_len < conn->mss ? conn->snd_len : conn->mss;
+		if (len > outstanding) len = outstanding;
+		int flags = TCP_FLAGS_ACK;
+		if (conn->fin_queued && conn->snd_una + len == fin_seq && SEQ_GT(conn->snd_max, fin_seq)) flags |= TCP_FLAGS_FIN;
+		if (len || (flags & TCP_FLAGS_FIN)) {
+			conn->rtt_timing = 0;
+			return tcp_build(conn, conn->snd_una, len, flags);
+		}
+	}
+
+	uint32_t seq = conn->snd_nxt;
+	size_t offset = seq - conn->snd_una;
+	size_t avail = offset < conn->snd_len ? conn->snd_len - offset : 0;
+	size_t window = conn->cwnd < conn->snd_wnd ? conn->cwnd : conn->snd_wnd;
+	if (conn->probe) {
+		conn->probe = 0;
+		window = offset + 1;
+	}
+
+	size_t len = avail < conn->mss ? avail : conn->mss;
+	if (offset + len > window) len = window > offset ? window - offset : 0;
+
+	int flags = TCP_FLAGS_ACK;
+	if (len && offset + len == conn->snd_len) flags |= TCP_FLAGS_PSH;
+	if (conn->fin_queued && seq + len == fin_seq) flags |= TCP_FLAGS_FIN;
+
+	if (!len && !(flags & TCP_FLAGS_FIN)) {
+		/* Blocked by a zero window with nothing in flight: probe it when the timer fires */
+		if (avail && !conn->snd_wnd && conn->snd_una == conn->snd_max && !conn->rto_at) {
+			tcp_arm(conn, &conn->rto_at, conn->rto);
+		}
+		if (!conn->ack_now) return NULL;
+	}
+
+	struct netbuf * nb = tcp_build(conn, seq, len, flags);
+	uint32_t old_max = conn->snd_max;
+	conn->snd_nxt = seq + len + !!(flags & TCP_FLAGS_FIN);
+	if (SEQ_GT(conn->snd_nxt, conn->snd_max)) conn->snd_max = conn->snd_nxt;
+
+	if (len && !conn->rtt_timing && SEQ_GEQ(seq, old_max)) {
+		/* Only time segments that aren't retransmissions (Karn) */
+		conn->rtt_timing = 1;
+		conn->rtt_seq = seq;
+		conn->rtt_start = tcp_now();
+	}
+
+	if (conn->snd_max != conn->snd_una && !conn->rto_at) {
+		tcp_arm(conn, &conn->rto_at, conn->rto);
+	}
+
+	return nb;
+}
+
+/**
+ * @brief Send whatever the connection has ready.
+ *
+ * Only one caller at a time builds segments for a connection; anyone
+ * arriving meanwhile leaves it to them, as they check for more after
+ * every segment they send.
+ */
+static void tcp_output(struct tcp_conn * conn) {
+	spin_lock(conn->lock);
+	if (conn->in_output) {
+		spin_unlock(conn->lock);
+		return;
+	}
+	conn->in_output = 1;
+
+	/* Build one ahead so the driver knows when a burst ends */
+	struct netbuf * nb = tcp_next_segment(conn);
+	while (nb) {
+		struct netbuf * next = tcp_next_segment(conn);
+		if (next) nb->flags |= NETBUF_MORE;
+		spin_unlock(conn->lock);
+		net_ipv4_send(nb, conn->nic);
+		spin_lock(conn->lock);
+		/* Sending may have led to more (eg. over loopback), so look again */
+		nb = next ? next : tcp_next_segment(conn);
+	}
+
+	conn->in_output = 0;
+	spin_unlock(conn->lock);
+}
+
+static void tcp_rtt_sample(struct tcp_conn * conn, uint64_t rtt) {
+	if (!conn->srtt && !conn->rttvar) {
+		conn->srtt = rtt;
+		conn->rttvar = rtt / 2;
+	} else {
+		uint64_t delta = conn->srtt > rtt ? conn->srtt - rtt : rtt - conn->srtt;
+		conn->rttvar = (3 * conn->rttvar + delta) / 4;
+		conn->srtt = (7 * conn->srtt + rtt) / 8;
+	}
+	uint64_t variance = 4 * conn->rttvar > TCP_TICK ? 4 * conn->rttvar : TCP_TICK;
+	conn->rto = conn->srtt + variance;
+	if (conn->rto < TCP_RTO_MIN) conn->rto = TCP_RTO_MIN;
+	if (conn->rto > TCP_RTO_MAX) conn->rto = TCP_RTO_MAX;
+}
+
+/**
+ * @brief Handle an ACK that covers new data. Requires the lock.
+ */
+static void tcp_ack_new(struct tcp_conn * conn, uint32_t ack) {
+	uint32_t acked = ack - conn->snd_una;
+	size_t data = acked;
+	int fin_acked = 0;
+
+	if (conn->fin_queued && SEQ_GT(ack, conn->snd_una + conn->snd_len)) {
+		data = conn->snd_len;
+		fin_acked = 1;
+	}
+	if (data > conn->snd_len) data = conn->snd_len;
+
+	conn->snd_head = (conn->snd_head + data) % TCP_SNDBUF;
+	conn->snd_len -= data;
+	conn->snd_una = ack;
+	if (SEQ_LT(conn->snd_nxt, conn->snd_una)) conn->snd_nxt = conn->snd_una;
+	conn->retries = 0;
+
+	if (conn->rtt_timing && SEQ_GT(ack, conn->rtt_seq)) {
+		conn->rtt_timing = 0;
+		tcp_rtt_sample(conn, tcp_now() - conn->rtt_start);
+	}
+
+	if (conn->in_recovery) {
+		if (SEQ_GEQ(ack, conn->recover)) {
+			/* Full acknowledgement: leave fast recovery */
+			conn->in_recovery = 0;
+			conn->cwnd = conn->ssthresh;
+		} else {
+			/* Partial acknowledgement: the next hole is at SND.UNA */
+			conn->rexmt_one = 1;
+			conn->cwnd = conn->cwnd > acked ? conn->cwnd - acked : 0;
+			if (acked >= conn->mss) conn->cwnd += conn->mss;
+		}
+	} else if (conn->cwnd < conn->ssthresh) {
+		/* Slow start, counting bytes as in RFC 3465 with L = 2 */
+		conn->cwnd += acked < 2 * conn->mss ? acked : 2 * conn->mss;
+	} else {
+		uint32_t increase = conn->mss * conn->mss / conn->cwnd;
+		conn->cwnd += increase ? increase : 1;
+	}
+	if (conn->cwnd > (1U << 30)) conn->cwnd = 1U << 30;
+	conn->dupacks = 0;
+
+	if (conn->snd_una == conn->snd_max) {
+		conn->rto_at = 0;
+	} else {
+		tcp_arm(conn, &conn->rto_at, conn->rto);
+	}
+
+	if (data) tcp_wake(conn);
+
+	if (fin_acked) {
+		switch (conn->state) {
+			case TCP_FIN_WAIT_1:
+				conn->state = TCP_FIN_WAIT_2;
+				/* Don't wait forever on a peer that never closes an orphaned connection */
+				if (!conn->sock) tcp_arm(conn, &conn->timewait_at, 2 * TCP_MSL);
+				break;
+			case TCP_CLOSING:
+				tcp_enter_time_wait(conn);
+				break;
+			case TCP_LAST_ACK:
+				conn->state = TCP_CLOSED;
+				conn->rto_at = 0;
+				tcp_wake(conn);
+				break;
+			default:
+				break;
+		}
+	}
+}
+
+static void tcp_dupack(struct tcp_conn * conn) {
+	conn->dupacks++;
+	if (conn->dupacks == 3 && !conn->in_recovery && SEQ_GT(conn->snd_una, conn->recover)) {
+		uint32_t flight = conn->snd_max - conn->snd_una;
+		conn->ssthresh = flight / 2 > 2 * conn->mss ? flight / 2 : 2 * conn->mss;
+		conn->recover = conn->snd_max;
+		conn->in_recovery = 1;
+		conn->rexmt_one = 1;
+		conn->rtt_timing = 0;
+		conn->cwnd = conn->ssthresh + 3 * conn->mss;
+		tcp_arm(conn, &conn->rto_at, conn->rto);
+	} else if (conn->dupacks > 3 && conn->in_recovery) {
+		conn->cwnd += conn->mss;
+	}
+}
+
+/**
+ * @brief Record a range of sequence space received ahead of RCV.NXT.
+ */
+static void tcp_ooo_insert(struct tcp_conn * conn, uint32_t start, uint32_t end) {
+	int i = 0;
+	while (i < conn->ooo_count && SEQ_LT(conn->ooo[i].end, start)) i++;
+
+	int j = i;
+	while (j < conn->ooo_count && SEQ_LEQ(conn->ooo[j].start, end)) {
+		if (SEQ_LT(conn->ooo[j].start, start)) start = conn->ooo[j].start;
+		if (SEQ_GT(conn->ooo[j].end, end)) end = conn->ooo[j].end;
+		j++;
+	}
+
+	if (i == j) {
+		if (conn->ooo_count == TCP_OOO_MAX) return;
+		memmove(&conn->ooo[i+1], &conn->ooo[i], (conn->ooo_count - i) * sizeof(struct tcp_range));
+		conn->ooo_count++;
+	} else {
+		memmove(&conn->ooo[i+1], &conn->ooo[j], (conn->ooo_count - j) * sizeof(struct tcp_range));
+		conn->ooo_count -= j - i - 1;
+	}
+	conn->ooo[i].start = start;
+	conn->ooo[i].end = end;
+}
+
+/**
+ * @brief Place data that starts @p offset bytes past RCV.NXT. Requires the lock.
+ */
+static void tcp_receive_data(struct tcp_conn * conn, size_t offset, uint8_t * data, size_t len) {
+	size_t pos = (conn->rcv_head + conn->rcv_len + offset) % TCP_RCVBUF;
+	size_t first = TCP_RCVBUF - pos < len ? TCP_RCVBUF - pos : len;
+	memcpy(conn->rcv_buf + pos, data, first);
+	if (first < len) memcpy(conn->rcv_buf, data + first, len - first);
+
+	if (offset) {
+		tcp_ooo_insert(conn, conn->rcv_nxt + offset, conn->rcv_nxt + offset + len);
+		conn->ack_now = 1;
+		return;
+	}
+
+	conn->rcv_nxt += len;
+	conn->rcv_len += len;
+
+	/* Pull in anything we already had beyond the gap we just filled */
+	while (conn->ooo_count && SEQ_LEQ(conn->ooo[0].start, conn->rcv_nxt)) {
+		if (SEQ_GT(conn->ooo[0].end, conn->rcv_nxt)) {
+			conn->rcv_len += conn->ooo[0].end - conn->rcv_nxt;
+			conn->rcv_nxt = conn->ooo[0].end;
+		}
+		conn->ooo_count--;
+		memmove(&conn->ooo[0], &conn->ooo[1], conn->ooo_count * sizeof(struct tcp_range));
+		conn->ack_now = 1;
+	}
+
+	/* ACK every second segment, or after a short delay */
+	if (++conn->unacked_segs >= 2) {
+		conn->ack_now = 1;
+	} else if (!conn->delack_at) {
+		tcp_arm(conn, &conn->delack_at, TCP_DELACK);
+	}
+
+	if (!conn->sock && !conn->parent) {
+		/* Nobody left to read it */
+		conn->rcv_head = (conn->rcv_head + conn->rcv_len) % TCP_RCVBUF;
+		conn->rcv_len = 0;
+	}
+
+	wakeup_queue(conn->rx_wait);
+	if (conn->sock) net_sock_alert(conn->sock);
+}
+
+static void tcp_receive_fin(struct tcp_conn * conn) {
+	conn->rcv_nxt++;
+	conn->rcv_closed = 1;
+	conn->ack_now = 1;
+	switch (conn->state) {
+		case TCP_SYN_RECEIVED:
+		case TCP_ESTABLISHED:
+			conn->state = TCP_CLOSE_WAIT;
+			break;
+		case TCP_FIN_WAIT_1:
+			conn->state = TCP_CLOSING;
+			break;
+		case TCP_FIN_WAIT_2:
+			tcp_enter_time_wait(conn);
+			break;
+		default:
+			break;
+	}
+	tcp_wake(conn);
+}
+
+static void tcp_apply_syn_options(struct tcp_conn * conn, struct tcp_segment * seg) {
+	if (seg->opt_wscale >= 0) {
+		conn->snd_wscale = seg->opt_wscale > 14 ? 14 : seg->opt_wscale;
+		conn->rcv_wscale = TCP_RCV_WSCALE;
+	} else {
+		conn->snd_wscale = 0;
+		conn->rcv_wscale = 0;
+	}
+	size_t peer_mss = seg->opt_mss ? seg->opt_mss : TCP_DEFAULT_MSS;
+	if (peer_mss < conn->mss) conn->mss = peer_mss;
+
+	/* Initial window from RFC 6928 */
+	uint32_t iw = 2 * conn->mss > 14600 ? 2 * conn->mss : 14600;
+	conn->cwnd = 10 * conn->mss < iw ? 10 * conn->mss : iw;
+}
+
+/**
+ * @brief Process an incoming segment for a connection. Requires the lock.
+ *
+ * @returns 1 if the connection is now closed and should be unregistered.
+ */
+static int tcp_input(struct tcp_conn * conn, struct tcp_segment * seg) {
+	uint16_t flags = seg->flags;
+
+	if (conn->state == TCP_CLOSED) return 0;
+
+	if (conn->state == TCP_SYN_SENT) {
+		if ((flags & TCP_FLAGS_ACK) && (SEQ_LEQ(seg->ack, conn->iss) || SEQ_GT(seg->ack, conn->snd_max))) return 0;
+		if (flags & TCP_FLAGS_RST) {
+			if (!(flags & TCP_FLAGS_ACK)) return 0;
+			tcp_abort(conn, -ECONNREFUSED);
+			return 1;
+		}
+		if (!(flags & TCP_FLAGS_SYN) || !(flags & TCP_FLAGS_ACK)) return 0; /* No simultaneous open */
+
+		conn->irs = seg->seq;
+		conn->rcv_nxt = seg->seq + 1;
+		conn->rcv_adv = conn->rcv_nxt;
+		tcp_apply_syn_options(conn, seg);
+		conn->snd_una = seg->ack;
+		conn->snd_wnd = seg->wnd;
+		conn->snd_wl1 = seg->seq;
+		conn->snd_wl2 = seg->ack;
+		conn->recover = seg->ack;
+		if (conn->rtt_timing) {
+			conn->rtt_timing = 0;
+			tcp_rtt_sample(conn, tcp_now() - conn->rtt_start);
+		}
+		conn->retries = 0;
+		conn->rto_at = 0;
+		conn->state = TCP_ESTABLISHED;
+		conn->ack_now = 1;
+		tcp_wake(conn);
+		return 0;
+	}
+
+	if (conn->state == TCP_SYN_RECEIVED && (flags & TCP_FLAGS_SYN) && !(flags & TCP_FLAGS_ACK) && seg->seq == conn->irs) {
+		/* Our SYN-ACK was lost; send it again */
+		conn->snd_nxt = conn->iss;
+		return 0;
+	}
+
+	/* Is the segment in our receive window at all? */
+	size_t rcv_wnd = TCP_RCVBUF - conn->rcv_len;
+	uint32_t seg_len = seg->len + !!(flags & TCP_FLAGS_SYN) + !!(flags & TCP_FLAGS_FIN);
+	uint32_t wnd_end = conn->rcv_nxt + rcv_wnd;
+	int acceptable;
+	if (!seg_len) {
+		acceptable = rcv_wnd ? (SEQ_GEQ(seg->seq, conn->rcv_nxt) && SEQ_LT(seg->seq, wnd_end)) : seg->seq == conn->rcv_nxt;
+	} else {
+		uint32_t last = seg->seq + seg_len - 1;
+		acceptable = rcv_wnd &&
+			((SEQ_GEQ(seg->seq, conn->rcv_nxt) && SEQ_LT(seg->seq, wnd_end)) ||
+			 (SEQ_GEQ(last, conn->rcv_nxt) && SEQ_LT(last, wnd_end)));
+	}
+
+	if (!acceptable) {
+		if (flags & TCP_FLAGS_RST) return 0;
+		conn->ack_now = 1;
+		/* A full window still lets ACKs through */
+		if (rcv_wnd || seg->seq != conn->rcv_nxt) return 0;
+		seg->len = 0;
+		flags &= ~(TCP_FLAGS_FIN | TCP_FLAGS_SYN);
+	}
+
+	if (flags & TCP_FLAGS_RST) {
+		if (conn->state == TCP_SYN_RECEIVED || conn->state == TCP_LAST_ACK || conn->state == TCP_CLOSING || conn->state == TCP_TIME_WAIT) {
+			tcp_abort(conn, 0);
+		} else {
+			tcp_abort(conn, -ECONNRESET);
+		}
+		return 1;
+	}
+
+	if (flags & TCP_FLAGS_SYN) {
+		/* Challenge ACK (RFC 5961) */
+		conn->ack_now = 1;
+		return 0;
+	}
+
+	if (!(flags & TCP_FLAGS_ACK)) return 0;
+
+	if (conn->state == TCP_SYN_RECEIVED) {
+		if (SEQ_LEQ(seg->ack, conn->snd_una) || SEQ_GT(seg->ack, conn->snd_max)) return 0;
+		conn->state = TCP_ESTABLISHED;
+		conn->snd_una = seg->ack;
+		conn->snd_wnd = (uint32_t)seg->wnd << conn->snd_wscale;
+		conn->snd_wl1 = seg->seq;
+		conn->snd_wl2 = seg->ack;
+		conn->recover = seg->ack;
+		conn->retries = 0;
+		conn->rto_at = 0;
+		if (conn->rtt_timing) {
+			conn->rtt_timing = 0;
+			tcp_rtt_sample(conn, tcp_now() - conn->rtt_start);
+		}
+		tcp_wake(conn);
+	}
+
+	if (SEQ_GT(seg->ack, conn->snd_max)) {
+		conn->ack_now = 1;
+		return 0;
+	}
+
+	if (SEQ_GEQ(seg->ack, conn->snd_una)) {
+		uint32_t window = (uint32_t)seg->wnd << conn->snd_wscale;
+		int window_changed = window != conn->snd_wnd;
+
+		if (SEQ_LT(conn->snd_wl1, seg->seq) || (conn->snd_wl1 == seg->seq && SEQ_LEQ(conn->snd_wl2, seg->ack))) {
+			if (window > conn->snd_wnd) tcp_wake(conn);
+			conn->snd_wnd = window;
+			conn->snd_wl1 = seg->seq;
+			conn->snd_wl2 = seg->ack;
+		}
+
+		if (SEQ_GT(seg->ack, conn->snd_una)) {
+			tcp_ack_new(conn, seg->ack);
+		} else if (!seg->len && !(flags & TCP_FLAGS_FIN) && !window_changed && conn->snd_max != conn->snd_una) {
+			tcp_dupack(conn);
+		}
+	}
+
+	if (conn->state == TCP_CLOSED) return 1;
+
+	if (conn->state == TCP_TIME_WAIT) {
+		if (flags & TCP_FLAGS_FIN) {
+			/* Our last ACK was lost */
+			conn->ack_now = 1;
+			tcp_arm(conn, &conn->timewait_at, 2 * TCP_MSL);
+		}
+		return 0;
+	}
+
+	if (!seg->len && !(flags & TCP_FLAGS_FIN)) return 0;
+
+	switch (conn->state) {
+		case TCP_ESTABLISHED:
+		case TCP_FIN_WAIT_1:
+		case TCP_FIN_WAIT_2:
+			break;
+		default:
+			/* Peer already sent its FIN; anything else is a retransmission */
+			conn->ack_now = 1;
+			return 0;
+	}
+
+	uint8_t * data = seg->data;
+	size_t len = seg->len;
+	uint32_t seq = seg->seq;
+	int fin = !!(flags & TCP_FLAGS_FIN);
+
+	if (SEQ_LT(seq, conn->rcv_nxt)) {
+		uint32_t skip = conn->rcv_nxt - seq;
+		if (skip > len) {
+			len = 0;
+			fin = 0;
+		} else {
+			data += skip;
+			len -= skip;
+			seq = conn->rcv_nxt;
+		}
+		conn->ack_now = 1;
+	}
+
+	size_t offset = seq - conn->rcv_nxt;
+	if (offset >= rcv_wnd) {
+		len = 0;
+		fin = 0;
+	} else if (offset + len > rcv_wnd) {
+		len = rcv_wnd - offset;
+		fin = 0;
+	}
+
+	if (len) tcp_receive_data(conn, offset, data, len);
+
+	/* A FIN is only taken once everything before it has arrived */
+	if (fin) {
+		if (seq + len == conn->rcv_nxt && !conn->ooo_count) {
+			tcp_receive_fin(conn);
+		} else {
+			conn->ack_now = 1;
+		}
+	}
+
+	return 0;
+}
+
+static void tcp_parse_options(struct tcp_header * tcp, size_t hlen, struct tcp_segment * seg) {
+	uint8_t * opt = tcp->payload;
+	uint8_t * end = (uint8_t*)tcp + hlen;
+
+	seg->opt_mss = 0;
+	seg->opt_wscale = -1;
+
+	while (opt < end) {
+		if (*opt == TCP_OPT_END) break;
+		if (*opt == TCP_OPT_NOP) {
+			opt++;
+			continue;
+		}
+		if (opt + 1 >= end || opt[1] < 2 || opt + opt[1] > end) break;
+		if (opt[0] == TCP_OPT_MSS && opt[1] == 4) seg->opt_mss = (opt[2] << 8) | opt[3];
+		if (opt[0] == TCP_OPT_WSCALE && opt[1] == 3) seg->opt_wscale = opt[2];
+		opt += opt[1];
+	}
+}
+
+/**
+ * @brief Start a connection for a SYN that arrived at a listener.
+ *
+ * The new connection sits on the listener's SYN queue until the
+ * handshake completes. If either queue is full the SYN is dropped
+ * and the peer will try again.
+ */
+static void tcp_listen_input(struct tcp_conn * listener, struct ipv4_packet * packet, struct tcp_header * tcp, struct tcp_segment * seg, fs_node_t * nic) {
+	if (seg->flags & TCP_FLAGS_RST) return;
+	if (seg->flags & TCP_FLAGS_ACK) {
+		tcp_send_reset(packet, tcp, seg, nic);
+		return;
+	}
+	if (!(seg->flags & TCP_FLAGS_SYN)) return;
+
+	struct tcp_conn * conn = tcp_conn_create();
+	conn->remote_addr = packet->source;
+	conn->remote_port = ntohs(tcp->source_port);
+	if (tcp_conn_route(conn)) {
+		tcp_conn_put(conn);
+		return;
+	}
+	conn->local_addr = packet->destination;
+	conn->local_port = listener->local_port;
+
+	conn->irs = seg->seq;
+	conn->rcv_nxt = seg->seq + 1;
+	conn->rcv_adv = conn->rcv_nxt;
+	tcp_apply_syn_options(conn, seg);
+	conn->snd_wnd = seg->wnd;
+	conn->snd_wl1 = seg->seq;
+	conn->iss = rand();
+	conn->snd_una = conn->iss;
+	conn->snd_nxt = conn->iss;
+	conn->snd_max = conn->iss;
+	conn->recover = conn->iss;
+	conn->ip_ident = rand();
+	conn->state = TCP_SYN_RECEIVED;
+
+	spin_lock(listener->lock);
+	if (listener->state != TCP_LISTEN ||
+		(int)listener->syn_queue->length >= listener->backlog ||
+		(int)listener->accept_queue->length >= listener->backlog) {
+		spin_unlock(listener->lock);
+		printf("tcp: dropping SYN for port %d, backlog full\n", listener->local_port);
+		tcp_conn_put(conn);
+		return;
+	}
+	/* The queue takes our reference; keep one of our own until we're done */
+	tcp_conn_get(listener);
+	conn->parent = listener;
+	tcp_conn_get(conn);
+	list_insert(listener->syn_queue, conn);
+	spin_unlock(listener->lock);
+
+	if (tcp_hash(conn)) {
+		tcp_unregister(conn);
+	} else {
+		tcp_output(conn);
+	}
+	tcp_conn_put(conn);
+}
+
+/**
+ * @brief Move a connection whose handshake has completed to its listener's accept queue.
+ */
+static void tcp_established(struct tcp_conn * conn) {
+	spin_lock(conn->lock);
+	struct tcp_conn * parent = conn->parent;
+	if (!parent || conn->state == TCP_SYN_RECEIVED || conn->state == TCP_CLOSED) {
+		spin_unlock(conn->lock);
+		return;
+	}
+	tcp_conn_get(parent);
+	spin_unlock(conn->lock);
+
+	spin_lock(parent->lock);
+	node_t * node = list_find(parent->syn_queue, conn);
+	if (node) {
+		list_delete(parent->syn_queue, node);
+		list_append(parent->accept_queue, node);
+		tcp_wake(parent);
+	}
+	spin_unlock(parent->lock);
+	tcp_conn_put(parent);
+}
+
+void net_tcp_handle(struct netbuf * nb, struct ipv4_packet * packet, fs_node_t * nic, size_t size) {
+	size_t ip_hlen = (packet->version_ihl & 0xF) * 4;
+	size_t ip_len = ntohs(packet->length);
+	if (ip_len > size || ip_len < ip_hlen + sizeof(struct tcp_header)) return;
+
+	struct tcp_header * tcp = (struct tcp_header*)((uint8_t*)packet + ip_hlen);
+	size_t tcp_length = ip_len - ip_hlen;
+	size_t hlen = (ntohs(tcp->flags) >> 12) * 4;
+	if (hlen < sizeof(struct tcp_header) || hlen > tcp_length) return;
+
+	struct tcp_check_header check_hd = {
+		.source = packet->source,
+		.destination = packet->destination,
+		.zeros = 0,
+		.protocol = IPV4_PROT_TCP,
+		.tcp_len = htons(tcp_length),
+	};
+	if (!(nb->flags & NETBUF_CSUM_VALID) &&
+		calculate_tcp_checksum(&check_hd, tcp, tcp->payload, tcp_length - sizeof(struct tcp_header)) != 0) {
+		printf("tcp: dropping segment with bad checksum\n");
+		return;
+	}
+
+	struct tcp_segment seg = {
+		.seq = ntohl(tcp->seq_number),
+		.ack = ntohl(tcp->ack_number),
+		.flags = ntohs(tcp->flags) & 0x1FF,
+		.wnd = ntohs(tcp->window_size),
+		.data = (uint8_t*)tcp + hlen,
+		.len = tcp_length - hlen,
+	};
+	tcp_parse_options(tcp, hlen, &seg);
+
+	struct tcp_tuple tuple = {
+		.local_addr = packet->destination,
+		.remote_addr = packet->source,
+		.local_port = ntohs(tcp->destination_port),
+		.remote_port = ntohs(tcp->source_port),
+	};
+	struct tcp_conn * conn = tcp_lookup(&tuple);
+	if (!conn) {
+		tcp_send_reset(packet, tcp, &seg, nic);
+		return;
+	}
+
+	if (conn->state == TCP_LISTEN) {
+		tcp_listen_input(conn, packet, tcp, &seg, nic);
+		tcp_conn_put(conn);
+		return;
+	}
+
+	spin_lock(conn->lock);
+	int was_syn_received = conn->state == TCP_SYN_RECEIVED;
+	int closed = tcp_input(conn, &seg);
+	spin_unlock(conn->lock);
+
+	if (was_syn_received && !closed) tcp_established(conn);
+	tcp_output(conn);
+	if (closed) tcp_unregister(conn);
+	tcp_conn_put(conn);
+}
+
+/**
+ * @brief Run any timers on @p conn that are due.
+ *
+ * @returns 1 if the connection still has timers armed.
+ */
+static int tcp_timers(struct tcp_conn * conn, uint64_t now) {
+	int output = 0;
+	int closed = 0;
+
+	spin_lock(conn->lock);
+
+	if (conn->output_pending) {
+		conn->output_pending = 0;
+		output = 1;
+		/* Left to us by a listener that closed before accepting it */
+		if (conn->state == TCP_CLOSED) closed = 1;
+	}
+
+	if (conn->timewait_at && now >= conn->timewait_at) {
+		conn->timewait_at = 0;
+		tcp_abort(conn, conn->error);
+		closed = 1;
+	}
+
+	if (conn->delack_at && now >= conn->delack_at) {
+		conn->delack_at = 0;
+		conn->ack_now = 1;
+		output = 1;
+	}
+
+	if (conn->rto_at && now >= conn->rto_at) {
+		conn->rto_at = 0;
+		output = 1;
+		int synchronized = conn->state != TCP_SYN_SENT && conn->state != TCP_SYN_RECEIVED;
+
+		if (synchronized && !conn->snd_wnd && conn->snd_len) {
+			/* Persist: probe the zero window with a byte, and never give up */
+			conn->probe = 1;
+			conn->snd_nxt = conn->snd_una;
+			conn->rto = conn->rto * 2 > TCP_RTO_MAX ? TCP_RTO_MAX : conn->rto * 2;
+		} else if (++conn->retries > (synchronized ? TCP_MAX_RETRIES : TCP_SYN_RETRIES)) {
+			tcp_abort(conn, -ETIMEDOUT);
+			closed = 1;
+			output = 0;
+		} else {
+			uint32_t flight = conn->snd_max - conn->snd_una;
+			conn->ssthresh = flight / 2 > 2 * conn->mss ? flight / 2 : 2 * conn->mss;
+			conn->cwnd = conn->mss;
+			conn->recover = conn->snd_max;
+			conn->in_recovery = 0;
+			conn->dupacks = 0;
+			conn->rtt_timing = 0;
+			conn->snd_nxt = conn->snd_una;
+			conn->rto = conn->rto * 2 > TCP_RTO_MAX ? TCP_RTO_MAX : conn->rto * 2;
+		}
+	}
+
+	int armed = conn->rto_at || conn->delack_at || conn->timewait_at;
+	spin_unlock(conn->lock);
+
+	if (output) tcp_output(conn);
+	if (closed) tcp_unregister(conn);
+
+	return armed;
+}
+
+static void tcp_timer_thread(void * arg) {
+	size_t capacity = 0;
+	struct tcp_conn ** conns = NULL;
+
+	while (1) {
+		/*
+		 * Take the list's connections, and the references it held. One that
+		 * is armed again while we look at it goes back on the list, as does
+		 * one with timers still pending afterwards.
+		 */
+		spin_lock(tcp_timer_lock);
+		if (capacity < tcp_timer_conns->length) {
+			capacity = tcp_timer_conns->length * 2;
+			conns = realloc(conns, capacity * sizeof(struct tcp_conn *));
+		}
+		size_t count = 0;
+		node_t * node;
+		while ((node = list_dequeue(tcp_timer_conns))) {
+			conns[count++] = node->value;
+		}
+		spin_unlock(tcp_timer_lock);
+
+		uint64_t now = tcp_now();
+		for (size_t i = 0; i < count; ++i) {
+			if (tcp_timers(conns[i], now)) tcp_timer_kick(conns[i]);
+			tcp_conn_put(conns[i]);
+		}
+
+		spin_lock(tcp_timer_lock);
+		if (!tcp_timer_conns->length) {
+			sleep_on_unlocking(tcp_timer_queue, &tcp_timer_lock);
+			continue;
+		}
+		spin_unlock(tcp_timer_lock);
+
+		unsigned long s, ss;
+		relative_time(0, TCP_TICK, &s, &ss);
+		sleep_until((process_t *)this_core->current_process, s, ss);
+		switch_task(0);
+	}
+}
+
+static int sock_tcp_check(fs_node_t * node) {
+	struct tcp_conn * conn = ((sock_t*)node)->proto;
+	if (conn->state == TCP_LISTEN) return conn->accept_queue->length ? 0 : 1;
+	if (conn->rcv_len || conn->rcv_closed || conn->error) return 0;
+	return 1;
+}
+
+/**
+ * @brief Stop listening, resetting any connections that were never accepted.
+ *
+ * The resets are sent from the timer thread, as with the FIN in sock_tcp_close.
+ */
+static void tcp_close_listener(struct tcp_conn * listener) {
+	spin_lock(listener->lock);
+	listener->state = TCP_CLOSED;
+	tcp_wake(listener);
+	spin_unlock(listener->lock);
+
+	list_t * queues[] = { listener->syn_queue, listener->accept_queue };
+	for (int i = 0; i < 2; ++i) {
+		while (1) {
+			spin_lock(listener->lock);
+			node_t * node = list_dequeue(queues[i]);
+			spin_unlock(listener->lock);
+			if (!node) break;
+
+			struct tcp_conn * conn = node->value;
+			free(node);
+
+			spin_lock(conn->lock);
+			int detached = conn->parent == listener;
+			conn->parent = NULL;
+			tcp_abort(conn, 0);
+			conn->rst_pending = 1;
+			conn->output_pending = 1;
+			tcp_timer_kick(conn);
+			spin_unlock(conn->lock);
+
+			if (detached) tcp_conn_put(listener);
+			tcp_conn_put(conn);
+		}
+	}
+}
+
+static void sock_tcp_close(sock_t * sock) {
+	struct tcp_conn * conn = sock->proto;
+	int closed = 0;
+
+	if (conn->state == TCP_LISTEN) tcp_close_listener(conn);
+
+	spin_lock(conn->lock);
+	conn->sock = NULL;
+	switch (conn->state) {
+		case TCP_SYN_SENT:
+		case TCP_CLOSED:
+			tcp_abort(conn, 0);
+			closed = 1;
+			break;
+		case TCP_SYN_RECEIVED:
+		case TCP_ESTABLISHED:
+			conn->fin_queued = 1;
+			conn->state = TCP_FIN_WAIT_1;
+			conn->output_pending = 1;
+			break;
+		case TCP_CLOSE_WAIT:
+			conn->fin_queued = 1;
+			conn->state = TCP_LAST_ACK;
+			conn->output_pending = 1;
+			break;
+		case TCP_FIN_WAIT_2:
+			tcp_arm(conn, &conn->timewait_at, 2 * TCP_MSL);
+			break;
+		default:
+			break;
+	}
+	conn->rcv_head = 0;
+	conn->rcv_len = 0;
+	/* The FIN goes out from the timer thread: we may be called with VFS locks held */
+	if (conn->output_pending) tcp_timer_kick(conn);
+	spin_unlock(conn->lock);
+
+	if (closed) tcp_unregister(conn);
+	tcp_conn_put(conn);
+}
+
+static long sock_tcp_recv(sock_t * sock, struct msghdr * msg, int flags) {
+	struct tcp_conn * conn = sock->proto;
+	if (msg->msg_iovlen == 0) return 0;
+
+	spin_lock(conn->lock);
+	while (!conn->rcv_len) {
+		if (conn->state == TCP_LISTEN) {
+			spin_unlock(conn->lock);
+			return -ENOTCONN;
+		}
+		if (conn->error) {
+			long error = conn->error;
+			conn->error = 0;
+			spin_unlock(conn->lock);
+			return error;
+		}
+		if (conn->rcv_closed || (conn->state == TCP_CLOSED && conn->remote_port)) {
+			spin_unlock(conn->lock);
+			return 0; /* EOF */
+		}
+		if (conn->state == TCP_CLOSED) {
+			spin_unlock(conn->lock);
+			return -ENOTCONN;
+		}
+		if (sock->nonblocking) {
+			spin_unlock(conn->lock);
+			return -EAGAIN;
+		}
+		if (sleep_on_unlocking(conn->rx_wait, &conn->lock)) return -ERESTARTSYS;
+		spin_lock(conn->lock);
+	}
+
+	size_t copied = 0;
+	for (size_t i = 0; i < msg->msg_iovlen && conn->rcv_len; ++i) {
+		size_t want = msg->msg_iov[i].iov_len;
+		uint8_t * out = msg->msg_iov[i].iov_base;
+		while (want && conn->rcv_len) {
+			size_t chunk = want < conn->rcv_len ? want : conn->rcv_len;
+			if (chunk > TCP_RCVBUF - conn->rcv_head) chunk = TCP_RCVBUF - conn->rcv_head;
+			memcpy(out, conn->rcv_buf + conn->rcv_head, chunk);
+			conn->rcv_head = (conn->rcv_head + chunk) % TCP_RCVBUF;
+			conn->rcv_len -= chunk;
+			out += chunk;
+			want -= chunk;
+			copied += chunk;
+		}
+	}
+
+	/* Tell the peer once the window has opened up by a useful amount */
+	size_t threshold = 2 * conn->mss < TCP_RCVBUF / 2 ? 2 * conn->mss : TCP_RCVBUF / 2;
+	uint32_t edge = conn->rcv_nxt + tcp_rcv_window(conn);
+	int update = conn->state >= TCP_ESTABLISHED && !conn->rcv_closed && SEQ_GEQ(edge, conn->rcv_adv + threshold);
+	if (update) conn->ack_now = 1;
+	spin_unlock(conn->lock);
+
+	if (update) tcp_output(conn);
+
+	return copied;
+}
+
+static long sock_tcp_send(sock_t * sock, const struct msghdr *msg, int flags) {
+	struct tcp_conn * conn = sock->proto;
+	size_t copied = 0;
+
+	spin_lock(conn->lock);
+	for (size_t i = 0; i < msg->msg_iovlen; ++i) {
+		const uint8_t * in = msg->msg_iov[i].iov_base;
+		size_t remaining = msg->msg_iov[i].iov_len;
+
+		while (remaining) {
+			if (conn->error) {
+				long error = conn->error;
+				spin_unlock(conn->lock);
+				return copied ? (long)copied : error;
+			}
+			if (conn->state != TCP_ESTABLISHED && conn->state != TCP_CLOSE_WAIT) {
+				int connected = conn->state != TCP_SYN_SENT && conn->remote_port;
+				spin_unlock(conn->lock);
+				if (copied) return copied;
+				return connected ? -EPIPE : -ENOTCONN;
+			}
+
+			size_t space = TCP_SNDBUF - conn->snd_len;
+			if (!space) {
+				/* Push out what we have, then wait for ACKs to make room */
+				spin_unlock(conn->lock);
+				tcp_output(conn);
+				spin_lock(conn->lock);
+				if (TCP_SNDBUF != conn->snd_len) continue;
+				if (sock->nonblocking) {
+					spin_unlock(conn->lock);
+					return copied ? (long)copied : -EAGAIN;
+				}
+				if (sleep_on_unlocking(conn->tx_wait, &conn->lock)) {
+					return copied ? (long)copied : -ERESTARTSYS;
+				}
+				spin_lock(conn->lock);
+				continue;
+			}
+
+			size_t chunk = remaining < space ? remaining : space;
+			size_t tail = (conn->snd_head + conn->snd_len) % TCP_SNDBUF;
+			if (chunk > TCP_SNDBUF - tail) chunk = TCP_SNDBUF - tail;
+			memcpy(conn->snd_buf + tail, in, chunk);
+			conn->snd_len += chunk;
+			in += chunk;
+			remaining -= chunk;
+			copied += chunk;
+		}
+	}
+	spin_unlock(conn->lock);
+
+	tcp_output(conn);
+	return copied;
+}
+
+static long sock_tcp_connect(sock_t * sock, const struct sockaddr *addr, socklen_t addrlen) {
+	struct tcp_conn * conn = sock->proto;
+	const struct sockaddr_in * dest = (const struct sockaddr_in *)addr;
+
+	if (addrlen < sizeof(struct sockaddr_in)) return -EINVAL;
+	if (conn->hashed || conn->state != TCP_CLOSED) return -EISCONN;
+
+	memcpy(&sock->dest, addr, sizeof(struct sockaddr_in));
+	conn->remote_addr = dest->sin_addr.s_addr;
+	conn->remote_port = ntohs(dest->sin_port);
+
+	int status = tcp_conn_route(conn);
+	if (status) return status;
+
+	if (!conn->bound) {
+		status = tcp_bind_port(conn, 0);
+		if (status) return status;
+	}
+
+	status = tcp_hash(conn);
+	if (status) return status;
+
+	printf("tcp: connecting from ephemeral port %d\n", conn->local_port);
+
+	spin_lock(conn->lock);
+	conn->iss = rand();
+	conn->snd_una = conn->iss;
+	conn->snd_nxt = conn->iss;
+	conn->snd_max = conn->iss;
+	conn->recover = conn->iss;
+	conn->ip_ident = rand();
+	conn->state = TCP_SYN_SENT;
+	spin_unlock(conn->lock);
+
+	tcp_output(conn);
+
+	spin_lock(conn->lock);
+	while (conn->state == TCP_SYN_SENT) {
+		if (sleep_on_unlocking(conn->tx_wait, &conn->lock)) {
+			/* Stop trying; the socket is no good for another attempt. */
+			spin_lock(conn->lock);
+			tcp_abort(conn, -EINTR);
+			spin_unlock(conn->lock);
+			tcp_unregister(conn);
+			return -EINTR;
+		}
+		spin_lock(conn->lock);
+	}
+	status = conn->state == TCP_CLOSED ? (conn->error ? conn->error : -ECONNREFUSED) : 0;
+	spin_unlock(conn->lock);
+
+	printf("tcp: connect complete (%d)\n", status);
+	return status;
+}
+
+static ssize_t sock_tcp_read(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
+	struct iovec _iovec = {
+		buffer, size
+	};
+	struct msghdr _header = {
+		.msg_name = NULL,
+		.msg_namelen = 0,
+		.msg_iov = &_iovec,
+		.msg_iovlen = 1,
+		.msg_control = NULL,
+		.msg_controllen = 0,
+		.msg_flags = 0,
+	};
+	return sock_tcp_recv((sock_t*)node, &_header, 0);
+}
+
+static ssize_t sock_tcp_write(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
+	struct iovec _iovec = {
+		(void*)buffer, size
+	};
+	struct msghdr _header = {
+		.msg_name = NULL,
+		.msg_namelen = 0,
+		.msg_iov = &_iovec,
+		.msg_iovlen = 1,
+		.msg_control = NULL,
+		.msg_controllen = 0,
+		.msg_flags = 0,
+	};
+	return sock_tcp_send((sock_t*)node, &_header, 0);
+}
+
+static long sock_tcp_getsockname(sock_t * sock, struct sockaddr *addr, socklen_t * addrlen) {
+	struct tcp_conn * conn = sock->proto;
+	in_addr_t ip4_addr = conn->local_addr;
+	if (!ip4_addr) {
+		fs_node_t * nic = net_if_route(conn->remote_addr);
+		if (nic) ip4_addr = ((struct EthernetDevice*)nic->device)->ipv4_addr;
+	}
+
+	struct sockaddr_in out = {
+		AF_INET, htons(conn->local_port), { ip4_addr }, {0},
+	};
+
+	memcpy(addr, &out, *addrlen < sizeof(struct sockaddr_in) ? *addrlen : sizeof(struct sockaddr_in));
+	if (*addrlen < sizeof(struct sockaddr_in)) *addrlen = sizeof(struct sockaddr_in);
+	return 0;
+}
+
+static long sock_tcp_getpeername(sock_t * sock, struct sockaddr *addr, socklen_t * addrlen) {
+	struct tcp_conn * conn = sock->proto;
+	struct sockaddr_in out = {
+		AF_INET, htons(conn->remote_port), { conn->remote_addr }, {0},
+	};
+	memcpy(addr, &out, *addrlen < sizeof(struct sockaddr_in) ? *addrlen : sizeof(struct sockaddr_in));
+	if (*addrlen < sizeof(struct sockaddr_in)) *addrlen = sizeof(struct sockaddr_in);
+	return 0;
+}
+
+static long sock_tcp_bind(sock_t * sock, const struct sockaddr *addr, socklen_t addrlen) {
+	struct tcp_conn * conn = sock->proto;
+	const struct sockaddr_in * addr_in = (const struct sockaddr_in *)addr;
+
+	if (addrlen < sizeof(struct sockaddr_in)) return -EINVAL;
+	if (conn->bound || conn->state != TCP_CLOSED) return -EINVAL; /* Already bound */
+
+	/* Like UDP, we listen on every interface whatever address was asked for */
+	return tcp_bind_port(conn, ntohs(addr_in->sin_port));
+}
+
+static long sock_tcp_listen(sock_t * sock, int backlog) {
+	struct tcp_conn * conn = sock->proto;
+
+	if (backlog < 1) backlog = 1;
+	if (backlog > TCP_BACKLOG_MAX) backlog = TCP_BACKLOG_MAX;
+
+	if (conn->state == TCP_LISTEN) {
+		conn->backlog = backlog;
+		return 0;
+	}
+	if (conn->hashed || conn->state != TCP_CLOSED) return -EINVAL;
+
+	if (!conn->bound) {
+		int status = tcp_bind_port(conn, 0);
+		if (status) return status;
+	}
+
+	spin_lock(conn->lock);
+	if (!conn->syn_queue) {
+		conn->syn_queue = list_create("tcp syn queue", conn);
+		conn->accept_queue = list_create("tcp accept queue", conn);
+	}
+	conn->backlog = backlog;
+	conn->state = TCP_LISTEN;
+	spin_unlock(conn->lock);
+
+	printf("tcp: listening on port %d\n", conn->local_port);
+	return 0;
+}
+
+static long sock_tcp_accept(sock_t * sock, struct sockaddr *addr, socklen_t * addrlen);
+
+static void tcp_sock_setup(sock_t * sock, struct tcp_conn * conn) {
+	conn->sock = sock;
+	sock->proto = conn;
+	sock->sock_recv = sock_tcp_recv;
+	sock->sock_send = sock_tcp_send;
+	sock->sock_close = sock_tcp_close;
+	sock->sock_connect = sock_tcp_connect;
+	sock->sock_bind = sock_tcp_bind;
+	sock->sock_listen = sock_tcp_listen;
+	sock->sock_accept = sock_tcp_accept;
+	sock->sock_getsockname = sock_tcp_getsockname;
+	sock->sock_getpeername = sock_tcp_getpeername;
+	sock->_fnode.read = sock_tcp_read;
+	sock->_fnode.write = sock_tcp_write;
+	sock->_fnode.selectcheck = sock_tcp_check;
+}
+
+static long sock_tcp_accept(sock_t * sock, struct sockaddr *addr, socklen_t * addrlen) {
+	struct tcp_conn * listener = sock->proto;
+
+	spin_lock(listener->lock);
+	while (1) {
+		if (listener->state != TCP_LISTEN) {
+			spin_unlock(listener->lock);
+			return -EINVAL;
+		}
+		if (listener->accept_queue->length) break;
+		if (sock->nonblocking) {
+			spin_unlock(listener->lock);
+			return -EAGAIN;
+		}
+		if (sleep_on_unlocking(listener->rx_wait, &listener->lock)) return -ERESTARTSYS;
+		spin_lock(listener->lock);
+	}
+	node_t * node = list_dequeue(listener->accept_queue);
+	spin_unlock(listener->lock);
+
+	/* The accept queue's reference becomes the new socket's */
+	struct tcp_conn * conn = node->value;
+	free(node);
+
+	sock_t * child = net_sock_create();
+	spin_lock(conn->lock);
+	int detached = conn->parent == listener;
+	conn->parent = NULL;
+	tcp_sock_setup(child, conn);
+	spin_unlock(conn->lock);
+	if (detached) tcp_conn_put(listener);
+
+	if (addr) sock_tcp_getpeername(child, addr, addrlen);
+
+	int fd = process_append_fd((process_t *)this_core->current_process, (fs_node_t *)child);
+	FD_MODE(fd) = 03;
+	return fd;
+}
+
+long net_tcp_socket(void) {
+	printf("tcp socket...\n");
+	sock_t * sock = net_sock_create();
+	tcp_sock_setup(sock, tcp_conn_create());
+	int fd = process_append_fd((process_t *)this_core->current_process, (fs_node_t *)sock);
+	FD_MODE(fd) = 03;
+	return fd;
+}
+
+void tcp_install(void) {
+	tcp_conns = hashmap_create(TCP_HASH_SIZE);
+	tcp_conns->hash_func = tcp_tuple_hash;
+	tcp_conns->hash_comp = tcp_tuple_comp;
+	tcp_conns->hash_key_dup = tcp_tuple_dupe;
+	tcp_ports = hashmap_create_int(64);
+	tcp_timer_queue = list_create("tcp timer", NULL);
+	tcp_timer_conns = list_create("tcp timers", NULL);
+}
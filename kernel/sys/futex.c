@@ -0,0 +1,170 @@
+/**
+ * @file  kernel/sys/futex.c
+ * @brief Fast userspace wait queues.
+ *
+ * Userspace synchronization primitives spin on an integer in their
+ * own memory and only enter the kernel when they need to sleep or
+ * when they need to wake up someone who is sleeping. The kernel
+ * side is just a set of wait queues keyed by the physical address
+ * of that integer, so threads and processes sharing memory through
+ * either clone or shm all find the same queue.
+ *
+ * Waiting threads sleep with the usual @ref sleep_on machinery.
+ * Queues are hashed into a fixed set of buckets, each with its
+ * own lock, and are created on demand and freed when the last
+ * waiter leaves.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2023 K. Lange
+ */
+#include <stdint.h>
+#include <errno.h>
+#include <sys/futex.h>
+#include <kernel/types.h>
+#include <kernel/string.h>
+#include <kernel/printf.h>
+#include <kernel/process.h>
+#include <kernel/spinlock.h>
+#include <kernel/syscall.h>
+#include <kernel/list.h>
+#include <kernel/mmu.h>
+
+extern int wakeup_queue_one(list_t * queue);
+
+#define FUTEX_BUCKETS 64
+
+struct futex_queue {
+	uintptr_t key;   /* Physical address of the futex word */
+	size_t users;    /* Threads currently waiting or about to wait */
+	list_t * waiters;
+};
+
+struct futex_bucket {
+	spin_lock_t lock;
+	list_t queues;   /* struct futex_queue */
+} __attribute__((aligned(64)));
+
+static struct futex_bucket futex_buckets[FUTEX_BUCKETS];
+
+static struct futex_bucket * futex_bucket_for(uintptr_t key) {
+	/* Words are 4-byte aligned, so mix in the higher bits */
+	return &futex_buckets[((key >> 2) ^ (key >> 12)) % FUTEX_BUCKETS];
+}
+
+/**
+ * @brief Find the queue for @p key, optionally creating it.
+ *
+ * Bucket lock must be held.
+ */
+static struct futex_queue * futex_queue_get(struct futex_bucket * bucket, uintptr_t key, int create) {
+	foreach(node, &bucket->queues) {
+		struct futex_queue * queue = node->value;
+		if (queue->key == key) return queue;
+	}
+
+	if (!create) return NULL;
+
+	struct futex_queue * queue = malloc(sizeof(struct futex_queue));
+	queue->key = key;
+	queue->users = 0;
+	queue->waiters = list_create("futex waiters", queue);
+	list_insert(&bucket->queues, queue);
+	return queue;
+}
+
+/**
+ * @brief Drop a reference to a queue, freeing it if it was the last.
+ *
+ * Bucket lock must be held.
+ */
+static void futex_queue_put(struct futex_bucket * bucket, struct futex_queue * queue) {
+	if (--queue->users) return;
+	node_t * node = list_find(&bucket->queues, queue);
+	list_delete(&bucket->queues, node);
+	free(node);
+	free(queue->waiters);
+	free(queue);
+}
+
+/**
+ * @brief Translate a user futex address into its key.
+ */
+static long futex_key(int * addr, uintptr_t * key) {
+	if ((uintptr_t)addr & 3) return -EINVAL;
+	if (!PTR_INRANGE(addr)) return -EFAULT;
+	/* Resolve copy-on-write now so the physical address is stable. */
+	if (!mmu_validate_user_pointer(addr, sizeof(int), MMU_PTR_WRITE)) return -EFAULT;
+	*key = mmu_map_to_physical(this_core->current_process->thread.page_directory->directory, (uintptr_t)addr);
+	return 0;
+}
+
+/**
+ * @brief Sleep if *addr still contains @p val.
+ *
+ * The comparison happens with the bucket locked, so a waker that
+ * changes the value and then calls @ref futex_wake can not slip in
+ * between the check and the sleep.
+ */
+static long futex_wait(int * addr, int val) {
+	uintptr_t key;
+	long res = futex_key(addr, &key);
+	if (res) return res;
+
+	struct futex_bucket * bucket = futex_bucket_for(key);
+	spin_lock(bucket->lock);
+
+	if (*(volatile int *)addr != val) {
+		spin_unlock(bucket->lock);
+		return -EAGAIN;
+	}
+
+	struct futex_queue * queue = futex_queue_get(bucket, key, 1);
+	queue->users++;
+
+	int interrupted = sleep_on_unlocking(queue->waiters, &bucket->lock);
+
+	spin_lock(bucket->lock);
+	futex_queue_put(bucket, queue);
+	spin_unlock(bucket->lock);
+
+	return interrupted ? -EINTR : 0;
+}
+
+/**
+ * @brief Wake up to @p count threads waiting on @p addr.
+ *
+ * @returns the number of threads woken.
+ */
+static long futex_wake(int * addr, int count) {
+	uintptr_t key;
+	long res = futex_key(addr, &key);
+	if (res) return res;
+
+	struct futex_bucket * bucket = futex_bucket_for(key);
+	spin_lock(bucket->lock);
+
+	long woken = 0;
+	struct futex_queue * queue = futex_queue_get(bucket, key, 0);
+	if (queue) {
+		while (woken < count && queue->waiters->length) {
+			woken += wakeup_queue_one(queue->waiters);
+		}
+	}
+
+	spin_unlock(bucket->lock);
+	return woken;
+}
+
+long sys_futex(int * addr, int op, int val) {
+	switch (op) {
+		case FUTEX_WAIT:
+			return futex_wait(addr, val);
+		case FUTEX_WAKE:
+			if (val < 0) return -EINVAL;
+			return futex_wake(addr, val);
+		default:
+			return -EINVAL;
+	}
+}
@@ -0,0 +1,681 @@
+/**
+ * @file  kernel/sys/mmap.c
+ * @brief Memory mappings with demand paging.
+ *
+ * Every address space keeps a sorted list of mapped regions.
+ * Creating a region does not allocate anything; when a process
+ * touches a page that isn't present, the page fault handler calls
+ * @ref mmap_page_fault and the page is zeroed or read in from the
+ * backing file through the VFS, so mapping a large file costs
+ * nothing until it is actually used.
+ *
+ * Private mappings are made of ordinary user pages, so fork shares
+ * them copy-on-write like the rest of the address space. Shared
+ * mappings are backed by a refcounted object which owns its frames;
+ * every address space mapping the object maps the same frames and
+ * the page tables mark them as shared so the MMU knows not to free
+ * them. Shared file mappings are found by file, so processes mapping
+ * the same file see each other's changes, and are written back to
+ * the file when the last mapping of them goes away.
+ *
+ * Untouched private anonymous memory is read from a single shared
+ * zero page, and only gets a frame of its own when first written.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2023 K. Lange
+ */
+#include <stdint.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <kernel/types.h>
+#include <kernel/string.h>
+#include <kernel/printf.h>
+#include <kernel/process.h>
+#include <kernel/spinlock.h>
+#include <kernel/syscall.h>
+#include <kernel/hashmap.h>
+#include <kernel/list.h>
+#include <kernel/vfs.h>
+#include <kernel/mmu.h>
+#include <kernel/mmap.h>
+
+#define PAGE_SIZE      0x1000UL
+#define PAGE_LOW_MASK  0x0000000000000FFFUL
+#define PAGE_SIZE_MASK 0xFFFFffffFFFFf000UL
+
+/* User stacks grow down from the top of the lower half, don't map over them. */
+#define USER_MMAP_LIMIT 0x0000700000000000UL
+
+struct mmap_object {
+	ssize_t refs;          /* Protected by objects_lock */
+	spin_lock_t lock;
+	fs_node_t * file;      /* Backing file, or NULL for anonymous memory */
+	hashmap_t * pages;     /* Page index -> frame index */
+	int writeback;         /* Has been mapped writable */
+};
+
+struct mmap_region {
+	uintptr_t start;
+	uintptr_t end;
+	int prot;
+	int flags;
+	int may_write;         /* Whether mprotect may add PROT_WRITE */
+	off_t offset;          /* Offset of start within the file or object */
+	uint64_t file_end;     /* File data stops here, the rest of the page reads as zero */
+	fs_node_t * file;      /* Source of private file mappings */
+	struct mmap_object * object; /* Backing of shared mappings */
+	volatile ssize_t refs;
+};
+
+static spin_lock_t objects_lock = { 0 };
+static list_t * shared_files = NULL;
+static uintptr_t zero_frame = 0;
+
+struct mmap_stats mmap_stats = {0};
+
+static struct mmap_object * mmap_object_create(fs_node_t * file) {
+	struct mmap_object * object = malloc(sizeof(struct mmap_object));
+	object->refs = 1;
+	spin_init(object->lock);
+	object->file = file;
+	object->pages = hashmap_create_int(64);
+	object->writeback = 0;
+	if (file) open_fs(file, 0);
+	return object;
+}
+
+/**
+ * @brief Find the shared object for a file, creating it if needed.
+ *
+ * Each open of a file gets its own node, so files are matched on
+ * the filesystem that owns them and their inode number.
+ */
+static struct mmap_object * mmap_object_for_file(fs_node_t * file) {
+	spin_lock(objects_lock);
+	if (!shared_files) shared_files = list_create("mmap shared files", NULL);
+	foreach(node, shared_files) {
+		struct mmap_object * object = node->value;
+		if (object->file->read == file->read && object->file->device == file->device && object->file->inode == file->inode) {
+			object->refs++;
+			spin_unlock(objects_lock);
+			return object;
+		}
+	}
+	struct mmap_object * object = mmap_object_create(file);
+	list_insert(shared_files, object);
+	spin_unlock(objects_lock);
+	return object;
+}
+
+static void mmap_object_get(struct mmap_object * object) {
+	spin_lock(objects_lock);
+	object->refs++;
+	spin_unlock(objects_lock);
+}
+
+static void mmap_object_put(struct mmap_object * object) {
+	spin_lock(objects_lock);
+	if (--object->refs) {
+		spin_unlock(objects_lock);
+		return;
+	}
+	if (object->file) {
+		node_t * node = list_find(shared_files, object);
+		list_delete(shared_files, node);
+		free(node);
+	}
+	spin_unlock(objects_lock);
+
+	list_t * indexes = hashmap_keys(object->pages);
+	foreach(node, indexes) {
+		uintptr_t index = (uintptr_t)node->value;
+		uintptr_t frame = (uintptr_t)hashmap_get(object->pages, (void*)index);
+		if (object->file && object->writeback && (index << 12) < object->file->length) {
+			size_t size = object->file->length - (index << 12);
+			if (size > PAGE_SIZE) size = PAGE_SIZE;
+			write_fs(object->file, index << 12, size, mmu_map_from_physical(frame << 12));
+		}
+		mmu_frame_release(frame << 12);
+	}
+	list_free(indexes);
+	free(indexes);
+
+	if (object->file) close_fs(object->file);
+	hashmap_free(object->pages);
+	free(object->pages);
+	free(object);
+}
+
+/**
+ * @brief Fill a fresh frame with page @p index of @p file.
+ *
+ * Anything past the end of the file, or past @p file_end, is left zeroed.
+ */
+static uintptr_t mmap_fill_frame(fs_node_t * file, uintptr_t index, uint64_t file_end) {
+	uintptr_t frame = mmu_allocate_a_frame();
+	uint8_t * data = mmu_map_from_physical(frame << 12);
+	memset(data, 0, PAGE_SIZE);
+	if (file && (index << 12) < file_end) {
+		uint64_t size = file_end - (index << 12);
+		if (size > PAGE_SIZE) size = PAGE_SIZE;
+		read_fs(file, index << 12, size, data);
+		__atomic_add_fetch(&mmap_stats.file_pages, 1, __ATOMIC_RELAXED);
+	} else {
+		__atomic_add_fetch(&mmap_stats.anon_pages, 1, __ATOMIC_RELAXED);
+	}
+	return frame;
+}
+
+/**
+ * @brief Get the frame backing page @p index of a shared object.
+ */
+static uintptr_t mmap_object_page(struct mmap_object * object, uintptr_t index) {
+	spin_lock(object->lock);
+	if (hashmap_has(object->pages, (void*)index)) {
+		uintptr_t frame = (uintptr_t)hashmap_get(object->pages, (void*)index);
+		spin_unlock(object->lock);
+		return frame;
+	}
+	spin_unlock(object->lock);
+
+	/* Reading the file may sleep, so do it unlocked and check again after. */
+	uintptr_t frame = mmap_fill_frame(object->file, index, UINT64_MAX);
+
+	spin_lock(object->lock);
+	if (hashmap_has(object->pages, (void*)index)) {
+		mmu_frame_release(frame << 12);
+		frame = (uintptr_t)hashmap_get(object->pages, (void*)index);
+	} else {
+		hashmap_set(object->pages, (void*)index, (void*)frame);
+	}
+	spin_unlock(object->lock);
+	return frame;
+}
+
+static struct mmap_region * mmap_region_copy(struct mmap_region * region) {
+	struct mmap_region * out = malloc(sizeof(struct mmap_region));
+	memcpy(out, region, sizeof(struct mmap_region));
+	out->refs = 1;
+	if (out->object) mmap_object_get(out->object);
+	if (out->file) open_fs(out->file, 0);
+	return out;
+}
+
+/**
+ * @brief Drop a reference to a region.
+ *
+ * Releasing the backing object may write it back to its file,
+ * so this must not be called with any locks held.
+ */
+static void mmap_region_put(struct mmap_region * region) {
+	if (__atomic_sub_fetch(&region->refs, 1, __ATOMIC_ACQ_REL)) return;
+	if (region->object) mmap_object_put(region->object);
+	if (region->file) close_fs(region->file);
+	free(region);
+}
+
+/**
+ * @brief Find the region containing @p address.
+ *
+ * Directory lock must be held.
+ */
+static struct mmap_region * mmap_find(page_directory_t * dir, uintptr_t address) {
+	if (!dir->mappings) return NULL;
+	foreach(node, dir->mappings) {
+		struct mmap_region * region = node->value;
+		if (region->start > address) break;
+		if (address < region->end) return region;
+	}
+	return NULL;
+}
+
+/**
+ * @brief Insert a region, keeping the list sorted.
+ *
+ * Directory lock must be held.
+ */
+static void mmap_insert(page_directory_t * dir, struct mmap_region * region) {
+	foreach(node, dir->mappings) {
+		struct mmap_region * other = node->value;
+		if (other->start > region->start) {
+			list_insert_before(dir->mappings, node, region);
+			return;
+		}
+	}
+	list_insert(dir->mappings, region);
+}
+
+/**
+ * @brief Split the region containing @p address so that a region starts there.
+ *
+ * Directory lock must be held.
+ */
+static void mmap_split(page_directory_t * dir, uintptr_t address) {
+	if (!dir->mappings) return;
+	foreach(node, dir->mappings) {
+		struct mmap_region * region = node->value;
+		if (region->start >= address) return;
+		if (address < region->end) {
+			struct mmap_region * tail = mmap_region_copy(region);
+			tail->start = address;
+			tail->offset += address - region->start;
+			region->end = address;
+			list_insert_after(dir->mappings, node, tail);
+			return;
+		}
+	}
+}
+
+/**
+ * @brief Remove all regions in [start,end) from the address space.
+ *
+ * The pages themselves are not touched. Removed regions are moved to
+ * @p out so they can be released once the directory lock is dropped.
+ */
+static void mmap_remove(page_directory_t * dir, uintptr_t start, uintptr_t end, list_t * out) {
+	if (!dir->mappings) return;
+	mmap_split(dir, start);
+	mmap_split(dir, end);
+	node_t * node = dir->mappings->head;
+	while (node) {
+		node_t * next = node->next;
+		struct mmap_region * region = node->value;
+		if (region->start >= end) break;
+		if (region->start >= start) {
+			list_delete(dir->mappings, node);
+			free(node);
+			list_insert(out, region);
+		}
+		node = next;
+	}
+}
+
+static void mmap_release_list(list_t * regions) {
+	while (regions->length) {
+		node_t * node = list_pop(regions);
+		mmap_region_put(node->value);
+		free(node);
+	}
+	free(regions);
+}
+
+/**
+ * @brief Check that a page-aligned range is somewhere we allow mappings.
+ */
+static int mmap_range_valid(uintptr_t start, size_t length) {
+	uintptr_t end = start + length;
+	if (end <= start) return 0;
+	if (start < PAGE_SIZE || end > USER_MMAP_LIMIT) return 0;
+	/* SHM and device mappings are managed separately. */
+	if (start <= USER_SHM_HIGH && end > USER_DEVICE_MAP) return 0;
+	return 1;
+}
+
+/**
+ * @brief Find a free range of @p length bytes in the mapping window.
+ *
+ * Directory lock must be held.
+ *
+ * @returns the start of the range, or 0 if nothing fits.
+ */
+static uintptr_t mmap_find_space(page_directory_t * dir, uintptr_t hint, size_t length) {
+	uintptr_t cursor = USER_MMAP_LOW;
+	if (hint >= USER_MMAP_LOW && hint + length <= USER_MMAP_HIGH && hint + length > hint) cursor = hint;
+
+	while (1) {
+		uintptr_t before = cursor;
+		foreach(node, dir->mappings) {
+			struct mmap_region * region = node->value;
+			if (region->end <= cursor) continue;
+			if (region->start >= cursor + length) break;
+			cursor = region->end;
+		}
+		if (cursor == before) break;
+	}
+
+	if (cursor + length > USER_MMAP_HIGH || cursor + length < cursor) {
+		/* The hint didn't work out, try again from the bottom. */
+		if (hint) return mmap_find_space(dir, 0, length);
+		return 0;
+	}
+
+	return cursor;
+}
+
+/**
+ * @brief Create a mapping in the current address space.
+ *
+ * Arguments must already be validated; @p length must be page-aligned
+ * and, with @c MAP_FIXED, so must @p addr. Used by @ref sys_mmap and
+ * by the ELF loader to map program segments.
+ *
+ * @param file      Backing file, or NULL for anonymous memory.
+ * @param file_end  File offset past which pages read as zeroes.
+ * @param may_write Whether @c PROT_WRITE may be added later with mprotect.
+ * @returns the start of the mapping, or a negative error.
+ */
+long mmap_map(uintptr_t addr, size_t length, int prot, int flags, fs_node_t * file, off_t offset, uint64_t file_end, int may_write) {
+	struct mmap_region * region = malloc(sizeof(struct mmap_region));
+	region->prot = prot;
+	region->flags = flags;
+	region->may_write = may_write;
+	region->offset = file ? offset : 0;
+	region->file_end = file_end;
+	region->file = NULL;
+	region->object = NULL;
+	region->refs = 1;
+
+	if (flags & MAP_SHARED) {
+		region->object = file ? mmap_object_for_file(file) : mmap_object_create(NULL);
+		if (prot & PROT_WRITE) region->object->writeback = 1;
+	} else if (file) {
+		open_fs(file, 0);
+		region->file = file;
+	}
+
+	page_directory_t * dir = this_core->current_process->thread.page_directory;
+	list_t * released = list_create("mmap released regions", NULL);
+
+	spin_lock(dir->lock);
+	if (!dir->mappings) dir->mappings = list_create("mmap regions", dir);
+
+	if (flags & MAP_FIXED) {
+		/* Replace whatever was there before. */
+		mmap_remove(dir, addr, addr + length, released);
+		mmu_unmap_user(addr, length);
+	} else {
+		addr = mmap_find_space(dir, addr & PAGE_SIZE_MASK, length);
+		if (!addr) {
+			spin_unlock(dir->lock);
+			mmap_release_list(released);
+			mmap_region_put(region);
+			return -ENOMEM;
+		}
+	}
+
+	region->start = addr;
+	region->end = addr + length;
+	mmap_insert(dir, region);
+	spin_unlock(dir->lock);
+
+	mmap_release_list(released);
+	return addr;
+}
+
+long sys_mmap(struct __mmap_args * args) {
+	PTR_VALIDATE(args);
+	if (!args) return -EFAULT;
+
+	uintptr_t addr = (uintptr_t)args->addr;
+	size_t length  = (args->length + PAGE_LOW_MASK) & PAGE_SIZE_MASK;
+	int prot  = args->prot;
+	int flags = args->flags;
+	off_t offset = args->offset;
+
+	if (!length || length < args->length) return -EINVAL;
+	if ((flags & MAP_SHARED) && (flags & MAP_PRIVATE)) return -EINVAL;
+	if (!(flags & (MAP_SHARED | MAP_PRIVATE))) return -EINVAL;
+	if (prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC)) return -EINVAL;
+	if ((flags & MAP_FIXED) && ((addr & PAGE_LOW_MASK) || !mmap_range_valid(addr, length))) return -EINVAL;
+
+	fs_node_t * file = NULL;
+	int may_write = 1;
+
+	if (!(flags & MAP_ANONYMOUS)) {
+		if (offset < 0 || (offset & PAGE_LOW_MASK)) return -EINVAL;
+		if (!FD_CHECK(args->fd)) return -EBADF;
+		file = FD_ENTRY(args->fd);
+		if (!(file->flags & FS_FILE)) return -ENODEV;
+		if (!(FD_MODE(args->fd) & 01)) return -EACCES;
+		if (flags & MAP_SHARED) {
+			may_write = !!(FD_MODE(args->fd) & 02);
+			if ((prot & PROT_WRITE) && !may_write) return -EACCES;
+		}
+	}
+
+	return mmap_map(addr, length, prot, flags, file, offset, UINT64_MAX, may_write);
+}
+
+long sys_munmap(void * addr, size_t length) {
+	uintptr_t start = (uintptr_t)addr;
+	length = (length + PAGE_LOW_MASK) & PAGE_SIZE_MASK;
+	if ((start & PAGE_LOW_MASK) || !length) return -EINVAL;
+	if (!mmap_range_valid(start, length)) return -EINVAL;
+
+	page_directory_t * dir = this_core->current_process->thread.page_directory;
+	list_t * released = list_create("mmap released regions", NULL);
+
+	spin_lock(dir->lock);
+	mmap_remove(dir, start, start + length, released);
+	mmu_unmap_user(start, length);
+	spin_unlock(dir->lock);
+
+	mmap_release_list(released);
+	return 0;
+}
+
+long sys_mprotect(void * addr, size_t length, int prot) {
+	uintptr_t start = (uintptr_t)addr;
+	length = (length + PAGE_LOW_MASK) & PAGE_SIZE_MASK;
+	if ((start & PAGE_LOW_MASK) || !length) return -EINVAL;
+	if (prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC)) return -EINVAL;
+	if (!mmap_range_valid(start, length)) return -EINVAL;
+
+	uintptr_t end = start + length;
+	page_directory_t * dir = this_core->current_process->thread.page_directory;
+
+	spin_lock(dir->lock);
+
+	if (dir->mappings) {
+		if (prot & PROT_WRITE) {
+			foreach(node, dir->mappings) {
+				struct mmap_region * region = node->value;
+				if (region->start >= end) break;
+				if (region->end > start && !region->may_write) {
+					spin_unlock(dir->lock);
+					return -EACCES;
+				}
+			}
+		}
+
+		mmap_split(dir, start);
+		mmap_split(dir, end);
+
+		foreach(node, dir->mappings) {
+			struct mmap_region * region = node->value;
+			if (region->start >= end) break;
+			if (region->start < start) continue;
+			region->prot = prot;
+			if (region->object && (prot & PROT_WRITE)) region->object->writeback = 1;
+		}
+	}
+
+	/*
+	 * Update anything already faulted in. A present entry can't express
+	 * PROT_NONE without upsetting the COW bookkeeping, so those pages are
+	 * left readable; untouched pages of a PROT_NONE region still fault.
+	 */
+	for (uintptr_t a = start; a < end; a += PAGE_SIZE) {
+		union PML * page = mmu_get_page_other(dir->directory, a);
+		if (!page || !page->bits.present || !mmu_page_is_user_readable(page)) continue;
+		/* The zero page stays read-only, writes will still break it. */
+		if (page->bits.shared && page->bits.page == zero_frame) continue;
+		mmu_page_protect(page, a, (prot & PROT_WRITE) ? MMU_FLAG_WRITABLE : 0);
+	}
+
+	spin_unlock(dir->lock);
+	return 0;
+}
+
+/**
+ * @brief Give a private anonymous page a zeroed frame of its own.
+ *
+ * Directory lock must be held.
+ */
+static void mmap_anon_page(union PML * page, uintptr_t page_addr) {
+	uintptr_t frame = mmu_allocate_a_frame();
+	memset(mmu_map_from_physical(frame << 12), 0, PAGE_SIZE);
+	page->raw = 0;
+	mmu_frame_map_address(page, MMU_FLAG_WRITABLE, frame << 12);
+	mmu_invalidate(page_addr);
+}
+
+/**
+ * @brief Get the page entry for @p address in @p dir.
+ *
+ * Page tables can only be created in the current address space;
+ * elsewhere this only finds entries in tables that already exist.
+ */
+static union PML * mmap_get_page(page_directory_t * dir, uintptr_t address) {
+	if (dir == this_core->current_process->thread.page_directory) return mmu_get_page(address, MMU_GET_MAKE);
+	return mmu_get_page_other(dir->directory, address);
+}
+
+/**
+ * @brief Populate a page of a mapping in @p dir.
+ *
+ * @param dir     Address space to populate, usually the current one.
+ * @param address Address within the page.
+ * @param write   Whether the access was a write.
+ * @returns 0 if the page was populated and the access can be retried, 1 otherwise.
+ */
+int mmap_populate(page_directory_t * dir, uintptr_t address, int write) {
+	uintptr_t page_addr = address & PAGE_SIZE_MASK;
+
+	spin_lock(dir->lock);
+	struct mmap_region * region = mmap_find(dir, page_addr);
+	if (!region || !(region->prot & (PROT_READ | PROT_WRITE | PROT_EXEC)) || (write && !(region->prot & PROT_WRITE))) {
+		spin_unlock(dir->lock);
+		return 1;
+	}
+
+	union PML * page = mmap_get_page(dir, page_addr);
+	if (!page) {
+		spin_unlock(dir->lock);
+		return 1;
+	}
+
+	if (page->bits.present) {
+		int result = 0;
+		if (write && page->bits.shared && page->bits.page == zero_frame) {
+			mmap_anon_page(page, page_addr);
+			__atomic_add_fetch(&mmap_stats.zero_breaks, 1, __ATOMIC_RELAXED);
+		} else if (!mmu_page_is_user_readable(page) || (write && !mmu_page_is_user_writable(page))) {
+			/* Not ours to fix. */
+			result = 1;
+		}
+		spin_unlock(dir->lock);
+		return result;
+	}
+
+	if (!region->object && !region->file) {
+		/* Private anonymous memory needs no I/O, so handle it right here. */
+		if (write) {
+			mmap_anon_page(page, page_addr);
+			__atomic_add_fetch(&mmap_stats.anon_pages, 1, __ATOMIC_RELAXED);
+		} else {
+			page->raw = 0;
+			page->bits.shared = 1;
+			mmu_frame_map_address(page, 0, zero_frame << 12);
+			__atomic_add_fetch(&mmap_stats.zero_maps, 1, __ATOMIC_RELAXED);
+		}
+		spin_unlock(dir->lock);
+		return 0;
+	}
+
+	__atomic_add_fetch(&region->refs, 1, __ATOMIC_ACQ_REL);
+	uintptr_t index = (region->offset + (page_addr - region->start)) >> 12;
+	spin_unlock(dir->lock);
+
+	/* Reading the file may sleep, so this happens with nothing locked. */
+	uintptr_t frame = region->object ? mmap_object_page(region->object, index) : mmap_fill_frame(region->file, index, region->file_end);
+
+	spin_lock(dir->lock);
+
+	/* The mapping may have changed while we were reading. */
+	page = NULL;
+	if (mmap_find(dir, page_addr) == region) {
+		page = mmap_get_page(dir, page_addr);
+	}
+
+	if (!page || page->bits.present) {
+		/* Either someone else filled it in, or it's gone; retry the access either way. */
+		spin_unlock(dir->lock);
+		if (!region->object) mmu_frame_release(frame << 12);
+		mmap_region_put(region);
+		return 0;
+	}
+
+	page->raw = 0;
+	if (region->object) page->bits.shared = 1;
+	mmu_frame_map_address(page, MMU_FLAG_WRITABLE, frame << 12);
+	if (!(region->prot & PROT_WRITE)) mmu_page_protect(page, page_addr, 0);
+
+#ifdef __aarch64__
+	if (region->prot & PROT_EXEC) {
+		/* Through the physical map, as @p dir might not be the current address space. */
+		uintptr_t alias = (uintptr_t)mmu_map_from_physical(frame << 12);
+		for (uintptr_t x = alias; x < alias + PAGE_SIZE; x += 64) asm volatile ("dc cvau, %0" :: "r"(x));
+		asm volatile ("dsb ish" ::: "memory");
+		for (uintptr_t x = alias; x < alias + PAGE_SIZE; x += 64) asm volatile ("ic ivau, %0" :: "r"(x));
+		asm volatile ("dsb ish\nisb" ::: "memory");
+	}
+#endif
+
+	spin_unlock(dir->lock);
+	mmap_region_put(region);
+	return 0;
+}
+
+/**
+ * @brief Populate a page of a mapping after a fault.
+ *
+ * Called by the page fault handler when a process touches a page
+ * that is not present or writes to the zero page, and by pointer
+ * validation so that system calls can read and write untouched
+ * mappings.
+ *
+ * @param address Faulting address.
+ * @param write   Whether the access was a write.
+ * @returns 0 if the page was populated and the access can be retried, 1 otherwise.
+ */
+int mmap_page_fault(uintptr_t address, int write) {
+	if (!this_core->current_process) return 1;
+	return mmap_populate(this_core->current_process->thread.page_directory, address, write);
+}
+
+/**
+ * @brief Copy the mappings of @p from into a freshly forked @p to.
+ *
+ * The page tables have already been cloned by @ref mmu_clone.
+ */
+void mmap_clone(page_directory_t * from, page_directory_t * to) {
+	to->mappings = NULL;
+	spin_lock(from->lock);
+	if (from->mappings) {
+		to->mappings = list_create("mmap regions", to);
+		foreach(node, from->mappings) {
+			list_insert(to->mappings, mmap_region_copy(node->value));
+		}
+	}
+	spin_unlock(from->lock);
+}
+
+/**
+ * @brief Release all mappings of a directory that is being freed.
+ */
+void mmap_release(page_directory_t * dir) {
+	if (!dir->mappings) return;
+	mmap_release_list(dir->mappings);
+	dir->mappings = NULL;
+}
+
+/**
+ * @brief Set up the zero page.
+ */
+void mmap_install(void) {
+	zero_frame = mmu_allocate_a_frame();
+	memset(mmu_map_from_physical(zero_frame << 12), 0, PAGE_SIZE);
+}
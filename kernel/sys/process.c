@@ -36,6 +36,8 @@
 #include <kernel/time.h>
 #include <kernel/misc.h>
 #include <kernel/syscall.h>
+#include <kernel/procfs.h>
+#include <kernel/mmap.h>
 #include <sys/wait.h>
 #include <sys/signal_defs.h>
 
@@ -50,17 +52,59 @@
 
 tree_t * process_tree;  /* Stores the parent-child process relationships; the root of this graph is 'init'. */
 list_t * process_list;  /* Stores all existing processes. Mostly used for sanity checking or for places where iterating over all processes is useful. */
-list_t * process_queue; /* Scheduler ready queue. This the round-robin source. The head is the next process to run. */
-list_t * sleep_queue;   /* Ordered list of processes waiting to be awoken by timeouts. The head is the earliest thread to awaken. */
+list_t * sleep_queue;   /* Marks sleep_node of processes in a timed sleep; the timers themselves are in the per-CPU timer heaps below. */
 list_t * reap_queue;    /* Processes that could not be cleaned up and need to be deleted. */
 
-struct ProcessorLocal processor_local_data[32] = {0};
+struct ProcessorLocal processor_local_data[PROCESSOR_MAX] = {0};
 int processor_count = 1;
 
-/* The following locks protect access to the process tree, scheduler queue,
+/**
+ * @brief Per-CPU scheduler ready queue.
+ *
+ * Each core round-robins through its own queue and only touches
+ * another core's queue when it has nothing to do and goes looking
+ * for work to steal. Each queue has its own lock, so cores do not
+ * contend with each other in the common case.
+ */
+struct runqueue {
+	spin_lock_t lock;
+	list_t queue;       /* The head is the next process this core will run. */
+	size_t enqueued;    /* Processes placed in this queue */
+	size_t steals;      /* Processes this core took from another core's queue */
+	size_t migrations;  /* Processes placed here that last ran on a different core */
+} __attribute__((aligned(64)));
+
+static struct runqueue runqueues[PROCESSOR_MAX];
+
+/**
+ * @brief Per-CPU timer heap.
+ *
+ * Timed sleeps and fswait timeouts are armed on the core that
+ * requested them, in a binary min-heap ordered by expiry time, so
+ * arming and cancelling are O(log n). Each core only expires its
+ * own heap from its own timer tick. The earliest expiry is cached
+ * so that a tick with nothing to do takes no locks at all.
+ */
+struct timer_base {
+	spin_lock_t lock;
+	sleeper_t ** heap;
+	size_t length;
+	size_t capacity;
+	volatile uint64_t next_tick;
+	volatile uint64_t next_subtick;
+} __attribute__((aligned(64)));
+
+static struct timer_base timer_bases[PROCESSOR_MAX];
+
+/**
+ * A process stays on the core it last ran on unless that core's queue
+ * is this many entries deeper than the shallowest queue.
+ */
+#define SCHED_IMBALANCE 2
+
+/* The following locks protect access to the process tree,
  * sleeping, and the very special wait queue... */
 static spin_lock_t tree_lock = { 0 };
-static spin_lock_t process_queue_lock = { 0 };
 static spin_lock_t wait_lock_tmp = { 0 };
 static spin_lock_t sleep_lock = { 0 };
 static spin_lock_t reap_lock = { 0 };
@@ -211,6 +255,24 @@ void switch_task(uint8_t reschedule) {
 	switch_next();
 }
 
+static void schedstat_func(fs_node_t * node) {
+	procfs_printf(node, "cpu   depth   enqueued     steals migrations\n");
+	for (int i = 0; i < processor_count; ++i) {
+		procfs_printf(node, "%3d %7zu %10zu %10zu %10zu\n",
+			i,
+			runqueues[i].queue.length,
+			runqueues[i].enqueued,
+			runqueues[i].steals,
+			runqueues[i].migrations);
+	}
+}
+
+static struct procfs_entry schedstat_entry = {
+	0,
+	"schedstat",
+	schedstat_func,
+};
+
 /**
  * @brief Initial scheduler datastructures.
  *
@@ -220,10 +282,19 @@ void switch_task(uint8_t reschedule) {
 void initialize_process_tree(void) {
 	process_tree = tree_create();
 	process_list = list_create("global process list",NULL);
-	process_queue = list_create("global scheduler queue",NULL);
-	sleep_queue = list_create("global timed sleep queue",NULL);
+	sleep_queue = list_create("timed sleep marker",NULL);
 	reap_queue = list_create("processes awaiting later cleanup",NULL);
 
+	for (int i = 0; i < PROCESSOR_MAX; ++i) {
+		spin_init(runqueues[i].lock);
+		runqueues[i].queue.name = "per-CPU scheduler queue";
+		spin_init(timer_bases[i].lock);
+		timer_bases[i].next_tick = UINT64_MAX;
+		timer_bases[i].next_subtick = UINT64_MAX;
+	}
+
+	procfs_install(&schedstat_entry);
+
 	/* TODO: PID bitset? */
 }
 
@@ -333,7 +404,9 @@ void process_release_directory(page_directory_t * dir) {
 	spin_lock(dir->lock);
 	dir->refcount--;
 	if (dir->refcount < 1) {
+		spin_unlock(dir->lock);
 		mmu_free(dir->directory);
+		mmap_release(dir);
 		free(dir);
 	} else {
 		spin_unlock(dir->lock);
@@ -351,6 +424,9 @@ process_t * spawn_kidle(int bsp) {
 		MMU_FLAG_KERNEL);
 
 	/* TODO arch_initialize_context(uintptr_t) ? */
+	idle->timer.process = idle;
+	idle->timer.cpu = -1;
+
 	idle->thread.context.ip = (uintptr_t)&_kidle;
 	idle->thread.context.sp = idle->image.stack;
 	idle->thread.context.bp = idle->image.stack;
@@ -364,6 +440,7 @@ process_t * spawn_kidle(int bsp) {
 	idle->thread.page_directory->refcount = 1;
 	idle->thread.page_directory->directory = mmu_clone(this_core->current_pml);
 	spin_init(idle->thread.page_directory->lock);
+	idle->thread.page_directory->mappings = NULL;
 	return idle;
 }
 
@@ -417,12 +494,14 @@ process_t * spawn_init(void) {
 	init->sleep_node.next = NULL;
 	init->sleep_node.value = init;
 
-	init->timed_sleep_node = NULL;
+	init->timer.process = init;
+	init->timer.cpu = -1;
 
 	init->thread.page_directory = malloc(sizeof(page_directory_t));
 	init->thread.page_directory->refcount = 1;
 	init->thread.page_directory->directory = this_core->current_pml;
 	spin_init(init->thread.page_directory->lock);
+	init->thread.page_directory->mappings = NULL;
 	init->description = strdup("[init]");
 	list_insert(process_list, (void*)init);
 
@@ -499,6 +578,8 @@ process_t * spawn_process(volatile process_t * parent, int flags) {
 
 	proc->sched_node.value = proc;
 	proc->sleep_node.value = proc;
+	proc->timer.process = proc;
+	proc->timer.cpu = -1;
 
 	gettimeofday(&proc->start, NULL);
 	tree_node_t * entry = tree_node_create(proc);
@@ -618,6 +699,156 @@ void process_delete(process_t * proc) {
 	process_reap(proc);
 }
 
+/**
+ * @brief Whether timer @p a expires before timer @p b.
+ */
+static inline int timer_before(sleeper_t * a, sleeper_t * b) {
+	return a->end_tick < b->end_tick || (a->end_tick == b->end_tick && a->end_subtick < b->end_subtick);
+}
+
+static void timer_heap_set(struct timer_base * base, size_t index, sleeper_t * timer) {
+	base->heap[index] = timer;
+	timer->index = index;
+}
+
+static void timer_sift_up(struct timer_base * base, size_t index) {
+	sleeper_t * timer = base->heap[index];
+	while (index > 0) {
+		size_t parent = (index - 1) / 2;
+		if (!timer_before(timer, base->heap[parent])) break;
+		timer_heap_set(base, index, base->heap[parent]);
+		index = parent;
+	}
+	timer_heap_set(base, index, timer);
+}
+
+static void timer_sift_down(struct timer_base * base, size_t index) {
+	sleeper_t * timer = base->heap[index];
+	while (1) {
+		size_t child = index * 2 + 1;
+		if (child >= base->length) break;
+		if (child + 1 < base->length && timer_before(base->heap[child+1], base->heap[child])) child++;
+		if (!timer_before(base->heap[child], timer)) break;
+		timer_heap_set(base, index, base->heap[child]);
+		index = child;
+	}
+	timer_heap_set(base, index, timer);
+}
+
+/**
+ * @brief Refresh the cached earliest expiry of a timer heap.
+ */
+static void timer_update_next(struct timer_base * base) {
+	if (base->length) {
+		base->next_tick = base->heap[0]->end_tick;
+		base->next_subtick = base->heap[0]->end_subtick;
+	} else {
+		base->next_tick = UINT64_MAX;
+		base->next_subtick = UINT64_MAX;
+	}
+}
+
+/**
+ * @brief Remove the timer at @p index from a heap; base lock must be held.
+ */
+static void timer_remove_locked(struct timer_base * base, size_t index) {
+	sleeper_t * timer = base->heap[index];
+	base->length--;
+	if (index != base->length) {
+		timer_heap_set(base, index, base->heap[base->length]);
+		if (index > 0 && timer_before(base->heap[index], base->heap[(index - 1) / 2])) {
+			timer_sift_up(base, index);
+		} else {
+			timer_sift_down(base, index);
+		}
+	}
+	timer->cpu = -1;
+	timer_update_next(base);
+}
+
+/**
+ * @brief Arm a timer on the current core.
+ *
+ * The timer's expiry time must already be set.
+ */
+static void timer_arm(sleeper_t * timer) {
+	struct timer_base * base = &timer_bases[this_core->cpu_id];
+	spin_lock(base->lock);
+	if (base->length == base->capacity) {
+		base->capacity = base->capacity ? base->capacity * 2 : 32;
+		base->heap = realloc(base->heap, sizeof(sleeper_t *) * base->capacity);
+	}
+	timer->cpu = this_core->cpu_id;
+	timer_heap_set(base, base->length++, timer);
+	timer_sift_up(base, timer->index);
+	timer_update_next(base);
+	spin_unlock(base->lock);
+}
+
+/**
+ * @brief Disarm a timer, if it is armed.
+ *
+ * The timer may be in the heap of any core. If it has already
+ * expired and been removed from its heap, this does nothing.
+ */
+static void timer_cancel(sleeper_t * timer) {
+	int cpu = timer->cpu;
+	if (cpu < 0) return;
+	struct timer_base * base = &timer_bases[cpu];
+	spin_lock(base->lock);
+	if (timer->cpu == cpu) {
+		timer_remove_locked(base, timer->index);
+	}
+	spin_unlock(base->lock);
+}
+
+/**
+ * @brief Choose the ready queue a process should be placed in.
+ *
+ * Processes that have run before go back to the core they last ran
+ * on, where their working set is most likely still in cache, unless
+ * that core is noticeably busier than the least-loaded core. Processes
+ * that have never run have no affinity and go to the least-loaded core.
+ */
+static int sched_select_cpu(volatile process_t * proc) {
+	int best = 0;
+	for (int i = 1; i < processor_count; ++i) {
+		if (runqueues[i].queue.length < runqueues[best].queue.length) best = i;
+	}
+
+	if (!proc->time_total || proc->owner < 0 || proc->owner >= processor_count) return best;
+
+	int home = proc->owner;
+	if (runqueues[home].queue.length > runqueues[best].queue.length + SCHED_IMBALANCE) {
+		__sync_fetch_and_add(&runqueues[best].migrations, 1);
+		return best;
+	}
+
+	return home;
+}
+
+/**
+ * @brief Let another core know there is new work for it.
+ *
+ * If the target core is idle, it gets a wakeup IPI. If it is busy,
+ * we instead nudge one idle core (if there is one) so it can steal
+ * the new process rather than waiting for the target to get to it.
+ */
+static void sched_kick(int target) {
+	if (processor_local_data[target].current_process == processor_local_data[target].kernel_idle_task) {
+		if (target != this_core->cpu_id) arch_wakeup_core(target);
+		return;
+	}
+
+	for (int i = 0; i < processor_count; ++i) {
+		if (i == target || i == this_core->cpu_id) continue;
+		if (processor_local_data[i].current_process == processor_local_data[i].kernel_idle_task) {
+			arch_wakeup_core(i);
+			return;
+		}
+	}
+}
+
 /**
  * @brief Place an available process in the ready queue.
  *
@@ -635,11 +866,8 @@ void make_process_ready(volatile process_t * proc) {
 	if (proc->sleep_node.owner != NULL) {
 		if (proc->sleep_node.owner == sleep_queue) {
 			/* The sleep queue is slightly special... */
-			if (proc->timed_sleep_node) {
-				list_delete(sleep_queue, proc->timed_sleep_node);
-				proc->sleep_node.owner = NULL;
-				free(proc->timed_sleep_node->value);
-			}
+			timer_cancel((sleeper_t*)&proc->timer);
+			proc->sleep_node.owner = NULL;
 		} else {
 			/* This was blocked on a semaphore we can interrupt. */
 			__sync_or_and_fetch(&proc->flags, PROC_FLAG_SLEEP_INT);
@@ -648,44 +876,104 @@ void make_process_ready(volatile process_t * proc) {
 	}
 	if (!sleep_lock_is_mine) spin_unlock(sleep_lock);
 
-	spin_lock(process_queue_lock);
-	if (proc->sched_node.owner) {
-		/* There's only one ready queue, so this means the process was already ready, which
-		 * is indicative of a bug somewhere as we shouldn't be added processes to the ready
-		 * queue multiple times. */
-		spin_unlock(process_queue_lock);
+	if (!__sync_bool_compare_and_swap(&proc->sched_queued, 0, 1)) {
+		/* The process was already ready, which is indicative of a bug somewhere
+		 * as we shouldn't be adding processes to the ready queues multiple times. */
 		return;
 	}
 
-	list_append(process_queue, (node_t*)&proc->sched_node);
-	spin_unlock(process_queue_lock);
+	int target = sched_select_cpu(proc);
+	struct runqueue * rq = &runqueues[target];
 
-	arch_wakeup_others();
+	spin_lock(rq->lock);
+	list_append(&rq->queue, (node_t*)&proc->sched_node);
+	rq->enqueued++;
+	spin_unlock(rq->lock);
+
+	/* A process rescheduling itself is about to be picked up by this core. */
+	if (proc != this_core->current_process) {
+		sched_kick(target);
+	}
 }
 
 /**
- * @brief Pop the next available process from the queue.
+ * @brief Claim a process pulled from a ready queue for this core.
+ */
+static volatile process_t * sched_claim(volatile process_t * next) {
+	if (!(next->flags & PROC_FLAG_FINISHED)) {
+		__sync_or_and_fetch(&next->flags, PROC_FLAG_RUNNING);
+	}
+
+	next->owner = this_core->cpu_id;
+
+	return next;
+}
+
+/**
+ * @brief Take a ready process from the busiest other core.
  *
- * Gets the next available process from the round-robin scheduling
- * queue. If there is no process to run, the idle task is returned.
+ * Called when this core's own queue is empty. Processes are taken
+ * from the tail of the victim's queue, leaving the ones it is about
+ * to run (and which are most likely to still be cache-hot there)
+ * alone. Processes whose previous core has not finished switching
+ * away from them yet are skipped.
+ */
+static volatile process_t * sched_steal(void) {
+	int victim = -1;
+	size_t depth = 0;
+
+	for (int i = 0; i < processor_count; ++i) {
+		if (i == this_core->cpu_id) continue;
+		if (runqueues[i].queue.length > depth) {
+			depth = runqueues[i].queue.length;
+			victim = i;
+		}
+	}
+
+	if (victim < 0) return NULL;
+
+	struct runqueue * rq = &runqueues[victim];
+	spin_lock(rq->lock);
+	foreachr(node, &rq->queue) {
+		volatile process_t * candidate = node->value;
+		if (candidate->flags & PROC_FLAG_RUNNING) continue;
+		list_delete(&rq->queue, node);
+		candidate->sched_queued = 0;
+		spin_unlock(rq->lock);
+		__sync_fetch_and_add(&runqueues[this_core->cpu_id].steals, 1);
+		return candidate;
+	}
+	spin_unlock(rq->lock);
+
+	return NULL;
+}
+
+/**
+ * @brief Pop the next available process from the queue.
  *
- * TODO This needs more locking for SMP...
+ * Gets the next available process from this core's round-robin
+ * scheduling queue. If that queue is empty, we try to steal work
+ * from another core. If there is still nothing to run, the idle
+ * task is returned.
  */
 volatile process_t * next_ready_process(void) {
-	spin_lock(process_queue_lock);
+	struct runqueue * rq = &runqueues[this_core->cpu_id];
+	spin_lock(rq->lock);
 
-	if (!process_queue->head) {
-		if (process_queue->length) {
+	if (!rq->queue.head) {
+		if (rq->queue.length) {
 			arch_fatal_prepare();
 			printf("Queue has a length but head is NULL\n");
 			arch_dump_traceback();
 			arch_fatal();
 		}
-		spin_unlock(process_queue_lock);
+		spin_unlock(rq->lock);
+		volatile process_t * stolen = sched_steal();
+		if (stolen) return sched_claim(stolen);
 		return this_core->kernel_idle_task;
 	}
 
-	node_t * np = list_dequeue(process_queue);
+	node_t * np = list_dequeue(&rq->queue);
 
 	if ((uintptr_t)np < 0xFFFFff0000000000UL || (uintptr_t)np > 0xFFFFfff000000000UL) {
 		arch_fatal_prepare();
@@ -698,20 +986,29 @@ volatile process_t * next_ready_process(void) {
 	if ((next->flags & PROC_FLAG_RUNNING) && (next->owner != this_core->cpu_id)) {
 		/* We pulled a process too soon, switch to idle for a bit so the
 		 * core that marked this process as ready can finish switching away from it. */
-		list_append(process_queue, (node_t*)&next->sched_node);
-		spin_unlock(process_queue_lock);
+		list_append(&rq->queue, (node_t*)&next->sched_node);
+		spin_unlock(rq->lock);
 		return this_core->kernel_idle_task;
 	}
 
-	spin_unlock(process_queue_lock);
+	next->sched_queued = 0;
+	spin_unlock(rq->lock);
 
-	if (!(next->flags & PROC_FLAG_FINISHED)) {
-		__sync_or_and_fetch(&next->flags, PROC_FLAG_RUNNING);
-	}
-
-	next->owner = this_core->cpu_id;
+	return sched_claim(next);
+}
 
-	return next;
+/**
+ * @brief Determine if this core has anything to switch to.
+ *
+ * Used by interrupt handlers running on top of the idle task
+ * to decide whether to switch away immediately. This is a racy
+ * peek at queue depths and may be wrong in either direction.
+ */
+int process_ready_available(void) {
+	for (int i = 0; i < processor_count; ++i) {
+		if (runqueues[i].queue.head) return 1;
+	}
+	return 0;
 }
 
 /**
@@ -842,31 +1139,33 @@ int process_alert_node_locked(process_t * process, void * value);
  * as timed out before the process is rescheduled.
  */
 void wakeup_sleepers(unsigned long seconds, unsigned long subseconds) {
+	struct timer_base * base = &timer_bases[this_core->cpu_id];
+
+	/* Nothing has expired on this core; don't bother with any locks. */
+	if (base->next_tick > seconds || (base->next_tick == seconds && base->next_subtick > subseconds)) return;
+
 	spin_lock(sleep_lock);
-	if (sleep_queue->length) {
-		sleeper_t * proc = ((sleeper_t *)sleep_queue->head->value);
-		while (proc && (proc->end_tick < seconds || (proc->end_tick == seconds && proc->end_subtick <= subseconds))) {
-
-			if (proc->is_fswait) {
-				proc->is_fswait = -1;
-				process_alert_node_locked(proc->process,proc);
-			} else {
-				process_t * process = proc->process;
-				process->sleep_node.owner = NULL;
-				process->timed_sleep_node = NULL;
-				if (!process_is_ready(process)) {
-					make_process_ready(process);
-				}
-			}
-			free(proc);
-			free(list_dequeue(sleep_queue));
-			if (sleep_queue->length) {
-				proc = ((sleeper_t *)sleep_queue->head->value);
-			} else {
-				break;
+	spin_lock(base->lock);
+	while (base->length) {
+		sleeper_t * proc = base->heap[0];
+		if (proc->end_tick > seconds || (proc->end_tick == seconds && proc->end_subtick > subseconds)) break;
+		timer_remove_locked(base, 0);
+		spin_unlock(base->lock);
+
+		if (proc->is_fswait) {
+			proc->is_fswait = -1;
+			process_alert_node_locked(proc->process,proc);
+		} else {
+			process_t * process = proc->process;
+			process->sleep_node.owner = NULL;
+			if (!process_is_ready(process)) {
+				make_process_ready(process);
 			}
 		}
+
+		spin_lock(base->lock);
 	}
+	spin_unlock(base->lock);
 	spin_unlock(sleep_lock);
 }
 
@@ -886,24 +1185,10 @@ void sleep_until(process_t * process, unsigned long seconds, unsigned long subse
 	}
 	process->sleep_node.owner = sleep_queue;
 
-	node_t * before = NULL;
-	foreach(node, sleep_queue) {
-		sleeper_t * candidate = ((sleeper_t *)node->value);
-		if (!candidate) {
-			printf("null candidate?\n");
-			continue;
-		}
-		if (candidate->end_tick > seconds || (candidate->end_tick == seconds && candidate->end_subtick > subseconds)) {
-			break;
-		}
-		before = node;
-	}
-	sleeper_t * proc = malloc(sizeof(sleeper_t));
-	proc->process     = process;
-	proc->end_tick    = seconds;
-	proc->end_subtick = subseconds;
-	proc->is_fswait = 0;
-	process->timed_sleep_node = list_insert_after(sleep_queue, before, proc);
+	process->timer.end_tick    = seconds;
+	process->timer.end_subtick = subseconds;
+	process->timer.is_fswait   = 0;
+	timer_arm(&process->timer);
 	spin_unlock(sleep_lock);
 }
 
@@ -1060,21 +1345,11 @@ int process_timeout_sleep(process_t * process, int timeout) {
 	unsigned long s, ss;
 	relative_time(0, timeout * 1000, &s, &ss);
 
-	node_t * before = NULL;
-	foreach(node, sleep_queue) {
-		sleeper_t * candidate = ((sleeper_t *)node->value);
-		if (candidate->end_tick > s || (candidate->end_tick == s && candidate->end_subtick > ss)) {
-			break;
-		}
-		before = node;
-	}
-	sleeper_t * proc = malloc(sizeof(sleeper_t));
-	proc->process     = process;
-	proc->end_tick    = s;
-	proc->end_subtick = ss;
-	proc->is_fswait = 1;
-	list_insert(((process_t *)process)->node_waits, proc);
-	process->timeout_node = list_insert_after(sleep_queue, before, proc);
+	process->timer.end_tick    = s;
+	process->timer.end_subtick = ss;
+	process->timer.is_fswait   = 1;
+	list_insert(((process_t *)process)->node_waits, &process->timer);
+	timer_arm(&process->timer);
 
 	return 0;
 }
@@ -1116,8 +1391,6 @@ int process_wait_nodes(process_t * process,fs_node_t * nodes[], int timeout) {
 
 	if (timeout > 0) {
 		process_timeout_sleep(process, timeout);
-	} else {
-		process->timeout_node = NULL;
 	}
 
 	process->awoken_index = -1;
@@ -1138,15 +1411,10 @@ int process_awaken_from_fswait(process_t * process, int index) {
 	free(process->node_waits);
 	process->node_waits = NULL;
 
-	if (process->timeout_node && process->timeout_node->owner == sleep_queue) {
-		sleeper_t * proc = process->timeout_node->value;
-		if (proc->is_fswait != -1) {
-			list_delete(sleep_queue, process->timeout_node);
-			free(process->timeout_node->value);
-			free(process->timeout_node);
-		}
+	if (process->timer.is_fswait == 1) {
+		timer_cancel(&process->timer);
 	}
-	process->timeout_node = NULL;
+	process->timer.is_fswait = 0;
 
 	make_process_ready(process);
 	spin_unlock(process->sched_lock);
@@ -1302,6 +1570,7 @@ pid_t fork(void) {
 	new_proc->thread.page_directory->refcount = 1;
 	new_proc->thread.page_directory->directory = directory;
 	spin_init(new_proc->thread.page_directory->lock);
+	mmap_clone(parent->thread.page_directory, new_proc->thread.page_directory);
 
 	memcpy(new_proc->signals, parent->signals, sizeof(struct signal_config) * (NUMSIGNALS+1));
 	new_proc->blocked_signals = parent->blocked_signals;
@@ -1412,6 +1681,7 @@ process_t * spawn_worker_thread(void (*entrypoint)(void * argp), const char * na
 	proc->thread.page_directory->refcount = 1;
 	proc->thread.page_directory->directory = mmu_clone(mmu_get_kernel_directory());
 	spin_init(proc->thread.page_directory->lock);
+	proc->thread.page_directory->mappings = NULL;
 
 	proc->image.stack       = (uintptr_t)valloc(KERNEL_STACK_SIZE) + KERNEL_STACK_SIZE;
 	PUSH(proc->image.stack, uintptr_t, (uintptr_t)entrypoint);
@@ -1427,6 +1697,8 @@ process_t * spawn_worker_thread(void (*entrypoint)(void * argp), const char * na
 
 	proc->sched_node.value = proc;
 	proc->sleep_node.value = proc;
+	proc->timer.process = proc;
+	proc->timer.cpu = -1;
 
 	gettimeofday(&proc->start, NULL);
 	tree_node_t * entry = tree_node_create(proc);
@@ -34,6 +34,7 @@
 #include <kernel/ptrace.h>
 #include <kernel/args.h>
 #include <kernel/mmu.h>
+#include <kernel/mmap.h>
 
 #if defined(__x86_64__)
 #include <kernel/arch/x86_64/regs.h>
@@ -314,6 +315,9 @@ long ptrace_peek(pid_t pid, void * addr, void * data) {
 	process_t * tracee = process_from_pid(pid);
 	if (!tracee || (tracee->tracer != this_core->current_process->id) || !(tracee->flags & PROC_FLAG_SUSPENDED)) return -ESRCH;
 
+	/* Bring in the page if it's part of a mapping the tracee hasn't touched yet. */
+	mmap_populate(tracee->thread.page_directory, (uintptr_t)addr, 0);
+
 	union PML * page_entry = mmu_get_page_other(tracee->thread.page_directory->directory, (uintptr_t)addr);
 
 	if (!page_entry) return -EFAULT;
@@ -354,6 +358,9 @@ long ptrace_poke(pid_t pid, void * addr, void * data) {
 	process_t * tracee = process_from_pid(pid);
 	if (!tracee || (tracee->tracer != this_core->current_process->id) || !(tracee->flags & PROC_FLAG_SUSPENDED)) return -ESRCH;
 
+	/* Bring in the page if it's part of a mapping the tracee hasn't touched yet. */
+	mmap_populate(tracee->thread.page_directory, (uintptr_t)addr, 0);
+
 	union PML * page_entry = mmu_get_page_other(tracee->thread.page_directory->directory, (uintptr_t)addr);
 
 	if (!page_entry) return -EFAULT;
@@ -23,6 +23,7 @@
 #include <kernel/version.h>
 #include <kernel/pipe.h>
 #include <kernel/shm.h>
+#include <kernel/mmap.h>
 #include <kernel/mmu.h>
 #include <kernel/pty.h>
 #include <kernel/spinlock.h>
@@ -149,9 +150,8 @@ long sys_sysfunc(long fn, char ** args) {
 		}
 
 		case TOARU_SYS_FUNC_MMAP: {
-			/* FIXME: This whole thing should be removed; we need a proper mmap interface,
-			 *        preferrably with all of the file mapping options, too. And it should
-			 *        probably also interact with the SHM subsystem... */
+			/* Legacy interface: eagerly maps writable memory at a fixed address.
+			 * New code should use mmap(), which is demand-paged and can map files. */
 			PTR_VALIDATE(args);
 			if (!args) return -EFAULT;
 			volatile process_t * volatile proc = this_core->current_process;
@@ -165,6 +165,15 @@ long sys_sysfunc(long fn, char ** args) {
 			if (!PTR_INRANGE(end)) return -EFAULT;
 			for (uintptr_t i = start; i < end; i += 0x1000) {
 				union PML * page = mmu_get_page(i, MMU_GET_MAKE);
+				if (page->bits.present && page->bits.shared) {
+					/* The zero page or a shared mapping; writing through it would change it for everyone. */
+					uintptr_t frame = mmu_allocate_a_frame();
+					memcpy(mmu_map_from_physical(frame << 12), mmu_map_from_physical((uintptr_t)page->bits.page << 12), 0x1000);
+					page->raw = 0;
+					mmu_frame_map_address(page, MMU_FLAG_WRITABLE, frame << 12);
+					mmu_invalidate(i);
+					continue;
+				}
 				mmu_frame_allocate(page, MMU_FLAG_WRITABLE);
 			}
 			spin_unlock(proc->image.lock);
@@ -508,6 +517,37 @@ long sys_readdir(int fd, long index, struct dirent * entry) {
 	return -EBADF;
 }
 
+/**
+ * @brief Read as many directory entries as fit in @p buffer.
+ *
+ * The file offset of a directory counts entries, so each call picks
+ * up where the last one left off and seeking to 0 starts over.
+ *
+ * @returns Bytes written to @p buffer, 0 at the end of the directory.
+ */
+long sys_getdents(int fd, struct dirent * buffer, size_t size) {
+	if (FD_CHECK(fd)) {
+		PTRCHECK(buffer,size,MMU_PTR_NULL|MMU_PTR_WRITE);
+		if (!buffer) return -EFAULT;
+		fs_node_t * node = FD_ENTRY(fd);
+		if (!(node->flags & FS_DIRECTORY)) return -ENOTDIR;
+		size_t count = size / sizeof(struct dirent);
+		if (!count) return -EINVAL;
+
+		size_t n = 0;
+		while (n < count) {
+			struct dirent * kentry = readdir_fs(node, FD_OFFSET(fd));
+			if (!kentry) break;
+			memcpy(&buffer[n], kentry, sizeof(struct dirent));
+			free(kentry);
+			FD_OFFSET(fd)++;
+			n++;
+		}
+		return n * sizeof(struct dirent);
+	}
+	return -EBADF;
+}
+
 long sys_mkdir(char * path, uint64_t mode) {
 	PTR_VALIDATE(path);
 	if (!path) return -EFAULT;
@@ -1191,6 +1231,7 @@ long sys_times(struct tms *buf) {
 }
 
 extern long ptrace_handle(long,pid_t,void*,void*);
+extern long sys_futex(int * addr, int op, int val);
 
 typedef long (*scall_func)(long,long,long,long,long);
 
@@ -1265,6 +1306,11 @@ static scall_func syscalls[] = {
 	[SYS_SIGWAIT]      = (scall_func)(uintptr_t)sys_sigwait,
 	[SYS_PREAD]        = (scall_func)(uintptr_t)sys_pread,
 	[SYS_PWRITE]       = (scall_func)(uintptr_t)sys_pwrite,
+	[SYS_FUTEX]        = (scall_func)(uintptr_t)sys_futex,
+	[SYS_MMAP]         = (scall_func)(uintptr_t)sys_mmap,
+	[SYS_MUNMAP]       = (scall_func)(uintptr_t)sys_munmap,
+	[SYS_MPROTECT]     = (scall_func)(uintptr_t)sys_mprotect,
+	[SYS_GETDENTS]     = (scall_func)(uintptr_t)sys_getdents,
 
 	[SYS_SOCKET]       = (scall_func)(uintptr_t)net_socket,
 	[SYS_SETSOCKOPT]   = (scall_func)(uintptr_t)net_setsockopt,
@@ -0,0 +1,588 @@
+/**
+ * @file  kernel/vfs/bcache.c
+ * @brief Block cache for disk-backed devices.
+ *
+ * Block device drivers describe how to move runs of 4KiB blocks to
+ * and from their hardware with a @ref bcache_device and send their
+ * read, write and ioctl calls through here. Blocks from every device
+ * share one pool of buffers, found through a hash on (device, block)
+ * and recycled with the CLOCK algorithm. Writes only dirty the cached
+ * block; dirty blocks reach the device when they are evicted, when too
+ * much of the pool is dirty, or on IOCTLSYNC, together with any dirty
+ * blocks next to them on the device.
+ *
+ * A buffer that is being transferred to or from its device is marked
+ * busy, and anyone else who wants it sleeps until the transfer is
+ * done, so the cache lock is never held across I/O.
+ *
+ * Blocks that miss are read from the device in runs: a read of many
+ * blocks claims buffers for every missing block it covers and asks the
+ * driver for each contiguous span at once. Filesystems can also ask
+ * for blocks they expect to need soon with IOCTL_BLOCK_READAHEAD; those
+ * are read the same way by a worker thread, so the caller doesn't wait.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2023 K. Lange
+ */
+#include <errno.h>
+#include <kernel/types.h>
+#include <kernel/string.h>
+#include <kernel/printf.h>
+#include <kernel/spinlock.h>
+#include <kernel/process.h>
+#include <kernel/list.h>
+#include <kernel/mmu.h>
+#include <kernel/vfs.h>
+#include <kernel/bcache.h>
+#include <sys/ioctl.h>
+
+#define BCACHE_COUNT     4096
+#define BCACHE_BUCKETS   2048
+#define BCACHE_DIRTY_MAX (BCACHE_COUNT / 4)
+#define BCACHE_RUN_MAX   64 /* Longest run of blocks read with one request */
+#define BCACHE_RA_QUEUE  32
+
+#define BCACHE_DIRTY 0x01
+#define BCACHE_BUSY  0x02 /* Being read or written; sleep on bcache_waiters */
+#define BCACHE_REF   0x04 /* Used since the clock hand last passed */
+#define BCACHE_FRESH 0x08 /* Read on demand; the lookup that asked for it isn't a hit */
+#define BCACHE_STUCK 0x10 /* Dirty, and the device refused it; not evicted until a writeback succeeds */
+
+struct bcache_entry {
+	struct bcache_device * dev; /* NULL if unused */
+	uint64_t block;
+	struct bcache_entry * next; /* Hash chain */
+	uint8_t * data;
+	unsigned int flags;
+};
+
+static spin_lock_t bcache_lock = { 0 };
+static list_t * bcache_waiters = NULL;
+static struct bcache_entry * entries = NULL;
+static struct bcache_entry * buckets[BCACHE_BUCKETS];
+static size_t clock_hand = 0;
+static size_t dirty_count = 0;
+
+static struct bcache_readahead_req {
+	struct bcache_device * dev;
+	uint64_t block;
+	size_t count;
+} ra_queue[BCACHE_RA_QUEUE];
+static unsigned int ra_head = 0, ra_tail = 0;
+static spin_lock_t ra_lock = { 0 };
+static list_t * ra_waiters = NULL;
+
+static unsigned int bcache_hash(struct bcache_device * dev, uint64_t block) {
+	uint64_t key = (block ^ ((uintptr_t)dev >> 4)) * 0x9E3779B97F4A7C15UL;
+	return (key >> 32) % BCACHE_BUCKETS;
+}
+
+static struct bcache_entry * bcache_find(struct bcache_device * dev, uint64_t block) {
+	for (struct bcache_entry * e = buckets[bcache_hash(dev, block)]; e; e = e->next) {
+		if (e->dev == dev && e->block == block) return e;
+	}
+	return NULL;
+}
+
+static void bcache_hash_insert(struct bcache_entry * e) {
+	struct bcache_entry ** bucket = &buckets[bcache_hash(e->dev, e->block)];
+	e->next = *bucket;
+	*bucket = e;
+}
+
+static void bcache_hash_remove(struct bcache_entry * e) {
+	struct bcache_entry ** link = &buckets[bcache_hash(e->dev, e->block)];
+	while (*link != e) link = &(*link)->next;
+	*link = e->next;
+	e->next = NULL;
+}
+
+/**
+ * @brief Sleep until some busy buffer finishes its transfer.
+ *
+ * Called and returns with @c bcache_lock held.
+ */
+static void bcache_wait(void) {
+	sleep_on_unlocking(bcache_waiters, &bcache_lock);
+	spin_lock(bcache_lock);
+}
+
+static void bcache_clean(struct bcache_entry * e) {
+	e->flags &= ~(BCACHE_DIRTY | BCACHE_STUCK);
+	e->dev->stats.dirty--;
+	dirty_count--;
+}
+
+static int bcache_writable(struct bcache_entry * e) {
+	return e && (e->flags & (BCACHE_DIRTY | BCACHE_BUSY)) == BCACHE_DIRTY;
+}
+
+/**
+ * @brief Write a dirty buffer to its device.
+ *
+ * Dirty blocks directly before and after it on the device go along in
+ * the same request, up to BCACHE_RUN_MAX blocks in all. Drops
+ * @c bcache_lock during the transfer; callers must look up anything
+ * they care about again afterwards.
+ */
+static int bcache_writeback(struct bcache_entry * e) {
+	struct bcache_device * dev = e->dev;
+	struct bcache_entry * run[BCACHE_RUN_MAX];
+
+	uint64_t first = e->block;
+	while (first > 0 && e->block - first < BCACHE_RUN_MAX / 2 && bcache_writable(bcache_find(dev, first - 1))) {
+		first--;
+	}
+
+	size_t n = 0;
+	while (n < BCACHE_RUN_MAX) {
+		struct bcache_entry * next = (first + n == e->block) ? e : bcache_find(dev, first + n);
+		if (!bcache_writable(next)) break;
+		next->flags |= BCACHE_BUSY;
+		run[n++] = next;
+	}
+	spin_unlock(bcache_lock);
+
+	int status;
+	if (n == 1) {
+		status = dev->write_blocks(dev, e->block, 1, e->data);
+	} else {
+		/* Gather the run so the driver can write it with one command. */
+		uint8_t * buf = malloc(n * BCACHE_BLOCK_SIZE);
+		for (size_t i = 0; i < n; ++i) {
+			memcpy(buf + i * BCACHE_BLOCK_SIZE, run[i]->data, BCACHE_BLOCK_SIZE);
+		}
+		status = dev->write_blocks(dev, first, n, buf);
+		free(buf);
+	}
+
+	spin_lock(bcache_lock);
+	for (size_t i = 0; i < n; ++i) {
+		run[i]->flags &= ~BCACHE_BUSY;
+		if (!status) {
+			bcache_clean(run[i]);
+			dev->stats.writebacks++;
+		}
+	}
+	wakeup_queue(bcache_waiters);
+	return status;
+}
+
+/**
+ * @brief Advance the clock hand to a buffer that can be reused.
+ *
+ * @param busy Set if any buffer was skipped for being busy, ie. if
+ *             waiting could make one available.
+ * @returns a buffer that is neither busy nor stuck, or NULL if there are none.
+ */
+static struct bcache_entry * bcache_victim(int * busy) {
+	*busy = 0;
+	for (size_t scanned = 0; scanned < BCACHE_COUNT * 2; ++scanned) {
+		struct bcache_entry * e = &entries[clock_hand];
+		clock_hand = (clock_hand + 1) % BCACHE_COUNT;
+		if (e->flags & BCACHE_BUSY) {
+			*busy = 1;
+			continue;
+		}
+		if (e->flags & BCACHE_STUCK) continue;
+		if (e->flags & BCACHE_REF) {
+			e->flags &= ~BCACHE_REF;
+			continue;
+		}
+		return e;
+	}
+	return NULL;
+}
+
+/**
+ * @brief Write back a dirty buffer so it can be evicted.
+ *
+ * If the device refuses the write the buffer stays dirty, and is left
+ * alone by eviction until a later writeback gets it to the device.
+ */
+static void bcache_evict_dirty(struct bcache_entry * e) {
+	e->dev->stats.evictions++;
+	if (bcache_writeback(e)) {
+		dprintf("bcache: %s: write to block %lu failed, keeping it\n", e->dev->name, e->block);
+		if (e->flags & BCACHE_DIRTY) e->flags |= BCACHE_STUCK;
+	}
+}
+
+/**
+ * @brief Find a block in the cache, loading it if needed.
+ *
+ * @param fill Read the block from the device on a miss; callers that
+ *             are about to overwrite all of it pass 0.
+ * @returns the buffer with @c bcache_lock held, or NULL with it released
+ *          if the device could not be read.
+ */
+static struct bcache_entry * bcache_get(struct bcache_device * dev, uint64_t block, int fill) {
+	spin_lock(bcache_lock);
+
+	while (1) {
+		struct bcache_entry * e = bcache_find(dev, block);
+		if (e) {
+			if (e->flags & BCACHE_BUSY) {
+				bcache_wait();
+				continue;
+			}
+			if (e->flags & BCACHE_FRESH) {
+				/* bcache_fill already counted this one as a miss */
+				e->flags &= ~BCACHE_FRESH;
+			} else {
+				dev->stats.hits++;
+			}
+			e->flags |= BCACHE_REF;
+			return e;
+		}
+
+		int busy;
+		e = bcache_victim(&busy);
+		if (!e) {
+			if (!busy) {
+				/* Every buffer is holding a write its device won't take */
+				spin_unlock(bcache_lock);
+				return NULL;
+			}
+			bcache_wait();
+			continue;
+		}
+
+		if (e->flags & BCACHE_DIRTY) {
+			bcache_evict_dirty(e);
+			/* The lock was dropped; someone may have loaded our block meanwhile. */
+			continue;
+		}
+
+		if (e->dev) {
+			bcache_hash_remove(e);
+			e->dev->stats.cached--;
+		}
+
+		e->dev = dev;
+		e->block = block;
+		e->flags = BCACHE_BUSY;
+		bcache_hash_insert(e);
+		dev->stats.cached++;
+
+		if (fill) {
+			dev->stats.misses++;
+			spin_unlock(bcache_lock);
+			int status = dev->read_blocks(dev, block, 1, e->data);
+			spin_lock(bcache_lock);
+			if (status) {
+				bcache_hash_remove(e);
+				dev->stats.cached--;
+				e->dev = NULL;
+				e->flags = 0;
+				wakeup_queue(bcache_waiters);
+				spin_unlock(bcache_lock);
+				return NULL;
+			}
+		}
+
+		e->flags = BCACHE_REF;
+		wakeup_queue(bcache_waiters);
+		return e;
+	}
+}
+
+/**
+ * @brief Make sure a range of blocks is cached.
+ *
+ * Claims a buffer for each block that isn't cached and reads every
+ * contiguous span of them with a single request to the driver.
+ *
+ * @param demand The blocks are about to be used; read-ahead leaves them
+ *               unreferenced so CLOCK can reclaim them first if they never are.
+ */
+static void bcache_fill(struct bcache_device * dev, uint64_t block, size_t count, int demand) {
+	struct bcache_entry * claimed[BCACHE_RUN_MAX];
+
+	if (block >= (dev->size + BCACHE_BLOCK_SIZE - 1) / BCACHE_BLOCK_SIZE) return;
+	if (count > (dev->size + BCACHE_BLOCK_SIZE - 1) / BCACHE_BLOCK_SIZE - block) {
+		count = (dev->size + BCACHE_BLOCK_SIZE - 1) / BCACHE_BLOCK_SIZE - block;
+	}
+
+	spin_lock(bcache_lock);
+	while (count) {
+		/* Skip anything that is already here or on its way. */
+		if (bcache_find(dev, block)) {
+			block++;
+			count--;
+			continue;
+		}
+
+		size_t n = 0;
+		int stalled = 0;
+		int busy = 0;
+		while (n < count && n < BCACHE_RUN_MAX && (n == 0 || !bcache_find(dev, block + n))) {
+			struct bcache_entry * e = bcache_victim(&busy);
+			if (!e) {
+				stalled = 1;
+				break;
+			}
+			if (e->flags & BCACHE_DIRTY) {
+				if (n) break;
+				/* Need room before we can claim anything. */
+				bcache_evict_dirty(e);
+				break;
+			}
+			if (e->dev) {
+				bcache_hash_remove(e);
+				e->dev->stats.cached--;
+			}
+			e->dev = dev;
+			e->block = block + n;
+			e->flags = BCACHE_BUSY;
+			bcache_hash_insert(e);
+			dev->stats.cached++;
+			claimed[n++] = e;
+		}
+
+		if (!n) {
+			/* Either everything is busy or we just made room; look again. */
+			if (stalled) {
+				/* Nothing will come free; leave it to bcache_get to report */
+				if (!busy) break;
+				bcache_wait();
+			}
+			continue;
+		}
+
+		if (demand) {
+			dev->stats.misses += n;
+		} else {
+			dev->stats.readahead += n;
+		}
+		spin_unlock(bcache_lock);
+
+		int status;
+		uint8_t * buf = NULL;
+		if (n == 1) {
+			status = dev->read_blocks(dev, block, 1, claimed[0]->data);
+		} else {
+			buf = malloc(n * BCACHE_BLOCK_SIZE);
+			status = dev->read_blocks(dev, block, n, buf);
+		}
+
+		spin_lock(bcache_lock);
+		for (size_t i = 0; i < n; ++i) {
+			struct bcache_entry * e = claimed[i];
+			if (status) {
+				bcache_hash_remove(e);
+				dev->stats.cached--;
+				e->dev = NULL;
+				e->flags = 0;
+			} else {
+				if (buf) memcpy(e->data, buf + i * BCACHE_BLOCK_SIZE, BCACHE_BLOCK_SIZE);
+				e->flags = demand ? (BCACHE_REF | BCACHE_FRESH) : 0;
+			}
+		}
+		wakeup_queue(bcache_waiters);
+		if (buf) {
+			spin_unlock(bcache_lock);
+			free(buf);
+			spin_lock(bcache_lock);
+		}
+
+		/* A failed read is reported when the caller asks for the block itself. */
+		if (status) break;
+		block += n;
+		count -= n;
+	}
+	spin_unlock(bcache_lock);
+}
+
+static void bcache_readahead_thread(void * argp) {
+	while (1) {
+		spin_lock(ra_lock);
+		while (ra_head == ra_tail) {
+			sleep_on_unlocking(ra_waiters, &ra_lock);
+			spin_lock(ra_lock);
+		}
+		struct bcache_readahead_req req = ra_queue[ra_tail % BCACHE_RA_QUEUE];
+		ra_tail++;
+		spin_unlock(ra_lock);
+
+		while (req.count) {
+			size_t n = req.count < BCACHE_RUN_MAX ? req.count : BCACHE_RUN_MAX;
+			bcache_fill(req.dev, req.block, n, 0);
+			req.block += n;
+			req.count -= n;
+		}
+	}
+}
+
+/**
+ * @brief Queue blocks to be read in the background.
+ *
+ * Requests are dropped if the queue is full; read-ahead is only a hint.
+ */
+static void bcache_readahead(struct bcache_device * dev, off_t offset, size_t size) {
+	if (offset < 0 || !size) return;
+	uint64_t first = offset / BCACHE_BLOCK_SIZE;
+	uint64_t last  = (offset + size - 1) / BCACHE_BLOCK_SIZE;
+
+	spin_lock(ra_lock);
+	if (ra_head - ra_tail < BCACHE_RA_QUEUE) {
+		struct bcache_readahead_req * req = &ra_queue[ra_head % BCACHE_RA_QUEUE];
+		req->dev   = dev;
+		req->block = first;
+		req->count = last - first + 1;
+		ra_head++;
+		wakeup_queue(ra_waiters);
+	}
+	spin_unlock(ra_lock);
+}
+
+/**
+ * @brief Write back every dirty block belonging to @p dev.
+ */
+static int bcache_writeback_all(struct bcache_device * dev) {
+	int status = 0;
+	spin_lock(bcache_lock);
+	for (size_t i = 0; i < BCACHE_COUNT; ++i) {
+		struct bcache_entry * e = &entries[i];
+		while (e->dev == dev && (e->flags & BCACHE_BUSY)) bcache_wait();
+		if (e->dev == dev && (e->flags & BCACHE_DIRTY)) {
+			if (bcache_writeback(e)) status = -EIO;
+		}
+	}
+	spin_unlock(bcache_lock);
+	return status;
+}
+
+/**
+ * @brief Make a device's blocks available through the cache.
+ *
+ * The shared pool is set up the first time a device is registered.
+ */
+void bcache_register(struct bcache_device * dev) {
+	if (!entries) {
+		bcache_waiters = list_create("block cache waiters", NULL);
+		ra_waiters = list_create("block cache read-ahead", NULL);
+		entries = malloc(sizeof(struct bcache_entry) * BCACHE_COUNT);
+		memset(entries, 0, sizeof(struct bcache_entry) * BCACHE_COUNT);
+		uint8_t * blocks = mmu_map_module(BCACHE_COUNT * BCACHE_BLOCK_SIZE);
+		for (size_t i = 0; i < BCACHE_COUNT; ++i) {
+			entries[i].data = blocks + i * BCACHE_BLOCK_SIZE;
+		}
+		spawn_worker_thread(bcache_readahead_thread, "[bcache]", NULL);
+	}
+	memset(&dev->stats, 0, sizeof(dev->stats));
+}
+
+ssize_t bcache_read(struct bcache_device * dev, off_t offset, size_t size, uint8_t * buffer) {
+	if (offset < 0 || (uint64_t)offset >= dev->size) return 0;
+	if (offset + size > dev->size) size = dev->size - offset;
+
+	size_t done = 0;
+	uint64_t filled = 0;
+	while (done < size) {
+		uint64_t block = (offset + done) / BCACHE_BLOCK_SIZE;
+		size_t skip = (offset + done) % BCACHE_BLOCK_SIZE;
+		size_t len = BCACHE_BLOCK_SIZE - skip;
+		if (len > size - done) len = size - done;
+
+		if (block >= filled) {
+			/* Bring in the next stretch of the request with as few device requests as possible */
+			uint64_t last = (offset + size - 1) / BCACHE_BLOCK_SIZE;
+			size_t count = last - block + 1;
+			if (count > BCACHE_RUN_MAX) count = BCACHE_RUN_MAX;
+			if (count > 1) bcache_fill(dev, block, count, 1);
+			filled = block + count;
+		}
+
+		struct bcache_entry * e = bcache_get(dev, block, 1);
+		if (!e) return done ? (ssize_t)done : -EIO;
+		memcpy(buffer + done, e->data + skip, len);
+		spin_unlock(bcache_lock);
+
+		done += len;
+	}
+
+	return done;
+}
+
+ssize_t bcache_write(struct bcache_device * dev, off_t offset, size_t size, uint8_t * buffer) {
+	if (!dev->write_blocks) return -EROFS;
+	if (offset < 0 || (uint64_t)offset >= dev->size) return 0;
+	if (offset + size > dev->size) size = dev->size - offset;
+
+	size_t done = 0;
+	while (done < size) {
+		uint64_t block = (offset + done) / BCACHE_BLOCK_SIZE;
+		size_t skip = (offset + done) % BCACHE_BLOCK_SIZE;
+		size_t len = BCACHE_BLOCK_SIZE - skip;
+		if (len > size - done) len = size - done;
+
+		struct bcache_entry * e = bcache_get(dev, block, len != BCACHE_BLOCK_SIZE);
+		if (!e) return done ? (ssize_t)done : -EIO;
+		memcpy(e->data + skip, buffer + done, len);
+		if (!(e->flags & BCACHE_DIRTY)) {
+			e->flags |= BCACHE_DIRTY;
+			dev->stats.dirty++;
+			dirty_count++;
+		}
+		dev->stats.writes++;
+		spin_unlock(bcache_lock);
+
+		done += len;
+	}
+
+	if (dirty_count > BCACHE_DIRTY_MAX) {
+		bcache_writeback_all(dev);
+	}
+
+	return done;
+}
+
+/**
+ * @brief Write back a device's dirty blocks and flush the device.
+ */
+int bcache_sync(struct bcache_device * dev) {
+	if (!dev->write_blocks) return 0;
+	int status = bcache_writeback_all(dev);
+	if (!status && dev->flush) status = dev->flush(dev);
+	return status;
+}
+
+int bcache_ioctl(struct bcache_device * dev, unsigned long request, void * argp) {
+	switch (request) {
+		case IOCTLSYNC:
+			return bcache_sync(dev);
+
+		case IOCTL_BLOCK_STATS: {
+			struct block_dev_stats stats;
+			spin_lock(bcache_lock);
+			memcpy(&stats, &dev->stats, sizeof(stats));
+			spin_unlock(bcache_lock);
+			memcpy(argp, &stats, sizeof(stats));
+			return 0;
+		}
+
+		case IOCTL_BLOCK_READAHEAD: {
+			struct block_readahead * req = argp;
+			bcache_readahead(dev, req->offset, req->length);
+			return 0;
+		}
+
+		default:
+			return -EINVAL;
+	}
+}
+
+ssize_t bcache_node_read(fs_node_t * node, off_t offset, size_t size, uint8_t * buffer) {
+	return bcache_read(node->device, offset, size, buffer);
+}
+
+ssize_t bcache_node_write(fs_node_t * node, off_t offset, size_t size, uint8_t * buffer) {
+	return bcache_write(node->device, offset, size, buffer);
+}
+
+int bcache_node_ioctl(fs_node_t * node, unsigned long request, void * argp) {
+	return bcache_ioctl(node->device, request, argp);
+}
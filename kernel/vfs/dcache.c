@@ -0,0 +1,261 @@
+/**
+ * @file  kernel/vfs/dcache.c
+ * @brief Directory entry cache.
+ *
+ * Remembers the results of looking names up in directories, including
+ * names that weren't found, so that opening the same paths again does
+ * not have to go through the filesystem driver's finddir.
+ *
+ * Only filesystems that give their nodes a @c refresh method take part.
+ * Entries are keyed by the directory's device and inode number, so such
+ * filesystems must keep that pair unique for as long as the directory
+ * exists. A cached node is a snapshot; each hit hands out a copy and has
+ * the filesystem bring its size, times and permissions up to date.
+ *
+ * The VFS drops entries when names are created or removed, and drops
+ * everything when something is mounted.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2023 K. Lange
+ */
+#include <kernel/types.h>
+#include <kernel/string.h>
+#include <kernel/printf.h>
+#include <kernel/spinlock.h>
+#include <kernel/vfs.h>
+#include <kernel/procfs.h>
+#include <kernel/dcache.h>
+
+#define DCACHE_COUNT   1024
+#define DCACHE_BUCKETS 512
+
+#define DCACHE_REF 0x01 /* Used since the clock hand last passed */
+
+struct dentry {
+	void * device;        /* Directory's device; NULL if unused */
+	uint64_t dir;         /* Directory's inode */
+	uint32_t hash;
+	unsigned int flags;
+	char * name;
+	fs_node_t * node;     /* NULL if the name does not exist */
+	struct dentry * next; /* Hash chain */
+};
+
+static spin_lock_t dcache_lock = { 0 };
+static struct dentry entries[DCACHE_COUNT];
+static struct dentry * buckets[DCACHE_BUCKETS];
+static size_t clock_hand = 0;
+static unsigned long dcache_gen = 0; /* Bumped by every invalidation */
+
+static struct {
+	uint64_t hits;
+	uint64_t negative_hits;
+	uint64_t misses;
+	uint64_t stale;
+	uint64_t evictions;
+	uint64_t invalidations;
+} dcache_stats;
+
+static uint32_t dcache_hash(void * device, uint64_t dir, const char * name) {
+	uint32_t hash = 2166136261U;
+	while (*name) {
+		hash = (hash ^ (uint8_t)*name++) * 16777619U;
+	}
+	return hash ^ (uint32_t)(((uintptr_t)device >> 4) * 0x9E3779B1U) ^ (uint32_t)(dir * 0x85EBCA6BU);
+}
+
+static struct dentry * dcache_find(void * device, uint64_t dir, uint32_t hash, const char * name) {
+	for (struct dentry * e = buckets[hash % DCACHE_BUCKETS]; e; e = e->next) {
+		if (e->hash == hash && e->device == device && e->dir == dir && !strcmp(e->name, name)) return e;
+	}
+	return NULL;
+}
+
+/**
+ * @brief Remove an entry from its hash chain and release what it holds.
+ */
+static void dcache_drop(struct dentry * e) {
+	struct dentry ** link = &buckets[e->hash % DCACHE_BUCKETS];
+	while (*link != e) link = &(*link)->next;
+	*link = e->next;
+
+	free(e->name);
+	if (e->node) free(e->node);
+	e->device = NULL;
+	e->name = NULL;
+	e->node = NULL;
+	e->next = NULL;
+	e->flags = 0;
+}
+
+static struct dentry * dcache_victim(void) {
+	while (1) {
+		struct dentry * e = &entries[clock_hand];
+		clock_hand = (clock_hand + 1) % DCACHE_COUNT;
+		if (e->flags & DCACHE_REF) {
+			e->flags &= ~DCACHE_REF;
+			continue;
+		}
+		if (e->device) {
+			dcache_stats.evictions++;
+			dcache_drop(e);
+		}
+		return e;
+	}
+}
+
+/**
+ * @brief Look up a name in a directory.
+ *
+ * @param dir  Directory to look in
+ * @param name Name to look for
+ * @param out  Receives a new node the caller owns, or NULL if the name is known not to exist
+ * @param gen  Receives a value to pass to @ref dcache_insert after a miss
+ * @returns 1 if the cache had an answer, 0 if the filesystem must be asked
+ */
+int dcache_lookup(fs_node_t * dir, const char * name, fs_node_t ** out, unsigned long * gen) {
+	uint32_t hash = dcache_hash(dir->device, dir->inode, name);
+	fs_node_t * node = NULL;
+
+	spin_lock(dcache_lock);
+	*gen = dcache_gen;
+	struct dentry * e = dcache_find(dir->device, dir->inode, hash, name);
+	if (!e) {
+		dcache_stats.misses++;
+		spin_unlock(dcache_lock);
+		return 0;
+	}
+	e->flags |= DCACHE_REF;
+	if (e->node) {
+		node = malloc(sizeof(fs_node_t));
+		memcpy(node, e->node, sizeof(fs_node_t));
+		node->refcount = 0;
+		dcache_stats.hits++;
+	} else {
+		dcache_stats.negative_hits++;
+	}
+	spin_unlock(dcache_lock);
+
+	if (node && node->refresh(node)) {
+		/* It's gone from under us; let the filesystem decide what is there now. */
+		free(node);
+		spin_lock(dcache_lock);
+		dcache_stats.stale++;
+		dcache_gen++;
+		e = dcache_find(dir->device, dir->inode, hash, name);
+		if (e) dcache_drop(e);
+		*gen = dcache_gen;
+		spin_unlock(dcache_lock);
+		return 0;
+	}
+
+	*out = node;
+	return 1;
+}
+
+/**
+ * @brief Remember the result of a lookup.
+ *
+ * @param node What finddir returned for @p name, which may be NULL
+ * @param gen  What @ref dcache_lookup gave us; if anything was invalidated
+ *             since then, the result may already be out of date and is not kept.
+ */
+void dcache_insert(fs_node_t * dir, const char * name, fs_node_t * node, unsigned long gen) {
+	if (node && !node->refresh) return;
+	if (strlen(name) >= sizeof(node->name)) return;
+
+	uint32_t hash = dcache_hash(dir->device, dir->inode, name);
+	char * copy_name = strdup(name);
+	fs_node_t * copy = NULL;
+	if (node) {
+		copy = malloc(sizeof(fs_node_t));
+		memcpy(copy, node, sizeof(fs_node_t));
+	}
+
+	spin_lock(dcache_lock);
+	if (gen != dcache_gen || dcache_find(dir->device, dir->inode, hash, name)) {
+		spin_unlock(dcache_lock);
+		free(copy_name);
+		if (copy) free(copy);
+		return;
+	}
+
+	struct dentry * e = dcache_victim();
+	e->device = dir->device;
+	e->dir    = dir->inode;
+	e->hash   = hash;
+	e->name   = copy_name;
+	e->node   = copy;
+	e->flags  = DCACHE_REF;
+	e->next   = buckets[hash % DCACHE_BUCKETS];
+	buckets[hash % DCACHE_BUCKETS] = e;
+	spin_unlock(dcache_lock);
+}
+
+/**
+ * @brief Forget what we know about one name in a directory.
+ */
+void dcache_invalidate(fs_node_t * dir, const char * name) {
+	uint32_t hash = dcache_hash(dir->device, dir->inode, name);
+	spin_lock(dcache_lock);
+	dcache_gen++;
+	dcache_stats.invalidations++;
+	struct dentry * e = dcache_find(dir->device, dir->inode, hash, name);
+	if (e) dcache_drop(e);
+	spin_unlock(dcache_lock);
+}
+
+/**
+ * @brief Forget every entry for directories on @p device, or everything if it is NULL.
+ */
+void dcache_purge(void * device) {
+	spin_lock(dcache_lock);
+	dcache_gen++;
+	dcache_stats.invalidations++;
+	for (size_t i = 0; i < DCACHE_COUNT; ++i) {
+		if (entries[i].device && (!device || entries[i].device == device)) {
+			dcache_drop(&entries[i]);
+		}
+	}
+	spin_unlock(dcache_lock);
+}
+
+static void dcache_func(fs_node_t * node) {
+	size_t cached = 0, negative = 0;
+	spin_lock(dcache_lock);
+	for (size_t i = 0; i < DCACHE_COUNT; ++i) {
+		if (!entries[i].device) continue;
+		cached++;
+		if (!entries[i].node) negative++;
+	}
+	spin_unlock(dcache_lock);
+
+	procfs_printf(node,
+		"Entries:      %zu\n"
+		"Negative:     %zu\n"
+		"Hits:         %lu\n"
+		"NegativeHits: %lu\n"
+		"Misses:       %lu\n"
+		"Stale:        %lu\n"
+		"Evictions:    %lu\n"
+		"Invalidations: %lu\n",
+		cached, negative,
+		dcache_stats.hits,
+		dcache_stats.negative_hits,
+		dcache_stats.misses,
+		dcache_stats.stale,
+		dcache_stats.evictions,
+		dcache_stats.invalidations);
+}
+
+static struct procfs_entry dcache_entry = {
+	0,
+	"dcache",
+	dcache_func,
+};
+
+void dcache_initialize(void) {
+	procfs_install(&dcache_entry);
+}
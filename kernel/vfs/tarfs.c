@@ -363,12 +363,18 @@ static int create_ret_rofs(fs_node_t *parent, char *name, mode_t permission) {
 	return -EROFS;
 }
 
+static int refresh_tarfs(fs_node_t * node) {
+	/* Nothing in the archive ever changes. */
+	return 0;
+}
+
 static fs_node_t * file_from_ustar(struct tarfs * self, struct ustar * file, unsigned int offset) {
 	fs_node_t * fs = malloc(sizeof(fs_node_t));
 	memset(fs, 0, sizeof(fs_node_t));
 	fs->device = self;
 	fs->inode  = offset;
 	fs->impl   = 0;
+	fs->refresh = refresh_tarfs;
 	char filename_workspace[256];
 	memcpy(fs->name, filename_workspace, strlen(filename_workspace)+1);
 
@@ -488,6 +494,9 @@ static fs_node_t * tar_mount(const char * device, const char * mount_path) {
 	root->create  = create_ret_rofs;
 	root->flags   = FS_DIRECTORY;
 	root->device  = self;
+	root->refresh = refresh_tarfs;
+	/* Every other node's inode is its header's offset; the end of the archive can't be one. */
+	root->inode   = self->length;
 
 	return root;
 }
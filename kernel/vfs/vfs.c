@@ -29,6 +29,7 @@
 #include <kernel/hashmap.h>
 #include <kernel/tree.h>
 #include <kernel/spinlock.h>
+#include <kernel/dcache.h>
 
 #define MAX_SYMLINK_DEPTH 8
 #define MAX_SYMLINK_SIZE 4096
@@ -318,6 +319,9 @@ struct dirent *readdir_fs(fs_node_t *node, unsigned long index) {
 /**
  * @brief Find the requested file in the directory and return an fs_node for it
  *
+ * Directories on filesystems that support it are looked up in the
+ * dentry cache first.
+ *
  * @param node Directory to search
  * @param name File to look for
  * @returns An fs_node that the caller can free
@@ -326,7 +330,17 @@ fs_node_t *finddir_fs(fs_node_t *node, char *name) {
 	if (!node) return NULL;
 
 	if ((node->flags & FS_DIRECTORY) && node->finddir) {
-		return node->finddir(node, name);
+		if (!node->refresh) {
+			return node->finddir(node, name);
+		}
+		fs_node_t * out;
+		unsigned long gen;
+		if (dcache_lookup(node, name, &out, &gen)) {
+			return out;
+		}
+		out = node->finddir(node, name);
+		dcache_insert(node, name, out, gen);
+		return out;
 	} else {
 		debug_print(WARNING, "Node passed to finddir_fs isn't a directory!");
 		debug_print(WARNING, "node = %p, name = %s", (void*)node, name);
@@ -400,6 +414,7 @@ int create_file_fs(char *name, mode_t permission) {
 	int ret = 0;
 	if (parent->create) {
 		ret = parent->create(parent, f_path, permission);
+		dcache_invalidate(parent, f_path);
 	} else {
 		ret = -EINVAL;
 	}
@@ -450,6 +465,8 @@ int unlink_fs(char * name) {
 	int ret = 0;
 	if (parent->unlink) {
 		ret = parent->unlink(parent, f_path);
+		/* If it was a directory, anything cached under it must go too. */
+		dcache_purge(parent->device);
 	} else {
 		ret = -EINVAL;
 	}
@@ -515,6 +532,7 @@ int mkdir_fs(char *name, mode_t permission) {
 	int ret = 0;
 	if (parent->mkdir) {
 		ret = parent->mkdir(parent, f_path, permission);
+		dcache_invalidate(parent, f_path);
 	} else {
 		ret = -EROFS;
 	}
@@ -567,6 +585,7 @@ int symlink_fs(char * target, char * name) {
 	int ret = 0;
 	if (parent->symlink) {
 		ret = parent->symlink(parent, target, f_path);
+		dcache_invalidate(parent, f_path);
 	} else {
 		ret = -EINVAL;
 	}
@@ -719,6 +738,8 @@ void vfs_install(void) {
 	tree_set_root(fs_tree, root);
 
 	fs_types = hashmap_create(5);
+
+	dcache_initialize();
 }
 
 int vfs_register(const char * name, vfs_mount_callback callback) {
@@ -780,6 +801,9 @@ void * vfs_mount(const char * path, fs_node_t * local_root) {
 
 	spin_lock(tmp_vfs_lock);
 
+	/* Lookups that went into whatever was here before are no longer valid. */
+	dcache_purge(NULL);
+
 	local_root->refcount = -1;
 
 	tree_node_t * ret_val = NULL;
@@ -1,3 +1,4 @@
+#include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
@@ -7,6 +8,10 @@
 #include <bits/dirent.h>
 
 DEFN_SYSCALL3(readdir, SYS_READDIR, int, int, void *);
+DEFN_SYSCALL3(getdents, SYS_GETDENTS, int, void *, size_t);
+
+/* Entries fetched per getdents call */
+#define DIR_BATCH 16
 
 DIR * opendir (const char * dirname) {
 	int fd = open(dirname, O_RDONLY);
@@ -17,33 +22,39 @@ DIR * opendir (const char * dirname) {
 
 	DIR * dir = (DIR *)malloc(sizeof(DIR));
 	dir->fd = fd;
-	dir->cur_entry = -1;
+	dir->cur_entry = 0;
+	dir->entries = 0;
+	dir->buffer = malloc(sizeof(struct dirent) * DIR_BATCH);
 	return dir;
 }
 
 int closedir (DIR * dir) {
 	if (dir && (dir->fd != -1)) {
-		return close(dir->fd);
+		int ret = close(dir->fd);
+		free(dir->buffer);
+		free(dir);
+		return ret;
 	} else {
 		return -EBADF;
 	}
 }
 
 struct dirent * readdir (DIR * dirp) {
-	static struct dirent ent;
-
-	int ret = syscall_readdir(dirp->fd, ++dirp->cur_entry, &ent);
-	if (ret < 0) {
-		errno = -ret;
-		memset(&ent, 0, sizeof(struct dirent));
-		return NULL;
-	}
-
-	if (ret == 0) {
-		/* end of directory */
-		memset(&ent, 0, sizeof(struct dirent));
-		return NULL;
+	if (dirp->cur_entry == dirp->entries) {
+		long ret = syscall_getdents(dirp->fd, dirp->buffer, sizeof(struct dirent) * DIR_BATCH);
+		if (ret < 0) {
+			errno = -ret;
+			return NULL;
+		}
+
+		dirp->cur_entry = 0;
+		dirp->entries = ret / sizeof(struct dirent);
+
+		if (!dirp->entries) {
+			/* end of directory */
+			return NULL;
+		}
 	}
 
-	return &ent;
+	return &dirp->buffer[dirp->cur_entry++];
 }
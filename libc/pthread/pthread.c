@@ -11,9 +11,11 @@
 #include <errno.h>
 #include <string.h>
 #include <stdio.h>
+#include <limits.h>
 
 #include <sys/wait.h>
 #include <sys/sysfunc.h>
+#include <sys/futex.h>
 
 DEFN_SYSCALL3(clone, SYS_CLONE, uintptr_t, uintptr_t, void *);
 DEFN_SYSCALL0(gettid, SYS_GETTID);
@@ -25,9 +27,9 @@ struct __pthread {
 };
 
 extern int __libc_is_multicore;
-static inline void _yield(void) {
-	if (!__libc_is_multicore) syscall_yield();
-}
+
+/* How many times to retry a contended lock before sleeping on it. */
+#define MUTEX_SPIN_COUNT 100
 
 #define PTHREAD_STACK_SIZE 0x100000
 
@@ -101,22 +103,48 @@ void pthread_cleanup_pop(int execute) {
 	/* do nothing */
 }
 
+/*
+ * Mutexes are a single integer:
+ *   0: unlocked
+ *   1: locked, nobody waiting
+ *   2: locked, and there may be threads sleeping on it
+ * Locking and unlocking an uncontended mutex never enters the kernel;
+ * only a contended unlock needs a futex wake.
+ */
 int pthread_mutex_lock(pthread_mutex_t *mutex) {
-	while (__sync_lock_test_and_set(mutex, 0x01)) {
-		_yield();
+	int c = __sync_val_compare_and_swap(mutex, 0, 1);
+	if (!c) return 0;
+
+	/* On SMP the owner may be about to release it; try again for a bit before sleeping. */
+	if (__libc_is_multicore) {
+		for (int i = 0; i < MUTEX_SPIN_COUNT && c == 1; ++i) {
+			__asm__ __volatile__ ("" ::: "memory");
+			c = __sync_val_compare_and_swap(mutex, 0, 1);
+			if (!c) return 0;
+		}
+	}
+
+	if (c != 2) c = __atomic_exchange_n(mutex, 2, __ATOMIC_ACQUIRE);
+	while (c) {
+		futex(mutex, FUTEX_WAIT, 2);
+		c = __atomic_exchange_n(mutex, 2, __ATOMIC_ACQUIRE);
 	}
 	return 0;
 }
 
 int pthread_mutex_trylock(pthread_mutex_t *mutex) {
-	if (__sync_lock_test_and_set(mutex, 0x01)) {
+	if (__sync_val_compare_and_swap(mutex, 0, 1)) {
 		return EBUSY;
 	}
 	return 0;
 }
 
 int pthread_mutex_unlock(pthread_mutex_t *mutex) {
-	__sync_lock_release(mutex);
+	if (__sync_fetch_and_sub(mutex, 1) != 1) {
+		/* There were waiters. */
+		__atomic_store_n(mutex, 0, __ATOMIC_RELEASE);
+		futex(mutex, FUTEX_WAKE, 1);
+	}
 	return 0;
 }
 
@@ -129,6 +157,43 @@ int pthread_mutex_destroy(pthread_mutex_t *mutex) {
 	return 0;
 }
 
+/*
+ * Condition variables are a sequence counter that is bumped on
+ * every signal; waiters sleep on the value they saw before
+ * releasing the mutex, so a signal in between is never lost.
+ */
+int pthread_cond_init(pthread_cond_t *cond, const pthread_condattr_t *attr) {
+	cond->seq = 0;
+	return 0;
+}
+
+int pthread_cond_destroy(pthread_cond_t *cond) {
+	return 0;
+}
+
+int pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex) {
+	int seq = cond->seq;
+	pthread_mutex_unlock(mutex);
+	futex(&cond->seq, FUTEX_WAIT, seq);
+	/* Other waiters may have been woken with us, so relock as contended. */
+	while (__atomic_exchange_n(mutex, 2, __ATOMIC_ACQUIRE)) {
+		futex(mutex, FUTEX_WAIT, 2);
+	}
+	return 0;
+}
+
+int pthread_cond_signal(pthread_cond_t *cond) {
+	__sync_fetch_and_add(&cond->seq, 1);
+	futex(&cond->seq, FUTEX_WAKE, 1);
+	return 0;
+}
+
+int pthread_cond_broadcast(pthread_cond_t *cond) {
+	__sync_fetch_and_add(&cond->seq, 1);
+	futex(&cond->seq, FUTEX_WAKE, INT_MAX);
+	return 0;
+}
+
 int pthread_attr_init(pthread_attr_t *attr) {
 	*attr = 0;
 	return 0;
@@ -1,6 +1,7 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <limits.h>
 #include <syscall.h>
 #include <syscall_nums.h>
 #include <signal.h>
@@ -8,18 +9,23 @@
 #include <errno.h>
 
 #include <sys/wait.h>
+#include <sys/futex.h>
 
-extern int __libc_is_multicore;
-static inline void _yield(void) {
-	if (!__libc_is_multicore) syscall_yield();
-}
+/*
+ * lock->readers is the number of readers holding the lock, or -1
+ * if it is held by a writer. Anyone who can not take the lock sleeps
+ * on that value and is woken when the lock is fully released.
+ */
 
-#define ACQUIRE_LOCK() do { while (__sync_lock_test_and_set(&lock->atomic_lock, 0x01)) { _yield(); } } while (0)
-#define RELEASE_LOCK() do { __sync_lock_release(&lock->atomic_lock); } while (0)
+static void _wait(pthread_rwlock_t * lock, int seen) {
+	__sync_fetch_and_add(&lock->waiters, 1);
+	futex(&lock->readers, FUTEX_WAIT, seen);
+	__sync_fetch_and_sub(&lock->waiters, 1);
+}
 
 int pthread_rwlock_init(pthread_rwlock_t * lock, void * args) {
 	lock->readers = 0;
-	lock->atomic_lock = 0;
+	lock->waiters = 0;
 	if (args != NULL) {
 		fprintf(stderr, "pthread: pthread_rwlock_init arg unsupported\n");
 		return 1;
@@ -28,36 +34,38 @@ int pthread_rwlock_init(pthread_rwlock_t * lock, void * args) {
 }
 
 int pthread_rwlock_wrlock(pthread_rwlock_t * lock) {
-	ACQUIRE_LOCK();
 	while (1) {
-		if (lock->readers == 0) {
-			lock->readers = -1;
+		if (__sync_bool_compare_and_swap(&lock->readers, 0, -1)) {
 			lock->writerPid = syscall_getpid();
-			RELEASE_LOCK();
 			return 0;
 		}
-		_yield();
+		int seen = lock->readers;
+		if (seen != 0) _wait(lock, seen);
 	}
 }
 
 int pthread_rwlock_rdlock(pthread_rwlock_t * lock) {
-	ACQUIRE_LOCK();
 	while (1) {
-		if (lock->readers >= 0) {
-			lock->readers++;
-			RELEASE_LOCK();
-			return 0;
+		int seen = lock->readers;
+		if (seen >= 0) {
+			if (__sync_bool_compare_and_swap(&lock->readers, seen, seen + 1)) return 0;
+		} else {
+			_wait(lock, seen);
 		}
-		_yield();
 	}
 }
 
 int pthread_rwlock_unlock(pthread_rwlock_t * lock) {
-	ACQUIRE_LOCK();
-	if (lock->readers > 0) lock->readers--;
-	else if (lock->readers < 0) lock->readers = 0;
-	else fprintf(stderr, "pthread: bad lock state detected\n");
-	RELEASE_LOCK();
+	int seen = lock->readers;
+	if (seen > 0) {
+		if (__sync_sub_and_fetch(&lock->readers, 1) != 0) return 0;
+	} else if (seen < 0) {
+		__sync_bool_compare_and_swap(&lock->readers, -1, 0);
+	} else {
+		fprintf(stderr, "pthread: bad lock state detected\n");
+		return 0;
+	}
+	if (lock->waiters) futex(&lock->readers, FUTEX_WAKE, INT_MAX);
 	return 0;
 }
 
@@ -0,0 +1,54 @@
+#include <stdint.h>
+#include <semaphore.h>
+#include <errno.h>
+
+#include <sys/futex.h>
+
+/*
+ * Unnamed semaphores. Waiters only enter the kernel when the count
+ * is zero, and posters only enter it when someone is waiting.
+ */
+
+int sem_init(sem_t * sem, int pshared, unsigned int value) {
+	sem->value = value;
+	sem->waiters = 0;
+	return 0;
+}
+
+int sem_destroy(sem_t * sem) {
+	return 0;
+}
+
+int sem_trywait(sem_t * sem) {
+	int seen = sem->value;
+	while (seen > 0) {
+		if (__sync_bool_compare_and_swap(&sem->value, seen, seen - 1)) return 0;
+		seen = sem->value;
+	}
+	errno = EAGAIN;
+	return -1;
+}
+
+int sem_wait(sem_t * sem) {
+	while (1) {
+		int seen = sem->value;
+		if (seen > 0) {
+			if (__sync_bool_compare_and_swap(&sem->value, seen, seen - 1)) return 0;
+			continue;
+		}
+		__sync_fetch_and_add(&sem->waiters, 1);
+		futex(&sem->value, FUTEX_WAIT, seen);
+		__sync_fetch_and_sub(&sem->waiters, 1);
+	}
+}
+
+int sem_post(sem_t * sem) {
+	__sync_fetch_and_add(&sem->value, 1);
+	if (sem->waiters) futex(&sem->value, FUTEX_WAKE, 1);
+	return 0;
+}
+
+int sem_getvalue(sem_t * sem, int * sval) {
+	*sval = sem->value;
+	return 0;
+}
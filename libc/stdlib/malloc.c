@@ -58,6 +58,21 @@
  * increased, as well as allowing for changing the size of page (though this
  * should, for the most part, remain 4KB under any modern system).
  *
+ * Threads and large allocations
+ * """""""""""""""""""""""""""""
+ *
+ * Small objects go through a handful of thread caches, each a stack of free
+ * objects per bin with its own lock. A thread picks its cache from the
+ * address of its stack, so threads rarely share one and the global lock is
+ * only taken to move objects between a cache and the bins in batches. (We
+ * can't use TLS for this: the dynamic linker links this file statically.)
+ *
+ * Anything too big for a bin gets its own anonymous mapping, which is
+ * unmapped as soon as it is freed. Small-bin pages that become entirely free
+ * are handed back to the kernel by malloc_trim(), which is also called
+ * automatically once enough of them pile up; their addresses are reused for
+ * new bins and get fresh zeroed pages from the kernel when touched.
+ *
  * Special thanks
  * """"""""""""""
  *
@@ -96,8 +111,6 @@
  * """""""""""""""""
  *
  * TODO: Try to be more consistent on comment widths...
- * FIXME: Make thread safe! Not necessary for competition, but would be nice.
- * FIXME: Splitting/coalescing is broken. Fix this ASAP!
  *
 **/
 
@@ -107,6 +120,8 @@
 #include <stdint.h>
 #include <limits.h>
 #include <string.h>
+#include <malloc.h>
+#include <sys/mman.h>
 /* }}} */
 /* Definitions {{{ */
 
@@ -133,6 +148,14 @@
 
 #define BIN_MAGIC 0xDEFAD00D
 
+#define CACHE_COUNT 8								/* Thread caches, chosen by stack address. */
+#define CACHE_SIZE 32								/* Objects per bin in a thread cache. */
+#define CACHE_BATCH 16								/* Objects moved between a cache and the bins at once. */
+#define CACHE_STACK_SHIFT 20						/* Thread stacks are at least 1MiB apart. */
+
+#define TRIM_THRESHOLD 256							/* Free small-bin pages that trigger a trim... */
+#define TRIM_KEEP 64								/* ...and how many of them it leaves alone. */
+
 /* }}} */
 
 /*
@@ -140,10 +163,17 @@
  */
 static void * __attribute__ ((malloc)) klmalloc(uintptr_t size);
 static void * __attribute__ ((malloc)) klrealloc(void * ptr, uintptr_t size);
-static void * __attribute__ ((malloc)) klcalloc(uintptr_t nmemb, uintptr_t size);
 static void * __attribute__ ((malloc)) klvalloc(uintptr_t size);
 static void klfree(void * ptr);
 
+static void * klmalloc_cache_alloc(uintptr_t bin);
+static void klmalloc_cache_free(void * ptr, uintptr_t bin);
+static void klmalloc_cache_drain(void);
+static void * __attribute__ ((malloc)) klmalloc_big_alloc(uintptr_t size);
+static void * klmalloc_big_realloc(void * ptr, uintptr_t size);
+static void klmalloc_big_free(void * ptr);
+static int klmalloc_trim(uintptr_t keep);
+
 static int volatile mem_lock = 0;
 static const char * _lock_holder;
 
@@ -182,14 +212,19 @@ static void spin_unlock(int volatile * lock) {
 }
 
 
+static inline uintptr_t __attribute__ ((always_inline, pure)) klmalloc_bin_size(uintptr_t size);
+static uintptr_t klmalloc_ptr_bin(void * ptr);
+
 void * __attribute__ ((malloc)) malloc(uintptr_t size) {
-	spin_lock(&mem_lock, __FUNCTION__);
-	void * ret = klmalloc(size);
-	spin_unlock(&mem_lock);
-	return ret;
+	if (__builtin_expect(size == 0, 0)) return NULL;
+	uintptr_t bin = klmalloc_bin_size(size);
+	if (bin == BIG_BIN) return klmalloc_big_alloc(size);
+	return klmalloc_cache_alloc(bin);
 }
 
 void * __attribute__ ((malloc)) realloc(void * ptr, uintptr_t size) {
+	/* Big blocks are their own mappings and don't need the lock. */
+	if (ptr && size && klmalloc_ptr_bin(ptr) == BIG_BIN) return klmalloc_big_realloc(ptr, size);
 	spin_lock(&mem_lock, __FUNCTION__);
 	void * ret = klrealloc(ptr, size);
 	spin_unlock(&mem_lock);
@@ -197,26 +232,44 @@ void * __attribute__ ((malloc)) realloc(void * ptr, uintptr_t size) {
 }
 
 void * __attribute__ ((malloc)) calloc(uintptr_t nmemb, uintptr_t size) {
-	spin_lock(&mem_lock, __FUNCTION__);
-	void * ret = klcalloc(nmemb, size);
-	spin_unlock(&mem_lock);
+	if (size && nmemb > UINTPTR_MAX / size) return NULL;
+	uintptr_t total = nmemb * size;
+	if (__builtin_expect(total == 0, 0)) return NULL;
+	uintptr_t bin = klmalloc_bin_size(total);
+	/* Fresh mappings are already zeroed. */
+	if (bin == BIG_BIN) return klmalloc_big_alloc(total);
+	void * ret = klmalloc_cache_alloc(bin);
+	memset(ret, 0x00, total);
 	return ret;
 }
 
 void * __attribute__ ((malloc)) valloc(uintptr_t size) {
-	spin_lock(&mem_lock, __FUNCTION__);
-	void * ret = klvalloc(size);
-	spin_unlock(&mem_lock);
-	return ret;
+	return klvalloc(size);
 }
 
 void free(void * ptr) {
+	if (__builtin_expect(ptr == NULL, 0)) return;
+	uintptr_t bin = klmalloc_ptr_bin(ptr);
+	if (bin == BIG_BIN) {
+		klmalloc_big_free(ptr);
+	} else if (bin < BIG_BIN) {
+		klmalloc_cache_free(ptr, bin);
+	} else {
+		/* Not one of ours; leave it to the heap to decide what to do with it. */
+		spin_lock(&mem_lock, __FUNCTION__);
+		klfree(ptr);
+		spin_unlock(&mem_lock);
+	}
+}
+
+int malloc_trim(size_t pad) {
+	klmalloc_cache_drain();
 	spin_lock(&mem_lock, __FUNCTION__);
-	klfree(ptr);
+	int ret = klmalloc_trim(pad / PAGE_SIZE);
 	spin_unlock(&mem_lock);
+	return ret;
 }
 
-
 /* Bin management {{{ */
 
 /*
@@ -257,6 +310,7 @@ typedef struct _klmalloc_bin_header {
 	void * head;							/* Head of this bin. */
 	uintptr_t size;							/* Size of this bin, if big; otherwise bin index. */
 	uint32_t bin_magic;
+	uint32_t used;							/* Objects taken out of a small bin. */
 } klmalloc_bin_header;
 
 /*
@@ -284,6 +338,41 @@ typedef struct _klmalloc_bin_header_head {
  */
 static klmalloc_bin_header_head klmalloc_bin_head[NUM_BINS - 1];	/* Small bins */
 
+static uintptr_t klmalloc_free_pages = 0;		/* Small-bin pages with nothing taken out */
+
+/*
+ * Pages given back by malloc_trim, to be reused for new bins.
+ * The stack itself lives in a big block.
+ */
+static uintptr_t * klmalloc_spare = NULL;
+static uintptr_t klmalloc_spare_count = 0;
+static uintptr_t klmalloc_spare_size = 0;
+
+/*
+ * Find the header for an allocated pointer.
+ */
+static inline klmalloc_bin_header * __attribute__ ((always_inline)) klmalloc_header(void * ptr) {
+	/*
+	 * Page-aligned pointers come from valloc, and their
+	 * header is on the page before.
+	 */
+	if ((uintptr_t)ptr % PAGE_SIZE == 0) {
+		ptr = (void *)((uintptr_t)ptr - 1);
+	}
+	return (klmalloc_bin_header *)((uintptr_t)ptr & (uintptr_t)~PAGE_MASK);
+}
+
+/*
+ * Which bin does an allocated pointer belong to?
+ * Returns NUM_BINS if it doesn't look like one of ours.
+ */
+static uintptr_t klmalloc_ptr_bin(void * ptr) {
+	klmalloc_bin_header * header = klmalloc_header(ptr);
+	if (header->bin_magic != BIN_MAGIC) return NUM_BINS;
+	if (header->size > NUM_BINS) return BIG_BIN;
+	return header->size;
+}
+
 /* }}} Bin management */
 /* Doubly-Linked List {{{ */
 
@@ -408,10 +497,17 @@ static void * __attribute__ ((malloc)) klmalloc(uintptr_t size) {
 		klmalloc_bin_header * bin_header = klmalloc_list_head(&klmalloc_bin_head[bucket_id]);
 		if (!bin_header) {
 			/*
-			 * Grow the heap for the new bin.
+			 * Reuse a trimmed page for the new bin,
+			 * or grow the heap if there are none.
 			 */
-			bin_header = (klmalloc_bin_header*)sbrk(PAGE_SIZE);
+			if (klmalloc_spare_count) {
+				bin_header = (klmalloc_bin_header*)klmalloc_spare[--klmalloc_spare_count];
+			} else {
+				bin_header = (klmalloc_bin_header*)sbrk(PAGE_SIZE);
+			}
 			bin_header->bin_magic = BIN_MAGIC;
+			bin_header->used = 0;
+			klmalloc_free_pages++;
 			assert((uintptr_t)bin_header % PAGE_SIZE == 0);
 
 			/*
@@ -450,25 +546,15 @@ static void * __attribute__ ((malloc)) klmalloc(uintptr_t size) {
 		if (klmalloc_stack_empty(bin_header)) {
 			klmalloc_list_decouple(&(klmalloc_bin_head[bucket_id]),bin_header);
 		}
+		if (bin_header->used++ == 0) {
+			klmalloc_free_pages--;
+		}
 		return item;
 	} else {
 		/*
-		 * Round requested size to a set of pages, plus the header size.
+		 * Big bins.
 		 */
-		uintptr_t pages = (size + sizeof(klmalloc_big_bin_header)) / PAGE_SIZE + 1;
-		klmalloc_big_bin_header * bin_header = (klmalloc_big_bin_header*)sbrk(PAGE_SIZE * pages);
-		bin_header->bin_magic = BIN_MAGIC;
-		assert((uintptr_t)bin_header % PAGE_SIZE == 0);
-		/*
-		 * Give the header the remaining space.
-		 */
-		bin_header->size = pages * PAGE_SIZE - sizeof(klmalloc_big_bin_header);
-		assert((bin_header->size + sizeof(klmalloc_big_bin_header)) % PAGE_SIZE == 0);
-		/*
-		 * Return the head of the block.
-		 */
-		bin_header->head = NULL;
-		return (void*)((uintptr_t)bin_header + sizeof(klmalloc_big_bin_header));
+		return klmalloc_big_alloc(size);
 	}
 }
 /* }}} */
@@ -481,21 +567,11 @@ static void klfree(void *ptr) {
 		return;
 	}
 
-	/*
-	 * Woah, woah, hold on, was this a page-aligned block?
-	 */
-	if ((uintptr_t)ptr % PAGE_SIZE == 0) {
-		/*
-		 * Well howdy-do, it was.
-		 */
-		ptr = (void *)((uintptr_t)ptr - 1);
-	}
-
 	/*
 	 * Get our pointer to the head of this block by
 	 * page aligning it.
 	 */
-	klmalloc_bin_header * header = (klmalloc_bin_header *)((uintptr_t)ptr & (uintptr_t)~PAGE_MASK);
+	klmalloc_bin_header * header = klmalloc_header(ptr);
 	assert((uintptr_t)header % PAGE_SIZE == 0);
 
 	if (header->bin_magic != BIN_MAGIC)
@@ -509,15 +585,7 @@ static void klfree(void *ptr) {
 	 */
 	uintptr_t bucket_id = header->size;
 	if (bucket_id > (uintptr_t)NUM_BINS) {
-		bucket_id = BIG_BIN;
-		klmalloc_big_bin_header *bheader = (klmalloc_big_bin_header*)header;
-		
-		assert(bheader);
-		assert(bheader->head == NULL);
-		assert((bheader->size + sizeof(klmalloc_big_bin_header)) % PAGE_SIZE == 0);
-
-		char * args[] = {(char*)header, (char*)(bheader->size + sizeof(klmalloc_big_bin_header))};
-		syscall_sysfunc(43, args);
+		klmalloc_big_free(ptr);
 	} else {
 		/*
 		 * If the stack is empty, we are freeing
@@ -531,6 +599,9 @@ static void klfree(void *ptr) {
 		 * Push new space back into the stack.
 		 */
 		klmalloc_stack_push(header, ptr);
+		if (--header->used == 0) {
+			klmalloc_free_pages++;
+		}
 	}
 }
 /* }}} */
@@ -563,7 +634,7 @@ static void * __attribute__ ((malloc)) klrealloc(void *ptr, uintptr_t size) {
 	 */
 	if (__builtin_expect(size == 0, 0))
 	{
-		free(ptr);
+		klfree(ptr);
 		return NULL;
 	}
 
@@ -614,21 +685,182 @@ static void * __attribute__ ((malloc)) klrealloc(void *ptr, uintptr_t size) {
 	return NULL;
 }
 /* }}} */
-/* calloc() {{{ */
-static void * __attribute__ ((malloc)) klcalloc(uintptr_t nmemb, uintptr_t size) {
-	/*
-	 * Allocate memory and zero it before returning
-	 * a pointer to the newly allocated memory.
-	 * 
-	 * Implemented by way of a simple malloc followed
-	 * by a memset to 0x00 across the length of the
-	 * requested memory chunk.
-	 */
 
-	void *ptr = klmalloc(nmemb * size);
-	if (ptr) memset(ptr,0x00,nmemb * size);
-	return ptr;
+/* Big blocks {{{ */
+
+/*
+ * Each big block is an anonymous mapping of its own, with the usual
+ * header at the front. None of this touches shared state, so it is
+ * done without taking the lock.
+ */
+static void * __attribute__ ((malloc)) klmalloc_big_alloc(uintptr_t size) {
+	if (size > UINTPTR_MAX - sizeof(klmalloc_big_bin_header) - PAGE_SIZE) return NULL;
+	uintptr_t pages = (size + sizeof(klmalloc_big_bin_header) + PAGE_MASK) / PAGE_SIZE;
+	klmalloc_big_bin_header * bin_header = mmap(NULL, pages * PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (bin_header == MAP_FAILED) return NULL;
+	bin_header->bin_magic = BIN_MAGIC;
+	bin_header->size = pages * PAGE_SIZE - sizeof(klmalloc_big_bin_header);
+	bin_header->head = NULL;
+	return (void*)((uintptr_t)bin_header + sizeof(klmalloc_big_bin_header));
+}
+
+static void klmalloc_big_free(void * ptr) {
+	klmalloc_big_bin_header * bheader = (klmalloc_big_bin_header *)klmalloc_header(ptr);
+	assert(bheader->head == NULL);
+	assert((bheader->size + sizeof(klmalloc_big_bin_header)) % PAGE_SIZE == 0);
+	munmap(bheader, bheader->size + sizeof(klmalloc_big_bin_header));
+}
+
+/*
+ * Shrink a big block by unmapping its tail, or grow it by mapping
+ * more pages right after it if that space is free; otherwise move it.
+ */
+static void * klmalloc_big_realloc(void * ptr, uintptr_t size) {
+	klmalloc_big_bin_header * bheader = (klmalloc_big_bin_header *)klmalloc_header(ptr);
+	uintptr_t offset = (uintptr_t)ptr - (uintptr_t)bheader;
+	uintptr_t span = bheader->size + sizeof(klmalloc_big_bin_header);
+	if (size > UINTPTR_MAX - offset - PAGE_SIZE) return NULL;
+	uintptr_t needed = (offset + size + PAGE_MASK) & ~(uintptr_t)PAGE_MASK;
+
+	if (needed <= span) {
+		if (needed < span) {
+			munmap((void *)((uintptr_t)bheader + needed), span - needed);
+			bheader->size = needed - sizeof(klmalloc_big_bin_header);
+		}
+		return ptr;
+	}
+
+	void * end = (void *)((uintptr_t)bheader + span);
+	void * more = mmap(end, needed - span, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (more == end) {
+		bheader->size = needed - sizeof(klmalloc_big_bin_header);
+		return ptr;
+	}
+	if (more != MAP_FAILED) munmap(more, needed - span);
+
+	void * out = malloc(size);
+	if (!out) return NULL;
+	memcpy(out, ptr, span - offset);
+	klmalloc_big_free(ptr);
+	return out;
+}
+
+/* }}} */
+/* Thread caches {{{ */
+
+/*
+ * A thread cache holds free objects for each small bin. Objects in
+ * a cache count as taken out as far as the bins are concerned. The
+ * cache lock is held while taking mem_lock, never the other way.
+ */
+static struct klmalloc_cache {
+	int volatile lock;
+	unsigned int count[BIG_BIN];
+	void * objects[BIG_BIN][CACHE_SIZE];
+} __attribute__((aligned(64))) klmalloc_caches[CACHE_COUNT];
+
+static inline struct klmalloc_cache * __attribute__ ((always_inline)) klmalloc_cache_get(void) {
+	uintptr_t stack = (uintptr_t)__builtin_frame_address(0);
+	return &klmalloc_caches[(stack >> CACHE_STACK_SHIFT) % CACHE_COUNT];
+}
+
+static void * klmalloc_cache_alloc(uintptr_t bin) {
+	struct klmalloc_cache * cache = klmalloc_cache_get();
+	spin_lock(&cache->lock, __FUNCTION__);
+	if (!cache->count[bin]) {
+		spin_lock(&mem_lock, __FUNCTION__);
+		while (cache->count[bin] < CACHE_BATCH) {
+			cache->objects[bin][cache->count[bin]++] = klmalloc(1UL << (SMALLEST_BIN_LOG + bin));
+		}
+		spin_unlock(&mem_lock);
+	}
+	void * out = cache->objects[bin][--cache->count[bin]];
+	spin_unlock(&cache->lock);
+	return out;
+}
+
+static void klmalloc_cache_free(void * ptr, uintptr_t bin) {
+	struct klmalloc_cache * cache = klmalloc_cache_get();
+	spin_lock(&cache->lock, __FUNCTION__);
+	if (cache->count[bin] == CACHE_SIZE) {
+		/* Send back the ones that have been sitting here the longest. */
+		spin_lock(&mem_lock, __FUNCTION__);
+		for (unsigned int i = 0; i < CACHE_BATCH; ++i) {
+			klfree(cache->objects[bin][i]);
+		}
+		if (klmalloc_free_pages > TRIM_THRESHOLD) {
+			klmalloc_trim(TRIM_KEEP);
+		}
+		spin_unlock(&mem_lock);
+		memmove(cache->objects[bin], cache->objects[bin] + CACHE_BATCH, sizeof(void*) * (CACHE_SIZE - CACHE_BATCH));
+		cache->count[bin] -= CACHE_BATCH;
+	}
+	cache->objects[bin][cache->count[bin]++] = ptr;
+	spin_unlock(&cache->lock);
+}
+
+/*
+ * Return everything in every cache to the bins.
+ */
+static void klmalloc_cache_drain(void) {
+	for (unsigned int i = 0; i < CACHE_COUNT; ++i) {
+		struct klmalloc_cache * cache = &klmalloc_caches[i];
+		spin_lock(&cache->lock, __FUNCTION__);
+		spin_lock(&mem_lock, __FUNCTION__);
+		for (unsigned int bin = 0; bin < BIG_BIN; ++bin) {
+			while (cache->count[bin]) {
+				klfree(cache->objects[bin][--cache->count[bin]]);
+			}
+		}
+		spin_unlock(&mem_lock);
+		spin_unlock(&cache->lock);
+	}
 }
+
 /* }}} */
+/* Trimming {{{ */
 
+/*
+ * Remember a trimmed page for reuse.
+ * Returns 0 if there was no room to remember it.
+ */
+static int klmalloc_spare_add(uintptr_t page) {
+	if (klmalloc_spare_count == klmalloc_spare_size) {
+		uintptr_t size = klmalloc_spare_size ? klmalloc_spare_size * 2 : PAGE_SIZE / sizeof(uintptr_t);
+		uintptr_t * spare = klmalloc_spare
+			? klmalloc_big_realloc(klmalloc_spare, size * sizeof(uintptr_t))
+			: klmalloc_big_alloc(size * sizeof(uintptr_t));
+		if (!spare) return 0;
+		klmalloc_spare = spare;
+		klmalloc_spare_size = size;
+	}
+	klmalloc_spare[klmalloc_spare_count++] = page;
+	return 1;
+}
 
+/*
+ * Give the kernel back the small-bin pages that have nothing taken
+ * out of them, leaving @keep of them in place. The pages are replaced
+ * with fresh anonymous memory, which has no frames behind it until
+ * something touches it again. mem_lock must be held.
+ */
+static int klmalloc_trim(uintptr_t keep) {
+	int released = 0;
+	for (unsigned int bin = 0; bin < BIG_BIN && klmalloc_free_pages > keep; ++bin) {
+		klmalloc_bin_header ** link = &klmalloc_bin_head[bin].first;
+		while (*link && klmalloc_free_pages > keep) {
+			klmalloc_bin_header * header = *link;
+			if (header->used || !klmalloc_spare_add((uintptr_t)header)) {
+				link = &header->next;
+				continue;
+			}
+			*link = header->next;
+			klmalloc_free_pages--;
+			mmap(header, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+			released = 1;
+		}
+	}
+	return released;
+}
+
+/* }}} */
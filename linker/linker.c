@@ -6,12 +6,10 @@
  * shared library dependencies.
  *
  * As of writing, this is a simplistic and not-fully-compliant
- * implementation of ELF dynamic linking. It suffers from a number
- * of issues, including not actually sharing libraries (there
- * isn't a sufficient mechanism in the kernel at the moment for
- * doing that - we need something with copy-on-write, preferably
- * an mmap-file mechanism), as well as not handling symbol
- * resolution correctly.
+ * implementation of ELF dynamic linking. Segments are mapped
+ * privately from their files, so they are paged in on demand, but
+ * each process still gets its own copy of any page it relocates,
+ * and symbol resolution is not handled correctly.
  *
  * However, it's sufficient for our purposes, and works well enough
  * to load Python C modules.
@@ -30,6 +28,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/sysfunc.h>
+#include <sys/mman.h>
 #include <syscall.h>
 
 #include <kernel/elf.h>
@@ -278,10 +277,52 @@ static size_t object_calculate_size(elf_t * object) {
 	return end_addr - base_addr;
 }
 
+/*
+ * Map a PT_LOAD segment straight from the file. Pages are only
+ * read in when they are first touched, and read-only pages of a
+ * library are never copied at all. Returns 0 if the segment could
+ * not be mapped this way and needs to be read in the old way.
+ */
+static int object_map_segment(elf_t * object, uintptr_t base, Elf64_Phdr * phdr, uintptr_t * mapped_end) {
+	uintptr_t vaddr     = base + phdr->p_vaddr;
+	uintptr_t seg_start = vaddr & ~0xFFFUL;
+	uintptr_t file_end  = vaddr + phdr->p_filesz;
+	uintptr_t map_end   = (file_end + 0xFFF) & ~0xFFFUL;
+	uintptr_t mem_end   = (vaddr + phdr->p_memsz + 0xFFF) & ~0xFFFUL;
+
+	/* File offset and address must agree within a page */
+	if ((vaddr & 0xFFF) != (phdr->p_offset & 0xFFF)) return 0;
+
+	/* Shares a page with the previous segment; load the old way, but write to the
+	 * page first so it is our own copy and not the zero page the BSS started as. */
+	if (seg_start < *mapped_end) {
+		*(volatile char *)seg_start = *(volatile char *)seg_start;
+		return 0;
+	}
+
+	int prot = PROT_READ | PROT_WRITE | PROT_EXEC;
+
+	if (map_end > seg_start) {
+		if (mmap((void *)seg_start, map_end - seg_start, prot, MAP_PRIVATE | MAP_FIXED,
+			fileno(object->file), phdr->p_offset & ~0xFFFUL) == MAP_FAILED) return 0;
+		/* Whatever follows the file data in the last page is the start of the BSS */
+		memset((void *)file_end, 0, map_end - file_end);
+	}
+
+	if (mem_end > map_end) {
+		if (mmap((void *)map_end, mem_end - map_end, prot, MAP_PRIVATE | MAP_FIXED | MAP_ANONYMOUS, -1, 0) == MAP_FAILED) return 0;
+	}
+
+	*mapped_end = mem_end;
+	clear_cache(vaddr, file_end);
+	return 1;
+}
+
 /* Load an object into memory */
 static uintptr_t object_load(elf_t * object, uintptr_t base) {
 
 	uintptr_t end_addr = 0x0;
+	uintptr_t mapped_end = 0x0;
 
 	object->base = base;
 
@@ -296,6 +337,13 @@ static uintptr_t object_load(elf_t * object, uintptr_t base) {
 		switch (phdr.p_type) {
 			case PT_LOAD:
 				{
+					if (object_map_segment(object, base, &phdr, &mapped_end)) {
+						if (end_addr < phdr.p_vaddr + base + phdr.p_memsz) {
+							end_addr = phdr.p_vaddr + base + phdr.p_memsz;
+						}
+						break;
+					}
+
 					/* Request memory to load this PHDR into */
 					char * args[] = {(char *)(base + phdr.p_vaddr), (char *)phdr.p_memsz};
 					sysfunc(TOARU_SYS_FUNC_MMAP, args);
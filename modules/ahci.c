@@ -3,19 +3,39 @@
  * @file modules/ahci.c
  * @package x86_64
  *
- * @warning This is a stub driver.
+ * Drives SATA disks attached to AHCI host controllers. Each disk port
+ * gets a command list with one command table per slot; transfers are
+ * described to the controller with a scatter-gather list built from the
+ * physical pages behind the caller's buffer, so data goes straight to
+ * and from the block cache without bouncing.
+ *
+ * Disks that support native command queuing get up to 32 reads and
+ * writes in flight at once, which lets concurrent readers and the block
+ * cache's read-ahead keep the drive busy. Completions are collected in
+ * the interrupt handler, which wakes the threads waiting on them.
+ *
+ * ATAPI devices are only put into an idle state.
  *
  * @copyright
  * This file is part of ToaruOS and is released under the terms
  * of the NCSA / University of Illinois License - see LICENSE.md
  * Copyright (C) 2021 K. Lange
  */
+#include <errno.h>
+#include <kernel/types.h>
+#include <kernel/string.h>
 #include <kernel/syscall.h>
 #include <kernel/module.h>
 #include <kernel/printf.h>
 #include <kernel/pci.h>
 #include <kernel/vfs.h>
 #include <kernel/mmu.h>
+#include <kernel/list.h>
+#include <kernel/process.h>
+#include <kernel/spinlock.h>
+#include <kernel/bcache.h>
+
+#include <kernel/arch/x86_64/irq.h>
 
 static uint32_t mmio_read4(uintptr_t mmiobase, intptr_t offset) {
 	volatile uint32_t * data = (volatile uint32_t *)(mmiobase + offset);
@@ -36,6 +56,36 @@ static char * ahci_device_name(uint32_t pcidev, int port) {
 	return buf;
 }
 
+/* Host controller registers */
+#define AHCI_HBA_CAP     0x00
+#define AHCI_HBA_GHC     0x04
+#define AHCI_HBA_IS      0x08
+#define AHCI_HBA_PI      0x0C
+#define AHCI_HBA_VS      0x10
+
+#define AHCI_CAP_S64A    (1UL << 31)
+#define AHCI_CAP_SNCQ    (1UL << 30)
+#define AHCI_CAP_SCLO    (1UL << 24)
+#define AHCI_CAP_NCS(c)  ((((c) >> 8) & 0x1F) + 1)
+
+#define AHCI_GHC_AE      (1UL << 31)
+#define AHCI_GHC_IE      (1UL << 1)
+
+/* Port registers, relative to 0x100 + port * 0x80 */
+#define AHCI_PXCLB       0x00
+#define AHCI_PXCLBU      0x04
+#define AHCI_PXFB        0x08
+#define AHCI_PXFBU       0x0C
+#define AHCI_PXIS        0x10
+#define AHCI_PXIE        0x14
+#define AHCI_PXCMD_REG   0x18
+#define AHCI_PXTFD       0x20
+#define AHCI_PXSIG       0x24
+#define AHCI_PXSSTS      0x28
+#define AHCI_PXSERR      0x30
+#define AHCI_PXSACT      0x34
+#define AHCI_PXCI        0x38
+
 #define AHCI_PXCMD_ST    (1 << 0UL)
 #define AHCI_PXCMD_SUD   (1 << 1UL)
 #define AHCI_PXCMD_POD   (1 << 2UL)
@@ -45,6 +95,595 @@ static char * ahci_device_name(uint32_t pcidev, int port) {
 #define AHCI_PXCMD_FR    (1 << 14UL)
 #define AHCI_PXCMD_CR    (1 << 15UL)
 
+#define AHCI_PXIS_DHRS   (1UL << 0)  /* Device to host register FIS */
+#define AHCI_PXIS_PSS    (1UL << 1)  /* PIO setup FIS */
+#define AHCI_PXIS_DSS    (1UL << 2)  /* DMA setup FIS */
+#define AHCI_PXIS_SDBS   (1UL << 3)  /* Set device bits FIS (queued completions) */
+#define AHCI_PXIS_DPS    (1UL << 5)  /* Descriptor processed */
+#define AHCI_PXIS_IFS    (1UL << 27) /* Interface fatal error */
+#define AHCI_PXIS_HBDS   (1UL << 28) /* Host bus data error */
+#define AHCI_PXIS_HBFS   (1UL << 29) /* Host bus fatal error */
+#define AHCI_PXIS_TFES   (1UL << 30) /* Task file error */
+
+#define AHCI_PXIS_ERROR  (AHCI_PXIS_IFS | AHCI_PXIS_HBDS | AHCI_PXIS_HBFS | AHCI_PXIS_TFES)
+#define AHCI_PXIE_MASK   (AHCI_PXIS_DHRS | AHCI_PXIS_PSS | AHCI_PXIS_DSS | AHCI_PXIS_SDBS | AHCI_PXIS_DPS | AHCI_PXIS_ERROR)
+
+#define AHCI_TFD_BSY     0x80
+#define AHCI_TFD_DRQ     0x08
+#define AHCI_TFD_ERR     0x01
+
+#define AHCI_SIG_ATA     0x00000101
+#define AHCI_SIG_ATAPI   0xeb140101
+
+#define ATA_CMD_READ_DMA_EXT      0x25
+#define ATA_CMD_WRITE_DMA_EXT     0x35
+#define ATA_CMD_READ_FPDMA        0x60
+#define ATA_CMD_WRITE_FPDMA       0x61
+#define ATA_CMD_CACHE_FLUSH_EXT   0xEA
+#define ATA_CMD_IDENTIFY          0xEC
+
+/* Words of IDENTIFY DEVICE data */
+#define ATA_IDENT_MODEL        27
+#define ATA_IDENT_SECTORS_28   60
+#define ATA_IDENT_QUEUE_DEPTH  75
+#define ATA_IDENT_SATA_CAPS    76
+#define ATA_IDENT_COMMANDSETS  83
+#define ATA_IDENT_SECTORS_48   100
+#define ATA_IDENT_SECTOR_INFO  106
+#define ATA_IDENT_SECTOR_SIZE  117
+
+/*
+ * A command table holds the command FIS and the scatter-gather list.
+ * The largest transfer we issue is AHCI_MAX_BLOCKS cache blocks, which
+ * needs one entry per page plus one if the buffer isn't page-aligned.
+ */
+#define AHCI_MAX_BLOCKS  64
+#define AHCI_PRDT_MAX    72
+#define AHCI_PRD_MAX     0x400000 /* Bytes one entry can describe */
+
+#define AHCI_SPIN_TIMEOUT 1000000
+
+struct ahci_cmd_header {
+	uint16_t flags;          /* FIS length in dwords, direction, ... */
+	uint16_t prdtl;          /* Entries in the scatter-gather list */
+	volatile uint32_t prdbc; /* Bytes transferred */
+	uint32_t ctba;
+	uint32_t ctbau;
+	uint32_t reserved[4];
+} __attribute__((packed));
+
+#define AHCI_CMD_FIS_LEN 5 /* A register FIS is 20 bytes */
+#define AHCI_CMD_WRITE   (1 << 6)
+
+struct ahci_prd {
+	uint32_t dba;
+	uint32_t dbau;
+	uint32_t reserved;
+	uint32_t dbc;            /* Byte count - 1 */
+} __attribute__((packed));
+
+struct ahci_cmd_table {
+	uint8_t cfis[64];
+	uint8_t acmd[16];
+	uint8_t reserved[48];
+	struct ahci_prd prdt[AHCI_PRDT_MAX];
+} __attribute__((packed));
+
+#define AHCI_SLOT_PENDING 1
+
+struct ahci_hba;
+
+struct ahci_port {
+	struct ahci_hba * hba;
+	int port;
+	uintptr_t regs;
+
+	/* Command list, received FISes and IDENTIFY data share one page */
+	struct ahci_cmd_header * cmd_list;
+	uintptr_t cmd_list_phys;
+	uint16_t * identify;
+	uintptr_t identify_phys;
+	struct ahci_cmd_table * tables;
+	uintptr_t tables_phys;
+
+	int slots;               /* Usable command slots */
+	int ncq;
+
+	/*
+	 * Slots are claimed by the thread issuing the command and given back
+	 * when it has collected the result. Queued and non-queued commands
+	 * can't be mixed, so @c queued says which kind the claimed slots are
+	 * and @c draining holds off new ones while the other kind waits.
+	 */
+	spin_lock_t lock;
+	list_t * waiters;
+	uint32_t claimed;
+	uint32_t active;         /* Issued to the controller, not yet complete */
+	int queued;
+	int draining;
+	int status[32];
+
+	uint64_t sectors;
+	size_t sector_size;
+	size_t sectors_per_block;
+	char name[16];
+	struct bcache_device cache;
+};
+
+struct ahci_hba {
+	uint32_t pcidev;
+	uintptr_t mmio;
+	uint32_t cap;
+	int irq;
+	struct ahci_port * ports[32];
+};
+
+static int hba_count = 0;
+static struct ahci_hba * hbas[8] = {NULL};
+static char ahci_drive_char = 'a';
+
+static void * kvmalloc_p(size_t size, uintptr_t * outphys) {
+	uintptr_t index = mmu_allocate_n_frames(size / 0x1000) << 12;
+	*outphys = index;
+	void * out = mmu_map_from_physical(index);
+	memset(out, 0, size);
+	return out;
+}
+
+/**
+ * @brief Wait for bits in a port register to reach a value.
+ * @returns 0 when they did, 1 if we gave up.
+ */
+static int ahci_port_wait(struct ahci_port * port, intptr_t reg, uint32_t mask, uint32_t value) {
+	for (int i = 0; i < AHCI_SPIN_TIMEOUT; ++i) {
+		if ((mmio_read4(port->regs, reg) & mask) == value) return 0;
+	}
+	return 1;
+}
+
+static void ahci_port_stop(struct ahci_port * port) {
+	uint32_t cmd = mmio_read4(port->regs, AHCI_PXCMD_REG);
+	mmio_write4(port->regs, AHCI_PXCMD_REG, cmd & ~AHCI_PXCMD_ST);
+	ahci_port_wait(port, AHCI_PXCMD_REG, AHCI_PXCMD_CR, 0);
+	cmd = mmio_read4(port->regs, AHCI_PXCMD_REG);
+	mmio_write4(port->regs, AHCI_PXCMD_REG, cmd & ~AHCI_PXCMD_FRE);
+	ahci_port_wait(port, AHCI_PXCMD_REG, AHCI_PXCMD_FR, 0);
+}
+
+/**
+ * @brief Start processing the command list.
+ *
+ * If the device is still busy from a failed command, ask the controller
+ * to ignore that (command list override) so the port can start at all.
+ */
+static void ahci_port_start(struct ahci_port * port) {
+	mmio_write4(port->regs, AHCI_PXSERR, 0xFFFFFFFF);
+	mmio_write4(port->regs, AHCI_PXIS, 0xFFFFFFFF);
+
+	uint32_t cmd = mmio_read4(port->regs, AHCI_PXCMD_REG);
+	mmio_write4(port->regs, AHCI_PXCMD_REG, cmd | AHCI_PXCMD_SUD | AHCI_PXCMD_POD | AHCI_PXCMD_FRE);
+
+	if (ahci_port_wait(port, AHCI_PXTFD, AHCI_TFD_BSY | AHCI_TFD_DRQ, 0) && (port->hba->cap & AHCI_CAP_SCLO)) {
+		cmd = mmio_read4(port->regs, AHCI_PXCMD_REG);
+		mmio_write4(port->regs, AHCI_PXCMD_REG, cmd | AHCI_PXCMD_CLO);
+		ahci_port_wait(port, AHCI_PXCMD_REG, AHCI_PXCMD_CLO, 0);
+	}
+
+	cmd = mmio_read4(port->regs, AHCI_PXCMD_REG);
+	mmio_write4(port->regs, AHCI_PXCMD_REG, cmd | AHCI_PXCMD_ST);
+}
+
+/**
+ * @brief Fail everything in flight and restart the port.
+ *
+ * A queued command that fails stops the device from completing any of
+ * the others, so they all get an error. Requires the port lock.
+ */
+static void ahci_port_recover(struct ahci_port * port, uint32_t is) {
+	dprintf("ahci: %s: command failed (is=%#x tfd=%#x serr=%#x)\n", port->name, is,
+		mmio_read4(port->regs, AHCI_PXTFD), mmio_read4(port->regs, AHCI_PXSERR));
+
+	for (int i = 0; i < 32; ++i) {
+		if (port->active & (1UL << i)) port->status[i] = -EIO;
+	}
+	port->active = 0;
+
+	ahci_port_stop(port);
+	ahci_port_start(port);
+}
+
+static void ahci_port_interrupt(struct ahci_port * port) {
+	spin_lock(port->lock);
+
+	uint32_t is = mmio_read4(port->regs, AHCI_PXIS);
+	mmio_write4(port->regs, AHCI_PXIS, is);
+
+	if (is & AHCI_PXIS_ERROR) {
+		ahci_port_recover(port, is);
+	} else {
+		uint32_t pending = mmio_read4(port->regs, AHCI_PXCI) | mmio_read4(port->regs, AHCI_PXSACT);
+		uint32_t done = port->active & ~pending;
+		for (int i = 0; i < 32; ++i) {
+			if (done & (1UL << i)) port->status[i] = 0;
+		}
+		port->active &= ~done;
+	}
+
+	wakeup_queue(port->waiters);
+	spin_unlock(port->lock);
+}
+
+static int ahci_irq_handler(struct regs * r) {
+	int irq = r->int_no - 32;
+	int handled = 0;
+
+	for (int i = 0; i < hba_count; ++i) {
+		struct ahci_hba * hba = hbas[i];
+		if (hba->irq != irq) continue;
+
+		uint32_t is = mmio_read4(hba->mmio, AHCI_HBA_IS);
+		if (!is) continue;
+
+		for (int p = 0; p < 32; ++p) {
+			if (!(is & (1UL << p))) continue;
+			if (hba->ports[p]) {
+				ahci_port_interrupt(hba->ports[p]);
+			} else {
+				uintptr_t regs = hba->mmio + 0x100 + p * 0x80;
+				mmio_write4(regs, AHCI_PXIS, mmio_read4(regs, AHCI_PXIS));
+			}
+		}
+		mmio_write4(hba->mmio, AHCI_HBA_IS, is);
+		handled = 1;
+	}
+
+	if (handled) irq_ack(irq);
+	return handled;
+}
+
+/**
+ * @brief Describe a kernel buffer to the controller, one physical run per entry.
+ * @returns Number of entries used, or -1 if the buffer can't be described.
+ */
+static int ahci_build_prdt(struct ahci_port * port, struct ahci_cmd_table * table, uint8_t * buffer, size_t size) {
+	union PML * dir = mmu_get_kernel_directory();
+	uintptr_t addr = (uintptr_t)buffer;
+	uintptr_t next = 0;
+	int n = 0;
+
+	while (size) {
+		size_t chunk = 0x1000 - (addr & 0xFFF);
+		if (chunk > size) chunk = size;
+
+		uintptr_t phys = mmu_map_to_physical(dir, addr);
+		if ((phys & 1) || phys >= (uintptr_t)-4) return -1;
+		if ((phys >> 32) && !(port->hba->cap & AHCI_CAP_S64A)) return -1;
+
+		if (n && phys == next && table->prdt[n-1].dbc + 1 + chunk <= AHCI_PRD_MAX) {
+			table->prdt[n-1].dbc += chunk;
+		} else {
+			if (n == AHCI_PRDT_MAX) return -1;
+			table->prdt[n].dba  = phys & 0xFFFFFFFF;
+			table->prdt[n].dbau = phys >> 32;
+			table->prdt[n].reserved = 0;
+			table->prdt[n].dbc  = chunk - 1;
+			n++;
+		}
+
+		next = phys + chunk;
+		addr += chunk;
+		size -= chunk;
+	}
+
+	return n;
+}
+
+/**
+ * @brief Fill in a host-to-device register FIS.
+ */
+static void ahci_build_fis(uint8_t * fis, uint8_t command, uint64_t lba, uint16_t count, uint16_t features, uint8_t device) {
+	memset(fis, 0, 20);
+	fis[0]  = 0x27; /* Register FIS, host to device */
+	fis[1]  = 0x80; /* This is a command */
+	fis[2]  = command;
+	fis[3]  = features & 0xFF;
+	fis[4]  = (lba >>  0) & 0xFF;
+	fis[5]  = (lba >>  8) & 0xFF;
+	fis[6]  = (lba >> 16) & 0xFF;
+	fis[7]  = device;
+	fis[8]  = (lba >> 24) & 0xFF;
+	fis[9]  = (lba >> 32) & 0xFF;
+	fis[10] = (lba >> 40) & 0xFF;
+	fis[11] = features >> 8;
+	fis[12] = count & 0xFF;
+	fis[13] = count >> 8;
+}
+
+/**
+ * @brief Claim a command slot for a command of the given kind.
+ *
+ * Requires the port lock.
+ * @returns Slot number, or -1 if the caller has to wait.
+ */
+static int ahci_claim_slot(struct ahci_port * port, int queued) {
+	if (port->claimed && port->queued != queued) {
+		port->draining = 1;
+		return -1;
+	}
+	if (!port->claimed) {
+		port->queued = queued;
+		port->draining = 0;
+	} else if (port->draining) {
+		return -1;
+	}
+
+	for (int i = 0; i < port->slots; ++i) {
+		if (!(port->claimed & (1UL << i))) {
+			port->claimed |= (1UL << i);
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+/**
+ * @brief Issue a command and sleep until it completes.
+ *
+ * @param buffer  Kernel buffer to transfer, or NULL for commands without data
+ * @param sectors Number of sectors to transfer
+ * @returns 0 on success or a negative error
+ */
+static int ahci_command(struct ahci_port * port, uint8_t command, uint64_t lba, size_t sectors, uint8_t * buffer, int write) {
+	int queued = (command == ATA_CMD_READ_FPDMA || command == ATA_CMD_WRITE_FPDMA);
+	int slot;
+
+	spin_lock(port->lock);
+	while ((slot = ahci_claim_slot(port, queued)) < 0) {
+		sleep_on_unlocking(port->waiters, &port->lock);
+		spin_lock(port->lock);
+	}
+	spin_unlock(port->lock);
+
+	struct ahci_cmd_table * table = &port->tables[slot];
+	int prds = 0;
+	if (buffer) {
+		prds = ahci_build_prdt(port, table, buffer, sectors * port->sector_size);
+	}
+
+	int status;
+	spin_lock(port->lock);
+	if (prds < 0) {
+		dprintf("ahci: %s: can't map buffer %p for DMA\n", port->name, (void *)buffer);
+		status = -EIO;
+	} else {
+		if (queued) {
+			ahci_build_fis(table->cfis, command, lba, slot << 3, sectors, 0x40);
+		} else {
+			ahci_build_fis(table->cfis, command, lba, sectors, 0, 0x40);
+		}
+		port->cmd_list[slot].flags = AHCI_CMD_FIS_LEN | (write ? AHCI_CMD_WRITE : 0);
+		port->cmd_list[slot].prdtl = prds;
+		port->cmd_list[slot].prdbc = 0;
+
+		port->status[slot] = AHCI_SLOT_PENDING;
+		port->active |= (1UL << slot);
+		if (queued) mmio_write4(port->regs, AHCI_PXSACT, 1UL << slot);
+		mmio_write4(port->regs, AHCI_PXCI, 1UL << slot);
+
+		while (port->status[slot] == AHCI_SLOT_PENDING) {
+			sleep_on_unlocking(port->waiters, &port->lock);
+			spin_lock(port->lock);
+		}
+		status = port->status[slot];
+	}
+
+	port->claimed &= ~(1UL << slot);
+	wakeup_queue(port->waiters);
+	spin_unlock(port->lock);
+
+	return status;
+}
+
+/**
+ * @brief Transfer whole cache blocks, trimming at the end of the disk.
+ */
+static int ahci_transfer_blocks(struct ahci_port * port, uint64_t block, size_t count, uint8_t * buffer, int write) {
+	uint8_t command;
+	if (port->ncq) {
+		command = write ? ATA_CMD_WRITE_FPDMA : ATA_CMD_READ_FPDMA;
+	} else {
+		command = write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT;
+	}
+
+	while (count) {
+		size_t n = count < AHCI_MAX_BLOCKS ? count : AHCI_MAX_BLOCKS;
+		uint64_t lba = block * port->sectors_per_block;
+		size_t sectors = n * port->sectors_per_block;
+
+		if (lba >= port->sectors) {
+			if (!write) memset(buffer, 0, n * BCACHE_BLOCK_SIZE);
+		} else {
+			if (lba + sectors > port->sectors) {
+				size_t tail = sectors - (port->sectors - lba);
+				sectors -= tail;
+				if (!write) memset(buffer + sectors * port->sector_size, 0, tail * port->sector_size);
+			}
+			int status = ahci_command(port, command, lba, sectors, buffer, write);
+			if (status) return status;
+		}
+
+		block  += n;
+		count  -= n;
+		buffer += n * BCACHE_BLOCK_SIZE;
+	}
+
+	return 0;
+}
+
+static int ahci_read_blocks(struct bcache_device * cache, uint64_t block, size_t count, uint8_t * buffer) {
+	return ahci_transfer_blocks(cache->driver, block, count, buffer, 0);
+}
+
+static int ahci_write_blocks(struct bcache_device * cache, uint64_t block, size_t count, uint8_t * buffer) {
+	return ahci_transfer_blocks(cache->driver, block, count, buffer, 1);
+}
+
+static int ahci_flush(struct bcache_device * cache) {
+	return ahci_command(cache->driver, ATA_CMD_CACHE_FLUSH_EXT, 0, 0, NULL, 0);
+}
+
+static void open_ahci(fs_node_t * node, unsigned int flags) {
+	return;
+}
+
+static void close_ahci(fs_node_t * node) {
+	return;
+}
+
+static fs_node_t * ahci_device_create(struct ahci_port * port) {
+	fs_node_t * fnode = malloc(sizeof(fs_node_t));
+	memset(fnode, 0x00, sizeof(fs_node_t));
+	fnode->inode = 0;
+	snprintf(fnode->name, 10, "%s", port->name);
+	fnode->device  = &port->cache;
+	fnode->uid = 0;
+	fnode->gid = 0;
+	fnode->mask    = 0660;
+	fnode->length  = port->sectors * port->sector_size;
+	fnode->flags   = FS_BLOCKDEVICE;
+	fnode->read    = bcache_node_read;
+	fnode->write   = bcache_node_write;
+	fnode->open    = open_ahci;
+	fnode->close   = close_ahci;
+	fnode->ioctl   = bcache_node_ioctl;
+
+	port->cache.name = port->name;
+	port->cache.driver = port;
+	port->cache.size = fnode->length;
+	port->cache.read_blocks = ahci_read_blocks;
+	port->cache.write_blocks = ahci_write_blocks;
+	port->cache.flush = ahci_flush;
+	bcache_register(&port->cache);
+	return fnode;
+}
+
+/**
+ * @brief Run IDENTIFY DEVICE on slot 0, polling, before interrupts are on.
+ */
+static int ahci_identify(struct ahci_port * port) {
+	struct ahci_cmd_table * table = &port->tables[0];
+	ahci_build_fis(table->cfis, ATA_CMD_IDENTIFY, 0, 0, 0, 0);
+	table->prdt[0].dba  = port->identify_phys & 0xFFFFFFFF;
+	table->prdt[0].dbau = port->identify_phys >> 32;
+	table->prdt[0].dbc  = 512 - 1;
+	port->cmd_list[0].flags = AHCI_CMD_FIS_LEN;
+	port->cmd_list[0].prdtl = 1;
+	port->cmd_list[0].prdbc = 0;
+
+	mmio_write4(port->regs, AHCI_PXCI, 1);
+	for (int i = 0; i < AHCI_SPIN_TIMEOUT; ++i) {
+		if (mmio_read4(port->regs, AHCI_PXIS) & AHCI_PXIS_ERROR) break;
+		if (!(mmio_read4(port->regs, AHCI_PXCI) & 1)) {
+			mmio_write4(port->regs, AHCI_PXIS, 0xFFFFFFFF);
+			return 0;
+		}
+	}
+
+	ahci_port_stop(port);
+	return 1;
+}
+
+static void ahci_setup_disk(fs_node_t * stderr, struct ahci_hba * hba, int port_no) {
+	struct ahci_port * port = calloc(1, sizeof(struct ahci_port));
+	port->hba  = hba;
+	port->port = port_no;
+	port->regs = hba->mmio + 0x100 + port_no * 0x80;
+
+	ahci_port_stop(port);
+
+	/* Command list at 0x000, received FISes at 0x400, IDENTIFY data at 0x800 */
+	uintptr_t page_phys;
+	uint8_t * page = kvmalloc_p(0x1000, &page_phys);
+	port->cmd_list      = (void *)page;
+	port->cmd_list_phys = page_phys;
+	port->identify      = (void *)(page + 0x800);
+	port->identify_phys = page_phys + 0x800;
+	port->tables = kvmalloc_p((sizeof(struct ahci_cmd_table) * 32 + 0xFFF) & ~0xFFF, &port->tables_phys);
+
+	for (int i = 0; i < 32; ++i) {
+		uintptr_t table = port->tables_phys + i * sizeof(struct ahci_cmd_table);
+		port->cmd_list[i].ctba  = table & 0xFFFFFFFF;
+		port->cmd_list[i].ctbau = table >> 32;
+	}
+
+	mmio_write4(port->regs, AHCI_PXCLB,  port->cmd_list_phys & 0xFFFFFFFF);
+	mmio_write4(port->regs, AHCI_PXCLBU, port->cmd_list_phys >> 32);
+	mmio_write4(port->regs, AHCI_PXFB,   (page_phys + 0x400) & 0xFFFFFFFF);
+	mmio_write4(port->regs, AHCI_PXFBU,  (page_phys + 0x400) >> 32);
+	mmio_write4(port->regs, AHCI_PXIE, 0);
+
+	ahci_port_start(port);
+
+	if (ahci_identify(port)) {
+		fprintf(stderr, "ahci:           IDENTIFY failed (tfd = %#x)\n", mmio_read4(port->regs, AHCI_PXTFD));
+		return;
+	}
+
+	uint16_t * id = port->identify;
+	if (id[ATA_IDENT_COMMANDSETS] & (1 << 10)) {
+		port->sectors = *(uint64_t *)&id[ATA_IDENT_SECTORS_48];
+	} else {
+		port->sectors = *(uint32_t *)&id[ATA_IDENT_SECTORS_28];
+	}
+
+	port->sector_size = 512;
+	if ((id[ATA_IDENT_SECTOR_INFO] & 0xC000) == 0x4000 && (id[ATA_IDENT_SECTOR_INFO] & (1 << 12))) {
+		port->sector_size = (*(uint32_t *)&id[ATA_IDENT_SECTOR_SIZE]) * 2;
+	}
+
+	if (!port->sectors || !port->sector_size || BCACHE_BLOCK_SIZE % port->sector_size) {
+		fprintf(stderr, "ahci:           unusable geometry (%lu sectors of %zu bytes)\n", port->sectors, port->sector_size);
+		ahci_port_stop(port);
+		return;
+	}
+	port->sectors_per_block = BCACHE_BLOCK_SIZE / port->sector_size;
+
+	char model[41];
+	for (int i = 0; i < 20; ++i) {
+		model[i*2]   = id[ATA_IDENT_MODEL + i] >> 8;
+		model[i*2+1] = id[ATA_IDENT_MODEL + i] & 0xFF;
+	}
+	model[40] = '\0';
+	for (int i = 39; i >= 0 && model[i] == ' '; --i) model[i] = '\0';
+
+	port->slots = AHCI_CAP_NCS(hba->cap);
+	if ((hba->cap & AHCI_CAP_SNCQ) && (id[ATA_IDENT_SATA_CAPS] & (1 << 8))) {
+		int depth = (id[ATA_IDENT_QUEUE_DEPTH] & 0x1F) + 1;
+		if (depth < port->slots) port->slots = depth;
+		port->ncq = 1;
+	}
+
+	port->waiters = list_create("ahci waiters", port);
+	spin_init(port->lock);
+	snprintf(port->name, sizeof(port->name), "sd%c", ahci_drive_char);
+
+	fprintf(stderr, "ahci:           %s: %s, %lu sectors of %zu bytes, %s with %d slots\n",
+		port->name, model, port->sectors, port->sector_size,
+		port->ncq ? "NCQ" : "no NCQ", port->slots);
+
+	mmio_write4(port->regs, AHCI_PXIS, 0xFFFFFFFF);
+	mmio_write4(port->regs, AHCI_PXIE, AHCI_PXIE_MASK);
+	hba->ports[port_no] = port;
+
+	char devname[64];
+	snprintf((char *)&devname, 20, "/dev/%s", port->name);
+	fs_node_t * node = ahci_device_create(port);
+	vfs_mount(devname, node);
+
+	ahci_drive_char++;
+}
+
 #define DPRINT(fmt,...) fprintf(stderr, "%s: " fmt, ahci_device_name(pcidev,port), ##__VA_ARGS__)
 static void ahci_setup_atapi(fs_node_t * stderr, uint32_t pcidev, uintptr_t mmio_addr, int port) {
 	intptr_t offset = 0x100 + port * 0x80;
@@ -69,6 +708,7 @@ static void ahci_setup_atapi(fs_node_t * stderr, uint32_t pcidev, uintptr_t mmio
 static void find_ahci(uint32_t device, uint16_t vendorid, uint16_t deviceid, void * extra) {
 	if (pci_find_type(device) != 0x0106) return; /* Mass Storage, SATA controller */
 	if (pci_read_field(device, PCI_PROG_IF, 1) != 0x01) return; /* AHCI */
+	if (hba_count == sizeof(hbas) / sizeof(*hbas)) return;
 	fs_node_t * stderr = extra;
 
 	fprintf(stderr, "ahci: located device at %#x\n", device);
@@ -76,44 +716,55 @@ static void find_ahci(uint32_t device, uint16_t vendorid, uint16_t deviceid, voi
 	uint16_t command_reg = pci_read_field(device, PCI_COMMAND, 2);
 	command_reg |= (1 << 2);
 	command_reg |= (1 << 1);
-	command_reg ^= (1 << 10);
+	command_reg &= ~(1 << 10);
 	pci_write_field(device, PCI_COMMAND, 2, command_reg);
 
 	fprintf(stderr, "ahci: examining PCI config space...\n");
 	fprintf(stderr, "ahci: interrupt line = %d\n", pci_get_interrupt(device));
 	fprintf(stderr, "ahci: BAR5 = %#x\n", pci_read_field(device, PCI_BAR5, 4));
 
-	uintptr_t mmio_addr = (uintptr_t)mmu_map_mmio_region(pci_read_field(device, PCI_BAR5, 4) & 0xFFFFFFF0, 0x2000); /* I have no idea how much space this needs */
+	uintptr_t mmio_addr = (uintptr_t)mmu_map_mmio_region(pci_read_field(device, PCI_BAR5, 4) & 0xFFFFFFF0, 0x2000); /* 0x100 + 32 ports * 0x80 */
 	fprintf(stderr, "ahci: mapping mmio to %#zx\n", mmio_addr);
 
-	uint32_t enabledPorts = mmio_read4(mmio_addr, 0x0C);
+	uint32_t enabledPorts = mmio_read4(mmio_addr, AHCI_HBA_PI);
 	fprintf(stderr, "ahci: implemented ports = %#x\n", enabledPorts);
 
-	uint32_t ahciVersion = mmio_read4(mmio_addr, 0x10);
+	uint32_t ahciVersion = mmio_read4(mmio_addr, AHCI_HBA_VS);
 	fprintf(stderr, "ahci: version %d.%d%d\n",
 		(ahciVersion >> 16) & 0xFFF,
 		(ahciVersion >> 8) & 0xFF,
 		(ahciVersion) & 0xFF);
 
 	fprintf(stderr, "ahci: Telling host controller we are aware of it.\n");
-	mmio_write4(mmio_addr, 0x04, mmio_read4(mmio_addr, 0x04) | (1 << 31UL));
+	mmio_write4(mmio_addr, AHCI_HBA_GHC, mmio_read4(mmio_addr, AHCI_HBA_GHC) | AHCI_GHC_AE);
+
+	struct ahci_hba * hba = calloc(1, sizeof(struct ahci_hba));
+	hba->pcidev = device;
+	hba->mmio   = mmio_addr;
+	hba->cap    = mmio_read4(mmio_addr, AHCI_HBA_CAP);
+	hba->irq    = pci_get_interrupt(device);
+	fprintf(stderr, "ahci: %d command slots, %s\n", AHCI_CAP_NCS(hba->cap),
+		(hba->cap & AHCI_CAP_SNCQ) ? "supports NCQ" : "no NCQ");
 
 	int offset = 0x100;
 	for (int port = 0; port < 32; ++port) {
 		if (enabledPorts & (1UL << port)) {
 			/* Check status */
-			uint32_t portSig    = mmio_read4(mmio_addr, offset + 0x24);
-			uint32_t portStatus = mmio_read4(mmio_addr, offset + 0x28);
+			uint32_t portSig    = mmio_read4(mmio_addr, offset + AHCI_PXSIG);
+			uint32_t portStatus = mmio_read4(mmio_addr, offset + AHCI_PXSSTS);
 			fprintf(stderr, "ahci: port %d: status = %#x\n", port, portStatus);
 			fprintf(stderr, "ahci: port %d: sig    = %#x\n", port, portSig);
 
 			switch (portSig) {
-				case 0xeb140101:
+				case AHCI_SIG_ATAPI:
 					fprintf(stderr, "ahci:           ATAPI (CD, DVD)\n");
 					ahci_setup_atapi(stderr, device, mmio_addr, port);
 					break;
-				case 0x00000101:
+				case AHCI_SIG_ATA:
 					fprintf(stderr, "ahci:           hard disk\n");
+					if ((portStatus & 0xF) == 3) {
+						ahci_setup_disk(stderr, hba, port);
+					}
 					break;
 				case 0xffff0101:
 					fprintf(stderr, "ahci:           no device\n");
@@ -127,8 +778,15 @@ static void find_ahci(uint32_t device, uint16_t vendorid, uint16_t deviceid, voi
 		offset += 0x80;
 	}
 
+	int shared = 0;
+	for (int i = 0; i < hba_count; ++i) {
+		if (hbas[i]->irq == hba->irq) shared = 1;
+	}
+	hbas[hba_count++] = hba;
+	if (!shared) irq_install_handler(hba->irq, ahci_irq_handler, "ahci");
 
-	
+	mmio_write4(mmio_addr, AHCI_HBA_IS, 0xFFFFFFFF);
+	mmio_write4(mmio_addr, AHCI_HBA_GHC, mmio_read4(mmio_addr, AHCI_HBA_GHC) | AHCI_GHC_IE);
 }
 
 static int init(int argc, char * argv[]) {
@@ -27,6 +27,7 @@
 #include <kernel/time.h>
 #include <kernel/misc.h>
 #include <kernel/mutex.h>
+#include <kernel/bcache.h>
 
 #include <kernel/arch/x86_64/ports.h>
 #include <kernel/arch/x86_64/irq.h>
@@ -169,11 +170,12 @@ static void find_ata_pci(uint32_t device, uint16_t vendorid, uint16_t deviceid,
 	}
 }
 
+/* Bus master physical region descriptor */
 typedef struct {
-	uintptr_t offset;
-	uint16_t bytes;
+	uint32_t offset;
+	uint16_t bytes; /* 0 means 64KiB */
 	uint16_t last;
-} prdt_t;
+} __attribute__((packed)) prdt_t;
 
 struct ata_device {
 	int io_base;
@@ -188,6 +190,7 @@ struct ata_device {
 	uint32_t bar4;
 	uint32_t atapi_lba;
 	uint32_t atapi_sector_size;
+	struct bcache_device cache;
 };
 
 static struct ata_device ata_primary_master   = {.io_base = 0x1F0, .control = 0x3F6, .slave = 0};
@@ -202,30 +205,20 @@ static spin_lock_t atapi_cmd_lock = { 0 };
 #define ATA_CACHE_SIZE  4096
 #define SECTORS_PER_CACHE_BLOCK 8
 
-static void ata_device_read_sector(struct ata_device * dev, uint64_t lba, uint8_t * buf);
-static void ata_device_read_sector_atapi(struct ata_device * dev, uint64_t lba, uint8_t * buf);
-static void ata_device_write_sector(struct ata_device * dev, uint64_t lba, uint8_t * buf);
-static void ata_device_write_sector_actual(struct ata_device * dev, uint64_t lba);
-
-struct CacheEntry {
-	struct ata_device * dev;
-	uint64_t lba;
-	uint64_t last_use;
-	uint64_t flags;
-};
+/*
+ * Largest transfer issued as one command. The PRDT gets a page of its
+ * own, which has room for far more entries than this needs.
+ */
+#define ATA_DMA_MAX_BLOCKS 64
+#define ATA_PRDT_MAX (4096 / sizeof(prdt_t))
 
-#define CACHE_COUNT 4096
+static void ata_device_read_sector_atapi(struct ata_device * dev, uint64_t lba, uint8_t * buf);
+static int ata_read_blocks(struct bcache_device * cache, uint64_t block, size_t count, uint8_t * buffer);
+static int ata_write_blocks(struct bcache_device * cache, uint64_t block, size_t count, uint8_t * buffer);
+static int atapi_read_blocks(struct bcache_device * cache, uint64_t block, size_t count, uint8_t * buffer);
 
-static uint64_t hit_count = 0;
-static uint64_t miss_count = 0;
-static uint64_t eviction_count = 0;
-static uint64_t write_count = 0;
 static sched_mutex_t * ata_mutex = NULL;
 
-static struct CacheEntry * cache_entries = NULL;
-static char * cache_blocks = NULL;
-static uint64_t counter = 1;
-
 static off_t ata_max_offset(struct ata_device * dev) {
 	uint64_t sectors = dev->identity.sectors_48;
 	
@@ -245,57 +238,6 @@ static off_t atapi_max_offset(struct ata_device * dev) {
 	return (max_sector + 1) * dev->atapi_sector_size;
 }
 
-static ssize_t read_ata(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
-	struct ata_device * dev = (struct ata_device *)node->device;
-	unsigned int start_block = offset / ATA_CACHE_SIZE;
-	unsigned int end_block = (offset + size - 1) / ATA_CACHE_SIZE;
-	unsigned int x_offset = 0;
-
-
-	if (offset > ata_max_offset(dev)) {
-		return 0;
-	}
-
-	if (offset + (ssize_t)size > ata_max_offset(dev)) {
-		unsigned int i = ata_max_offset(dev) - offset;
-		size = i;
-	}
-
-	if (offset % ATA_CACHE_SIZE || size < ATA_CACHE_SIZE) {
-		unsigned int prefix_size = (ATA_CACHE_SIZE - (offset % ATA_CACHE_SIZE));
-		if (prefix_size > size) prefix_size = size;
-		char * tmp = malloc(ATA_CACHE_SIZE);
-		ata_device_read_sector(dev, start_block, (uint8_t *)tmp);
-
-		memcpy(buffer, (void *)((uintptr_t)tmp + ((uintptr_t)offset % ATA_CACHE_SIZE)), prefix_size);
-
-		free(tmp);
-
-		x_offset += prefix_size;
-		start_block++;
-	}
-
-	if ((offset + size)  % ATA_CACHE_SIZE && start_block <= end_block) {
-		unsigned int postfix_size = (offset + size) % ATA_CACHE_SIZE;
-		char * tmp = malloc(ATA_CACHE_SIZE);
-		ata_device_read_sector(dev, end_block, (uint8_t *)tmp);
-
-		memcpy((void *)((uintptr_t)buffer + size - postfix_size), tmp, postfix_size);
-
-		free(tmp);
-
-		end_block--;
-	}
-
-	while (start_block <= end_block) {
-		ata_device_read_sector(dev, start_block, (uint8_t *)((uintptr_t)buffer + x_offset));
-		x_offset += ATA_CACHE_SIZE;
-		start_block++;
-	}
-
-	return size;
-}
-
 static ssize_t read_atapi(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
 
 	struct ata_device * dev = (struct ata_device *)node->device;
@@ -350,60 +292,6 @@ static ssize_t read_atapi(fs_node_t *node, off_t offset, size_t size, uint8_t *b
 }
 
 
-static ssize_t write_ata(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
-	struct ata_device * dev = (struct ata_device *)node->device;
-
-	unsigned int start_block = offset / ATA_CACHE_SIZE;
-	unsigned int end_block = (offset + size - 1) / ATA_CACHE_SIZE;
-
-	unsigned int x_offset = 0;
-
-	if (offset > ata_max_offset(dev)) {
-		return 0;
-	}
-
-	if (offset + (ssize_t)size > ata_max_offset(dev)) {
-		unsigned int i = ata_max_offset(dev) - offset;
-		size = i;
-	}
-
-	if (offset % ATA_CACHE_SIZE) {
-		unsigned int prefix_size = (ATA_CACHE_SIZE - (offset % ATA_CACHE_SIZE));
-
-		char * tmp = malloc(ATA_CACHE_SIZE);
-		ata_device_read_sector(dev, start_block, (uint8_t *)tmp);
-
-		memcpy((void *)((uintptr_t)tmp + ((uintptr_t)offset % ATA_CACHE_SIZE)), buffer, prefix_size);
-		ata_device_write_sector(dev, start_block, (uint8_t *)tmp);
-
-		free(tmp);
-		x_offset += prefix_size;
-		start_block++;
-	}
-
-	if ((offset + size)  % ATA_CACHE_SIZE && start_block <= end_block) {
-		unsigned int postfix_size = (offset + size) % ATA_CACHE_SIZE;
-
-		char * tmp = malloc(ATA_CACHE_SIZE);
-		ata_device_read_sector(dev, end_block, (uint8_t *)tmp);
-
-		memcpy(tmp, (void *)((uintptr_t)buffer + size - postfix_size), postfix_size);
-
-		ata_device_write_sector(dev, end_block, (uint8_t *)tmp);
-
-		free(tmp);
-		end_block--;
-	}
-
-	while (start_block <= end_block) {
-		ata_device_write_sector(dev, start_block, (uint8_t *)((uintptr_t)buffer + x_offset));
-		x_offset += ATA_CACHE_SIZE;
-		start_block++;
-	}
-
-	return size;
-}
-
 static void open_ata(fs_node_t * node, unsigned int flags) {
 	return;
 }
@@ -412,38 +300,6 @@ static void close_ata(fs_node_t * node) {
 	return;
 }
 
-static int ioctl_ata(fs_node_t * node, unsigned long request, void * argp) {
-	struct ata_device * dev = (struct ata_device *)node->device;
-
-	switch (request) {
-		case IOCTLSYNC: {
-			mutex_acquire(ata_mutex);
-			for (int i = 0; i < CACHE_COUNT; ++i) {
-				if (cache_entries[i].dev == dev && cache_entries[i].flags & 1) {
-					eviction_count++;
-					memcpy(cache_entries[i].dev->dma_start, cache_blocks + i * ATA_CACHE_SIZE, ATA_CACHE_SIZE);
-					ata_device_write_sector_actual(cache_entries[i].dev, cache_entries[i].lba);
-					cache_entries[i].flags = 0;
-				}
-			}
-			mutex_release(ata_mutex);
-			return 0;
-		}
-
-		case 0x2A01234UL: {
-			uint64_t * args = argp;
-			memcpy(&args[0], &hit_count, sizeof(uint64_t));
-			memcpy(&args[1], &miss_count, sizeof(uint64_t));
-			memcpy(&args[2], &eviction_count, sizeof(uint64_t));
-			memcpy(&args[3], &write_count, sizeof(uint64_t));
-			return 0;
-		}
-
-		default:
-			return -EINVAL;
-	}
-}
-
 static fs_node_t * atapi_device_create(struct ata_device * device) {
 	fs_node_t * fnode = malloc(sizeof(fs_node_t));
 	memset(fnode, 0x00, sizeof(fs_node_t));
@@ -461,7 +317,18 @@ static fs_node_t * atapi_device_create(struct ata_device * device) {
 	fnode->close   = close_ata;
 	fnode->readdir = NULL;
 	fnode->finddir = NULL;
-	fnode->ioctl   = NULL; /* TODO, identify, etc? */
+
+	/* Other sector sizes keep reading straight from the drive. */
+	if (ATA_CACHE_SIZE % device->atapi_sector_size == 0) {
+		device->cache.name = fnode->name;
+		device->cache.driver = device;
+		device->cache.size = fnode->length;
+		device->cache.read_blocks = atapi_read_blocks;
+		bcache_register(&device->cache);
+		fnode->device = &device->cache;
+		fnode->read   = bcache_node_read;
+		fnode->ioctl  = bcache_node_ioctl;
+	}
 	return fnode;
 }
 
@@ -470,19 +337,26 @@ static fs_node_t * ata_device_create(struct ata_device * device) {
 	memset(fnode, 0x00, sizeof(fs_node_t));
 	fnode->inode = 0;
 	snprintf(fnode->name, 10, "atadev%d", ata_drive_char - 'a');
-	fnode->device  = device;
+	fnode->device  = &device->cache;
 	fnode->uid = 0;
 	fnode->gid = 0;
 	fnode->mask    = 0660;
 	fnode->length  = ata_max_offset(device); /* TODO */
 	fnode->flags   = FS_BLOCKDEVICE;
-	fnode->read    = read_ata;
-	fnode->write   = write_ata;
+	fnode->read    = bcache_node_read;
+	fnode->write   = bcache_node_write;
 	fnode->open    = open_ata;
 	fnode->close   = close_ata;
 	fnode->readdir = NULL;
 	fnode->finddir = NULL;
-	fnode->ioctl   = ioctl_ata; /* TODO, identify, etc? */
+	fnode->ioctl   = bcache_node_ioctl;
+
+	device->cache.name = fnode->name;
+	device->cache.driver = device;
+	device->cache.size = fnode->length;
+	device->cache.read_blocks = ata_read_blocks;
+	device->cache.write_blocks = ata_write_blocks;
+	bcache_register(&device->cache);
 	return fnode;
 }
 
@@ -545,6 +419,59 @@ static void * kvmalloc_p(size_t size, uintptr_t * outphys) {
 	return mmu_map_from_physical(index);
 }
 
+/**
+ * @brief Point the PRDT at the device's own one-block bounce buffer.
+ */
+static void ata_dma_bounce(struct ata_device * dev) {
+	dev->dma_prdt[0].offset = dev->dma_start_phys;
+	dev->dma_prdt[0].bytes = ATA_CACHE_SIZE;
+	dev->dma_prdt[0].last = 0x8000;
+}
+
+/**
+ * @brief Point the PRDT at a kernel buffer so the transfer goes straight to it.
+ *
+ * Each physically contiguous stretch of the buffer gets one entry, split
+ * where it would cross a 64KiB boundary, which the controller can't do.
+ *
+ * @returns 0, or 1 if the controller can't reach the buffer and the
+ *          bounce buffer has to be used instead.
+ */
+static int ata_dma_map(struct ata_device * dev, uint8_t * buffer, size_t size) {
+	union PML * dir = mmu_get_kernel_directory();
+	uintptr_t addr = (uintptr_t)buffer;
+	uintptr_t next = 0;
+	size_t n = 0;
+
+	while (size) {
+		size_t chunk = 0x1000 - (addr & 0xFFF);
+		if (chunk > size) chunk = size;
+
+		uintptr_t phys = mmu_map_to_physical(dir, addr);
+		if (phys >= (uintptr_t)-4) return 1;
+		/* PRD entries need even addresses below 4GiB */
+		if ((phys & 1) || phys + chunk > 0x100000000UL) return 1;
+
+		size_t bytes = n ? (dev->dma_prdt[n-1].bytes ? dev->dma_prdt[n-1].bytes : 0x10000) : 0;
+		if (n && phys == next && (phys & 0xFFFF) && bytes + chunk <= 0x10000) {
+			dev->dma_prdt[n-1].bytes = (bytes + chunk) & 0xFFFF;
+		} else {
+			if (n == ATA_PRDT_MAX) return 1;
+			dev->dma_prdt[n].offset = phys;
+			dev->dma_prdt[n].bytes = chunk;
+			dev->dma_prdt[n].last = 0;
+			n++;
+		}
+
+		next = phys + chunk;
+		addr += chunk;
+		size -= chunk;
+	}
+
+	dev->dma_prdt[n-1].last = 0x8000;
+	return 0;
+}
+
 static void ata_device_init(struct ata_device * dev) {
 	outportb(dev->io_base + 1, 1);
 	outportb(dev->control, 0);
@@ -575,9 +502,7 @@ static void ata_device_init(struct ata_device * dev) {
 	dev->is_atapi = 0;
 	dev->dma_prdt  = (void *)kvmalloc_p(4096, &dev->dma_prdt_phys);
 	dev->dma_start = (void *)kvmalloc_p(4096, &dev->dma_start_phys);
-	dev->dma_prdt[0].offset = dev->dma_start_phys;
-	dev->dma_prdt[0].bytes = ATA_CACHE_SIZE;
-	dev->dma_prdt[0].last = 0x8000;
+	ata_dma_bounce(dev);
 
 	uint16_t command_reg = pci_read_field(ata_pci, PCI_COMMAND, 4);
 	if (!(command_reg & (1 << 2))) {
@@ -754,7 +679,7 @@ static int ata_device_detect(struct ata_device * dev) {
 	return 0;
 }
 
-static void ata_device_read_sector_actual(struct ata_device * dev, uint64_t lba) {
+static void ata_device_read_sector_actual(struct ata_device * dev, uint64_t lba, size_t sectors) {
 	uint16_t bus = dev->io_base;
 	uint8_t slave = dev->slave;
 
@@ -784,12 +709,12 @@ static void ata_device_read_sector_actual(struct ata_device * dev, uint64_t lba)
 	ata_io_wait(dev);
 	outportb(bus + ATA_REG_FEATURES, 0x00);
 
-	outportb(bus + ATA_REG_SECCOUNT0, 0);
+	outportb(bus + ATA_REG_SECCOUNT0, (sectors >> 8) & 0xFF);
 	outportb(bus + ATA_REG_LBA0, (lba & 0xff000000) >> 24);
 	outportb(bus + ATA_REG_LBA1, (lba & 0xff00000000) >> 32);
 	outportb(bus + ATA_REG_LBA2, (lba & 0xff0000000000) >> 40);
 
-	outportb(bus + ATA_REG_SECCOUNT0, SECTORS_PER_CACHE_BLOCK);
+	outportb(bus + ATA_REG_SECCOUNT0, sectors & 0xFF);
 	outportb(bus + ATA_REG_LBA0, (lba & 0x000000ff) >>  0);
 	outportb(bus + ATA_REG_LBA1, (lba & 0x0000ff00) >>  8);
 	outportb(bus + ATA_REG_LBA2, (lba & 0x00ff0000) >> 16);
@@ -891,7 +816,7 @@ atapi_timeout:
 	return;
 }
 
-static void ata_device_write_sector_actual(struct ata_device * dev, uint64_t lba) {
+static void ata_device_write_sector_actual(struct ata_device * dev, uint64_t lba, size_t sectors) {
 	uint16_t bus = dev->io_base;
 	uint8_t slave = dev->slave;
 
@@ -913,12 +838,12 @@ static void ata_device_write_sector_actual(struct ata_device * dev, uint64_t lba
 	ata_wait(dev, 0);
 	outportb(bus + ATA_REG_FEATURES, 0x00);
 
-	outportb(bus + ATA_REG_SECCOUNT0, 0);
+	outportb(bus + ATA_REG_SECCOUNT0, (sectors >> 8) & 0xFF);
 	outportb(bus + ATA_REG_LBA0, (lba & 0xff000000) >> 24);
 	outportb(bus + ATA_REG_LBA1, (lba & 0xff00000000) >> 32);
 	outportb(bus + ATA_REG_LBA2, (lba & 0xff0000000000) >> 40);
 
-	outportb(bus + ATA_REG_SECCOUNT0, SECTORS_PER_CACHE_BLOCK);
+	outportb(bus + ATA_REG_SECCOUNT0, sectors & 0xFF);
 	outportb(bus + ATA_REG_LBA0, (lba & 0x000000ff) >>  0);
 	outportb(bus + ATA_REG_LBA1, (lba & 0x0000ff00) >>  8);
 	outportb(bus + ATA_REG_LBA2, (lba & 0x00ff0000) >> 16);
@@ -949,87 +874,73 @@ static void ata_device_write_sector_actual(struct ata_device * dev, uint64_t lba
 #endif
 }
 
-static void ata_device_read_sector(struct ata_device * dev, uint64_t lba, uint8_t * buf) {
-	lba *= SECTORS_PER_CACHE_BLOCK;
-	/* Is it in the cache? */
+static void ata_device_read_sector_atapi(struct ata_device * dev, uint64_t lba, uint8_t * buf) {
 	mutex_acquire(ata_mutex);
-	int found = 0;
-	int oldest = 0;
-	uint64_t lu = -1;
-	for (int i = 0; i < CACHE_COUNT; ++i) {
-		if (cache_entries[i].dev == dev && cache_entries[i].lba == lba) {
-			//dprintf("ata: cache hit\n");
-			hit_count++;
-			oldest = i;
-			found = 1;
-			break;
-		} else if (cache_entries[i].dev == NULL) {
-			oldest = i;
-			break;
-		} else if (cache_entries[i].last_use < lu) {
-			oldest = i;
-			lu = cache_entries[oldest].last_use;
-		}
-	}
-	if (!found) {
-		miss_count++;
-		if (cache_entries[oldest].dev && cache_entries[oldest].flags & 1) {
-			eviction_count++;
-			memcpy(cache_entries[oldest].dev->dma_start, cache_blocks + oldest * ATA_CACHE_SIZE, ATA_CACHE_SIZE);
-			ata_device_write_sector_actual(cache_entries[oldest].dev, cache_entries[oldest].lba);
-		}
-		ata_device_read_sector_actual(dev, lba);
-		cache_entries[oldest].dev = dev;
-		cache_entries[oldest].lba = lba;
-		cache_entries[oldest].flags = 0;
-		memcpy(cache_blocks + oldest * ATA_CACHE_SIZE, dev->dma_start, ATA_CACHE_SIZE);
-	}
-	cache_entries[oldest].last_use = counter++;
-	memcpy(buf, cache_blocks + ATA_CACHE_SIZE * oldest, ATA_CACHE_SIZE);
+	ata_device_read_sector_atapi_actual(dev, lba, buf);
 	mutex_release(ata_mutex);
 }
 
-static void ata_device_write_sector(struct ata_device * dev, uint64_t lba, uint8_t * buf) {
-	lba *= SECTORS_PER_CACHE_BLOCK;
+/*
+ * Block cache backends. Runs of up to ATA_DMA_MAX_BLOCKS blocks go to
+ * and from the cache's buffers with one command; only buffers the
+ * controller can't address take the bounce buffer, a block at a time.
+ */
+static int ata_read_blocks(struct bcache_device * cache, uint64_t block, size_t count, uint8_t * buffer) {
+	struct ata_device * dev = cache->driver;
 	mutex_acquire(ata_mutex);
-	int found = 0;
-	int oldest = 0;
-	uint64_t lu = -1;
-	for (int i = 0; i < CACHE_COUNT; ++i) {
-		if (cache_entries[i].dev == dev && cache_entries[i].lba == lba) {
-			//dprintf("ata: cache hit\n");
-			hit_count++;
-			oldest = i;
-			found = 1;
-			break;
-		} else if (cache_entries[i].dev == NULL) {
-			oldest = i;
-			break;
-		} else if (cache_entries[i].last_use < lu) {
-			oldest = i;
-			lu = cache_entries[oldest].last_use;
+	while (count) {
+		size_t n = count < ATA_DMA_MAX_BLOCKS ? count : ATA_DMA_MAX_BLOCKS;
+		if (ata_dma_map(dev, buffer, n * ATA_CACHE_SIZE)) {
+			n = 1;
+			ata_dma_bounce(dev);
+			ata_device_read_sector_actual(dev, block * SECTORS_PER_CACHE_BLOCK, SECTORS_PER_CACHE_BLOCK);
+			memcpy(buffer, dev->dma_start, ATA_CACHE_SIZE);
+		} else {
+			ata_device_read_sector_actual(dev, block * SECTORS_PER_CACHE_BLOCK, n * SECTORS_PER_CACHE_BLOCK);
 		}
+		block  += n;
+		count  -= n;
+		buffer += n * ATA_CACHE_SIZE;
 	}
-	if (!found) {
-		miss_count++;
-		if (cache_entries[oldest].dev && cache_entries[oldest].flags & 1) {
-			eviction_count++;
-			memcpy(cache_entries[oldest].dev->dma_start, cache_blocks + oldest * ATA_CACHE_SIZE, ATA_CACHE_SIZE);
-			ata_device_write_sector_actual(cache_entries[oldest].dev, cache_entries[oldest].lba);
+	mutex_release(ata_mutex);
+	return 0;
+}
+
+static int ata_write_blocks(struct bcache_device * cache, uint64_t block, size_t count, uint8_t * buffer) {
+	struct ata_device * dev = cache->driver;
+	mutex_acquire(ata_mutex);
+	while (count) {
+		size_t n = count < ATA_DMA_MAX_BLOCKS ? count : ATA_DMA_MAX_BLOCKS;
+		if (ata_dma_map(dev, buffer, n * ATA_CACHE_SIZE)) {
+			n = 1;
+			ata_dma_bounce(dev);
+			memcpy(dev->dma_start, buffer, ATA_CACHE_SIZE);
 		}
-		cache_entries[oldest].dev = dev;
-		cache_entries[oldest].lba = lba;
+		ata_device_write_sector_actual(dev, block * SECTORS_PER_CACHE_BLOCK, n * SECTORS_PER_CACHE_BLOCK);
+		block  += n;
+		count  -= n;
+		buffer += n * ATA_CACHE_SIZE;
 	}
-	write_count++;
-	cache_entries[oldest].last_use = counter++;
-	memcpy(cache_blocks + oldest * ATA_CACHE_SIZE, buf, ATA_CACHE_SIZE);
-	cache_entries[oldest].flags = 1;
 	mutex_release(ata_mutex);
+	return 0;
 }
-static void ata_device_read_sector_atapi(struct ata_device * dev, uint64_t lba, uint8_t * buf) {
+
+static int atapi_read_blocks(struct bcache_device * cache, uint64_t block, size_t count, uint8_t * buffer) {
+	struct ata_device * dev = cache->driver;
+	size_t per_block = ATA_CACHE_SIZE / dev->atapi_sector_size;
 	mutex_acquire(ata_mutex);
-	ata_device_read_sector_atapi_actual(dev, lba, buf);
+	for (size_t i = 0; i < count * per_block; ++i) {
+		uint64_t lba = block * per_block + i;
+		uint8_t * out = buffer + i * dev->atapi_sector_size;
+		if (lba > dev->atapi_lba) {
+			/* Past the end of the medium */
+			memset(out, 0, dev->atapi_sector_size);
+			continue;
+		}
+		ata_device_read_sector_atapi_actual(dev, lba, out);
+	}
 	mutex_release(ata_mutex);
+	return 0;
 }
 
 static int ata_initialize(int argc, char * argv[]) {
@@ -1043,9 +954,6 @@ static int ata_initialize(int argc, char * argv[]) {
 
 	atapi_waiter = list_create("atapi waiter", NULL);
 
-	cache_entries = malloc(sizeof(struct CacheEntry) * CACHE_COUNT);
-	memset(cache_entries, 0, sizeof(struct CacheEntry) * CACHE_COUNT);
-	cache_blocks  = mmu_map_module(CACHE_COUNT * ATA_CACHE_SIZE);
 	ata_mutex = mutex_init("ata lock");
 
 	ata_device_detect(&ata_primary_master);
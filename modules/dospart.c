@@ -16,6 +16,7 @@
 #include <kernel/vfs.h>
 #include <kernel/printf.h>
 #include <kernel/tokenize.h>
+#include <sys/ioctl.h>
 
 #define SECTORSIZE      512
 
@@ -67,6 +68,17 @@ static ssize_t write_part(fs_node_t *node, off_t offset, size_t size, uint8_t *b
 	return write_fs(device->device, offset + device->partition.lba_first_sector * SECTORSIZE, size, buffer);
 }
 
+static int ioctl_part(fs_node_t * node, unsigned long request, void * argp) {
+	struct dos_partition_entry * device = (struct dos_partition_entry *)node->device;
+	if (request == IOCTL_BLOCK_READAHEAD) {
+		struct block_readahead req = *(struct block_readahead *)argp;
+		req.offset += (uint64_t)device->partition.lba_first_sector * SECTORSIZE;
+		return ioctl_fs(device->device, request, &req);
+	}
+	/* Syncs and cache statistics belong to the whole disk. */
+	return ioctl_fs(device->device, request, argp);
+}
+
 static void open_part(fs_node_t * node, unsigned int flags) {
 	return;
 }
@@ -99,7 +111,7 @@ static fs_node_t * dospart_device_create(int i, fs_node_t * dev, mbr_t * mbr, in
 	fnode->close   = close_part;
 	fnode->readdir = NULL;
 	fnode->finddir = NULL;
-	fnode->ioctl   = NULL; /* TODO, identify, etc? */
+	fnode->ioctl   = ioctl_part;
 	return fnode;
 }
 
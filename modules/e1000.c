@@ -38,6 +38,17 @@
 #include <net/if.h>
 
 #define INTS (ICR_LSC | ICR_RXO | ICR_RXT0 | ICR_TXQE | ICR_TXDW | ICR_ACK | ICR_RXDMT0 | ICR_SRPD)
+#define POLL_INTS (INTS & ~ICR_LSC) /* Masked while the poller is running */
+
+#define E1000_RX_BUFSIZE 2048 /* Matches RCTL_BSIZE_2048 */
+
+#define E1000_BUDGET_MIN  16  /* RX descriptors per polling pass */
+#define E1000_BUDGET_MAX  256
+#define E1000_TX_BATCH    32  /* Most frames queued before we write the tail */
+
+/* Interrupt rates for the moderation register, in interrupts per second */
+#define E1000_ITR_LATENCY 20000 /* Light, interactive traffic */
+#define E1000_ITR_BULK    4000  /* Streaming; let frames pile up between interrupts */
 
 struct e1000_nic {
 	struct EthernetDevice eth;
@@ -48,13 +59,23 @@ struct e1000_nic {
 
 	int has_eeprom;
 	int rx_index;
-	int tx_index;
+	int tx_index;   /* Next descriptor to fill */
+	int tx_clean;   /* Oldest descriptor the device may still own */
+	int tx_pending; /* Descriptors filled since the last tail write */
 	int link_status;
 
 	spin_lock_t tx_lock;
 
-	uint8_t * rx_virt[E1000_NUM_RX_DESC];
-	uint8_t * tx_virt[E1000_NUM_TX_DESC];
+	/* Set while the poller owns the rings and RX/TX interrupts are masked */
+	volatile int polling;
+	int rx_budget;
+	unsigned int itr_rate;
+	size_t cycle_packets;
+	size_t cycle_bytes;
+
+	/* Packet buffers the descriptors point into; TX buffers are released as the device finishes with them */
+	struct netbuf * rx_bufs[E1000_NUM_RX_DESC];
+	struct netbuf * tx_bufs[E1000_NUM_TX_DESC];
 	volatile struct e1000_rx_desc * rx;
 	volatile struct e1000_tx_desc * tx;
 	uintptr_t rx_phys;
@@ -65,6 +86,7 @@ struct e1000_nic {
 	process_t * processor;
 
 	netif_counters_t counts;
+	netif_queue_counters_t queue;
 };
 
 static int device_count = 0;
@@ -181,6 +203,19 @@ static void read_mac(struct e1000_nic * device) {
 	}
 }
 
+/**
+ * @brief Point an RX descriptor at a fresh buffer.
+ */
+static void rx_refill(struct e1000_nic * nic, int i) {
+	struct netbuf * nb = netbuf_alloc(E1000_RX_BUFSIZE);
+#ifdef __aarch64__
+	cache_clean(nb);
+#endif
+	nic->rx_bufs[i] = nb;
+	nic->rx[i].addr = netbuf_phys(nb, nb->data);
+	nic->rx[i].status = 0;
+}
+
 static void e1000_handle(struct e1000_nic * nic, uint32_t status) {
 	write_command(nic, E1000_REG_ICR, status);
 
@@ -192,60 +227,182 @@ static void e1000_handle(struct e1000_nic * nic, uint32_t status) {
 		nic->link_status= (read_command(nic, E1000_REG_STATUS) & (1 << 1));
 	}
 
-	make_process_ready(nic->queuer);
+	/* Hand off to the poller, which turns these back on once it has caught up */
+	if ((status & POLL_INTS) && !__sync_lock_test_and_set(&nic->polling, 1)) {
+		write_command(nic, E1000_REG_IMC, POLL_INTS);
+		nic->queue.rx_interrupts++;
+		make_process_ready(nic->queuer);
+	}
 }
 
-static void e1000_queuer(void * data) {
-	struct e1000_nic * nic = data;
-
-	int head = read_command(nic, E1000_REG_RXDESCHEAD);
-	int budget = 8;
+/**
+ * @brief Pass up to @p budget received frames to the stack.
+ *
+ * Descriptors are given back to the device with one tail write at the end.
+ */
+static int e1000_rx_poll(struct e1000_nic * nic, int budget) {
+	int processed = 0;
 
-	while (1) {
-		int processed = 0;
-		if (head == nic->rx_index) {
-			head = read_command(nic, E1000_REG_RXDESCHEAD);
-		}
-		if (head != nic->rx_index) {
 #ifdef __aarch64__
-			__sync_synchronize();
+	__sync_synchronize();
 #endif
-			while ((nic->rx[nic->rx_index].status & 0x01) && (processed < budget)) {
-				int i = nic->rx_index;
-				if (!(nic->rx[i].errors & (0x97))) {
-					nic->counts.rx_count++;
-					nic->counts.rx_bytes += nic->rx[i].length;
+	while (processed < budget && (nic->rx[nic->rx_index].status & 0x01)) {
+		int i = nic->rx_index;
+		size_t length = nic->rx[i].length;
+		if (!(nic->rx[i].errors & (0x97))) {
+			struct netbuf * nb = nic->rx_bufs[i];
+			nic->counts.rx_count++;
+			nic->counts.rx_bytes += length;
+			nic->queue.rx_packets++;
+			nic->queue.rx_bytes += length;
+			nic->cycle_bytes += length;
 #ifdef __aarch64__
-					cache_invalidate(nic->rx_virt[i]);
+			cache_invalidate(nb);
 #endif
-					net_eth_handle((void*)nic->rx_virt[i], nic->eth.device_node, nic->rx[i].length);
-				} else {
-					printf("error bits set in packet: %x\n", nic->rx[i].errors);
-				}
-				processed++;
+			/* Hand the buffer up as-is; sockets keep it by reference, so give the ring a new one */
+			nb->len = length;
+			net_eth_handle(nb, nic->eth.device_node);
+			netbuf_release(nb);
+			rx_refill(nic, i);
+		} else {
+			/* Leave the buffer where it is for the device to reuse */
+			nic->queue.rx_errors++;
+			printf("error bits set in packet: %x\n", nic->rx[i].errors);
+		}
+		processed++;
 #ifdef __aarch64__
-				__sync_synchronize();
+		__sync_synchronize();
 #endif
-				nic->rx[i].status = 0;
-				if (++nic->rx_index == E1000_NUM_RX_DESC) {
-					nic->rx_index = 0;
-				}
-				if (nic->rx_index == head) {
-					head = read_command(nic, E1000_REG_RXDESCHEAD);
-					if (nic->rx_index == head) break;
-				}
-				write_command(nic, E1000_REG_RXDESCTAIL, nic->rx_index);
-				read_command(nic, E1000_REG_STATUS);
+		nic->rx[i].status = 0;
+		nic->rx_index = (nic->rx_index + 1) % E1000_NUM_RX_DESC;
+	}
+
+	if (processed) {
 #ifdef __aarch64__
-				__sync_synchronize();
+		__sync_synchronize();
 #endif
-			}
+		/* The device may fill everything up to, but not including, the tail */
+		write_command(nic, E1000_REG_RXDESCTAIL, (nic->rx_index + E1000_NUM_RX_DESC - 1) % E1000_NUM_RX_DESC);
+		nic->cycle_packets += processed;
+	}
+
+	return processed;
+}
+
+/**
+ * @brief Release buffers for descriptors the device has finished sending.
+ *
+ * Requires the TX lock.
+ */
+static void tx_reclaim(struct e1000_nic * device, int head) {
+	while (device->tx_clean != head) {
+		int i = device->tx_clean;
+		if (device->tx_bufs[i]) {
+			netbuf_release(device->tx_bufs[i]);
+			device->tx_bufs[i] = NULL;
 		}
-		if (processed == 0) {
-			delay_yield(100000);
-		} else {
-			if (this_core->cpu_id == 0) switch_task(1);
+		device->queue.tx_reclaimed++;
+		device->tx_clean = (i + 1) % E1000_NUM_TX_DESC;
+	}
+}
+
+/**
+ * @brief Tell the device about everything filled since the last tail write.
+ *
+ * Only the last descriptor of a batch asks for a status write-back, so a
+ * burst costs one register write and at most one TX interrupt. Requires
+ * the TX lock.
+ */
+static void tx_flush(struct e1000_nic * device) {
+	if (!device->tx_pending) return;
+
+	int last = (device->tx_index + E1000_NUM_TX_DESC - 1) % E1000_NUM_TX_DESC;
+	device->tx[last].cmd |= CMD_RS;
+#if defined(__aarch64__)
+	asm volatile ("dmb ish\nisb" ::: "memory");
+#endif
+
+	write_command(device, E1000_REG_TXDESCTAIL, device->tx_index);
+	device->tx_pending = 0;
+	device->queue.tx_doorbells++;
+
+#if defined(__aarch64__)
+	asm volatile ("dc ivac, %0\ndsb sy\n" :: "r"(&device->tx[last]) : "memory");
+#endif
+}
+
+static int rx_pending(struct e1000_nic * nic) {
+#ifdef __aarch64__
+	__sync_synchronize();
+#endif
+	return nic->rx[nic->rx_index].status & 0x01;
+}
+
+/**
+ * @brief Pick an interrupt rate from what the last polling cycle saw.
+ *
+ * A cycle runs from the interrupt that woke the poller to the poller
+ * going back to sleep, so lots of traffic in one cycle means interrupts
+ * are coming faster than we need them.
+ */
+static void e1000_update_itr(struct e1000_nic * nic) {
+	unsigned int rate = E1000_ITR_LATENCY;
+	if (nic->cycle_packets > E1000_BUDGET_MIN || nic->cycle_bytes > 32768) {
+		rate = E1000_ITR_BULK;
+	}
+	nic->cycle_packets = 0;
+	nic->cycle_bytes = 0;
+
+	if (rate != nic->itr_rate) {
+		nic->itr_rate = rate;
+		/* Interval between interrupts, in 256ns units */
+		write_command(nic, E1000_REG_ITR, 1000000000 / (rate * 256));
+	}
+}
+
+/**
+ * @brief Ring processing thread.
+ *
+ * Sleeps until an interrupt, then polls with interrupts masked until
+ * the RX ring is empty. A pass that uses its whole budget means more is
+ * waiting, so the budget grows and we yield rather than sleep; quiet
+ * passes shrink it again.
+ */
+static void e1000_queuer(void * data) {
+	struct e1000_nic * nic = data;
+
+	while (1) {
+		int budget = nic->rx_budget;
+		int processed = e1000_rx_poll(nic, budget);
+		nic->queue.rx_polls++;
+
+		spin_lock(nic->tx_lock);
+		tx_reclaim(nic, read_command(nic, E1000_REG_TXDESCHEAD));
+		tx_flush(nic);
+		spin_unlock(nic->tx_lock);
+
+		if (processed == budget) {
+			nic->queue.rx_budget_hits++;
+			if (nic->rx_budget < E1000_BUDGET_MAX) nic->rx_budget *= 2;
+			switch_task(1);
+			continue;
+		}
+
+		if (processed < budget / 4 && nic->rx_budget > E1000_BUDGET_MIN) nic->rx_budget /= 2;
+
+		e1000_update_itr(nic);
+
+		/* Caught up; go back to interrupts. Anything that arrived since
+		 * the last pass and didn't raise one is picked up here. */
+		__sync_lock_release(&nic->polling);
+		write_command(nic, E1000_REG_IMS, INTS);
+		if (rx_pending(nic) && !__sync_lock_test_and_set(&nic->polling, 1)) {
+			write_command(nic, E1000_REG_IMC, POLL_INTS);
+			continue;
 		}
+
+		/* The interrupt handler makes us ready again */
+		switch_task(0);
 	}
 }
 
@@ -275,19 +432,40 @@ static int e1000_irq_handler(process_t * this, int irq, void * data) {
 	return handled;
 }
 
-static int tx_full(struct e1000_nic * device, int tx_tail, int tx_head) {
-	if (tx_tail == tx_head) return 0;
-	if (device->tx_index == tx_head) return 1;
-	if (((device->tx_index + 1) & E1000_NUM_TX_DESC) == tx_head) return 1;
-	return 0;
+static int tx_free(struct e1000_nic * device) {
+	return (device->tx_clean + E1000_NUM_TX_DESC - device->tx_index - 1) % E1000_NUM_TX_DESC;
 }
 
-static void send_packet(struct e1000_nic * device, uint8_t* payload, size_t payload_size) {
+/**
+ * @brief Queue a frame, pointing the descriptor straight at its buffer.
+ *
+ * The ring keeps the caller's reference until the device is done with
+ * it. Frames marked NETBUF_MORE are only written to the tail with the
+ * rest of their batch.
+ */
+static void e1000_transmit(struct EthernetDevice * eth, struct netbuf * nb) {
+	struct e1000_nic * device = (struct e1000_nic*)eth;
+
+	if (!nb->phys) {
+		/* Came from the heap; the NIC needs it somewhere it can see. */
+		if (nb->len > NETBUF_POOL_MTU) {
+			netbuf_release(nb);
+			return;
+		}
+		struct netbuf * copy = netbuf_copy(nb);
+		netbuf_release(nb);
+		nb = copy;
+	}
+
 	spin_lock(device->tx_lock);
-	int tx_tail = read_command(device, E1000_REG_TXDESCTAIL);
-	int tx_head = read_command(device, E1000_REG_TXDESCHEAD);
 
-	if (tx_full(device, tx_tail, tx_head)) {
+	if (!tx_free(device)) {
+		tx_reclaim(device, read_command(device, E1000_REG_TXDESCHEAD));
+	}
+
+	if (!tx_free(device)) {
+		device->queue.tx_ring_full++;
+		tx_flush(device);
 		int timeout = 1000;
 		do {
 			spin_unlock(device->tx_lock);
@@ -295,45 +473,39 @@ static void send_packet(struct e1000_nic * device, uint8_t* payload, size_t payl
 			timeout--;
 			if (timeout == 0) {
 				printf("e1000: wait for tx timed out, giving up\n");
+				netbuf_release(nb);
 				return;
 			}
 			spin_lock(device->tx_lock);
-			tx_tail = read_command(device, E1000_REG_TXDESCTAIL);
-			tx_head = read_command(device, E1000_REG_TXDESCHEAD);
-		} while (tx_full(device, tx_tail, tx_head));
+			tx_reclaim(device, read_command(device, E1000_REG_TXDESCHEAD));
+		} while (!tx_free(device));
 	}
 
-	int sent = device->tx_index;
+	int i = device->tx_index;
+	size_t payload_size = nb->len;
 
-	memcpy(device->tx_virt[device->tx_index], payload, payload_size);
+	device->tx_bufs[i] = nb;
 #if defined(__aarch64__)
 	asm volatile ("dmb ish\nisb" ::: "memory");
-	cache_clean(device->tx_virt[device->tx_index]);
+	cache_clean(nb);
 #endif
 
-	device->tx[device->tx_index].length = payload_size;
-	device->tx[device->tx_index].cmd = CMD_EOP | CMD_IFCS | CMD_RS | CMD_RPS;
-	device->tx[device->tx_index].status = 0;
-#if defined(__aarch64__)
-	asm volatile ("dmb ish\nisb" ::: "memory");
-#endif
+	device->tx[i].addr = netbuf_phys(nb, nb->data);
+	device->tx[i].length = payload_size;
+	device->tx[i].cmd = CMD_EOP | CMD_IFCS;
+	device->tx[i].status = 0;
 
 	device->counts.tx_count++;
 	device->counts.tx_bytes += payload_size;
+	device->queue.tx_packets++;
+	device->queue.tx_bytes += payload_size;
 
-	if (++device->tx_index == E1000_NUM_TX_DESC) {
-		device->tx_index = 0;
-	}
-
-	write_command(device, E1000_REG_TXDESCTAIL, device->tx_index);
-	int st = read_command(device, E1000_REG_STATUS);
-	(void)st;
+	device->tx_index = (i + 1) % E1000_NUM_TX_DESC;
+	device->tx_pending++;
 
-#if defined(__aarch64__)
-	asm volatile ("dc ivac, %0\ndsb sy\n" :: "r"(&device->tx[sent]) : "memory");
-#else
-	(void)sent;
-#endif
+	if (!(nb->flags & NETBUF_MORE) || device->tx_pending >= E1000_TX_BATCH) {
+		tx_flush(device);
+	}
 
 	spin_unlock(device->tx_lock);
 }
@@ -352,8 +524,7 @@ static void init_rx(struct e1000_nic * device) {
 		(1 << 2) | /* store bad packets */
 		(1 << 4) | /* multicast promiscuous */
 		(1 << 15) | /* broadcast accept */
-		(1 << 25) | /* Extended size... */
-		(3 << 16) | /*   4096 */
+		RCTL_BSIZE_2048 | /* fits in a pooled netbuf after its headroom */
 		(1 << 26) /* strip CRC */
 	);
 }
@@ -366,6 +537,8 @@ static void init_tx(struct e1000_nic * device) {
 	write_command(device, E1000_REG_TXDESCTAIL, 0);
 
 	device->tx_index = 0;
+	device->tx_clean = 0;
+	device->tx_pending = 0;
 
 	uint32_t tctl = read_command(device, E1000_REG_TCTRL);
 
@@ -446,6 +619,16 @@ static int ioctl_e1000(fs_node_t * node, unsigned long request, void * argp) {
 			return 0;
 		}
 
+		case SIOCGIFQCOUNTS: {
+			netif_queue_counters_t * counts = argp;
+			/* One RX ring and one TX ring */
+			if (counts->queue != 0) return -ENOENT;
+			memcpy(counts, &nic->queue, sizeof(netif_queue_counters_t));
+			counts->queue = 0;
+			counts->queue_count = 1;
+			return 0;
+		}
+
 		default:
 			return -EINVAL;
 	}
@@ -453,8 +636,11 @@ static int ioctl_e1000(fs_node_t * node, unsigned long request, void * argp) {
 
 static ssize_t write_e1000(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
 	struct e1000_nic * nic = node->device;
+	if (size > NETBUF_POOL_MTU) return -EINVAL;
 	/* write packet */
-	send_packet(nic, buffer, size);
+	struct netbuf * nb = netbuf_alloc(size);
+	memcpy(netbuf_put(nb, size), buffer, size);
+	e1000_transmit(&nic->eth, nb);
 	return size;
 }
 
@@ -478,17 +664,11 @@ static void e1000_init(struct e1000_nic * nic) {
 
 	/* Allocate buffers */
 	for (int i = 0; i < E1000_NUM_RX_DESC; ++i) {
-		nic->rx[i].addr = mmu_allocate_a_frame() << 12;
-		nic->rx_virt[i] = mmu_map_mmio_region(nic->rx[i].addr, 4096);
-		mmu_frame_map_address(mmu_get_page((uintptr_t)nic->rx_virt[i],0),MMU_FLAG_KERNEL|MMU_FLAG_WRITABLE,nic->rx[i].addr);
-		nic->rx[i].status = 0;
+		rx_refill(nic, i);
 	}
 
+	/* TX descriptors get their buffers as frames are sent */
 	for (int i = 0; i < E1000_NUM_TX_DESC; ++i) {
-		nic->tx[i].addr = mmu_allocate_a_frame() << 12;
-		nic->tx_virt[i] = mmu_map_mmio_region(nic->tx[i].addr, 4096);
-		mmu_frame_allocate(mmu_get_page((uintptr_t)nic->tx_virt[i],0),MMU_FLAG_KERNEL|MMU_FLAG_WRITABLE);
-		memset(nic->tx_virt[i], 0, 4096);
 		nic->tx[i].status = 0;
 		nic->tx[i].cmd = (1 << 0);
 	}
@@ -578,7 +758,7 @@ static void e1000_init(struct e1000_nic * nic) {
 	init_tx(nic);
 
 	write_command(nic, E1000_REG_RDTR, 0);
-	write_command(nic, E1000_REG_ITR, 500);
+	e1000_update_itr(nic);
 	read_command(nic, E1000_REG_STATUS);
 
 	nic->link_status = (read_command(nic, E1000_REG_STATUS) & (1 << 1));
@@ -590,6 +770,7 @@ static void e1000_init(struct e1000_nic * nic) {
 	nic->eth.device_node->ioctl = ioctl_e1000;
 	nic->eth.device_node->write = write_e1000;
 	nic->eth.device_node->device = nic;
+	nic->eth.transmit = e1000_transmit;
 
 	nic->eth.mtu = 1500; /* guess */
 
@@ -597,6 +778,8 @@ static void e1000_init(struct e1000_nic * nic) {
 
 	char worker_name[34];
 	snprintf(worker_name, 33, "[%s]", nic->eth.if_name);
+	nic->rx_budget = E1000_BUDGET_MIN;
+	nic->polling = 1; /* The poller starts out running */
 	nic->queuer = spawn_worker_thread(e1000_queuer, worker_name, nic);
 
 	nic->configured = 1;
@@ -21,6 +21,7 @@
 #include <kernel/tokenize.h>
 #include <kernel/module.h>
 #include <kernel/mutex.h>
+#include <kernel/hashmap.h>
 
 #include <sys/ioctl.h>
 
@@ -186,6 +187,50 @@ typedef struct ext2_dir ext2_dir_t;
 #undef _symlink
 #define _symlink(inode) ((char *)(inode)->block)
 
+/*
+ * Inode cache entries
+ *
+ * Along with a copy of the inode, each entry remembers a few runs of
+ * logical blocks that are known to be contiguous on disk, so that
+ * reading through a file does not walk the indirect blocks for every
+ * block of it.
+ */
+#define EXT2_ICACHE_SIZE    512
+#define EXT2_ICACHE_BUCKETS 256
+#define EXT2_MAP_EXTENTS    8
+
+/*
+ * Blocks set aside for a file that is growing, so that its next few
+ * writes land right after the last one.
+ */
+#define EXT2_PREALLOC_SLOTS  16
+#define EXT2_PREALLOC_BLOCKS 8
+
+struct ext2_prealloc {
+	uint32_t ino;   /* 0 if unused */
+	uint32_t start; /* Next block to hand out */
+	uint32_t count;
+};
+
+/* Per-group metadata that differs from what is on disk */
+#define EXT2_DIRTY_BLOCK_BITMAP 0x01
+#define EXT2_DIRTY_INODE_BITMAP 0x02
+
+struct ext2_extent {
+	uint32_t logical;
+	uint32_t physical;
+	uint32_t length;  /* 0 if unused */
+};
+
+struct ext2_icache {
+	uint32_t ino;     /* 0 if unused */
+	int referenced;
+	struct ext2_icache * next;
+	unsigned int map_next;
+	struct ext2_extent map[EXT2_MAP_EXTENTS];
+	ext2_inodetable_t * inode;
+};
+
 /*
  * EXT2 filesystem object
  */
@@ -210,6 +255,22 @@ typedef struct {
 	int flags;
 
 	sched_mutex_t *           mutex;
+
+	spin_lock_t               icache_lock;
+	struct ext2_icache *      icache;
+	struct ext2_icache *      icache_buckets[EXT2_ICACHE_BUCKETS];
+	unsigned int              icache_hand;
+	unsigned long             icache_gen;          /* Bumped by every inode write */
+
+	/* Allocation state, protected by mutex and written out on sync */
+	uint8_t **                block_bitmaps;       /* Per group, loaded on first use */
+	uint8_t **                inode_bitmaps;
+	uint8_t *                 group_dirty;         /* EXT2_DIRTY_* for each group */
+	int                       bgd_dirty;
+	int                       sb_dirty;
+	struct ext2_prealloc      prealloc[EXT2_PREALLOC_SLOTS];
+	unsigned int              prealloc_hand;
+	hashmap_t *               open_nodes;          /* Inode -> open nodes for it, so the last close drops its preallocation */
 } ext2_fs_t;
 
 #define EXT2_FLAG_READWRITE 0x0002
@@ -237,7 +298,7 @@ static ext2_inodetable_t * read_inode(ext2_fs_t * this, size_t inode);
 static void refresh_inode(ext2_fs_t * this, ext2_inodetable_t * inodet,  size_t inode);
 static int write_inode(ext2_fs_t * this, ext2_inodetable_t *inode, size_t index);
 static fs_node_t * finddir_ext2(fs_node_t *node, char *name);
-static size_t allocate_block(ext2_fs_t * this);
+static unsigned int allocate_block(ext2_fs_t * this, unsigned int inode_no, unsigned int goal, int zero);
 
 /**
  * ext2->rewrite_superblock Rewrite the superblock.
@@ -294,6 +355,175 @@ static int write_block(ext2_fs_t * this, unsigned int block_no, uint8_t *buf) {
 	return E_SUCCESS;
 }
 
+/**
+ * ext2->load_inode Read an inode straight from the inode table.
+ */
+static void load_inode(ext2_fs_t * this, ext2_inodetable_t * inodet, size_t inode) {
+	if (!inode) {
+		dprintf("ext2: Attempt to read inode 0\n");
+		return;
+	}
+	inode--;
+
+	uint32_t group = inode / this->inodes_per_group;
+	if (group > BGDS) {
+		return;
+	}
+	uint32_t inode_table_block = BGD[group].inode_table;
+	inode -= group * this->inodes_per_group;	// adjust index within group
+	uint32_t block_offset		= (inode * this->inode_size) / this->block_size;
+	uint32_t offset_in_block    = inode - block_offset * (this->block_size / this->inode_size);
+
+	uint8_t * buf = malloc(this->block_size);
+
+	read_block(this, inode_table_block + block_offset, buf);
+
+	ext2_inodetable_t *inodes = (ext2_inodetable_t *)buf;
+
+	memcpy(inodet, (uint8_t *)((uintptr_t)inodes + offset_in_block * this->inode_size), this->inode_size);
+
+	free(buf);
+}
+
+/*
+ * Inode cache
+ *
+ * Entries are found by hashing the inode number and recycled with
+ * the CLOCK algorithm. write_inode updates the cached copy and still
+ * writes through to the inode table, so nothing is lost if an entry
+ * is dropped.
+ */
+static struct ext2_icache * icache_find(ext2_fs_t * this, uint32_t ino) {
+	for (struct ext2_icache * e = this->icache_buckets[ino % EXT2_ICACHE_BUCKETS]; e; e = e->next) {
+		if (e->ino == ino) return e;
+	}
+	return NULL;
+}
+
+static void icache_unlink(ext2_fs_t * this, struct ext2_icache * e) {
+	struct ext2_icache ** link = &this->icache_buckets[e->ino % EXT2_ICACHE_BUCKETS];
+	while (*link != e) link = &(*link)->next;
+	*link = e->next;
+	e->next = NULL;
+}
+
+static struct ext2_icache * icache_victim(ext2_fs_t * this) {
+	while (1) {
+		struct ext2_icache * e = &this->icache[this->icache_hand];
+		this->icache_hand = (this->icache_hand + 1) % EXT2_ICACHE_SIZE;
+		if (e->ino && e->referenced) {
+			e->referenced = 0;
+			continue;
+		}
+		return e;
+	}
+}
+
+/**
+ * ext2->icache_get Find an inode in the cache, reading it in on a miss.
+ *
+ * @returns The cache entry, with icache_lock held.
+ */
+static struct ext2_icache * icache_get(ext2_fs_t * this, uint32_t ino) {
+	ext2_inodetable_t * loaded = NULL;
+
+	spin_lock(this->icache_lock);
+	while (1) {
+		struct ext2_icache * e = icache_find(this, ino);
+		if (e) {
+			e->referenced = 1;
+			if (loaded) free(loaded);
+			return e;
+		}
+
+		if (loaded) {
+			e = icache_victim(this);
+			if (e->ino) icache_unlink(this, e);
+			e->ino = ino;
+			e->referenced = 1;
+			e->next = this->icache_buckets[ino % EXT2_ICACHE_BUCKETS];
+			this->icache_buckets[ino % EXT2_ICACHE_BUCKETS] = e;
+			memset(e->map, 0, sizeof(e->map));
+			e->map_next = 0;
+			memcpy(e->inode, loaded, this->inode_size);
+			free(loaded);
+			return e;
+		}
+
+		/* Read it without the lock, then check nobody wrote it in the meantime. */
+		unsigned long gen = this->icache_gen;
+		spin_unlock(this->icache_lock);
+
+		loaded = malloc(this->inode_size);
+		memset(loaded, 0, this->inode_size);
+		load_inode(this, loaded, ino);
+
+		spin_lock(this->icache_lock);
+		if (gen != this->icache_gen) {
+			free(loaded);
+			loaded = NULL;
+		}
+	}
+}
+
+/**
+ * ext2->icache_map_lookup Find a cached run of blocks covering @p iblock.
+ *
+ * @returns The real block number, or 0 if no run is known.
+ */
+static unsigned int icache_map_lookup(ext2_fs_t * this, uint32_t ino, uint32_t iblock, unsigned int * run) {
+	unsigned int out = 0;
+	spin_lock(this->icache_lock);
+	struct ext2_icache * e = icache_find(this, ino);
+	if (e) {
+		for (int i = 0; i < EXT2_MAP_EXTENTS; ++i) {
+			struct ext2_extent * x = &e->map[i];
+			if (x->length && iblock >= x->logical && iblock - x->logical < x->length) {
+				out = x->physical + (iblock - x->logical);
+				*run = x->length - (iblock - x->logical);
+				break;
+			}
+		}
+	}
+	spin_unlock(this->icache_lock);
+	return out;
+}
+
+static void icache_map_insert(ext2_fs_t * this, uint32_t ino, uint32_t logical, uint32_t physical, uint32_t length) {
+	spin_lock(this->icache_lock);
+	struct ext2_icache * e = icache_find(this, ino);
+	if (e) {
+		e->map[e->map_next].logical  = logical;
+		e->map[e->map_next].physical = physical;
+		e->map[e->map_next].length   = length;
+		e->map_next = (e->map_next + 1) % EXT2_MAP_EXTENTS;
+	}
+	spin_unlock(this->icache_lock);
+}
+
+/**
+ * ext2->icache_map_forget Drop the cached block runs for an inode whose block map is changing.
+ */
+static void icache_map_forget(ext2_fs_t * this, uint32_t ino) {
+	spin_lock(this->icache_lock);
+	struct ext2_icache * e = icache_find(this, ino);
+	if (e) {
+		memset(e->map, 0, sizeof(e->map));
+		e->map_next = 0;
+	}
+	spin_unlock(this->icache_lock);
+}
+
+static void icache_init(ext2_fs_t * this) {
+	this->icache = malloc(sizeof(struct ext2_icache) * EXT2_ICACHE_SIZE);
+	memset(this->icache, 0, sizeof(struct ext2_icache) * EXT2_ICACHE_SIZE);
+	uint8_t * inodes = malloc(this->inode_size * EXT2_ICACHE_SIZE);
+	for (int i = 0; i < EXT2_ICACHE_SIZE; ++i) {
+		this->icache[i].inode = (ext2_inodetable_t *)(inodes + i * this->inode_size);
+	}
+	spin_init(this->icache_lock);
+}
+
 /**
  * ext2->set_block_number Set the "real" block number for a given "inode" block number.
  *
@@ -311,13 +541,15 @@ static unsigned int set_block_number(ext2_fs_t * this, ext2_inodetable_t * inode
 
 	uint8_t * tmp;
 
+	icache_map_forget(this, inode_no);
+
 	if (iblock < EXT2_DIRECT_BLOCKS) {
 		inode->block[iblock] = rblock;
 		return E_SUCCESS;
 	} else if (iblock < EXT2_DIRECT_BLOCKS + p) {
 		/* XXX what if inode->block[EXT2_DIRECT_BLOCKS] isn't set? */
 		if (!inode->block[EXT2_DIRECT_BLOCKS]) {
-			unsigned int block_no = allocate_block(this);
+			unsigned int block_no = allocate_block(this, 0, rblock, 1);
 			if (!block_no) return E_NOSPACE;
 			inode->block[EXT2_DIRECT_BLOCKS] = block_no;
 			write_inode(this, inode, inode_no);
@@ -337,7 +569,7 @@ static unsigned int set_block_number(ext2_fs_t * this, ext2_inodetable_t * inode
 		d = b - c * p;
 
 		if (!inode->block[EXT2_DIRECT_BLOCKS+1]) {
-			unsigned int block_no = allocate_block(this);
+			unsigned int block_no = allocate_block(this, 0, rblock, 1);
 			if (!block_no) return E_NOSPACE;
 			inode->block[EXT2_DIRECT_BLOCKS+1] = block_no;
 			write_inode(this, inode, inode_no);
@@ -347,7 +579,7 @@ static unsigned int set_block_number(ext2_fs_t * this, ext2_inodetable_t * inode
 		read_block(this, inode->block[EXT2_DIRECT_BLOCKS + 1], (uint8_t *)tmp);
 
 		if (!((uint32_t *)tmp)[c]) {
-			unsigned int block_no = allocate_block(this);
+			unsigned int block_no = allocate_block(this, 0, rblock, 1);
 			if (!block_no) goto no_space_free;
 			((uint32_t *)tmp)[c] = block_no;
 			write_block(this, inode->block[EXT2_DIRECT_BLOCKS + 1], (uint8_t *)tmp);
@@ -371,7 +603,7 @@ static unsigned int set_block_number(ext2_fs_t * this, ext2_inodetable_t * inode
 		g = e - f * p;
 
 		if (!inode->block[EXT2_DIRECT_BLOCKS+2]) {
-			unsigned int block_no = allocate_block(this);
+			unsigned int block_no = allocate_block(this, 0, rblock, 1);
 			if (!block_no) return E_NOSPACE;
 			inode->block[EXT2_DIRECT_BLOCKS+2] = block_no;
 			write_inode(this, inode, inode_no);
@@ -381,7 +613,7 @@ static unsigned int set_block_number(ext2_fs_t * this, ext2_inodetable_t * inode
 		read_block(this, inode->block[EXT2_DIRECT_BLOCKS + 2], (uint8_t *)tmp);
 
 		if (!((uint32_t *)tmp)[d]) {
-			unsigned int block_no = allocate_block(this);
+			unsigned int block_no = allocate_block(this, 0, rblock, 1);
 			if (!block_no) goto no_space_free;
 			((uint32_t *)tmp)[d] = block_no;
 			write_block(this, inode->block[EXT2_DIRECT_BLOCKS + 2], (uint8_t *)tmp);
@@ -391,7 +623,7 @@ static unsigned int set_block_number(ext2_fs_t * this, ext2_inodetable_t * inode
 		read_block(this, nblock, (uint8_t *)tmp);
 
 		if (!((uint32_t *)tmp)[f]) {
-			unsigned int block_no = allocate_block(this);
+			unsigned int block_no = allocate_block(this, 0, rblock, 1);
 			if (!block_no) goto no_space_free;
 			((uint32_t *)tmp)[f] = block_no;
 			write_block(this, nblock, (uint8_t *)tmp);
@@ -400,7 +632,7 @@ static unsigned int set_block_number(ext2_fs_t * this, ext2_inodetable_t * inode
 		nblock = ((uint32_t *)tmp)[f];
 		read_block(this, nblock, (uint8_t *)tmp);
 
-		((uint32_t *)tmp)[g] = nblock;
+		((uint32_t *)tmp)[g] = rblock;
 		write_block(this, nblock, (uint8_t *)tmp);
 
 		free(tmp);
@@ -417,29 +649,47 @@ no_space_free:
 /**
  * ext2->get_block_number Given an inode block number, get the real block number.
  *
+ * Also works out how many of the following blocks come right after it on
+ * disk, and remembers that run in the inode cache.
+ *
  * @param inode   Inode to operate on
+ * @param inode_no Number of the inode
  * @param iblock  Block offset within the inode
+ * @param run     If not NULL, receives the number of contiguous blocks starting at @p iblock
  * @returns Real block number
  */
-static unsigned int get_block_number(ext2_fs_t * this, ext2_inodetable_t * inode, unsigned int iblock) {
+static unsigned int get_block_number(ext2_fs_t * this, ext2_inodetable_t * inode, unsigned int inode_no, unsigned int iblock, unsigned int * run) {
 
 	unsigned int p = this->pointers_per_block;
 
 	/* We're going to do some crazy math in a bit... */
 	unsigned int a, b, c, d, e, f, g;
 
-	uint8_t * tmp;
+	uint8_t * tmp = NULL;
+	uint32_t direct[EXT2_DIRECT_BLOCKS];
+	uint32_t * ptrs;
+	unsigned int index, limit;
+
+	unsigned int cached_run;
+	unsigned int cached = icache_map_lookup(this, inode_no, iblock, &cached_run);
+	if (cached) {
+		if (run) *run = cached_run;
+		return cached;
+	}
 
 	if (iblock < EXT2_DIRECT_BLOCKS) {
-		return inode->block[iblock];
+		memcpy(direct, inode->block, sizeof(direct));
+		ptrs  = direct;
+		index = iblock;
+		limit = EXT2_DIRECT_BLOCKS;
 	} else if (iblock < EXT2_DIRECT_BLOCKS + p) {
 		/* XXX what if inode->block[EXT2_DIRECT_BLOCKS] isn't set? */
 		tmp = malloc(this->block_size);
 		read_block(this, inode->block[EXT2_DIRECT_BLOCKS], (uint8_t *)tmp);
 
-		unsigned int out = ((uint32_t *)tmp)[iblock - EXT2_DIRECT_BLOCKS];
-		free(tmp);
-		return out;
+		ptrs  = (uint32_t *)tmp;
+		index = iblock - EXT2_DIRECT_BLOCKS;
+		limit = p;
 	} else if (iblock < EXT2_DIRECT_BLOCKS + p + p * p) {
 		a = iblock - EXT2_DIRECT_BLOCKS;
 		b = a - p;
@@ -452,9 +702,9 @@ static unsigned int get_block_number(ext2_fs_t * this, ext2_inodetable_t * inode
 		uint32_t nblock = ((uint32_t *)tmp)[c];
 		read_block(this, nblock, (uint8_t *)tmp);
 
-		unsigned int out = ((uint32_t  *)tmp)[d];
-		free(tmp);
-		return out;
+		ptrs  = (uint32_t *)tmp;
+		index = d;
+		limit = p;
 	} else if (iblock < EXT2_DIRECT_BLOCKS + p + p * p + p) {
 		a = iblock - EXT2_DIRECT_BLOCKS;
 		b = a - p;
@@ -473,14 +723,25 @@ static unsigned int get_block_number(ext2_fs_t * this, ext2_inodetable_t * inode
 		nblock = ((uint32_t *)tmp)[f];
 		read_block(this, nblock, (uint8_t *)tmp);
 
-		unsigned int out = ((uint32_t  *)tmp)[g];
-		free(tmp);
-		return out;
+		ptrs  = (uint32_t *)tmp;
+		index = g;
+		limit = p;
+	} else {
+		debug_print(CRITICAL, "EXT2 driver tried to read to a block number that was too high (%d)", iblock);
+		return 0;
 	}
 
-	debug_print(CRITICAL, "EXT2 driver tried to read to a block number that was too high (%d)", iblock);
+	unsigned int out = ptrs[index];
+	unsigned int length = 1;
+	while (out && index + length < limit && ptrs[index + length] == out + length) {
+		length++;
+	}
 
-	return 0;
+	if (tmp) free(tmp);
+
+	if (out) icache_map_insert(this, inode_no, iblock, out, length);
+	if (run) *run = length;
+	return out;
 }
 
 static int write_inode(ext2_fs_t * this, ext2_inodetable_t *inode, size_t index) {
@@ -488,6 +749,19 @@ static int write_inode(ext2_fs_t * this, ext2_inodetable_t *inode, size_t index)
 		dprintf("ext2: Attempt to write inode 0\n");
 		return E_BADBLOCK;
 	}
+
+	spin_lock(this->icache_lock);
+	this->icache_gen++;
+	struct ext2_icache * cached = icache_find(this, index);
+	if (cached) {
+		if (memcmp(cached->inode->block, inode->block, sizeof(inode->block))) {
+			memset(cached->map, 0, sizeof(cached->map));
+			cached->map_next = 0;
+		}
+		memcpy(cached->inode, inode, this->inode_size);
+	}
+	spin_unlock(this->icache_lock);
+
 	index--;
 
 	size_t group = index / this->inodes_per_group;
@@ -510,57 +784,256 @@ static int write_inode(ext2_fs_t * this, ext2_inodetable_t *inode, size_t index)
 	return E_SUCCESS;
 }
 
-static size_t allocate_block(ext2_fs_t * this) {
-	size_t block_no     = 0;
-	size_t block_offset = 0;
-	size_t group        = 0;
-	uint8_t * bg_buffer = malloc(this->block_size);
+/**
+ * ext2->group_block_bitmap Get the in-memory copy of a group's block bitmap.
+ *
+ * Bitmaps are read the first time something is allocated in their group
+ * and stay in memory for as long as the filesystem is mounted; changes to
+ * them are written back by ext2_sync. Requires the filesystem mutex.
+ */
+static uint8_t * group_block_bitmap(ext2_fs_t * this, unsigned int group) {
+	if (!this->block_bitmaps[group]) {
+		this->block_bitmaps[group] = malloc(this->block_size);
+		read_block(this, BGD[group].block_bitmap, this->block_bitmaps[group]);
+	}
+	return this->block_bitmaps[group];
+}
 
-	mutex_acquire(this->mutex);
+static uint8_t * group_inode_bitmap(ext2_fs_t * this, unsigned int group) {
+	if (!this->inode_bitmaps[group]) {
+		this->inode_bitmaps[group] = malloc(this->block_size);
+		read_block(this, BGD[group].inode_bitmap, this->inode_bitmaps[group]);
+	}
+	return this->inode_bitmaps[group];
+}
 
-	for (unsigned int i = 0; i < BGDS; ++i) {
-		if (BGD[i].free_blocks_count > 0) {
-			read_block(this, BGD[i].block_bitmap, (uint8_t *)bg_buffer);
-			while (BLOCKBIT(block_offset)) {
-				++block_offset;
-			}
-			block_no = block_offset + SB->blocks_per_group * i;
-			group = i;
-			break;
+/**
+ * Number of blocks in a group; the last one is usually short.
+ */
+static unsigned int group_block_count(ext2_fs_t * this, unsigned int group) {
+	unsigned int first = SB->first_data_block + group * SB->blocks_per_group;
+	if (SB->blocks_count - first < SB->blocks_per_group) return SB->blocks_count - first;
+	return SB->blocks_per_group;
+}
+
+/**
+ * Find the first clear bit in [start, limit), or return limit.
+ */
+static unsigned int bitmap_find_free(uint8_t * bg_buffer, unsigned int start, unsigned int limit) {
+	unsigned int n = start;
+	while (n < limit) {
+		if (!(n & 7) && BLOCKBYTE(n) == 0xFF) {
+			n += 8;
+			continue;
 		}
+		if (!BLOCKBIT(n)) return n;
+		n++;
 	}
+	return limit;
+}
 
-	if (!block_no) {
-		mutex_release(this->mutex);
-		debug_print(CRITICAL, "No available blocks, disk is out of space!");
-		free(bg_buffer);
-		return 0;
+/**
+ * ext2->mark_block Mark a block used or free, keeping the counts in step.
+ *
+ * Requires the filesystem mutex.
+ */
+static void mark_block(ext2_fs_t * this, unsigned int block_no, int used) {
+	unsigned int group  = (block_no - SB->first_data_block) / SB->blocks_per_group;
+	unsigned int offset = (block_no - SB->first_data_block) % SB->blocks_per_group;
+	uint8_t * bg_buffer = group_block_bitmap(this, group);
+
+	if (used) {
+		BLOCKBYTE(offset) |= SETBIT(offset);
+		BGD[group].free_blocks_count--;
+		SB->free_blocks_count--;
+	} else {
+		BLOCKBYTE(offset) &= ~SETBIT(offset);
+		BGD[group].free_blocks_count++;
+		SB->free_blocks_count++;
 	}
 
-	debug_print(WARNING, "allocating block #%zu (group %zu)", block_no, group);
+	this->group_dirty[group] |= EXT2_DIRTY_BLOCK_BITMAP;
+	this->bgd_dirty = 1;
+	this->sb_dirty = 1;
+}
 
-	BLOCKBYTE(block_offset) |= SETBIT(block_offset);
-	write_block(this, BGD[group].block_bitmap, (uint8_t *)bg_buffer);
+/**
+ * ext2->prealloc_release Give back the unused part of a preallocation.
+ *
+ * Requires the filesystem mutex.
+ */
+static void prealloc_release(ext2_fs_t * this, struct ext2_prealloc * pa) {
+	while (pa->count) {
+		mark_block(this, pa->start, 0);
+		pa->start++;
+		pa->count--;
+	}
+	pa->ino = 0;
+}
 
-	BGD[group].free_blocks_count--;
-	for (int i = 0; i < this->bgd_block_span; ++i) {
-		write_block(this, this->bgd_offset + i, (uint8_t *)((uintptr_t)BGD + this->block_size * i));
+static struct ext2_prealloc * prealloc_find(ext2_fs_t * this, unsigned int inode_no) {
+	for (int i = 0; i < EXT2_PREALLOC_SLOTS; ++i) {
+		if (this->prealloc[i].ino == inode_no) return &this->prealloc[i];
+	}
+	return NULL;
+}
+
+/**
+ * ext2->prealloc_discard Drop any preallocation held for an inode.
+ */
+static void prealloc_discard(ext2_fs_t * this, unsigned int inode_no) {
+	mutex_acquire(this->mutex);
+	struct ext2_prealloc * pa = prealloc_find(this, inode_no);
+	if (pa) prealloc_release(this, pa);
+	mutex_release(this->mutex);
+}
+
+/**
+ * ext2->find_free_block Find a free block as close after @p goal as possible.
+ *
+ * Looks through the rest of the goal's group first, then the following
+ * groups, wrapping around to the part of the goal's group before it.
+ * Requires the filesystem mutex.
+ *
+ * @returns Block number, or 0 if the disk is full.
+ */
+static unsigned int find_free_block(ext2_fs_t * this, unsigned int goal) {
+	if (goal < SB->first_data_block || goal >= SB->blocks_count) goal = SB->first_data_block;
+	unsigned int first_group = (goal - SB->first_data_block) / SB->blocks_per_group;
+	unsigned int start = (goal - SB->first_data_block) % SB->blocks_per_group;
+
+	for (unsigned int i = 0; i <= BGDS; ++i) {
+		unsigned int group = (first_group + i) % BGDS;
+		if (!BGD[group].free_blocks_count) continue;
+
+		unsigned int from  = (i == 0) ? start : 0;
+		unsigned int limit = (i == BGDS) ? start : group_block_count(this, group);
+		unsigned int offset = bitmap_find_free(group_block_bitmap(this, group), from, limit);
+		if (offset < limit) {
+			return SB->first_data_block + group * SB->blocks_per_group + offset;
+		}
 	}
 
-	SB->free_blocks_count--;
-	rewrite_superblock(this);
+	return 0;
+}
+
+/**
+ * ext2->block_is_free Check a single block in the in-memory bitmap.
+ *
+ * Requires the filesystem mutex.
+ */
+static int block_is_free(ext2_fs_t * this, unsigned int block_no) {
+	if (block_no >= SB->blocks_count) return 0;
+	unsigned int group  = (block_no - SB->first_data_block) / SB->blocks_per_group;
+	unsigned int offset = (block_no - SB->first_data_block) % SB->blocks_per_group;
+	uint8_t * bg_buffer = group_block_bitmap(this, group);
+	return !BLOCKBIT(offset);
+}
+
+/**
+ * ext2->allocate_block Allocate a block.
+ *
+ * Blocks for a file come from its preallocation when that continues where
+ * the file left off. Otherwise the free block nearest @p goal is taken,
+ * along with up to EXT2_PREALLOC_BLOCKS - 1 free blocks right after it,
+ * which are held for the file's next writes.
+ *
+ * @param inode_no Inode the block is for, or 0 for indirect blocks
+ * @param goal     Preferred block number
+ * @param zero     Clear the block; callers about to write all of it pass 0
+ * @returns Block number, or 0 if the disk is full.
+ */
+static unsigned int allocate_block(ext2_fs_t * this, unsigned int inode_no, unsigned int goal, int zero) {
+	unsigned int block_no = 0;
 
-	memset(bg_buffer, 0x00, this->block_size);
-	write_block(this, block_no, bg_buffer);
+	mutex_acquire(this->mutex);
+
+	struct ext2_prealloc * pa = inode_no ? prealloc_find(this, inode_no) : NULL;
+	if (pa && pa->count && pa->start == goal) {
+		block_no = pa->start;
+		pa->start++;
+		pa->count--;
+	} else {
+		if (pa) prealloc_release(this, pa);
+
+		block_no = find_free_block(this, goal);
+		if (!block_no) {
+			mutex_release(this->mutex);
+			debug_print(CRITICAL, "No available blocks, disk is out of space!");
+			return 0;
+		}
+		mark_block(this, block_no, 1);
+
+		if (inode_no) {
+			unsigned int count = 0;
+			while (count < EXT2_PREALLOC_BLOCKS - 1 && block_is_free(this, block_no + 1 + count)) {
+				mark_block(this, block_no + 1 + count, 1);
+				count++;
+			}
+			if (count) {
+				if (!pa) {
+					pa = &this->prealloc[this->prealloc_hand];
+					this->prealloc_hand = (this->prealloc_hand + 1) % EXT2_PREALLOC_SLOTS;
+					prealloc_release(this, pa);
+				}
+				pa->ino   = inode_no;
+				pa->start = block_no + 1;
+				pa->count = count;
+			}
+		}
+	}
+
+	debug_print(WARNING, "allocating block #%u for inode %u (goal %u)", block_no, inode_no, goal);
 
 	mutex_release(this->mutex);
 
-	free(bg_buffer);
+	if (zero) {
+		uint8_t * empty = calloc(1, this->block_size);
+		write_block(this, block_no, empty);
+		free(empty);
+	}
 
 	return block_no;
-
 }
 
+/**
+ * ext2->sync Write back bitmaps, group descriptors and the superblock.
+ *
+ * Allocation only changes the in-memory copies of these; this is where
+ * they reach the disk. Outstanding preallocations are given back first
+ * so that what gets written matches the files.
+ */
+static void ext2_sync(ext2_fs_t * this) {
+	mutex_acquire(this->mutex);
+
+	for (int i = 0; i < EXT2_PREALLOC_SLOTS; ++i) {
+		if (this->prealloc[i].ino) prealloc_release(this, &this->prealloc[i]);
+	}
+
+	for (unsigned int i = 0; i < BGDS; ++i) {
+		if (this->group_dirty[i] & EXT2_DIRTY_BLOCK_BITMAP) {
+			write_block(this, BGD[i].block_bitmap, this->block_bitmaps[i]);
+		}
+		if (this->group_dirty[i] & EXT2_DIRTY_INODE_BITMAP) {
+			write_block(this, BGD[i].inode_bitmap, this->inode_bitmaps[i]);
+		}
+		this->group_dirty[i] = 0;
+	}
+
+	if (this->bgd_dirty) {
+		for (int i = 0; i < this->bgd_block_span; ++i) {
+			write_block(this, this->bgd_offset + i, (uint8_t *)((uintptr_t)BGD + this->block_size * i));
+		}
+		this->bgd_dirty = 0;
+	}
+
+	if (this->sb_dirty) {
+		rewrite_superblock(this);
+		this->sb_dirty = 0;
+	}
+
+	mutex_release(this->mutex);
+}
 
 /**
  * ext2->allocate_inode_block Allocate a block in an inode.
@@ -568,11 +1041,23 @@ static size_t allocate_block(ext2_fs_t * this) {
  * @param inode Inode to operate on
  * @param inode_no Number of the inode (this is not part of the struct)
  * @param block Block within inode to allocate
+ * @param zero Clear the new block, unless the caller is about to write all of it
  * @returns Error code or E_SUCCESS
  */
-static int allocate_inode_block(ext2_fs_t * this, ext2_inodetable_t * inode, unsigned int inode_no, unsigned int block) {
+static int allocate_inode_block(ext2_fs_t * this, ext2_inodetable_t * inode, unsigned int inode_no, unsigned int block, int zero) {
 	debug_print(NOTICE, "Allocating block #%d for inode #%d", block, inode_no);
-	unsigned int block_no = allocate_block(this);
+
+	/* Continue from the previous block, or start a file off in its inode's group. */
+	unsigned int goal = 0;
+	if (block > 0) {
+		goal = get_block_number(this, inode, inode_no, block - 1, NULL);
+		if (goal) goal++;
+	}
+	if (!goal) {
+		goal = SB->first_data_block + ((inode_no - 1) / this->inodes_per_group) * SB->blocks_per_group;
+	}
+
+	unsigned int block_no = allocate_block(this, inode_no, goal, zero);
 
 	if (!block_no) return E_NOSPACE;
 
@@ -597,7 +1082,7 @@ static int allocate_inode_block(ext2_fs_t * this, ext2_inodetable_t * inode, uns
  * @parma buf
  * @returns Real block number for reference.
  */
-static unsigned int inode_read_block(ext2_fs_t * this, ext2_inodetable_t * inode, unsigned int block, uint8_t * buf) {
+static unsigned int inode_read_block(ext2_fs_t * this, ext2_inodetable_t * inode, unsigned int inode_no, unsigned int block, uint8_t * buf) {
 
 	if (block >= inode->blocks / (this->block_size / 512)) {
 		memset(buf, 0x00, this->block_size);
@@ -605,7 +1090,7 @@ static unsigned int inode_read_block(ext2_fs_t * this, ext2_inodetable_t * inode
 		return 0;
 	}
 
-	unsigned int real_block = get_block_number(this, inode, block);
+	unsigned int real_block = get_block_number(this, inode, inode_no, block, NULL);
 	read_block(this, real_block, buf);
 
 	return real_block;
@@ -624,13 +1109,14 @@ static unsigned int inode_write_block(ext2_fs_t * this, ext2_inodetable_t * inod
 	char * empty = NULL;
 
 	while (block >= inode->blocks / (this->block_size / 512)) {
-		allocate_inode_block(this, inode, inode_no, inode->blocks / (this->block_size / 512));
+		unsigned int next = inode->blocks / (this->block_size / 512);
+		allocate_inode_block(this, inode, inode_no, next, next != block);
 		refresh_inode(this, inode, inode_no);
 	}
 	if (empty) free(empty);
 	debug_print(WARNING, "... done");
 
-	unsigned int real_block = get_block_number(this, inode, block);
+	unsigned int real_block = get_block_number(this, inode, inode_no, block, NULL);
 	debug_print(WARNING, "Writing virtual block %d for inode %d maps to real block %d", block, inode_no, real_block);
 
 	write_block(this, real_block, buf);
@@ -677,12 +1163,12 @@ static int create_entry(fs_node_t * parent, char * name, uint32_t inode) {
 	int modify_or_replace = 0;
 	ext2_dir_t *previous;
 
-	inode_read_block(this, pinode, block_nr, block);
+	inode_read_block(this, pinode, parent->inode, block_nr, block);
 	while (total_offset < pinode->size) {
 		if (dir_offset >= this->block_size) {
 			block_nr++;
 			dir_offset -= this->block_size;
-			inode_read_block(this, pinode, block_nr, block);
+			inode_read_block(this, pinode, parent->inode, block_nr, block);
 		}
 		ext2_dir_t *d_ent = (ext2_dir_t *)((uintptr_t)block + dir_offset);
 
@@ -730,7 +1216,7 @@ static int create_entry(fs_node_t * parent, char * name, uint32_t inode) {
 
 		if (dir_offset + rec_len >= this->block_size) {
 			block_nr++;
-			allocate_inode_block(this, pinode, parent->inode, block_nr);
+			allocate_inode_block(this, pinode, parent->inode, block_nr, 0);
 			memset(block, 0, this->block_size);
 			dir_offset = 0;
 			pinode->size += this->block_size;
@@ -765,65 +1251,45 @@ static int create_entry(fs_node_t * parent, char * name, uint32_t inode) {
 	return E_NOSPACE;
 }
 
-static unsigned int allocate_inode(ext2_fs_t * this) {
-	uint32_t node_no     = 0;
-	uint32_t node_offset = 0;
-	uint32_t group       = 0;
-	uint8_t * bg_buffer  = malloc(this->block_size);
+/**
+ * ext2->allocate_inode Allocate an inode, preferably in the same group as @p parent.
+ *
+ * @returns Inode number, or 0 if there are none left.
+ */
+static unsigned int allocate_inode(ext2_fs_t * this, unsigned int parent) {
+	unsigned int node_no = 0;
+	unsigned int first_group = parent ? (parent - 1) / this->inodes_per_group : 0;
 
 	mutex_acquire(this->mutex);
 
-	for (unsigned int i = 0; i < BGDS; ++i) {
-		if (BGD[i].free_inodes_count > 0) {
-			debug_print(NOTICE, "Group %d has %d free inodes.", i, BGD[i].free_inodes_count);
-			read_block(this, BGD[i].inode_bitmap, (uint8_t *)bg_buffer);
-
-			/* Sorry for the weird loops */
-			while (1) {
-				while (BLOCKBIT(node_offset)) {
-					node_offset++;
-					if (node_offset == this->inodes_per_group) {
-						goto _next_block;
-					}
-				}
-				node_no = node_offset + i * this->inodes_per_group + 1;
-				/* Is this a reserved inode? */
-				if (node_no <= 10) {
-					node_offset++;
-					if (node_offset == this->inodes_per_group) {
-						goto _next_block;
-					}
-					continue;
-				}
+	for (unsigned int i = 0; i < BGDS && !node_no; ++i) {
+		unsigned int group = (first_group + i) % BGDS;
+		if (!BGD[group].free_inodes_count) continue;
+
+		uint8_t * bg_buffer = group_inode_bitmap(this, group);
+		unsigned int node_offset = 0;
+		while ((node_offset = bitmap_find_free(bg_buffer, node_offset, this->inodes_per_group)) < this->inodes_per_group) {
+			/* Is this a reserved inode? */
+			if (node_offset + group * this->inodes_per_group + 1 > 10) {
+				node_no = node_offset + group * this->inodes_per_group + 1;
+				BLOCKBYTE(node_offset) |= SETBIT(node_offset);
+				BGD[group].free_inodes_count--;
+				this->group_dirty[group] |= EXT2_DIRTY_INODE_BITMAP;
 				break;
 			}
-			if (node_offset == this->inodes_per_group) {
-				_next_block:
-				node_offset = 0;
-				continue;
-			}
-			group = i;
-			break;
+			node_offset++;
 		}
 	}
+
 	if (!node_no) {
 		mutex_release(this->mutex);
 		dprintf("ext2: Out of inodes? node_no = 0\n");
 		return 0;
 	}
 
-	BLOCKBYTE(node_offset) |= SETBIT(node_offset);
-
-	write_block(this, BGD[group].inode_bitmap, (uint8_t *)bg_buffer);
-	free(bg_buffer);
-
-	BGD[group].free_inodes_count--;
-	for (int i = 0; i < this->bgd_block_span; ++i) {
-		write_block(this, this->bgd_offset + i, (uint8_t *)((uintptr_t)BGD + this->block_size * i));
-	}
-
 	SB->free_inodes_count--;
-	rewrite_superblock(this);
+	this->bgd_dirty = 1;
+	this->sb_dirty = 1;
 
 	mutex_release(this->mutex);
 
@@ -845,7 +1311,7 @@ static int mkdir_ext2(fs_node_t * parent, char * name, mode_t permission) {
 	}
 
 	/* Allocate an inode for it */
-	unsigned int inode_no = allocate_inode(this);
+	unsigned int inode_no = allocate_inode(this, parent->inode);
 	ext2_inodetable_t * inode = read_inode(this,inode_no);
 
 	/* Set the access and creation times to now */
@@ -915,11 +1381,11 @@ static int mkdir_ext2(fs_node_t * parent, char * name, mode_t permission) {
 	free(pinode);
 
 	/* Update directory count in block group descriptor */
-	uint32_t group = inode_no / this->inodes_per_group;
+	uint32_t group = (inode_no - 1) / this->inodes_per_group;
+	mutex_acquire(this->mutex);
 	BGD[group].used_dirs_count++;
-	for (int i = 0; i < this->bgd_block_span; ++i) {
-		write_block(this, this->bgd_offset + i, (uint8_t *)((uintptr_t)BGD + this->block_size * i));
-	}
+	this->bgd_dirty = 1;
+	mutex_release(this->mutex);
 
 	return 0;
 }
@@ -939,7 +1405,7 @@ static int create_ext2(fs_node_t * parent, char * name, mode_t permission) {
 	}
 
 	/* Allocate an inode for it */
-	unsigned int inode_no = allocate_inode(this);
+	unsigned int inode_no = allocate_inode(this, parent->inode);
 	ext2_inodetable_t * inode = read_inode(this,inode_no);
 
 	/* Set the access and creation times to now */
@@ -999,21 +1465,29 @@ static int chmod_ext2(fs_node_t * node, mode_t mode) {
 
 /**
  * direntry_ext2
+ *
+ * Find the @p index'th entry in a directory, scanning from @p *offset,
+ * which is where entry @p from begins. On success @p *offset is moved
+ * past the returned entry, so a caller walking the directory in order
+ * can pick up from there instead of the start.
  */
-static ext2_dir_t * direntry_ext2(ext2_fs_t * this, ext2_inodetable_t * inode, uint32_t no, uint32_t index) {
+static ext2_dir_t * direntry_ext2(ext2_fs_t * this, ext2_inodetable_t * inode, uint32_t no, uint32_t index, uint32_t from, uint32_t * offset) {
 	uint8_t *block = malloc(this->block_size);
-	uint8_t block_nr = 0;
-	inode_read_block(this, inode, block_nr, block);
-	uint32_t dir_offset = 0;
-	uint32_t total_offset = 0;
-	uint32_t dir_index = 0;
+	unsigned int block_nr = *offset / this->block_size;
+	inode_read_block(this, inode, no, block_nr, block);
+	uint32_t dir_offset = *offset % this->block_size;
+	uint32_t total_offset = *offset;
+	uint32_t dir_index = from;
 
 	while (total_offset < inode->size && dir_index <= index) {
 		ext2_dir_t *d_ent = (ext2_dir_t *)((uintptr_t)block + dir_offset);
 
+		if (!d_ent->rec_len) break; /* Corrupt directory; don't spin forever */
+
 		if (d_ent->inode != 0 && dir_index == index) {
 			ext2_dir_t *out = malloc(d_ent->rec_len);
 			memcpy(out, d_ent, d_ent->rec_len);
+			*offset = total_offset + d_ent->rec_len;
 			free(block);
 			return out;
 		}
@@ -1028,7 +1502,7 @@ static ext2_dir_t * direntry_ext2(ext2_fs_t * this, ext2_inodetable_t * inode, u
 		if (dir_offset >= this->block_size) {
 			block_nr++;
 			dir_offset -= this->block_size;
-			inode_read_block(this, inode, block_nr, block);
+			inode_read_block(this, inode, no, block_nr, block);
 		}
 	}
 
@@ -1048,7 +1522,7 @@ static fs_node_t * finddir_ext2(fs_node_t *node, char *name) {
 	uint8_t * block = malloc(this->block_size);
 	ext2_dir_t *direntry = NULL;
 	uint8_t block_nr = 0;
-	inode_read_block(this, inode, block_nr, block);
+	inode_read_block(this, inode, node->inode, block_nr, block);
 	uint32_t dir_offset = 0;
 	uint32_t total_offset = 0;
 
@@ -1056,7 +1530,7 @@ static fs_node_t * finddir_ext2(fs_node_t *node, char *name) {
 		if (dir_offset >= this->block_size) {
 			block_nr++;
 			dir_offset -= this->block_size;
-			inode_read_block(this, inode, block_nr, block);
+			inode_read_block(this, inode, node->inode, block_nr, block);
 		}
 		ext2_dir_t *d_ent = (ext2_dir_t *)((uintptr_t)block + dir_offset);
 
@@ -1111,7 +1585,7 @@ static int unlink_ext2(fs_node_t * node, char * name) {
 	uint8_t * block = malloc(this->block_size);
 	ext2_dir_t *direntry = NULL;
 	uint8_t block_nr = 0;
-	inode_read_block(this, inode, block_nr, block);
+	inode_read_block(this, inode, node->inode, block_nr, block);
 	uint32_t dir_offset = 0;
 	uint32_t total_offset = 0;
 
@@ -1119,7 +1593,7 @@ static int unlink_ext2(fs_node_t * node, char * name) {
 		if (dir_offset >= this->block_size) {
 			block_nr++;
 			dir_offset -= this->block_size;
-			inode_read_block(this, inode, block_nr, block);
+			inode_read_block(this, inode, node->inode, block_nr, block);
 		}
 		ext2_dir_t *d_ent = (ext2_dir_t *)((uintptr_t)block + dir_offset);
 
@@ -1178,26 +1652,9 @@ static void refresh_inode(ext2_fs_t * this, ext2_inodetable_t * inodet,  size_t
 		dprintf("ext2: Attempt to read inode 0\n");
 		return;
 	}
-	inode--;
-
-	uint32_t group = inode / this->inodes_per_group;
-	if (group > BGDS) {
-		return;
-	}
-	uint32_t inode_table_block = BGD[group].inode_table;
-	inode -= group * this->inodes_per_group;	// adjust index within group
-	uint32_t block_offset		= (inode * this->inode_size) / this->block_size;
-	uint32_t offset_in_block    = inode - block_offset * (this->block_size / this->inode_size);
-
-	uint8_t * buf = malloc(this->block_size);
-
-	read_block(this, inode_table_block + block_offset, buf);
-
-	ext2_inodetable_t *inodes = (ext2_inodetable_t *)buf;
-
-	memcpy(inodet, (uint8_t *)((uintptr_t)inodes + offset_in_block * this->inode_size), this->inode_size);
-
-	free(buf);
+	struct ext2_icache * e = icache_get(this, inode);
+	memcpy(inodet, e->inode, this->inode_size);
+	spin_unlock(this->icache_lock);
 }
 
 /**
@@ -1209,45 +1666,124 @@ static ext2_inodetable_t * read_inode(ext2_fs_t * this, size_t inode) {
 	return inodet;
 }
 
+/*
+ * Read-ahead state for an open file, kept in node->impl since every open
+ * of an ext2 file gets its own node: the block we expect the next read to
+ * start at, the current read-ahead window, and how far past that block
+ * read-ahead has already been requested.
+ */
+#define EXT2_RA_MIN 4
+#define EXT2_RA_MAX 256
+#define RA_NEXT(s)   ((unsigned int)((s) & 0xFFFFFFFF))
+#define RA_WINDOW(s) ((unsigned int)(((s) >> 32) & 0xFFFF))
+#define RA_AHEAD(s)  ((unsigned int)(((s) >> 48) & 0xFFFF))
+#define RA_PACK(next,window,ahead) ((uint64_t)(next) | ((uint64_t)(window) << 32) | ((uint64_t)(ahead) << 48))
+
+/**
+ * @brief Ask the block device to start loading blocks [first, last) of an inode.
+ */
+static void ext2_readahead(ext2_fs_t * this, ext2_inodetable_t * inode, unsigned int inode_no, unsigned int first, unsigned int last) {
+	while (first < last) {
+		unsigned int run = 1;
+		unsigned int real_block = get_block_number(this, inode, inode_no, first, &run);
+		if (run > last - first) run = last - first;
+		if (real_block) {
+			struct block_readahead req = {
+				.offset = (uint64_t)real_block * this->block_size,
+				.length = (uint64_t)run * this->block_size,
+			};
+			ioctl_fs(this->block_device, IOCTL_BLOCK_READAHEAD, &req);
+		}
+		first += run;
+	}
+}
+
+/**
+ * @brief Track sequential reads of an open file and keep the device ahead of them.
+ *
+ * The window starts small on the first sequential read and doubles with
+ * each one after that; any seek throws it away.
+ */
+static void ext2_read_sequential(ext2_fs_t * this, fs_node_t * node, ext2_inodetable_t * inode, unsigned int allocated, unsigned int first, unsigned int last) {
+	uint64_t state = node->impl;
+	unsigned int window = RA_WINDOW(state);
+	unsigned int ahead = RA_NEXT(state) + RA_AHEAD(state);
+
+	if (first == RA_NEXT(state)) {
+		window = window ? window * 2 : EXT2_RA_MIN;
+		if (window > EXT2_RA_MAX) window = EXT2_RA_MAX;
+	} else {
+		window = 0;
+	}
+
+	unsigned int next = last + 1;
+	if (ahead < next) ahead = next;
+
+	/* Top the window up once half of it has been consumed. */
+	if (window && ahead < next + window / 2) {
+		unsigned int target = next + window;
+		if (target > allocated) target = allocated;
+		if (ahead < target) ext2_readahead(this, inode, node->inode, ahead, target);
+		ahead = target > ahead ? target : ahead;
+	}
+
+	if (!window) ahead = next;
+	node->impl = RA_PACK(next, window, ahead - next);
+}
+
 static ssize_t read_ext2(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
 	ext2_fs_t * this = (ext2_fs_t *)node->device;
 	ext2_inodetable_t * inode = read_inode(this, node->inode);
-	uint32_t end;
-	if (inode->size == 0) return 0;
+	if (offset < 0 || (size_t)offset >= inode->size) {
+		free(inode);
+		return 0;
+	}
 	if (offset + size > inode->size) {
-		end = inode->size;
-	} else {
-		end = offset + size;
+		size = inode->size - offset;
 	}
-	uint32_t start_block  = offset / this->block_size;
-	uint32_t end_block    = end / this->block_size;
-	uint32_t end_size     = end - end_block * this->block_size;
-	uint32_t size_to_read = end - offset;
 
-	uint8_t * buf = malloc(this->block_size);
-	if (start_block == end_block) {
-		inode_read_block(this, inode, start_block, buf);
-		memcpy(buffer, (uint8_t *)(((uintptr_t)buf) + ((uintptr_t)offset % this->block_size)), size_to_read);
-	} else {
-		uint32_t block_offset;
-		uint32_t blocks_read = 0;
-		for (block_offset = start_block; block_offset < end_block; block_offset++, blocks_read++) {
-			if (block_offset == start_block) {
-				inode_read_block(this, inode, block_offset, buf);
-				memcpy(buffer, (uint8_t *)(((uintptr_t)buf) + ((uintptr_t)offset % this->block_size)), this->block_size - (offset % this->block_size));
-			} else {
-				inode_read_block(this, inode, block_offset, buf);
-				memcpy(buffer + this->block_size * blocks_read - (offset % this->block_size), buf, this->block_size);
-			}
+	unsigned int allocated = inode->blocks / (this->block_size / 512);
+	ext2_read_sequential(this, node, inode, allocated, offset / this->block_size, (offset + size - 1) / this->block_size);
+
+	uint8_t * buf = NULL;
+	size_t done = 0;
+
+	while (done < size) {
+		unsigned int block = (offset + done) / this->block_size;
+		size_t skip = (offset + done) % this->block_size;
+
+		unsigned int run = 1;
+		unsigned int real_block = 0;
+		if (block < allocated) {
+			real_block = get_block_number(this, inode, node->inode, block, &run);
+			if (run > allocated - block) run = allocated - block;
 		}
-		if (end_size) {
-			inode_read_block(this, inode, end_block, buf);
-			memcpy(buffer + this->block_size * blocks_read - (offset % this->block_size), buf, end_size);
+
+		if (real_block && !skip && size - done >= this->block_size) {
+			/* Whole blocks go straight into the caller's buffer, one request per contiguous run */
+			if (run > (size - done) / this->block_size) run = (size - done) / this->block_size;
+			read_fs(this->block_device, (uint64_t)real_block * this->block_size, run * this->block_size, buffer + done);
+			done += run * this->block_size;
+			continue;
+		}
+
+		/* Partial blocks at either end are read whole and the wanted part copied out */
+		size_t length = this->block_size - skip;
+		if (length > size - done) length = size - done;
+		if (real_block) {
+			if (!buf) buf = malloc(this->block_size);
+			read_fs(this->block_device, (uint64_t)real_block * this->block_size, this->block_size, buf);
+			memcpy(buffer + done, buf + skip, length);
+		} else {
+			/* Holes and blocks past the end of the allocation read as zero */
+			memset(buffer + done, 0x00, length);
 		}
+		done += length;
 	}
+
 	free(inode);
 	free(buf);
-	return size_to_read;
+	return size;
 }
 
 static ssize_t write_inode_buffer(ext2_fs_t * this, ext2_inodetable_t * inode, uint32_t inode_number, off_t offset, size_t size, uint8_t *buffer) {
@@ -1263,7 +1799,7 @@ static ssize_t write_inode_buffer(ext2_fs_t * this, ext2_inodetable_t * inode, u
 	uint32_t size_to_read = end - offset;
 	uint8_t * buf = malloc(this->block_size);
 	if (start_block == end_block) {
-		inode_read_block(this, inode, start_block, buf);
+		inode_read_block(this, inode, inode_number, start_block, buf);
 		memcpy((uint8_t *)(((uintptr_t)buf) + ((uintptr_t)offset % this->block_size)), buffer, size_to_read);
 		inode_write_block(this, inode, inode_number, start_block, buf);
 	} else {
@@ -1271,14 +1807,14 @@ static ssize_t write_inode_buffer(ext2_fs_t * this, ext2_inodetable_t * inode, u
 		uint32_t blocks_read = 0;
 		for (block_offset = start_block; block_offset < end_block; block_offset++, blocks_read++) {
 			if (block_offset == start_block) {
-				int b = inode_read_block(this, inode, block_offset, buf);
+				int b = inode_read_block(this, inode, inode_number, block_offset, buf);
 				memcpy((uint8_t *)(((uintptr_t)buf) + ((uintptr_t)offset % this->block_size)), buffer, this->block_size - (offset % this->block_size));
 				inode_write_block(this, inode, inode_number, block_offset, buf);
 				if (!b) {
 					refresh_inode(this, inode, inode_number);
 				}
 			} else {
-				int b = inode_read_block(this, inode, block_offset, buf);
+				int b = inode_read_block(this, inode, inode_number, block_offset, buf);
 				memcpy(buf, buffer + this->block_size * blocks_read - (offset % this->block_size), this->block_size);
 				inode_write_block(this, inode, inode_number, block_offset, buf);
 				if (!b) {
@@ -1287,7 +1823,7 @@ static ssize_t write_inode_buffer(ext2_fs_t * this, ext2_inodetable_t * inode, u
 			}
 		}
 		if (end_size) {
-			inode_read_block(this, inode, end_block, buf);
+			inode_read_block(this, inode, inode_number, end_block, buf);
 			memcpy(buf, buffer + this->block_size * blocks_read - (offset % this->block_size), end_size);
 			inode_write_block(this, inode, inode_number, end_block, buf);
 		}
@@ -1318,11 +1854,32 @@ static int truncate_ext2(fs_node_t * node) {
 }
 
 static void open_ext2(fs_node_t *node, unsigned int flags) {
-	/* Nothing to do here */
+	ext2_fs_t * this = node->device;
+	/* open_fs calls this for every reference to a node, but we only hear about its last close. */
+	if (!(this->flags & EXT2_FLAG_READWRITE) || node->refcount != 1) return;
+
+	mutex_acquire(this->mutex);
+	uintptr_t count = (uintptr_t)hashmap_get(this->open_nodes, (void*)(uintptr_t)node->inode);
+	hashmap_set(this->open_nodes, (void*)(uintptr_t)node->inode, (void*)(count + 1));
+	mutex_release(this->mutex);
 }
 
 static void close_ext2(fs_node_t *node) {
-	/* Nothing to do here */
+	ext2_fs_t * this = node->device;
+	if (!(this->flags & EXT2_FLAG_READWRITE)) return;
+
+	mutex_acquire(this->mutex);
+	uintptr_t count = (uintptr_t)hashmap_get(this->open_nodes, (void*)(uintptr_t)node->inode);
+	if (count > 1) {
+		/* Someone else still has the file open and may still be writing to it */
+		hashmap_set(this->open_nodes, (void*)(uintptr_t)node->inode, (void*)(count - 1));
+		mutex_release(this->mutex);
+		return;
+	}
+	hashmap_remove(this->open_nodes, (void*)(uintptr_t)node->inode);
+	mutex_release(this->mutex);
+
+	prealloc_discard(this, node->inode);
 }
 
 
@@ -1335,11 +1892,25 @@ static struct dirent * readdir_ext2(fs_node_t *node, unsigned long index) {
 
 	ext2_inodetable_t *inode = read_inode(this, node->inode);
 	//assert(inode->mode & EXT2_S_IFDIR);
-	ext2_dir_t *direntry = direntry_ext2(this, inode, node->inode, index);
+
+	/*
+	 * Directories are usually read in order, so each open directory
+	 * remembers in node->impl the index and byte offset of the entry
+	 * after the one it returned last, and carries on from there.
+	 */
+	uint32_t from = node->impl >> 32;
+	uint32_t offset = node->impl & 0xFFFFFFFF;
+	if (index < from) {
+		from = 0;
+		offset = 0;
+	}
+
+	ext2_dir_t *direntry = direntry_ext2(this, inode, node->inode, index, from, &offset);
 	if (!direntry) {
 		free(inode);
 		return NULL;
 	}
+	node->impl = ((uint64_t)(index + 1) << 32) | offset;
 	struct dirent *dirent = malloc(sizeof(struct dirent));
 	memcpy(&dirent->d_name, &direntry->name, direntry->name_len);
 	dirent->d_name[direntry->name_len] = '\0';
@@ -1364,7 +1935,7 @@ static int symlink_ext2(fs_node_t * parent, char * target, char * name) {
 	}
 
 	/* Allocate an inode for it */
-	unsigned int inode_no = allocate_inode(this);
+	unsigned int inode_no = allocate_inode(this, parent->inode);
 	ext2_inodetable_t * inode = read_inode(this,inode_no);
 
 	/* Set the access and creation times to now */
@@ -1446,6 +2017,9 @@ static int ioctl_ext2(fs_node_t * node, unsigned long request, void * argp) {
 
 	switch (request) {
 		case IOCTLSYNC:
+			if (this->flags & EXT2_FLAG_READWRITE) {
+				ext2_sync(this);
+			}
 			return ioctl_fs(this->block_device, IOCTLSYNC, NULL);
 
 		default:
@@ -1453,6 +2027,30 @@ static int ioctl_ext2(fs_node_t * node, unsigned long request, void * argp) {
 	}
 }
 
+/**
+ * refresh_ext2
+ *
+ * Bring a node the VFS kept from an earlier lookup up to date with its inode.
+ */
+static int refresh_ext2(fs_node_t * node) {
+	ext2_fs_t * this = (ext2_fs_t *)node->device;
+	ext2_inodetable_t * inode = read_inode(this, node->inode);
+	if (!inode->links_count || !inode->mode) {
+		free(inode);
+		return 1;
+	}
+	node->uid    = inode->uid;
+	node->gid    = inode->gid;
+	node->length = inode->size;
+	node->mask   = inode->mode & 0xFFF;
+	node->nlink  = inode->links_count;
+	node->atime  = inode->atime;
+	node->mtime  = inode->mtime;
+	node->ctime  = inode->ctime;
+	free(inode);
+	return 0;
+}
+
 static int node_from_file(ext2_fs_t * this, ext2_inodetable_t *inode, ext2_dir_t *direntry,  fs_node_t *fnode) {
 	if (!fnode) {
 		/* You didn't give me a node to write into, go **** yourself */
@@ -1471,6 +2069,8 @@ static int node_from_file(ext2_fs_t * this, ext2_inodetable_t *inode, ext2_dir_t
 	fnode->nlink = inode->links_count;
 	/* File Flags */
 	fnode->flags = 0;
+	fnode->impl = 0;
+	fnode->refresh = refresh_ext2;
 	if ((inode->mode & EXT2_S_IFREG) == EXT2_S_IFREG) {
 		fnode->flags   |= FS_FILE;
 		fnode->read     = read_ext2;
@@ -1586,7 +2186,8 @@ static int ext2_root(ext2_fs_t * this, ext2_inodetable_t *inode, fs_node_t *fnod
 	fnode->close   = close_ext2;
 	fnode->readdir = readdir_ext2;
 	fnode->finddir = finddir_ext2;
-	fnode->ioctl   = NULL;
+	fnode->ioctl   = ioctl_ext2;
+	fnode->refresh = refresh_ext2;
 	fnode->create  = create_ext2;
 	fnode->mkdir   = mkdir_ext2;
 	fnode->unlink  = unlink_ext2;
@@ -1607,6 +2208,7 @@ static fs_node_t * mount_ext2(fs_node_t * block_device, int flags) {
 	//vfs_lock(this->block_device);
 
 	this->mutex = mutex_init("ext2 fs");
+	this->open_nodes = hashmap_create_int(32);
 
 	SB = malloc(this->block_size);
 
@@ -1622,6 +2224,7 @@ static fs_node_t * mount_ext2(fs_node_t * block_device, int flags) {
 	}
 	this->block_size = 1024 << SB->log_block_size;
 	this->pointers_per_block = this->block_size / 4;
+	icache_init(this);
 	debug_print(INFO, "Log block size = %d -> %d", SB->log_block_size, this->block_size);
 	BGDS = SB->blocks_count / SB->blocks_per_group;
 	if (SB->blocks_per_group * BGDS < SB->blocks_count) {
@@ -1645,6 +2248,10 @@ static fs_node_t * mount_ext2(fs_node_t * block_device, int flags) {
 		read_block(this, this->bgd_offset + i, (uint8_t *)((uintptr_t)BGD + this->block_size * i));
 	}
 
+	this->block_bitmaps = calloc(BGDS, sizeof(uint8_t *));
+	this->inode_bitmaps = calloc(BGDS, sizeof(uint8_t *));
+	this->group_dirty   = calloc(BGDS, sizeof(uint8_t));
+
 	dprintf("ext2: %u BGDs, %u inodes, %u inodes per group\n",
 		BGDS, SB->inodes_count, this->inodes_per_group);
 
@@ -1679,6 +2286,7 @@ static fs_node_t * mount_ext2(fs_node_t * block_device, int flags) {
 
 	ext2_inodetable_t *root_inode = read_inode(this, 2);
 	RN = (fs_node_t *)malloc(sizeof(fs_node_t));
+	memset(RN, 0, sizeof(fs_node_t));
 	if (!ext2_root(this, root_inode, RN)) {
 		return NULL;
 	}
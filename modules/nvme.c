@@ -0,0 +1,731 @@
+/**
+ * @brief NVMe block device driver
+ * @file modules/nvme.c
+ * @package x86_64
+ *
+ * Brings up NVMe controllers with an admin queue and one I/O queue
+ * pair per CPU, as far as the controller allows, and registers each
+ * active namespace with the block cache as /dev/nvmeXnY.
+ *
+ * A request goes to the submission queue of the CPU that issues it, so
+ * cores don't contend for one queue lock. Transfers are described with
+ * PRPs: the first page in the command, the rest in a per-command PRP
+ * list when there are more than two.
+ *
+ * Admin commands are only issued while setting up, and are polled.
+ * I/O completions arrive through the controller's pin interrupt,
+ * which every completion queue shares, as we have no MSI-X support.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2023 K. Lange
+ */
+#include <errno.h>
+#include <kernel/types.h>
+#include <kernel/string.h>
+#include <kernel/printf.h>
+#include <kernel/module.h>
+#include <kernel/pci.h>
+#include <kernel/vfs.h>
+#include <kernel/mmu.h>
+#include <kernel/list.h>
+#include <kernel/misc.h>
+#include <kernel/time.h>
+#include <kernel/process.h>
+#include <kernel/spinlock.h>
+#include <kernel/bcache.h>
+
+#include <kernel/arch/x86_64/irq.h>
+
+/* Controller registers */
+#define NVME_REG_CAP   0x00
+#define NVME_REG_VS    0x08
+#define NVME_REG_INTMS 0x0C
+#define NVME_REG_CC    0x14
+#define NVME_REG_CSTS  0x1C
+#define NVME_REG_AQA   0x24
+#define NVME_REG_ASQ   0x28
+#define NVME_REG_ACQ   0x30
+#define NVME_REG_DB    0x1000
+
+#define NVME_CAP_MQES(c)   ((c) & 0xFFFF)
+#define NVME_CAP_TO(c)     (((c) >> 24) & 0xFF)
+#define NVME_CAP_DSTRD(c)  (((c) >> 32) & 0xF)
+
+#define NVME_CC_EN         (1 << 0)
+#define NVME_CC_IOSQES     (6 << 16) /* 64-byte submission entries */
+#define NVME_CC_IOCQES     (4 << 20) /* 16-byte completion entries */
+
+#define NVME_CSTS_RDY      (1 << 0)
+#define NVME_CSTS_CFS      (1 << 1)
+
+/* Admin commands */
+#define NVME_ADMIN_CREATE_SQ  0x01
+#define NVME_ADMIN_DELETE_CQ  0x04
+#define NVME_ADMIN_CREATE_CQ  0x05
+#define NVME_ADMIN_IDENTIFY   0x06
+#define NVME_ADMIN_SET_FEATURES 0x09
+
+#define NVME_IDENTIFY_NS          0
+#define NVME_IDENTIFY_CTRL        1
+#define NVME_IDENTIFY_NS_LIST     2
+#define NVME_FEATURE_NUM_QUEUES   0x07
+
+/* I/O commands */
+#define NVME_CMD_FLUSH  0x00
+#define NVME_CMD_WRITE  0x01
+#define NVME_CMD_READ   0x02
+
+/* Identify controller data */
+#define NVME_ID_CTRL_MDTS 77
+#define NVME_ID_CTRL_VWC  525
+
+/* Identify namespace data */
+#define NVME_ID_NS_NSZE   0
+#define NVME_ID_NS_FLBAS  26
+#define NVME_ID_NS_LBAF   128
+
+#define NVME_ADMIN_DEPTH  16
+#define NVME_IO_DEPTH     64
+#define NVME_SLOTS        32 /* Commands in flight per I/O queue */
+#define NVME_MAX_BLOCKS   64
+#define NVME_PRP_LIST     512 /* Bytes of PRP list per command; covers NVME_MAX_BLOCKS + 1 pages */
+#define NVME_MAX_QUEUES   PROCESSOR_MAX
+#define NVME_MAX_NS       16
+
+#define NVME_PENDING      1
+
+struct nvme_command {
+	uint32_t cdw0;     /* Opcode, and command identifier in the high half */
+	uint32_t nsid;
+	uint64_t reserved;
+	uint64_t mptr;
+	uint64_t prp1;
+	uint64_t prp2;
+	uint32_t cdw10;
+	uint32_t cdw11;
+	uint32_t cdw12;
+	uint32_t cdw13;
+	uint32_t cdw14;
+	uint32_t cdw15;
+} __attribute__((packed));
+
+struct nvme_completion {
+	uint32_t result;
+	uint32_t reserved;
+	uint16_t sq_head;
+	uint16_t sq_id;
+	uint16_t cid;
+	volatile uint16_t status; /* Phase tag in bit 0 */
+} __attribute__((packed));
+
+struct nvme_ctrl;
+
+struct nvme_queue {
+	struct nvme_ctrl * ctrl;
+	int qid;
+	uint16_t depth;
+
+	struct nvme_command * sq;
+	uintptr_t sq_phys;
+	volatile struct nvme_completion * cq;
+	uintptr_t cq_phys;
+	uint16_t sq_tail;
+	uint16_t cq_head;
+	uint16_t phase;
+
+	uint64_t * prp_lists;     /* NVME_PRP_LIST bytes for each command slot */
+	uintptr_t prp_phys;
+
+	spin_lock_t lock;
+	list_t * waiters;
+	uint32_t claimed;
+	int status[NVME_SLOTS];
+};
+
+struct nvme_ns {
+	struct nvme_ctrl * ctrl;
+	uint32_t nsid;
+	uint64_t blocks;          /* In logical blocks */
+	size_t lba_size;
+	char name[16];
+	struct bcache_device cache;
+};
+
+struct nvme_ctrl {
+	uint32_t pcidev;
+	int index;
+	int irq;
+	uintptr_t mmio;
+	uintptr_t doorbells;      /* Mapped separately, from NVME_REG_DB */
+	uint64_t cap;
+	size_t stride;            /* Doorbell stride in bytes */
+	size_t max_blocks;        /* Largest transfer, in cache blocks */
+	int volatile_cache;
+
+	uint8_t * scratch;        /* A page for IDENTIFY data */
+	uintptr_t scratch_phys;
+
+	struct nvme_queue admin;
+	int io_queue_count;
+	struct nvme_queue * io_queues[NVME_MAX_QUEUES];
+};
+
+static int ctrl_count = 0;
+static struct nvme_ctrl * ctrls[8] = {NULL};
+
+static uint32_t mmio_read4(uintptr_t mmiobase, intptr_t offset) {
+	volatile uint32_t * data = (volatile uint32_t *)(mmiobase + offset);
+	return *data;
+}
+
+static void mmio_write4(uintptr_t mmiobase, intptr_t offset, uint32_t value) {
+	volatile uint32_t * data = (volatile uint32_t *)(mmiobase + offset);
+	*data = value;
+}
+
+static uint64_t mmio_read8(uintptr_t mmiobase, intptr_t offset) {
+	return mmio_read4(mmiobase, offset) | ((uint64_t)mmio_read4(mmiobase, offset + 4) << 32);
+}
+
+static void mmio_write8(uintptr_t mmiobase, intptr_t offset, uint64_t value) {
+	mmio_write4(mmiobase, offset, value & 0xFFFFFFFF);
+	mmio_write4(mmiobase, offset + 4, value >> 32);
+}
+
+static void * kvmalloc_p(size_t size, uintptr_t * outphys) {
+	uintptr_t index = mmu_allocate_n_frames(size / 0x1000) << 12;
+	*outphys = index;
+	void * out = mmu_map_from_physical(index);
+	memset(out, 0, size);
+	return out;
+}
+
+static void kvfree_p(uintptr_t phys, size_t size) {
+	for (size_t i = 0; i < size; i += 0x1000) {
+		mmu_frame_release(phys + i);
+	}
+}
+
+static void nvme_sq_doorbell(struct nvme_queue * q) {
+	mmio_write4(q->ctrl->doorbells, (2 * q->qid) * q->ctrl->stride, q->sq_tail);
+}
+
+static void nvme_cq_doorbell(struct nvme_queue * q) {
+	mmio_write4(q->ctrl->doorbells, (2 * q->qid + 1) * q->ctrl->stride, q->cq_head);
+}
+
+/**
+ * @brief Wait for the controller's ready bit to match @p ready.
+ * @returns 0 when it does, 1 if the controller's own timeout passes first.
+ */
+static int nvme_wait_ready(struct nvme_ctrl * ctrl, int ready) {
+	uint64_t timeout = NVME_CAP_TO(ctrl->cap) ? NVME_CAP_TO(ctrl->cap) * 500 : 500; /* ms */
+	uint64_t expire = arch_perf_timer() + timeout * 1000 * arch_cpu_mhz();
+	while (arch_perf_timer() < expire) {
+		uint32_t csts = mmio_read4(ctrl->mmio, NVME_REG_CSTS);
+		if (csts & NVME_CSTS_CFS) return 1;
+		if (!!(csts & NVME_CSTS_RDY) == ready) return 0;
+	}
+	return 1;
+}
+
+static void nvme_queue_init(struct nvme_ctrl * ctrl, struct nvme_queue * q, int qid, uint16_t depth) {
+	q->ctrl  = ctrl;
+	q->qid   = qid;
+	q->depth = depth;
+	q->sq = kvmalloc_p((depth * sizeof(struct nvme_command) + 0xFFF) & ~0xFFF, &q->sq_phys);
+	q->cq = kvmalloc_p((depth * sizeof(struct nvme_completion) + 0xFFF) & ~0xFFF, &q->cq_phys);
+	q->phase = 1;
+	spin_init(q->lock);
+}
+
+/**
+ * @brief Give back a queue's memory; the controller must no longer know about it.
+ */
+static void nvme_queue_free(struct nvme_queue * q) {
+	kvfree_p(q->sq_phys, (q->depth * sizeof(struct nvme_command) + 0xFFF) & ~0xFFF);
+	kvfree_p(q->cq_phys, (q->depth * sizeof(struct nvme_completion) + 0xFFF) & ~0xFFF);
+	if (q->prp_lists) kvfree_p(q->prp_phys, NVME_SLOTS * NVME_PRP_LIST);
+	if (q->waiters) {
+		list_free(q->waiters);
+		free(q->waiters);
+	}
+}
+
+/**
+ * @brief Consume new completion queue entries.
+ *
+ * Requires the queue lock.
+ * @returns 1 if there were any.
+ */
+static int nvme_reap(struct nvme_queue * q) {
+	int reaped = 0;
+	while ((q->cq[q->cq_head].status & 1) == q->phase) {
+		__sync_synchronize();
+		uint16_t cid = q->cq[q->cq_head].cid;
+		uint16_t status = q->cq[q->cq_head].status >> 1;
+		if (cid < NVME_SLOTS) {
+			if (status) dprintf("nvme: queue %d: command %u failed with status %#x\n", q->qid, cid, status);
+			q->status[cid] = status ? -EIO : 0;
+		}
+		if (++q->cq_head == q->depth) {
+			q->cq_head = 0;
+			q->phase ^= 1;
+		}
+		reaped = 1;
+	}
+	if (reaped) {
+		nvme_cq_doorbell(q);
+		if (q->waiters) wakeup_queue(q->waiters);
+	}
+	return reaped;
+}
+
+static int nvme_irq_handler(struct regs * r) {
+	int irq = r->int_no - 32;
+	int handled = 0;
+
+	for (int i = 0; i < ctrl_count; ++i) {
+		struct nvme_ctrl * ctrl = ctrls[i];
+		if (ctrl->irq != irq) continue;
+		for (int j = 0; j < ctrl->io_queue_count; ++j) {
+			struct nvme_queue * q = ctrl->io_queues[j];
+			spin_lock(q->lock);
+			if (nvme_reap(q)) handled = 1;
+			spin_unlock(q->lock);
+		}
+	}
+
+	if (handled) irq_ack(irq);
+	return handled;
+}
+
+/**
+ * @brief Run an admin command and poll for its completion.
+ *
+ * @param result Receives the command-specific result, if not NULL
+ * @returns 0 on success
+ */
+static int nvme_admin(struct nvme_ctrl * ctrl, struct nvme_command * cmd, uint32_t * result) {
+	struct nvme_queue * q = &ctrl->admin;
+	memcpy(&q->sq[q->sq_tail], cmd, sizeof(struct nvme_command));
+	q->sq_tail = (q->sq_tail + 1) % q->depth;
+	__sync_synchronize();
+	nvme_sq_doorbell(q);
+
+	uint64_t expire = arch_perf_timer() + 1000000UL * arch_cpu_mhz();
+	while ((q->cq[q->cq_head].status & 1) != q->phase) {
+		if (arch_perf_timer() >= expire) {
+			dprintf("nvme: admin command %#x timed out\n", cmd->cdw0 & 0xFF);
+			return 1;
+		}
+	}
+
+	__sync_synchronize();
+	uint16_t status = q->cq[q->cq_head].status >> 1;
+	if (result) *result = q->cq[q->cq_head].result;
+	if (++q->cq_head == q->depth) {
+		q->cq_head = 0;
+		q->phase ^= 1;
+	}
+	nvme_cq_doorbell(q);
+
+	if (status) {
+		dprintf("nvme: admin command %#x failed with status %#x\n", cmd->cdw0 & 0xFF, status);
+		return 1;
+	}
+	return 0;
+}
+
+static int nvme_identify(struct nvme_ctrl * ctrl, uint32_t cns, uint32_t nsid) {
+	struct nvme_command cmd = {0};
+	cmd.cdw0  = NVME_ADMIN_IDENTIFY;
+	cmd.nsid  = nsid;
+	cmd.prp1  = ctrl->scratch_phys;
+	cmd.cdw10 = cns;
+	return nvme_admin(ctrl, &cmd, NULL);
+}
+
+/**
+ * @brief Create the I/O queue pair @p qid, its completion queue first.
+ */
+static struct nvme_queue * nvme_create_io_queue(struct nvme_ctrl * ctrl, int qid, uint16_t depth) {
+	struct nvme_queue * q = calloc(1, sizeof(struct nvme_queue));
+	nvme_queue_init(ctrl, q, qid, depth);
+
+	struct nvme_command cmd = {0};
+	cmd.cdw0  = NVME_ADMIN_CREATE_CQ;
+	cmd.prp1  = q->cq_phys;
+	cmd.cdw10 = ((uint32_t)(depth - 1) << 16) | qid;
+	cmd.cdw11 = (1 << 1) | (1 << 0); /* Interrupts on, vector 0; physically contiguous */
+	if (nvme_admin(ctrl, &cmd, NULL)) goto _fail;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.cdw0  = NVME_ADMIN_CREATE_SQ;
+	cmd.prp1  = q->sq_phys;
+	cmd.cdw10 = ((uint32_t)(depth - 1) << 16) | qid;
+	cmd.cdw11 = ((uint32_t)qid << 16) | (1 << 0);
+	if (nvme_admin(ctrl, &cmd, NULL)) {
+		memset(&cmd, 0, sizeof(cmd));
+		cmd.cdw0  = NVME_ADMIN_DELETE_CQ;
+		cmd.cdw10 = qid;
+		if (nvme_admin(ctrl, &cmd, NULL)) return NULL; /* Still in the controller's hands */
+		goto _fail;
+	}
+
+	q->prp_lists = kvmalloc_p(NVME_SLOTS * NVME_PRP_LIST, &q->prp_phys);
+	q->waiters = list_create("nvme waiters", q);
+	return q;
+
+_fail:
+	nvme_queue_free(q);
+	free(q);
+	return NULL;
+}
+
+/**
+ * @brief Fill in the PRP entries for a transfer from a kernel buffer.
+ *
+ * The first entry may start anywhere in a page; every later one is a
+ * whole page, which a virtually contiguous buffer gives us for free.
+ */
+static int nvme_build_prps(struct nvme_queue * q, int slot, struct nvme_command * cmd, uint8_t * buffer, size_t size) {
+	union PML * dir = mmu_get_kernel_directory();
+	uintptr_t addr = (uintptr_t)buffer;
+	uint64_t * list = (uint64_t *)((uintptr_t)q->prp_lists + slot * NVME_PRP_LIST);
+	size_t entries = 0;
+
+	uintptr_t phys = mmu_map_to_physical(dir, addr);
+	if ((phys & 3) || phys >= (uintptr_t)-4) return 1;
+	cmd->prp1 = phys;
+
+	size_t first = 0x1000 - (addr & 0xFFF);
+	if (first >= size) return 0;
+	addr += first;
+	size -= first;
+
+	while (size) {
+		phys = mmu_map_to_physical(dir, addr);
+		if (phys >= (uintptr_t)-4) return 1;
+		if (entries == NVME_PRP_LIST / sizeof(uint64_t)) return 1;
+		list[entries++] = phys;
+		size_t chunk = size < 0x1000 ? size : 0x1000;
+		addr += chunk;
+		size -= chunk;
+	}
+
+	if (entries == 1) {
+		cmd->prp2 = list[0];
+	} else {
+		cmd->prp2 = q->prp_phys + slot * NVME_PRP_LIST;
+	}
+	return 0;
+}
+
+static int nvme_claim_slot(struct nvme_queue * q) {
+	for (int i = 0; i < NVME_SLOTS && i < q->depth - 1; ++i) {
+		if (!(q->claimed & (1UL << i))) {
+			q->claimed |= (1UL << i);
+			return i;
+		}
+	}
+	return -1;
+}
+
+/**
+ * @brief Submit an I/O command on this CPU's queue and sleep until it completes.
+ *
+ * @param buffer Kernel buffer to transfer, or NULL for commands without data
+ * @param count  Logical blocks to transfer
+ * @returns 0 on success or a negative error
+ */
+static int nvme_io(struct nvme_ns * ns, uint8_t opcode, uint64_t lba, uint32_t count, uint8_t * buffer) {
+	struct nvme_ctrl * ctrl = ns->ctrl;
+	struct nvme_queue * q = ctrl->io_queues[this_core->cpu_id % ctrl->io_queue_count];
+	int slot;
+
+	spin_lock(q->lock);
+	while ((slot = nvme_claim_slot(q)) < 0) {
+		sleep_on_unlocking(q->waiters, &q->lock);
+		spin_lock(q->lock);
+	}
+	spin_unlock(q->lock);
+
+	struct nvme_command cmd = {0};
+	cmd.cdw0 = opcode | ((uint32_t)slot << 16);
+	cmd.nsid = ns->nsid;
+
+	int status = 0;
+	if (buffer) {
+		cmd.cdw10 = lba & 0xFFFFFFFF;
+		cmd.cdw11 = lba >> 32;
+		cmd.cdw12 = count - 1;
+		if (nvme_build_prps(q, slot, &cmd, buffer, count * ns->lba_size)) {
+			dprintf("nvme: %s: can't map buffer %p for DMA\n", ns->name, (void *)buffer);
+			status = -EIO;
+		}
+	}
+
+	spin_lock(q->lock);
+	if (!status) {
+		q->status[slot] = NVME_PENDING;
+		memcpy(&q->sq[q->sq_tail], &cmd, sizeof(cmd));
+		q->sq_tail = (q->sq_tail + 1) % q->depth;
+		__sync_synchronize();
+		nvme_sq_doorbell(q);
+
+		while (q->status[slot] == NVME_PENDING) {
+			sleep_on_unlocking(q->waiters, &q->lock);
+			spin_lock(q->lock);
+		}
+		status = q->status[slot];
+	}
+
+	q->claimed &= ~(1UL << slot);
+	wakeup_queue(q->waiters);
+	spin_unlock(q->lock);
+
+	return status;
+}
+
+/**
+ * @brief Transfer whole cache blocks, trimming at the end of the namespace.
+ */
+static int nvme_transfer_blocks(struct nvme_ns * ns, uint64_t block, size_t count, uint8_t * buffer, int write) {
+	size_t per_block = BCACHE_BLOCK_SIZE / ns->lba_size;
+
+	while (count) {
+		size_t n = count < ns->ctrl->max_blocks ? count : ns->ctrl->max_blocks;
+		uint64_t lba = block * per_block;
+		size_t lbas = n * per_block;
+
+		if (lba >= ns->blocks) {
+			if (!write) memset(buffer, 0, n * BCACHE_BLOCK_SIZE);
+		} else {
+			if (lba + lbas > ns->blocks) {
+				size_t tail = lbas - (ns->blocks - lba);
+				lbas -= tail;
+				if (!write) memset(buffer + lbas * ns->lba_size, 0, tail * ns->lba_size);
+			}
+			int status = nvme_io(ns, write ? NVME_CMD_WRITE : NVME_CMD_READ, lba, lbas, buffer);
+			if (status) return status;
+		}
+
+		block  += n;
+		count  -= n;
+		buffer += n * BCACHE_BLOCK_SIZE;
+	}
+
+	return 0;
+}
+
+static int nvme_read_blocks(struct bcache_device * cache, uint64_t block, size_t count, uint8_t * buffer) {
+	return nvme_transfer_blocks(cache->driver, block, count, buffer, 0);
+}
+
+static int nvme_write_blocks(struct bcache_device * cache, uint64_t block, size_t count, uint8_t * buffer) {
+	return nvme_transfer_blocks(cache->driver, block, count, buffer, 1);
+}
+
+static int nvme_flush(struct bcache_device * cache) {
+	return nvme_io(cache->driver, NVME_CMD_FLUSH, 0, 0, NULL);
+}
+
+static void open_nvme(fs_node_t * node, unsigned int flags) {
+	return;
+}
+
+static void close_nvme(fs_node_t * node) {
+	return;
+}
+
+static fs_node_t * nvme_device_create(struct nvme_ns * ns) {
+	fs_node_t * fnode = malloc(sizeof(fs_node_t));
+	memset(fnode, 0x00, sizeof(fs_node_t));
+	fnode->inode = 0;
+	snprintf(fnode->name, 16, "%s", ns->name);
+	fnode->device  = &ns->cache;
+	fnode->uid = 0;
+	fnode->gid = 0;
+	fnode->mask    = 0660;
+	fnode->length  = ns->blocks * ns->lba_size;
+	fnode->flags   = FS_BLOCKDEVICE;
+	fnode->read    = bcache_node_read;
+	fnode->write   = bcache_node_write;
+	fnode->open    = open_nvme;
+	fnode->close   = close_nvme;
+	fnode->ioctl   = bcache_node_ioctl;
+
+	ns->cache.name = ns->name;
+	ns->cache.driver = ns;
+	ns->cache.size = fnode->length;
+	ns->cache.read_blocks = nvme_read_blocks;
+	ns->cache.write_blocks = nvme_write_blocks;
+	if (ns->ctrl->volatile_cache) ns->cache.flush = nvme_flush;
+	bcache_register(&ns->cache);
+	return fnode;
+}
+
+static void nvme_add_namespace(struct nvme_ctrl * ctrl, uint32_t nsid) {
+	if (nvme_identify(ctrl, NVME_IDENTIFY_NS, nsid)) return;
+
+	uint8_t * id = ctrl->scratch;
+	uint64_t blocks = *(uint64_t *)&id[NVME_ID_NS_NSZE];
+	int format = id[NVME_ID_NS_FLBAS] & 0xF;
+	int lbads = id[NVME_ID_NS_LBAF + format * 4 + 2];
+
+	if (!blocks || lbads < 9 || lbads > 12) {
+		dprintf("nvme: namespace %u: unsupported format (%lu blocks of 2^%d bytes)\n", nsid, blocks, lbads);
+		return;
+	}
+
+	struct nvme_ns * ns = calloc(1, sizeof(struct nvme_ns));
+	ns->ctrl = ctrl;
+	ns->nsid = nsid;
+	ns->blocks = blocks;
+	ns->lba_size = 1UL << lbads;
+	snprintf(ns->name, sizeof(ns->name), "nvme%dn%u", ctrl->index, nsid);
+
+	dprintf("nvme: %s: %lu blocks of %zu bytes\n", ns->name, ns->blocks, ns->lba_size);
+
+	char devname[64];
+	snprintf((char *)&devname, 30, "/dev/%s", ns->name);
+	fs_node_t * node = nvme_device_create(ns);
+	vfs_mount(devname, node);
+}
+
+static void find_nvme(uint32_t device, uint16_t vendorid, uint16_t deviceid, void * extra) {
+	if (pci_find_type(device) != 0x0108) return; /* Mass Storage, Non-Volatile Memory controller */
+	if (pci_read_field(device, PCI_PROG_IF, 1) != 0x02) return; /* NVM Express */
+	if (ctrl_count == sizeof(ctrls) / sizeof(*ctrls)) return;
+
+	uint16_t command_reg = pci_read_field(device, PCI_COMMAND, 2);
+	command_reg |= (1 << 2) | (1 << 1);
+	command_reg &= ~(1 << 10);
+	pci_write_field(device, PCI_COMMAND, 2, command_reg);
+
+	uint64_t bar = pci_read_field(device, PCI_BAR0, 4);
+	if (((bar >> 1) & 3) == 2) bar |= (uint64_t)pci_read_field(device, PCI_BAR1, 4) << 32;
+	bar &= ~0xFUL;
+
+	struct nvme_ctrl * ctrl = calloc(1, sizeof(struct nvme_ctrl));
+	ctrl->pcidev = device;
+	ctrl->index  = ctrl_count;
+	ctrl->mmio   = (uintptr_t)mmu_map_mmio_region(bar, NVME_REG_DB);
+	ctrl->cap    = mmio_read8(ctrl->mmio, NVME_REG_CAP);
+	ctrl->stride = 4 << NVME_CAP_DSTRD(ctrl->cap);
+
+	/*
+	 * MMIO space is never reclaimed, so map the doorbells on their own once
+	 * we know the stride rather than mapping the registers a second time:
+	 * a pair for the admin queue and each I/O queue.
+	 */
+	size_t db_size = (2 * (NVME_MAX_QUEUES + 1) * ctrl->stride + 0xFFF) & ~0xFFFUL;
+	ctrl->doorbells = (uintptr_t)mmu_map_mmio_region(bar + NVME_REG_DB, db_size);
+
+	uint32_t version = mmio_read4(ctrl->mmio, NVME_REG_VS);
+	dprintf("nvme: controller %d at %#x, version %d.%d, %u queue entries max\n",
+		ctrl->index, device, version >> 16, (version >> 8) & 0xFF,
+		(unsigned int)NVME_CAP_MQES(ctrl->cap) + 1);
+
+	/* Reset, then bring it back up with the admin queue. */
+	mmio_write4(ctrl->mmio, NVME_REG_CC, 0);
+	if (nvme_wait_ready(ctrl, 0)) {
+		dprintf("nvme: controller %d did not reset\n", ctrl->index);
+		goto _fail;
+	}
+
+	uint16_t max_depth = NVME_CAP_MQES(ctrl->cap) + 1;
+	nvme_queue_init(ctrl, &ctrl->admin, 0, NVME_ADMIN_DEPTH < max_depth ? NVME_ADMIN_DEPTH : max_depth);
+	mmio_write4(ctrl->mmio, NVME_REG_AQA, ((uint32_t)(ctrl->admin.depth - 1) << 16) | (ctrl->admin.depth - 1));
+	mmio_write8(ctrl->mmio, NVME_REG_ASQ, ctrl->admin.sq_phys);
+	mmio_write8(ctrl->mmio, NVME_REG_ACQ, ctrl->admin.cq_phys);
+	mmio_write4(ctrl->mmio, NVME_REG_CC, NVME_CC_EN | NVME_CC_IOSQES | NVME_CC_IOCQES);
+	if (nvme_wait_ready(ctrl, 1)) {
+		dprintf("nvme: controller %d did not come up\n", ctrl->index);
+		goto _fail;
+	}
+
+	ctrl->scratch = kvmalloc_p(0x1000, &ctrl->scratch_phys);
+	if (nvme_identify(ctrl, NVME_IDENTIFY_CTRL, 0)) goto _fail;
+
+	int mdts = ctrl->scratch[NVME_ID_CTRL_MDTS];
+	ctrl->max_blocks = NVME_MAX_BLOCKS;
+	if (mdts && mdts < 7 && (1UL << mdts) < ctrl->max_blocks) ctrl->max_blocks = 1UL << mdts;
+	ctrl->volatile_cache = ctrl->scratch[NVME_ID_CTRL_VWC] & 1;
+
+	/* Ask for a queue pair per CPU and take what we're given. */
+	int wanted = processor_count < NVME_MAX_QUEUES ? processor_count : NVME_MAX_QUEUES;
+	uint32_t granted = 0;
+	struct nvme_command cmd = {0};
+	cmd.cdw0  = NVME_ADMIN_SET_FEATURES;
+	cmd.cdw10 = NVME_FEATURE_NUM_QUEUES;
+	cmd.cdw11 = ((uint32_t)(wanted - 1) << 16) | (wanted - 1);
+	if (nvme_admin(ctrl, &cmd, &granted)) goto _fail;
+	int queues = wanted;
+	if ((int)(granted & 0xFFFF) + 1 < queues) queues = (granted & 0xFFFF) + 1;
+	if ((int)(granted >> 16) + 1 < queues) queues = (granted >> 16) + 1;
+
+	uint16_t depth = NVME_IO_DEPTH < max_depth ? NVME_IO_DEPTH : max_depth;
+	for (int i = 0; i < queues; ++i) {
+		struct nvme_queue * q = nvme_create_io_queue(ctrl, i + 1, depth);
+		if (!q) break;
+		ctrl->io_queues[ctrl->io_queue_count++] = q;
+	}
+	if (!ctrl->io_queue_count) {
+		dprintf("nvme: controller %d has no I/O queues\n", ctrl->index);
+		goto _fail;
+	}
+	dprintf("nvme: controller %d: %d I/O queues of %u entries, transfers up to %zu blocks\n",
+		ctrl->index, ctrl->io_queue_count, depth, ctrl->max_blocks);
+
+	/* The list is overwritten by each namespace's IDENTIFY, so take a copy. */
+	uint32_t nsids[NVME_MAX_NS];
+	int ns_count = 0;
+	if (!nvme_identify(ctrl, NVME_IDENTIFY_NS_LIST, 0)) {
+		uint32_t * list = (uint32_t *)ctrl->scratch;
+		while (ns_count < NVME_MAX_NS && list[ns_count]) {
+			nsids[ns_count] = list[ns_count];
+			ns_count++;
+		}
+	}
+	for (int i = 0; i < ns_count; ++i) {
+		nvme_add_namespace(ctrl, nsids[i]);
+	}
+
+	/* Only after the last polled admin command, as the handler doesn't look at the admin queue. */
+	int shared = 0;
+	ctrl->irq = pci_get_interrupt(device);
+	for (int i = 0; i < ctrl_count; ++i) {
+		if (ctrls[i]->irq == ctrl->irq) shared = 1;
+	}
+	ctrls[ctrl_count++] = ctrl;
+	if (!shared) irq_install_handler(ctrl->irq, nvme_irq_handler, "nvme");
+	return;
+
+_fail:
+	/* Disable the controller before giving its queues' memory back */
+	mmio_write4(ctrl->mmio, NVME_REG_CC, 0);
+	nvme_wait_ready(ctrl, 0);
+	if (ctrl->admin.sq) nvme_queue_free(&ctrl->admin);
+	if (ctrl->scratch) kvfree_p(ctrl->scratch_phys, 0x1000);
+	free(ctrl);
+}
+
+static int init(int argc, char * argv[]) {
+	pci_scan(find_nvme, -1, NULL);
+	return 0;
+}
+
+static int fini(void) {
+	return 0;
+}
+
+struct Module metadata = {
+	.name = "nvme",
+	.init = init,
+	.fini = fini,
+};
+
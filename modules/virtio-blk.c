@@ -0,0 +1,799 @@
+/**
+ * @brief virtio block device driver
+ * @file modules/virtio-blk.c
+ * @package x86_64
+ *
+ * Paravirtual disks for KVM and QEMU, through either the legacy
+ * (I/O port) or the modern (PCI capability) virtio transport.
+ *
+ * Requests go through a single split virtqueue. Each request is built
+ * in a slot of its own: a header, the data pages and a status byte,
+ * chained together in a descriptor table. When the device takes
+ * indirect descriptors the whole chain costs one ring entry; otherwise
+ * the table is copied into the ring. Up to VBLK_SLOTS requests are in
+ * flight at once, and the interrupt handler collects completions from
+ * the used ring and wakes the threads waiting on them.
+ *
+ * Disks are registered with the block cache as /dev/vdX.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2023 K. Lange
+ */
+#include <errno.h>
+#include <kernel/types.h>
+#include <kernel/string.h>
+#include <kernel/printf.h>
+#include <kernel/module.h>
+#include <kernel/pci.h>
+#include <kernel/vfs.h>
+#include <kernel/mmu.h>
+#include <kernel/list.h>
+#include <kernel/process.h>
+#include <kernel/spinlock.h>
+#include <kernel/bcache.h>
+
+#include <kernel/arch/x86_64/ports.h>
+#include <kernel/arch/x86_64/irq.h>
+
+#define VIRTIO_VENDOR          0x1AF4
+#define VIRTIO_BLK_LEGACY      0x1001
+#define VIRTIO_BLK_MODERN      0x1042
+
+/* Legacy registers, in I/O space at BAR0 */
+#define VIRTIO_PCI_HOST_FEATURES  0x00
+#define VIRTIO_PCI_GUEST_FEATURES 0x04
+#define VIRTIO_PCI_QUEUE_PFN      0x08
+#define VIRTIO_PCI_QUEUE_SIZE     0x0C
+#define VIRTIO_PCI_QUEUE_SEL      0x0E
+#define VIRTIO_PCI_QUEUE_NOTIFY   0x10
+#define VIRTIO_PCI_STATUS         0x12
+#define VIRTIO_PCI_ISR            0x13
+#define VIRTIO_PCI_CONFIG         0x14
+
+/* Modern vendor capability types */
+#define VIRTIO_PCI_CAP_COMMON_CFG 1
+#define VIRTIO_PCI_CAP_NOTIFY_CFG 2
+#define VIRTIO_PCI_CAP_ISR_CFG    3
+#define VIRTIO_PCI_CAP_DEVICE_CFG 4
+
+#define VIRTIO_STATUS_ACKNOWLEDGE 0x01
+#define VIRTIO_STATUS_DRIVER      0x02
+#define VIRTIO_STATUS_DRIVER_OK   0x04
+#define VIRTIO_STATUS_FEATURES_OK 0x08
+#define VIRTIO_STATUS_FAILED      0x80
+
+#define VIRTIO_BLK_F_SIZE_MAX     (1UL << 1)
+#define VIRTIO_BLK_F_SEG_MAX      (1UL << 2)
+#define VIRTIO_BLK_F_RO           (1UL << 5)
+#define VIRTIO_BLK_F_FLUSH        (1UL << 9)
+#define VIRTIO_F_INDIRECT_DESC    (1UL << 28)
+#define VIRTIO_F_VERSION_1        (1UL << 32)
+
+/* Device configuration */
+#define VIRTIO_BLK_CFG_CAPACITY   0
+#define VIRTIO_BLK_CFG_SIZE_MAX   8
+#define VIRTIO_BLK_CFG_SEG_MAX    12
+
+#define VIRTIO_BLK_T_IN           0
+#define VIRTIO_BLK_T_OUT          1
+#define VIRTIO_BLK_T_FLUSH        4
+#define VIRTIO_BLK_S_OK           0
+
+#define VIRTIO_BLK_SECTOR_SIZE    512
+
+struct virtio_pci_common_cfg {
+	volatile uint32_t device_feature_select;
+	volatile uint32_t device_feature;
+	volatile uint32_t driver_feature_select;
+	volatile uint32_t driver_feature;
+	volatile uint16_t msix_config;
+	volatile uint16_t num_queues;
+	volatile uint8_t  device_status;
+	volatile uint8_t  config_generation;
+
+	volatile uint16_t queue_select;
+	volatile uint16_t queue_size;
+	volatile uint16_t queue_msix_vector;
+	volatile uint16_t queue_enable;
+	volatile uint16_t queue_notify_off;
+	volatile uint32_t queue_desc_lo;
+	volatile uint32_t queue_desc_hi;
+	volatile uint32_t queue_avail_lo;
+	volatile uint32_t queue_avail_hi;
+	volatile uint32_t queue_used_lo;
+	volatile uint32_t queue_used_hi;
+} __attribute__((packed));
+
+struct virtq_desc {
+	uint64_t addr;
+	uint32_t len;
+	uint16_t flags;
+	uint16_t next;
+} __attribute__((packed));
+
+#define VIRTQ_DESC_F_NEXT     1
+#define VIRTQ_DESC_F_WRITE    2 /* Device writes this buffer */
+#define VIRTQ_DESC_F_INDIRECT 4
+
+struct virtq_avail {
+	uint16_t flags;
+	volatile uint16_t idx;
+	uint16_t ring[];
+} __attribute__((packed));
+
+struct virtq_used_elem {
+	uint32_t id;
+	uint32_t len;
+} __attribute__((packed));
+
+struct virtq_used {
+	volatile uint16_t flags;
+	volatile uint16_t idx;
+	struct virtq_used_elem ring[];
+} __attribute__((packed));
+
+#define VIRTQ_USED_F_NO_NOTIFY 1
+
+struct virtio_blk_header {
+	uint32_t type;
+	uint32_t reserved;
+	uint64_t sector;
+} __attribute__((packed));
+
+/*
+ * Every request has a slot: the header at the start, the status byte
+ * after it, and its descriptor table from VBLK_TABLE_OFFSET on.
+ */
+#define VBLK_SLOTS        32
+#define VBLK_SLOT_SIZE    2048
+#define VBLK_STATUS_OFFSET 16
+#define VBLK_TABLE_OFFSET 64
+#define VBLK_TABLE_MAX    ((VBLK_SLOT_SIZE - VBLK_TABLE_OFFSET) / sizeof(struct virtq_desc))
+#define VBLK_QUEUE_MAX    256
+#define VBLK_MAX_BLOCKS   64
+
+#define VBLK_PENDING      1
+
+struct vblk_device {
+	uint32_t pcidev;
+	int irq;
+	int modern;
+
+	/* Legacy transport */
+	uint16_t io_base;
+
+	/* Modern transport */
+	struct virtio_pci_common_cfg * common;
+	volatile uint8_t * isr;
+	volatile uint8_t * device_cfg;
+	volatile uint16_t * notify;
+
+	uint64_t features;
+	int indirect;
+	size_t max_segments;
+	size_t max_segment_size;
+
+	/* The request queue; descriptors not in use are chained through @c next */
+	struct virtq_desc * desc;
+	struct virtq_avail * avail;
+	struct virtq_used * used;
+	uint16_t queue_size;
+	uint16_t free_head;
+	uint16_t num_free;
+	uint16_t avail_idx;
+	uint16_t last_used;
+	uint8_t * head_slot;  /* Slot each chain in the ring belongs to */
+	uintptr_t ring_phys;
+	size_t ring_size;
+
+	uint8_t * slot_mem;
+	uintptr_t slot_phys;
+	uint32_t claimed;
+	int status[VBLK_SLOTS];
+
+	spin_lock_t lock;
+	list_t * waiters;
+
+	uint64_t capacity;    /* In 512-byte sectors */
+	char name[16];
+	struct bcache_device cache;
+};
+
+static int device_count = 0;
+static struct vblk_device * devices[32] = {NULL};
+static char vblk_drive_char = 'a';
+
+static void * kvmalloc_p(size_t size, uintptr_t * outphys) {
+	uintptr_t index = mmu_allocate_n_frames(size / 0x1000) << 12;
+	*outphys = index;
+	void * out = mmu_map_from_physical(index);
+	memset(out, 0, size);
+	return out;
+}
+
+static uint8_t vblk_get_status(struct vblk_device * dev) {
+	return dev->modern ? dev->common->device_status : inportb(dev->io_base + VIRTIO_PCI_STATUS);
+}
+
+static void vblk_set_status(struct vblk_device * dev, uint8_t status) {
+	if (dev->modern) {
+		dev->common->device_status = status;
+	} else {
+		outportb(dev->io_base + VIRTIO_PCI_STATUS, status);
+	}
+}
+
+static uint64_t vblk_cfg_read(struct vblk_device * dev, int offset, int size) {
+	uint64_t out = 0;
+	for (int i = size - 1; i >= 0; --i) {
+		uint8_t byte = dev->modern ? dev->device_cfg[offset + i] : inportb(dev->io_base + VIRTIO_PCI_CONFIG + offset + i);
+		out = (out << 8) | byte;
+	}
+	return out;
+}
+
+static void vblk_notify(struct vblk_device * dev) {
+	if (dev->modern) {
+		*dev->notify = 0;
+	} else {
+		outports(dev->io_base + VIRTIO_PCI_QUEUE_NOTIFY, 0);
+	}
+}
+
+/**
+ * @brief Reading the ISR status acknowledges the interrupt.
+ */
+static uint8_t vblk_isr(struct vblk_device * dev) {
+	return dev->modern ? *dev->isr : inportb(dev->io_base + VIRTIO_PCI_ISR);
+}
+
+/**
+ * @brief Put a chain of descriptors back on the free list.
+ *
+ * Requires the device lock.
+ */
+static void vblk_free_chain(struct vblk_device * dev, uint16_t head) {
+	uint16_t last = head;
+	uint16_t count = 1;
+	while (dev->desc[last].flags & VIRTQ_DESC_F_NEXT) {
+		last = dev->desc[last].next;
+		count++;
+	}
+	dev->desc[last].next = dev->free_head;
+	dev->free_head = head;
+	dev->num_free += count;
+}
+
+/**
+ * @brief Collect finished requests from the used ring.
+ *
+ * Requires the device lock.
+ */
+static void vblk_complete(struct vblk_device * dev) {
+	while (dev->last_used != dev->used->idx) {
+		__sync_synchronize();
+		struct virtq_used_elem * e = &dev->used->ring[dev->last_used % dev->queue_size];
+		int slot = dev->head_slot[e->id];
+		uint8_t result = dev->slot_mem[slot * VBLK_SLOT_SIZE + VBLK_STATUS_OFFSET];
+		dev->status[slot] = (result == VIRTIO_BLK_S_OK) ? 0 : -EIO;
+		vblk_free_chain(dev, e->id);
+		dev->last_used++;
+	}
+	wakeup_queue(dev->waiters);
+}
+
+static int vblk_irq_handler(struct regs * r) {
+	int irq = r->int_no - 32;
+	int handled = 0;
+
+	for (int i = 0; i < device_count; ++i) {
+		struct vblk_device * dev = devices[i];
+		if (dev->irq != irq) continue;
+		uint8_t isr = vblk_isr(dev);
+		if (!isr) continue;
+		if (isr & 1) {
+			spin_lock(dev->lock);
+			vblk_complete(dev);
+			spin_unlock(dev->lock);
+		}
+		handled = 1;
+	}
+
+	if (handled) irq_ack(irq);
+	return handled;
+}
+
+/**
+ * @brief Describe a kernel buffer with one descriptor per physical run.
+ *
+ * @returns Descriptors used, or -E2BIG if the device would need more
+ *          than it accepts in one request.
+ */
+static int vblk_map(struct vblk_device * dev, struct virtq_desc * table, uint8_t * buffer, size_t size, uint16_t flags) {
+	union PML * dir = mmu_get_kernel_directory();
+	uintptr_t addr = (uintptr_t)buffer;
+	uintptr_t next = 0;
+	size_t n = 0;
+
+	while (size) {
+		size_t chunk = 0x1000 - (addr & 0xFFF);
+		if (chunk > size) chunk = size;
+
+		uintptr_t phys = mmu_map_to_physical(dir, addr);
+		if (phys >= (uintptr_t)-4) return -EIO;
+
+		if (n && phys == next && table[n-1].len + chunk <= dev->max_segment_size) {
+			table[n-1].len += chunk;
+		} else {
+			if (n == dev->max_segments) return -E2BIG;
+			table[n].addr  = phys;
+			table[n].len   = chunk;
+			table[n].flags = flags | VIRTQ_DESC_F_NEXT;
+			table[n].next  = 0;
+			n++;
+		}
+
+		next = phys + chunk;
+		addr += chunk;
+		size -= chunk;
+	}
+
+	return n;
+}
+
+static int vblk_claim_slot(struct vblk_device * dev) {
+	for (int i = 0; i < VBLK_SLOTS; ++i) {
+		if (!(dev->claimed & (1UL << i))) {
+			dev->claimed |= (1UL << i);
+			return i;
+		}
+	}
+	return -1;
+}
+
+/**
+ * @brief Submit one request and sleep until the device has completed it.
+ *
+ * @param buffer Kernel buffer to transfer, or NULL for requests without data
+ * @returns 0 on success or a negative error
+ */
+static int vblk_request(struct vblk_device * dev, uint32_t type, uint64_t sector, uint8_t * buffer, size_t size) {
+	int slot;
+
+	spin_lock(dev->lock);
+	while ((slot = vblk_claim_slot(dev)) < 0) {
+		sleep_on_unlocking(dev->waiters, &dev->lock);
+		spin_lock(dev->lock);
+	}
+	spin_unlock(dev->lock);
+
+	uint8_t * mem = dev->slot_mem + slot * VBLK_SLOT_SIZE;
+	uintptr_t phys = dev->slot_phys + slot * VBLK_SLOT_SIZE;
+	struct virtio_blk_header * header = (void *)mem;
+	struct virtq_desc * table = (void *)(mem + VBLK_TABLE_OFFSET);
+
+	header->type = type;
+	header->reserved = 0;
+	header->sector = sector;
+	mem[VBLK_STATUS_OFFSET] = 0xFF;
+
+	table[0].addr  = phys;
+	table[0].len   = sizeof(struct virtio_blk_header);
+	table[0].flags = VIRTQ_DESC_F_NEXT;
+
+	int n = 1;
+	if (buffer) {
+		int segs = vblk_map(dev, &table[1], buffer, size, type == VIRTIO_BLK_T_IN ? VIRTQ_DESC_F_WRITE : 0);
+		if (segs < 0) {
+			spin_lock(dev->lock);
+			dev->claimed &= ~(1UL << slot);
+			wakeup_queue(dev->waiters);
+			spin_unlock(dev->lock);
+			return segs;
+		}
+		n += segs;
+	}
+
+	table[n].addr  = phys + VBLK_STATUS_OFFSET;
+	table[n].len   = 1;
+	table[n].flags = VIRTQ_DESC_F_WRITE;
+	n++;
+	for (int i = 0; i < n - 1; ++i) table[i].next = i + 1;
+
+	spin_lock(dev->lock);
+	uint16_t head = dev->free_head;
+	if (dev->indirect) {
+		while (!dev->num_free) {
+			sleep_on_unlocking(dev->waiters, &dev->lock);
+			spin_lock(dev->lock);
+		}
+		head = dev->free_head;
+		dev->free_head = dev->desc[head].next;
+		dev->num_free--;
+		dev->desc[head].addr  = phys + VBLK_TABLE_OFFSET;
+		dev->desc[head].len   = n * sizeof(struct virtq_desc);
+		dev->desc[head].flags = VIRTQ_DESC_F_INDIRECT;
+	} else {
+		while (dev->num_free < n) {
+			sleep_on_unlocking(dev->waiters, &dev->lock);
+			spin_lock(dev->lock);
+		}
+		/* Free descriptors are already linked; take the first n and keep their order. */
+		head = dev->free_head;
+		uint16_t idx = head;
+		for (int i = 0; i < n; ++i) {
+			uint16_t next = dev->desc[idx].next;
+			dev->desc[idx].addr  = table[i].addr;
+			dev->desc[idx].len   = table[i].len;
+			dev->desc[idx].flags = table[i].flags;
+			idx = next;
+		}
+		dev->free_head = idx;
+		dev->num_free -= n;
+	}
+
+	dev->head_slot[head] = slot;
+	dev->status[slot] = VBLK_PENDING;
+	dev->avail->ring[dev->avail_idx % dev->queue_size] = head;
+	__sync_synchronize();
+	dev->avail->idx = ++dev->avail_idx;
+	__sync_synchronize();
+	if (!(dev->used->flags & VIRTQ_USED_F_NO_NOTIFY)) vblk_notify(dev);
+
+	while (dev->status[slot] == VBLK_PENDING) {
+		sleep_on_unlocking(dev->waiters, &dev->lock);
+		spin_lock(dev->lock);
+	}
+	int status = dev->status[slot];
+
+	dev->claimed &= ~(1UL << slot);
+	wakeup_queue(dev->waiters);
+	spin_unlock(dev->lock);
+
+	return status;
+}
+
+/**
+ * @brief Transfer whole cache blocks, trimming at the end of the disk.
+ *
+ * Requests whose buffers break into more pieces than the device takes
+ * at once are split in half until they fit.
+ */
+static int vblk_transfer_blocks(struct vblk_device * dev, uint64_t block, size_t count, uint8_t * buffer, int write) {
+	size_t per_block = BCACHE_BLOCK_SIZE / VIRTIO_BLK_SECTOR_SIZE;
+
+	while (count) {
+		size_t n = count < VBLK_MAX_BLOCKS ? count : VBLK_MAX_BLOCKS;
+		uint64_t sector = block * per_block;
+		size_t sectors = n * per_block;
+
+		if (sector >= dev->capacity) {
+			if (!write) memset(buffer, 0, n * BCACHE_BLOCK_SIZE);
+		} else {
+			if (sector + sectors > dev->capacity) {
+				size_t tail = sectors - (dev->capacity - sector);
+				sectors -= tail;
+				if (!write) memset(buffer + sectors * VIRTIO_BLK_SECTOR_SIZE, 0, tail * VIRTIO_BLK_SECTOR_SIZE);
+			}
+			int status;
+			while ((status = vblk_request(dev, write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN, sector, buffer,
+					sectors * VIRTIO_BLK_SECTOR_SIZE)) == -E2BIG && n > 1) {
+				n /= 2;
+				if (sectors > n * per_block) sectors = n * per_block;
+			}
+			if (status) return status;
+		}
+
+		block  += n;
+		count  -= n;
+		buffer += n * BCACHE_BLOCK_SIZE;
+	}
+
+	return 0;
+}
+
+static int vblk_read_blocks(struct bcache_device * cache, uint64_t block, size_t count, uint8_t * buffer) {
+	return vblk_transfer_blocks(cache->driver, block, count, buffer, 0);
+}
+
+static int vblk_write_blocks(struct bcache_device * cache, uint64_t block, size_t count, uint8_t * buffer) {
+	return vblk_transfer_blocks(cache->driver, block, count, buffer, 1);
+}
+
+static int vblk_flush(struct bcache_device * cache) {
+	return vblk_request(cache->driver, VIRTIO_BLK_T_FLUSH, 0, NULL, 0);
+}
+
+static void open_vblk(fs_node_t * node, unsigned int flags) {
+	return;
+}
+
+static void close_vblk(fs_node_t * node) {
+	return;
+}
+
+static fs_node_t * vblk_device_create(struct vblk_device * dev) {
+	fs_node_t * fnode = malloc(sizeof(fs_node_t));
+	memset(fnode, 0x00, sizeof(fs_node_t));
+	fnode->inode = 0;
+	snprintf(fnode->name, 10, "%s", dev->name);
+	fnode->device  = &dev->cache;
+	fnode->uid = 0;
+	fnode->gid = 0;
+	fnode->mask    = 0660;
+	fnode->length  = dev->capacity * VIRTIO_BLK_SECTOR_SIZE;
+	fnode->flags   = FS_BLOCKDEVICE;
+	fnode->read    = bcache_node_read;
+	fnode->write   = bcache_node_write;
+	fnode->open    = open_vblk;
+	fnode->close   = close_vblk;
+	fnode->ioctl   = bcache_node_ioctl;
+
+	dev->cache.name = dev->name;
+	dev->cache.driver = dev;
+	dev->cache.size = fnode->length;
+	dev->cache.read_blocks = vblk_read_blocks;
+	if (!(dev->features & VIRTIO_BLK_F_RO)) {
+		dev->cache.write_blocks = vblk_write_blocks;
+	}
+	if (dev->features & VIRTIO_BLK_F_FLUSH) {
+		dev->cache.flush = vblk_flush;
+	}
+	bcache_register(&dev->cache);
+	return fnode;
+}
+
+/**
+ * @brief Map the part of a BAR a modern capability points at.
+ */
+static void * vblk_map_cap(uint32_t device, int cap) {
+	int bar = pci_read_field(device, cap + 4, 1);
+	uint32_t offset = pci_read_field(device, cap + 8, 4);
+	uint32_t length = pci_read_field(device, cap + 12, 4);
+
+	uint32_t bar_low = pci_read_field(device, PCI_BAR0 + bar * 4, 4);
+	if (bar_low & 1) return NULL; /* I/O space */
+	uint64_t base = bar_low & 0xFFFFFFF0;
+	if (((bar_low >> 1) & 3) == 2) {
+		base |= (uint64_t)pci_read_field(device, PCI_BAR0 + bar * 4 + 4, 4) << 32;
+	}
+
+	uint64_t start = (base + offset) & ~0xFFFUL;
+	size_t size = ((base + offset + length - start) + 0xFFF) & ~0xFFFUL;
+	uint8_t * mapped = mmu_map_mmio_region(start, size);
+	return mapped + (base + offset - start);
+}
+
+/**
+ * @brief Find the modern transport's register blocks.
+ * @returns 1 if they are all there.
+ */
+static int vblk_find_caps(struct vblk_device * dev) {
+	uint32_t device = dev->pcidev;
+	if (!(pci_read_field(device, PCI_STATUS, 2) & 0x10)) return 0;
+
+	uint8_t * notify_base = NULL;
+	uint32_t notify_mult = 0;
+
+	int cap = pci_read_field(device, 0x34, 1) & 0xFC;
+	while (cap) {
+		if (pci_read_field(device, cap, 1) == 0x09) {
+			switch (pci_read_field(device, cap + 3, 1)) {
+				case VIRTIO_PCI_CAP_COMMON_CFG:
+					if (!dev->common) dev->common = vblk_map_cap(device, cap);
+					break;
+				case VIRTIO_PCI_CAP_NOTIFY_CFG:
+					if (!notify_base) {
+						notify_base = vblk_map_cap(device, cap);
+						notify_mult = pci_read_field(device, cap + 16, 4);
+					}
+					break;
+				case VIRTIO_PCI_CAP_ISR_CFG:
+					if (!dev->isr) dev->isr = vblk_map_cap(device, cap);
+					break;
+				case VIRTIO_PCI_CAP_DEVICE_CFG:
+					if (!dev->device_cfg) dev->device_cfg = vblk_map_cap(device, cap);
+					break;
+			}
+		}
+		cap = pci_read_field(device, cap + 1, 1) & 0xFC;
+	}
+
+	if (!dev->common || !notify_base || !dev->isr || !dev->device_cfg) return 0;
+
+	dev->common->queue_select = 0;
+	dev->notify = (volatile uint16_t *)(notify_base + dev->common->queue_notify_off * notify_mult);
+	return 1;
+}
+
+/**
+ * @brief Agree on features.
+ * @returns 0 if the device accepted what we asked for.
+ */
+static int vblk_negotiate(struct vblk_device * dev) {
+	uint64_t wanted = VIRTIO_BLK_F_SIZE_MAX | VIRTIO_BLK_F_SEG_MAX | VIRTIO_BLK_F_RO | VIRTIO_BLK_F_FLUSH | VIRTIO_F_INDIRECT_DESC;
+	uint64_t offered;
+
+	if (dev->modern) {
+		dev->common->device_feature_select = 0;
+		offered = dev->common->device_feature;
+		dev->common->device_feature_select = 1;
+		offered |= (uint64_t)dev->common->device_feature << 32;
+		if (!(offered & VIRTIO_F_VERSION_1)) return 1;
+		dev->features = offered & (wanted | VIRTIO_F_VERSION_1);
+		dev->common->driver_feature_select = 0;
+		dev->common->driver_feature = dev->features & 0xFFFFFFFF;
+		dev->common->driver_feature_select = 1;
+		dev->common->driver_feature = dev->features >> 32;
+		vblk_set_status(dev, vblk_get_status(dev) | VIRTIO_STATUS_FEATURES_OK);
+		if (!(vblk_get_status(dev) & VIRTIO_STATUS_FEATURES_OK)) return 1;
+	} else {
+		offered = inportl(dev->io_base + VIRTIO_PCI_HOST_FEATURES);
+		dev->features = offered & wanted;
+		outportl(dev->io_base + VIRTIO_PCI_GUEST_FEATURES, dev->features);
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Set up the request queue.
+ *
+ * The legacy transport wants the rings laid out one after the other,
+ * with the used ring on its own page; the modern one is happy with that too.
+ */
+static int vblk_setup_queue(struct vblk_device * dev) {
+	uint16_t size;
+	if (dev->modern) {
+		dev->common->queue_select = 0;
+		size = dev->common->queue_size;
+		if (size > VBLK_QUEUE_MAX) {
+			size = VBLK_QUEUE_MAX;
+			dev->common->queue_size = size;
+		}
+	} else {
+		outports(dev->io_base + VIRTIO_PCI_QUEUE_SEL, 0);
+		size = inports(dev->io_base + VIRTIO_PCI_QUEUE_SIZE);
+	}
+	if (!size) return 1;
+
+	size_t avail_end = sizeof(struct virtq_desc) * size + sizeof(struct virtq_avail) + sizeof(uint16_t) * (size + 1);
+	size_t used_offset = (avail_end + 0xFFF) & ~0xFFFUL;
+	size_t total = used_offset + ((sizeof(struct virtq_used) + sizeof(struct virtq_used_elem) * size + sizeof(uint16_t) + 0xFFF) & ~0xFFFUL);
+
+	uintptr_t phys;
+	uint8_t * ring = kvmalloc_p(total, &phys);
+	dev->ring_phys = phys;
+	dev->ring_size = total;
+	dev->queue_size = size;
+	dev->desc  = (void *)ring;
+	dev->avail = (void *)(ring + sizeof(struct virtq_desc) * size);
+	dev->used  = (void *)(ring + used_offset);
+	dev->head_slot = calloc(size, sizeof(uint8_t));
+
+	for (uint16_t i = 0; i < size; ++i) {
+		dev->desc[i].next = i + 1;
+	}
+	dev->free_head = 0;
+	dev->num_free = size;
+
+	if (dev->modern) {
+		uintptr_t avail = phys + sizeof(struct virtq_desc) * size;
+		uintptr_t used  = phys + used_offset;
+		dev->common->queue_desc_lo  = phys & 0xFFFFFFFF;
+		dev->common->queue_desc_hi  = phys >> 32;
+		dev->common->queue_avail_lo = avail & 0xFFFFFFFF;
+		dev->common->queue_avail_hi = avail >> 32;
+		dev->common->queue_used_lo  = used & 0xFFFFFFFF;
+		dev->common->queue_used_hi  = used >> 32;
+		dev->common->queue_enable = 1;
+	} else {
+		outportl(dev->io_base + VIRTIO_PCI_QUEUE_PFN, phys >> 12);
+	}
+
+	return 0;
+}
+
+static void find_vblk(uint32_t device, uint16_t vendorid, uint16_t deviceid, void * extra) {
+	if (vendorid != VIRTIO_VENDOR) return;
+	if (deviceid != VIRTIO_BLK_LEGACY && deviceid != VIRTIO_BLK_MODERN) return;
+	if (device_count == sizeof(devices) / sizeof(*devices)) return;
+
+	struct vblk_device * dev = calloc(1, sizeof(struct vblk_device));
+	dev->pcidev = device;
+
+	uint16_t command_reg = pci_read_field(device, PCI_COMMAND, 2);
+	command_reg |= (1 << 2) | (1 << 1) | (1 << 0);
+	command_reg &= ~(1 << 10);
+	pci_write_field(device, PCI_COMMAND, 2, command_reg);
+
+	dev->modern = vblk_find_caps(dev);
+	if (!dev->modern) {
+		uint32_t bar0 = pci_read_field(device, PCI_BAR0, 4);
+		if (!(bar0 & 1)) {
+			dprintf("virtio-blk: device %#x has neither transport\n", device);
+			free(dev);
+			return;
+		}
+		dev->io_base = bar0 & 0xFFFFFFFC;
+	}
+
+	vblk_set_status(dev, 0);
+	if (dev->modern) while (vblk_get_status(dev));
+	vblk_set_status(dev, VIRTIO_STATUS_ACKNOWLEDGE);
+	vblk_set_status(dev, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
+
+	if (vblk_negotiate(dev) || vblk_setup_queue(dev)) {
+		dprintf("virtio-blk: device %#x could not be set up\n", device);
+		/* Make the device forget the ring before we give its memory back */
+		vblk_set_status(dev, 0);
+		if (dev->modern) while (vblk_get_status(dev));
+		vblk_set_status(dev, VIRTIO_STATUS_FAILED);
+		for (size_t i = 0; i < dev->ring_size; i += 0x1000) mmu_frame_release(dev->ring_phys + i);
+		if (dev->head_slot) free(dev->head_slot);
+		free(dev);
+		return;
+	}
+
+	dev->indirect = !!(dev->features & VIRTIO_F_INDIRECT_DESC);
+
+	/* Leave room for the header and status descriptors. */
+	dev->max_segments = dev->indirect ? VBLK_TABLE_MAX : dev->queue_size;
+	if (dev->max_segments > VBLK_TABLE_MAX) dev->max_segments = VBLK_TABLE_MAX;
+	if (dev->features & VIRTIO_BLK_F_SEG_MAX) {
+		size_t seg_max = vblk_cfg_read(dev, VIRTIO_BLK_CFG_SEG_MAX, 4);
+		if (seg_max && seg_max + 2 < dev->max_segments) dev->max_segments = seg_max + 2;
+	}
+	dev->max_segments -= 2;
+	dev->max_segment_size = 0x400000;
+	if (dev->features & VIRTIO_BLK_F_SIZE_MAX) {
+		size_t size_max = vblk_cfg_read(dev, VIRTIO_BLK_CFG_SIZE_MAX, 4);
+		if (size_max >= 0x1000 && size_max < dev->max_segment_size) dev->max_segment_size = size_max;
+	}
+
+	dev->capacity = vblk_cfg_read(dev, VIRTIO_BLK_CFG_CAPACITY, 8);
+	dev->slot_mem = kvmalloc_p(VBLK_SLOTS * VBLK_SLOT_SIZE, &dev->slot_phys);
+	dev->waiters = list_create("virtio-blk waiters", dev);
+	spin_init(dev->lock);
+	snprintf(dev->name, sizeof(dev->name), "vd%c", vblk_drive_char);
+
+	int shared = 0;
+	dev->irq = pci_get_interrupt(device);
+	for (int i = 0; i < device_count; ++i) {
+		if (devices[i]->irq == dev->irq) shared = 1;
+	}
+	devices[device_count++] = dev;
+	if (!shared) irq_install_handler(dev->irq, vblk_irq_handler, "virtio-blk");
+
+	vblk_set_status(dev, vblk_get_status(dev) | VIRTIO_STATUS_DRIVER_OK);
+
+	dprintf("virtio-blk: %s: %s transport, %lu sectors, queue of %u%s%s\n",
+		dev->name, dev->modern ? "modern" : "legacy", dev->capacity, dev->queue_size,
+		dev->indirect ? ", indirect descriptors" : "",
+		(dev->features & VIRTIO_BLK_F_RO) ? ", read-only" : "");
+
+	char devname[64];
+	snprintf((char *)&devname, 20, "/dev/%s", dev->name);
+	fs_node_t * node = vblk_device_create(dev);
+	vfs_mount(devname, node);
+
+	vblk_drive_char++;
+}
+
+static int init(int argc, char * argv[]) {
+	pci_scan(find_vblk, -1, NULL);
+	return 0;
+}
+
+static int fini(void) {
+	return 0;
+}
+
+struct Module metadata = {
+	.name = "virtio-blk",
+	.init = init,
+	.fini = fini,
+};
+
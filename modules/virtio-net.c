@@ -0,0 +1,1123 @@
+/**
+ * @brief virtio network device driver
+ * @file modules/virtio-net.c
+ * @package x86_64
+ *
+ * Paravirtual NICs for KVM and QEMU, through either the legacy
+ * (I/O port) or the modern (PCI capability) virtio transport.
+ *
+ * Frames move through pairs of split virtqueues, one RX and one TX.
+ * When the device offers more than one pair we ask for one per CPU,
+ * up to VNET_MAX_PAIRS, and a sender uses the pair belonging to the
+ * CPU it is running on. Each pair has a poller thread that works like
+ * the e1000's: the interrupt handler suppresses further RX interrupts
+ * and wakes it, and it polls with an adaptive budget until the ring is
+ * empty before turning interrupts back on.
+ *
+ * RX descriptors point straight into pooled netbufs. With mergeable
+ * RX buffers a frame may span several of them, in which case it is
+ * gathered into one buffer before going up the stack. TX descriptors
+ * point at the netbuf being sent, with the virtio header pushed into
+ * its headroom, and the device finishes TCP checksums when it offers to.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2023 K. Lange
+ */
+#include <errno.h>
+#include <kernel/types.h>
+#include <kernel/string.h>
+#include <kernel/printf.h>
+#include <kernel/module.h>
+#include <kernel/pci.h>
+#include <kernel/vfs.h>
+#include <kernel/mmu.h>
+#include <kernel/misc.h>
+#include <kernel/time.h>
+#include <kernel/process.h>
+#include <kernel/spinlock.h>
+#include <kernel/net/netif.h>
+#include <kernel/net/eth.h>
+
+#include <kernel/arch/x86_64/ports.h>
+#include <kernel/arch/x86_64/irq.h>
+
+#include <sys/socket.h>
+#include <net/if.h>
+
+#define VIRTIO_VENDOR          0x1AF4
+#define VIRTIO_NET_LEGACY      0x1000
+#define VIRTIO_NET_MODERN      0x1041
+
+/* Legacy registers, in I/O space at BAR0 */
+#define VIRTIO_PCI_HOST_FEATURES  0x00
+#define VIRTIO_PCI_GUEST_FEATURES 0x04
+#define VIRTIO_PCI_QUEUE_PFN      0x08
+#define VIRTIO_PCI_QUEUE_SIZE     0x0C
+#define VIRTIO_PCI_QUEUE_SEL      0x0E
+#define VIRTIO_PCI_QUEUE_NOTIFY   0x10
+#define VIRTIO_PCI_STATUS         0x12
+#define VIRTIO_PCI_ISR            0x13
+#define VIRTIO_PCI_CONFIG         0x14
+
+/* Modern vendor capability types */
+#define VIRTIO_PCI_CAP_COMMON_CFG 1
+#define VIRTIO_PCI_CAP_NOTIFY_CFG 2
+#define VIRTIO_PCI_CAP_ISR_CFG    3
+#define VIRTIO_PCI_CAP_DEVICE_CFG 4
+
+#define VIRTIO_STATUS_ACKNOWLEDGE 0x01
+#define VIRTIO_STATUS_DRIVER      0x02
+#define VIRTIO_STATUS_DRIVER_OK   0x04
+#define VIRTIO_STATUS_FEATURES_OK 0x08
+#define VIRTIO_STATUS_FAILED      0x80
+
+#define VIRTIO_ISR_QUEUE          0x01
+#define VIRTIO_ISR_CONFIG         0x02
+
+#define VIRTIO_NET_F_CSUM         (1UL << 0)  /* Device finishes checksums we leave partial */
+#define VIRTIO_NET_F_GUEST_CSUM   (1UL << 1)  /* Device tells us about checksums it has checked */
+#define VIRTIO_NET_F_MAC          (1UL << 5)
+#define VIRTIO_NET_F_MRG_RXBUF    (1UL << 15)
+#define VIRTIO_NET_F_STATUS       (1UL << 16)
+#define VIRTIO_NET_F_CTRL_VQ      (1UL << 17)
+#define VIRTIO_NET_F_MQ           (1UL << 22)
+#define VIRTIO_F_ANY_LAYOUT       (1UL << 27)
+#define VIRTIO_F_VERSION_1        (1UL << 32)
+
+/* Device configuration */
+#define VIRTIO_NET_CFG_MAC        0
+#define VIRTIO_NET_CFG_STATUS     6
+#define VIRTIO_NET_CFG_MAX_PAIRS  8
+
+#define VIRTIO_NET_S_LINK_UP      1
+
+/* Control queue commands */
+#define VIRTIO_NET_CTRL_MQ              4
+#define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET 0
+#define VIRTIO_NET_OK                   0
+
+struct virtio_pci_common_cfg {
+	volatile uint32_t device_feature_select;
+	volatile uint32_t device_feature;
+	volatile uint32_t driver_feature_select;
+	volatile uint32_t driver_feature;
+	volatile uint16_t msix_config;
+	volatile uint16_t num_queues;
+	volatile uint8_t  device_status;
+	volatile uint8_t  config_generation;
+
+	volatile uint16_t queue_select;
+	volatile uint16_t queue_size;
+	volatile uint16_t queue_msix_vector;
+	volatile uint16_t queue_enable;
+	volatile uint16_t queue_notify_off;
+	volatile uint32_t queue_desc_lo;
+	volatile uint32_t queue_desc_hi;
+	volatile uint32_t queue_avail_lo;
+	volatile uint32_t queue_avail_hi;
+	volatile uint32_t queue_used_lo;
+	volatile uint32_t queue_used_hi;
+} __attribute__((packed));
+
+struct virtq_desc {
+	uint64_t addr;
+	uint32_t len;
+	uint16_t flags;
+	uint16_t next;
+} __attribute__((packed));
+
+#define VIRTQ_DESC_F_NEXT     1
+#define VIRTQ_DESC_F_WRITE    2 /* Device writes this buffer */
+
+struct virtq_avail {
+	volatile uint16_t flags;
+	volatile uint16_t idx;
+	uint16_t ring[];
+} __attribute__((packed));
+
+#define VIRTQ_AVAIL_F_NO_INTERRUPT 1
+
+struct virtq_used_elem {
+	uint32_t id;
+	uint32_t len;
+} __attribute__((packed));
+
+struct virtq_used {
+	volatile uint16_t flags;
+	volatile uint16_t idx;
+	struct virtq_used_elem ring[];
+} __attribute__((packed));
+
+#define VIRTQ_USED_F_NO_NOTIFY 1
+
+/* In front of every frame in both directions */
+struct virtio_net_hdr {
+	uint8_t  flags;
+	uint8_t  gso_type;
+	uint16_t hdr_len;
+	uint16_t gso_size;
+	uint16_t csum_start;
+	uint16_t csum_offset;
+	uint16_t num_buffers; /* Only with mergeable RX buffers or the modern transport */
+} __attribute__((packed));
+
+#define VIRTIO_NET_HDR_F_NEEDS_CSUM 1
+#define VIRTIO_NET_HDR_F_DATA_VALID 2
+
+#define VNET_QUEUE_MAX    256
+#define VNET_MAX_PAIRS    8
+#define VNET_BUDGET_MIN   16  /* RX buffers per polling pass */
+#define VNET_BUDGET_MAX   256
+#define VNET_TX_BATCH     32  /* Most frames queued before we notify the device */
+
+struct vnet_device;
+
+/**
+ * One virtqueue. RX and TX put one chain in the ring per buffer: a
+ * single descriptor, or two if the virtio header has to be described
+ * on its own. Descriptors not in use are chained through @c next.
+ */
+struct vnet_queue {
+	uint16_t index;
+	struct virtq_desc * desc;
+	struct virtq_avail * avail;
+	struct virtq_used * used;
+	volatile uint16_t * notify;
+	uint16_t size;
+	uint16_t free_head;
+	uint16_t num_free;
+	uint16_t avail_idx;
+	uint16_t last_used;
+	uint16_t pending;       /* Buffers added since the device was last notified */
+	uint16_t split;         /* Bytes at the start of each buffer that get a descriptor of their own, or 0 */
+	struct netbuf ** bufs;  /* Buffer behind each chain, by its first descriptor */
+	uintptr_t ring_phys;
+	size_t ring_size;
+	spin_lock_t lock;
+};
+
+struct vnet_pair {
+	struct vnet_device * dev;
+	struct vnet_queue rx;   /* Only touched by the poller once running */
+	struct vnet_queue tx;
+
+	/* Set while the poller is running and RX interrupts are suppressed */
+	volatile int polling;
+	int rx_budget;
+	process_t * poller;
+
+	netif_queue_counters_t counts;
+};
+
+struct vnet_device {
+	struct EthernetDevice eth;
+	uint32_t pcidev;
+	int irq;
+	int modern;
+
+	/* Legacy transport */
+	uint16_t io_base;
+
+	/* Modern transport */
+	struct virtio_pci_common_cfg * common;
+	volatile uint8_t * isr;
+	volatile uint8_t * device_cfg;
+	uint8_t * notify_base;
+	uint32_t notify_mult;
+
+	uint64_t features;
+	size_t hdr_len;
+	int link_up;
+
+	int pair_count;
+	struct vnet_pair * pairs;
+	struct vnet_queue ctrl;
+	uint8_t * ctrl_mem;
+	uintptr_t ctrl_phys;
+};
+
+static int device_count = 0;
+static struct vnet_device * devices[32] = {NULL};
+
+static void * kvmalloc_p(size_t size, uintptr_t * outphys) {
+	uintptr_t index = mmu_allocate_n_frames(size / 0x1000) << 12;
+	*outphys = index;
+	void * out = mmu_map_from_physical(index);
+	memset(out, 0, size);
+	return out;
+}
+
+static void delay_yield(size_t subticks) {
+	unsigned long s, ss;
+	relative_time(0, subticks, &s, &ss);
+	sleep_until((process_t *)this_core->current_process, s, ss);
+	switch_task(0);
+}
+
+static uint8_t vnet_get_status(struct vnet_device * dev) {
+	return dev->modern ? dev->common->device_status : inportb(dev->io_base + VIRTIO_PCI_STATUS);
+}
+
+static void vnet_set_status(struct vnet_device * dev, uint8_t status) {
+	if (dev->modern) {
+		dev->common->device_status = status;
+	} else {
+		outportb(dev->io_base + VIRTIO_PCI_STATUS, status);
+	}
+}
+
+static uint64_t vnet_cfg_read(struct vnet_device * dev, int offset, int size) {
+	uint64_t out = 0;
+	for (int i = size - 1; i >= 0; --i) {
+		uint8_t byte = dev->modern ? dev->device_cfg[offset + i] : inportb(dev->io_base + VIRTIO_PCI_CONFIG + offset + i);
+		out = (out << 8) | byte;
+	}
+	return out;
+}
+
+/**
+ * @brief Reading the ISR status acknowledges the interrupt.
+ */
+static uint8_t vnet_isr(struct vnet_device * dev) {
+	return dev->modern ? *dev->isr : inportb(dev->io_base + VIRTIO_PCI_ISR);
+}
+
+static void vnet_notify(struct vnet_device * dev, struct vnet_queue * q) {
+	if (dev->modern) {
+		*q->notify = q->index;
+	} else {
+		outports(dev->io_base + VIRTIO_PCI_QUEUE_NOTIFY, q->index);
+	}
+}
+
+/**
+ * @brief Tell the device about buffers added since the last time, unless it has asked us not to.
+ */
+static int vnet_kick(struct vnet_device * dev, struct vnet_queue * q) {
+	if (!q->pending) return 0;
+	q->pending = 0;
+	__sync_synchronize();
+	if (q->used->flags & VIRTQ_USED_F_NO_NOTIFY) return 0;
+	vnet_notify(dev, q);
+	return 1;
+}
+
+/**
+ * @brief Descriptors one buffer takes up in @p q.
+ */
+static int vnet_queue_descs(struct vnet_queue * q) {
+	return q->split ? 2 : 1;
+}
+
+/**
+ * @brief Put one buffer in the ring; the caller makes sure enough descriptors are free.
+ */
+static void vnet_queue_add(struct vnet_queue * q, struct netbuf * nb, uintptr_t addr, uint32_t len, uint16_t flags) {
+	uint16_t id = q->free_head;
+	uint16_t last = id;
+
+	if (q->split) {
+		/* The two halves are still contiguous; the device just wants to be told about them separately. */
+		q->desc[id].addr  = addr;
+		q->desc[id].len   = q->split;
+		q->desc[id].flags = flags | VIRTQ_DESC_F_NEXT;
+		last = q->desc[id].next;
+		addr += q->split;
+		len  -= q->split;
+	}
+
+	q->free_head = q->desc[last].next;
+	q->num_free -= vnet_queue_descs(q);
+
+	q->desc[last].addr  = addr;
+	q->desc[last].len   = len;
+	q->desc[last].flags = flags;
+	q->bufs[id] = nb;
+
+	q->avail->ring[q->avail_idx % q->size] = id;
+	__sync_synchronize();
+	q->avail->idx = ++q->avail_idx;
+	q->pending++;
+}
+
+static int vnet_queue_ready(struct vnet_queue * q) {
+	return q->last_used != q->used->idx;
+}
+
+/**
+ * @brief Take the next buffer the device has finished with.
+ * @returns The buffer, or NULL if there are none.
+ */
+static struct netbuf * vnet_queue_get(struct vnet_queue * q, uint32_t * len) {
+	if (!vnet_queue_ready(q)) return NULL;
+	__sync_synchronize();
+
+	struct virtq_used_elem * e = &q->used->ring[q->last_used % q->size];
+	uint16_t id = e->id;
+	*len = e->len;
+
+	struct netbuf * nb = q->bufs[id];
+	q->bufs[id] = NULL;
+
+	uint16_t last = id;
+	while (q->desc[last].flags & VIRTQ_DESC_F_NEXT) last = q->desc[last].next;
+	q->desc[last].next = q->free_head;
+	q->free_head = id;
+	q->num_free += vnet_queue_descs(q);
+	q->last_used++;
+	return nb;
+}
+
+/**
+ * @brief Give every free RX descriptor a fresh buffer.
+ */
+static void vnet_rx_fill(struct vnet_queue * q) {
+	while (q->num_free >= vnet_queue_descs(q)) {
+		struct netbuf * nb = netbuf_alloc(NETBUF_POOL_MTU);
+		vnet_queue_add(q, nb, netbuf_phys(nb, nb->data), NETBUF_POOL_MTU, VIRTQ_DESC_F_WRITE);
+	}
+}
+
+/**
+ * @brief Gather a frame the device spread over several RX buffers.
+ *
+ * @p first is the buffer holding the virtio header; the other @p count - 1
+ * are the next ones in the used ring. All of them are released.
+ */
+static struct netbuf * vnet_rx_merge(struct vnet_device * dev, struct vnet_queue * q, struct netbuf * first, uint16_t count) {
+	if ((uint16_t)(q->used->idx - q->last_used) < count - 1) {
+		/* The device should never do this */
+		netbuf_release(first);
+		return NULL;
+	}
+
+	size_t total = first->len - dev->hdr_len;
+	for (uint16_t i = 0; i < count - 1; ++i) {
+		total += q->used->ring[(uint16_t)(q->last_used + i) % q->size].len;
+	}
+
+	struct netbuf * nb = netbuf_alloc(total);
+	memcpy(netbuf_put(nb, first->len - dev->hdr_len), first->data + dev->hdr_len, first->len - dev->hdr_len);
+	netbuf_release(first);
+
+	for (uint16_t i = 0; i < count - 1; ++i) {
+		uint32_t len;
+		struct netbuf * part = vnet_queue_get(q, &len);
+		memcpy(netbuf_put(nb, len), part->data, len);
+		netbuf_release(part);
+	}
+
+	return nb;
+}
+
+/**
+ * @brief Pass up to @p budget received frames to the stack.
+ *
+ * The ring is refilled, and the device notified, once at the end.
+ */
+static int vnet_rx_poll(struct vnet_pair * pair, int budget) {
+	struct vnet_device * dev = pair->dev;
+	struct vnet_queue * q = &pair->rx;
+	int processed = 0;
+
+	while (processed < budget) {
+		uint32_t len;
+		struct netbuf * nb = vnet_queue_get(q, &len);
+		if (!nb) break;
+		processed++;
+
+		if (len < dev->hdr_len) {
+			pair->counts.rx_errors++;
+			netbuf_release(nb);
+			continue;
+		}
+
+		struct virtio_net_hdr * hdr = (struct virtio_net_hdr *)nb->data;
+		uint8_t flags = hdr->flags;
+		uint16_t count = (dev->features & VIRTIO_NET_F_MRG_RXBUF) ? hdr->num_buffers : 1;
+		nb->len = len;
+
+		if (count > 1) {
+			nb = vnet_rx_merge(dev, q, nb, count);
+			if (!nb) {
+				pair->counts.rx_errors++;
+				continue;
+			}
+		} else {
+			netbuf_pull(nb, dev->hdr_len);
+		}
+
+		/* Either the device checked it, or it came from another guest on this host and was never summed */
+		if (flags & (VIRTIO_NET_HDR_F_DATA_VALID | VIRTIO_NET_HDR_F_NEEDS_CSUM)) {
+			nb->flags |= NETBUF_CSUM_VALID;
+		}
+
+		pair->counts.rx_packets++;
+		pair->counts.rx_bytes += nb->len;
+
+		net_eth_handle(nb, dev->eth.device_node);
+		netbuf_release(nb);
+	}
+
+	if (processed) {
+		vnet_rx_fill(q);
+		vnet_kick(dev, q);
+	}
+
+	return processed;
+}
+
+/**
+ * @brief Release buffers the device has finished sending.
+ *
+ * Requires the TX lock.
+ */
+static void vnet_tx_reclaim(struct vnet_pair * pair) {
+	uint32_t len;
+	struct netbuf * nb;
+	while ((nb = vnet_queue_get(&pair->tx, &len))) {
+		netbuf_release(nb);
+		pair->counts.tx_reclaimed++;
+	}
+}
+
+/**
+ * @brief Poller thread for one queue pair.
+ *
+ * Same shape as the e1000's: poll until a pass comes up short, growing
+ * the budget and yielding while passes use all of it, then allow RX
+ * interrupts again and sleep. TX interrupts stay off; finished TX
+ * buffers are collected here and whenever a sender finds the ring full.
+ */
+static void vnet_poller(void * data) {
+	struct vnet_pair * pair = data;
+	struct vnet_device * dev = pair->dev;
+
+	while (1) {
+		int budget = pair->rx_budget;
+		int processed = vnet_rx_poll(pair, budget);
+		pair->counts.rx_polls++;
+
+		spin_lock(pair->tx.lock);
+		vnet_tx_reclaim(pair);
+		if (vnet_kick(dev, &pair->tx)) pair->counts.tx_doorbells++;
+		spin_unlock(pair->tx.lock);
+
+		if (processed == budget) {
+			pair->counts.rx_budget_hits++;
+			if (pair->rx_budget < VNET_BUDGET_MAX) pair->rx_budget *= 2;
+			switch_task(1);
+			continue;
+		}
+
+		if (processed < budget / 4 && pair->rx_budget > VNET_BUDGET_MIN) pair->rx_budget /= 2;
+
+		/* Caught up; go back to interrupts, and catch anything that slipped in before they were on. */
+		__sync_lock_release(&pair->polling);
+		pair->rx.avail->flags = 0;
+		__sync_synchronize();
+		if (vnet_queue_ready(&pair->rx) && !__sync_lock_test_and_set(&pair->polling, 1)) {
+			pair->rx.avail->flags = VIRTQ_AVAIL_F_NO_INTERRUPT;
+			continue;
+		}
+
+		/* The interrupt handler makes us ready again */
+		switch_task(0);
+	}
+}
+
+static int vnet_irq_handler(struct regs * r) {
+	int irq = r->int_no - 32;
+	int handled = 0;
+
+	for (int i = 0; i < device_count; ++i) {
+		struct vnet_device * dev = devices[i];
+		if (dev->irq != irq) continue;
+		uint8_t isr = vnet_isr(dev);
+		if (!isr) continue;
+		handled = 1;
+
+		if ((isr & VIRTIO_ISR_CONFIG) && (dev->features & VIRTIO_NET_F_STATUS)) {
+			dev->link_up = !!(vnet_cfg_read(dev, VIRTIO_NET_CFG_STATUS, 2) & VIRTIO_NET_S_LINK_UP);
+		}
+
+		if (isr & VIRTIO_ISR_QUEUE) {
+			/* With one pin for every queue, wake whichever pollers have something to do */
+			for (int p = 0; p < dev->pair_count; ++p) {
+				struct vnet_pair * pair = &dev->pairs[p];
+				if (vnet_queue_ready(&pair->rx) && !__sync_lock_test_and_set(&pair->polling, 1)) {
+					pair->rx.avail->flags = VIRTQ_AVAIL_F_NO_INTERRUPT;
+					pair->counts.rx_interrupts++;
+					make_process_ready(pair->poller);
+				}
+			}
+		}
+	}
+
+	if (handled) irq_ack(irq);
+	return handled;
+}
+
+/**
+ * @brief Queue a frame on this CPU's TX queue.
+ *
+ * The virtio header goes in the buffer's headroom, so the frame needs
+ * no copy, and only one descriptor where the device allows it. The
+ * ring keeps the caller's reference until the device is done with it;
+ * frames marked NETBUF_MORE are only announced to the device with the
+ * rest of their batch.
+ */
+static void vnet_transmit(struct EthernetDevice * eth, struct netbuf * nb) {
+	struct vnet_device * dev = (struct vnet_device *)eth;
+	struct vnet_pair * pair = &dev->pairs[this_core->cpu_id % dev->pair_count];
+	struct vnet_queue * q = &pair->tx;
+
+	if (!nb->phys || (size_t)(nb->data - nb->buf) < dev->hdr_len) {
+		/* From the heap, or no room for our header; the device needs it somewhere it can see. */
+		if (nb->len > NETBUF_POOL_MTU) {
+			netbuf_release(nb);
+			return;
+		}
+		struct netbuf * copy = netbuf_copy(nb);
+		netbuf_release(nb);
+		nb = copy;
+	}
+
+	size_t payload_size = nb->len;
+	int more = nb->flags & NETBUF_MORE;
+
+	struct virtio_net_hdr * hdr = netbuf_push(nb, dev->hdr_len);
+	memset(hdr, 0, dev->hdr_len);
+	if (nb->flags & NETBUF_CSUM_PARTIAL) {
+		hdr->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+		hdr->csum_start = (nb->buf + nb->csum_start) - (nb->data + dev->hdr_len);
+		hdr->csum_offset = nb->csum_offset;
+	}
+
+	spin_lock(q->lock);
+
+	if (q->num_free < vnet_queue_descs(q)) {
+		vnet_tx_reclaim(pair);
+	}
+
+	if (q->num_free < vnet_queue_descs(q)) {
+		pair->counts.tx_ring_full++;
+		if (vnet_kick(dev, q)) pair->counts.tx_doorbells++;
+		int timeout = 1000;
+		do {
+			spin_unlock(q->lock);
+			delay_yield(10000);
+			timeout--;
+			if (timeout == 0) {
+				printf("virtio-net: wait for tx timed out, giving up\n");
+				netbuf_release(nb);
+				return;
+			}
+			spin_lock(q->lock);
+			vnet_tx_reclaim(pair);
+		} while (q->num_free < vnet_queue_descs(q));
+	}
+
+	vnet_queue_add(q, nb, netbuf_phys(nb, nb->data), nb->len, 0);
+
+	pair->counts.tx_packets++;
+	pair->counts.tx_bytes += payload_size;
+
+	if (!more || q->pending >= VNET_TX_BATCH) {
+		if (vnet_kick(dev, q)) pair->counts.tx_doorbells++;
+	}
+
+	spin_unlock(q->lock);
+}
+
+#define privileged() do { if (this_core->current_process->user != USER_ROOT_UID) { return -EPERM; } } while (0)
+
+static int ioctl_vnet(fs_node_t * node, unsigned long request, void * argp) {
+	struct vnet_device * nic = node->device;
+
+	switch (request) {
+		case SIOCGIFHWADDR:
+			/* fill argp with mac */
+			memcpy(argp, nic->eth.mac, 6);
+			return 0;
+
+		case SIOCGIFADDR:
+			if (nic->eth.ipv4_addr == 0) return -ENOENT;
+			memcpy(argp, &nic->eth.ipv4_addr, sizeof(nic->eth.ipv4_addr));
+			return 0;
+		case SIOCSIFADDR:
+			privileged();
+			memcpy(&nic->eth.ipv4_addr, argp, sizeof(nic->eth.ipv4_addr));
+			return 0;
+		case SIOCGIFNETMASK:
+			if (nic->eth.ipv4_subnet == 0) return -ENOENT;
+			memcpy(argp, &nic->eth.ipv4_subnet, sizeof(nic->eth.ipv4_subnet));
+			return 0;
+		case SIOCSIFNETMASK:
+			privileged();
+			memcpy(&nic->eth.ipv4_subnet, argp, sizeof(nic->eth.ipv4_subnet));
+			return 0;
+		case SIOCGIFGATEWAY:
+			if (nic->eth.ipv4_subnet == 0) return -ENOENT;
+			memcpy(argp, &nic->eth.ipv4_gateway, sizeof(nic->eth.ipv4_gateway));
+			return 0;
+		case SIOCSIFGATEWAY:
+			privileged();
+			memcpy(&nic->eth.ipv4_gateway, argp, sizeof(nic->eth.ipv4_gateway));
+			net_arp_ask(nic->eth.ipv4_gateway, node);
+			return 0;
+
+		case SIOCGIFADDR6:
+			return -ENOENT;
+		case SIOCSIFADDR6:
+			privileged();
+			memcpy(&nic->eth.ipv6_addr, argp, sizeof(nic->eth.ipv6_addr));
+			return 0;
+
+		case SIOCGIFFLAGS: {
+			uint32_t * flags = argp;
+			*flags = IFF_RUNNING;
+			if (nic->link_up) *flags |= IFF_UP;
+			*flags |= IFF_BROADCAST;
+			*flags |= IFF_MULTICAST;
+			return 0;
+		}
+
+		case SIOCGIFMTU: {
+			uint32_t * mtu = argp;
+			*mtu = nic->eth.mtu;
+			return 0;
+		}
+
+		case SIOCGIFCOUNTS: {
+			netif_counters_t * counts = argp;
+			memset(counts, 0, sizeof(netif_counters_t));
+			for (int i = 0; i < nic->pair_count; ++i) {
+				counts->rx_count += nic->pairs[i].counts.rx_packets;
+				counts->rx_bytes += nic->pairs[i].counts.rx_bytes;
+				counts->tx_count += nic->pairs[i].counts.tx_packets;
+				counts->tx_bytes += nic->pairs[i].counts.tx_bytes;
+			}
+			return 0;
+		}
+
+		case SIOCGIFQCOUNTS: {
+			netif_queue_counters_t * counts = argp;
+			uint32_t queue = counts->queue;
+			if (queue >= (uint32_t)nic->pair_count) return -ENOENT;
+			memcpy(counts, &nic->pairs[queue].counts, sizeof(netif_queue_counters_t));
+			counts->queue = queue;
+			counts->queue_count = nic->pair_count;
+			return 0;
+		}
+
+		default:
+			return -EINVAL;
+	}
+}
+
+static ssize_t write_vnet(fs_node_t * node, off_t offset, size_t size, uint8_t * buffer) {
+	struct vnet_device * nic = node->device;
+	if (size > NETBUF_POOL_MTU) return -EINVAL;
+	/* write packet */
+	struct netbuf * nb = netbuf_alloc(size);
+	memcpy(netbuf_put(nb, size), buffer, size);
+	vnet_transmit(&nic->eth, nb);
+	return size;
+}
+
+/**
+ * @brief Map the part of a BAR a modern capability points at.
+ */
+static void * vnet_map_cap(uint32_t device, int cap) {
+	int bar = pci_read_field(device, cap + 4, 1);
+	uint32_t offset = pci_read_field(device, cap + 8, 4);
+	uint32_t length = pci_read_field(device, cap + 12, 4);
+
+	uint32_t bar_low = pci_read_field(device, PCI_BAR0 + bar * 4, 4);
+	if (bar_low & 1) return NULL; /* I/O space */
+	uint64_t base = bar_low & 0xFFFFFFF0;
+	if (((bar_low >> 1) & 3) == 2) {
+		base |= (uint64_t)pci_read_field(device, PCI_BAR0 + bar * 4 + 4, 4) << 32;
+	}
+
+	uint64_t start = (base + offset) & ~0xFFFUL;
+	size_t size = ((base + offset + length - start) + 0xFFF) & ~0xFFFUL;
+	uint8_t * mapped = mmu_map_mmio_region(start, size);
+	return mapped + (base + offset - start);
+}
+
+/**
+ * @brief Find the modern transport's register blocks.
+ * @returns 1 if they are all there.
+ */
+static int vnet_find_caps(struct vnet_device * dev) {
+	uint32_t device = dev->pcidev;
+	if (!(pci_read_field(device, PCI_STATUS, 2) & 0x10)) return 0;
+
+	int cap = pci_read_field(device, 0x34, 1) & 0xFC;
+	while (cap) {
+		if (pci_read_field(device, cap, 1) == 0x09) {
+			switch (pci_read_field(device, cap + 3, 1)) {
+				case VIRTIO_PCI_CAP_COMMON_CFG:
+					if (!dev->common) dev->common = vnet_map_cap(device, cap);
+					break;
+				case VIRTIO_PCI_CAP_NOTIFY_CFG:
+					if (!dev->notify_base) {
+						dev->notify_base = vnet_map_cap(device, cap);
+						dev->notify_mult = pci_read_field(device, cap + 16, 4);
+					}
+					break;
+				case VIRTIO_PCI_CAP_ISR_CFG:
+					if (!dev->isr) dev->isr = vnet_map_cap(device, cap);
+					break;
+				case VIRTIO_PCI_CAP_DEVICE_CFG:
+					if (!dev->device_cfg) dev->device_cfg = vnet_map_cap(device, cap);
+					break;
+			}
+		}
+		cap = pci_read_field(device, cap + 1, 1) & 0xFC;
+	}
+
+	return dev->common && dev->notify_base && dev->isr && dev->device_cfg;
+}
+
+/**
+ * @brief Agree on features.
+ * @returns 0 if the device accepted what we asked for.
+ */
+static int vnet_negotiate(struct vnet_device * dev) {
+	uint64_t wanted = VIRTIO_NET_F_CSUM | VIRTIO_NET_F_GUEST_CSUM | VIRTIO_NET_F_MAC | VIRTIO_NET_F_MRG_RXBUF |
+		VIRTIO_NET_F_STATUS | VIRTIO_NET_F_CTRL_VQ | VIRTIO_NET_F_MQ;
+	uint64_t offered;
+
+	if (dev->modern) {
+		dev->common->device_feature_select = 0;
+		offered = dev->common->device_feature;
+		dev->common->device_feature_select = 1;
+		offered |= (uint64_t)dev->common->device_feature << 32;
+		if (!(offered & VIRTIO_F_VERSION_1)) return 1;
+		dev->features = offered & (wanted | VIRTIO_F_VERSION_1);
+	} else {
+		/* The modern transport always lets the header share a descriptor with the frame */
+		offered = inportl(dev->io_base + VIRTIO_PCI_HOST_FEATURES);
+		dev->features = offered & (wanted | VIRTIO_F_ANY_LAYOUT);
+	}
+
+	/* Multiqueue is configured through the control queue */
+	if (!(dev->features & VIRTIO_NET_F_CTRL_VQ)) dev->features &= ~VIRTIO_NET_F_MQ;
+
+	if (dev->modern) {
+		dev->common->driver_feature_select = 0;
+		dev->common->driver_feature = dev->features & 0xFFFFFFFF;
+		dev->common->driver_feature_select = 1;
+		dev->common->driver_feature = dev->features >> 32;
+		vnet_set_status(dev, vnet_get_status(dev) | VIRTIO_STATUS_FEATURES_OK);
+		if (!(vnet_get_status(dev) & VIRTIO_STATUS_FEATURES_OK)) return 1;
+	} else {
+		outportl(dev->io_base + VIRTIO_PCI_GUEST_FEATURES, dev->features);
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Set up virtqueue @p index.
+ *
+ * The legacy transport wants the rings laid out one after the other,
+ * with the used ring on its own page; the modern one is happy with that too.
+ */
+static int vnet_setup_queue(struct vnet_device * dev, struct vnet_queue * q, uint16_t index) {
+	uint16_t size;
+	if (dev->modern) {
+		dev->common->queue_select = index;
+		size = dev->common->queue_size;
+		if (size > VNET_QUEUE_MAX) {
+			size = VNET_QUEUE_MAX;
+			dev->common->queue_size = size;
+		}
+	} else {
+		outports(dev->io_base + VIRTIO_PCI_QUEUE_SEL, index);
+		size = inports(dev->io_base + VIRTIO_PCI_QUEUE_SIZE);
+	}
+	if (!size) return 1;
+
+	size_t avail_end = sizeof(struct virtq_desc) * size + sizeof(struct virtq_avail) + sizeof(uint16_t) * (size + 1);
+	size_t used_offset = (avail_end + 0xFFF) & ~0xFFFUL;
+	size_t total = used_offset + ((sizeof(struct virtq_used) + sizeof(struct virtq_used_elem) * size + sizeof(uint16_t) + 0xFFF) & ~0xFFFUL);
+
+	uintptr_t phys;
+	uint8_t * ring = kvmalloc_p(total, &phys);
+	q->ring_phys = phys;
+	q->ring_size = total;
+	q->index = index;
+	q->size  = size;
+	q->desc  = (void *)ring;
+	q->avail = (void *)(ring + sizeof(struct virtq_desc) * size);
+	q->used  = (void *)(ring + used_offset);
+	q->bufs  = calloc(size, sizeof(struct netbuf *));
+	spin_init(q->lock);
+
+	for (uint16_t i = 0; i < size; ++i) {
+		q->desc[i].next = i + 1;
+	}
+	q->free_head = 0;
+	q->num_free = size;
+
+	if (dev->modern) {
+		uintptr_t avail = phys + sizeof(struct virtq_desc) * size;
+		uintptr_t used  = phys + used_offset;
+		dev->common->queue_desc_lo  = phys & 0xFFFFFFFF;
+		dev->common->queue_desc_hi  = phys >> 32;
+		dev->common->queue_avail_lo = avail & 0xFFFFFFFF;
+		dev->common->queue_avail_hi = avail >> 32;
+		dev->common->queue_used_lo  = used & 0xFFFFFFFF;
+		dev->common->queue_used_hi  = used >> 32;
+		q->notify = (volatile uint16_t *)(dev->notify_base + dev->common->queue_notify_off * dev->notify_mult);
+		dev->common->queue_enable = 1;
+	} else {
+		outportl(dev->io_base + VIRTIO_PCI_QUEUE_PFN, phys >> 12);
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Release a queue's rings and any buffers still in it.
+ *
+ * Only for queues the device has been reset out of.
+ */
+static void vnet_queue_free(struct vnet_queue * q) {
+	if (!q->size) return;
+	for (uint16_t i = 0; i < q->size; ++i) {
+		if (q->bufs[i]) netbuf_release(q->bufs[i]);
+	}
+	free(q->bufs);
+	for (size_t i = 0; i < q->ring_size; i += 0x1000) {
+		mmu_frame_release(q->ring_phys + i);
+	}
+	q->size = 0;
+}
+
+/**
+ * @brief Ask the device to spread traffic over @p pairs queue pairs.
+ *
+ * Only done once, at startup, so we just poll for the answer.
+ *
+ * @returns 0 if the device agreed.
+ */
+static int vnet_set_pairs(struct vnet_device * dev, uint16_t pairs) {
+	struct vnet_queue * q = &dev->ctrl;
+	uint8_t * mem = dev->ctrl_mem;
+	uintptr_t phys = dev->ctrl_phys;
+
+	/* Class and command, then the argument, then the device's answer */
+	mem[0] = VIRTIO_NET_CTRL_MQ;
+	mem[1] = VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET;
+	memcpy(mem + 16, &pairs, sizeof(uint16_t));
+	mem[32] = 0xFF;
+
+	q->desc[0].addr  = phys;
+	q->desc[0].len   = 2;
+	q->desc[0].flags = VIRTQ_DESC_F_NEXT;
+	q->desc[0].next  = 1;
+	q->desc[1].addr  = phys + 16;
+	q->desc[1].len   = sizeof(uint16_t);
+	q->desc[1].flags = VIRTQ_DESC_F_NEXT;
+	q->desc[1].next  = 2;
+	q->desc[2].addr  = phys + 32;
+	q->desc[2].len   = 1;
+	q->desc[2].flags = VIRTQ_DESC_F_WRITE;
+
+	q->avail->ring[q->avail_idx % q->size] = 0;
+	__sync_synchronize();
+	q->avail->idx = ++q->avail_idx;
+	__sync_synchronize();
+	vnet_notify(dev, q);
+
+	uint64_t expire = arch_perf_timer() + 1000000UL * arch_cpu_mhz();
+	while (!vnet_queue_ready(q)) {
+		if (arch_perf_timer() >= expire) {
+			dprintf("virtio-net: %s: no answer to control command\n", dev->eth.if_name);
+			return 1;
+		}
+	}
+	q->last_used++;
+
+	return mem[32] != VIRTIO_NET_OK;
+}
+
+static void find_vnet(uint32_t device, uint16_t vendorid, uint16_t deviceid, void * found) {
+	if (vendorid != VIRTIO_VENDOR) return;
+	if (deviceid != VIRTIO_NET_LEGACY && deviceid != VIRTIO_NET_MODERN) return;
+	if (device_count == sizeof(devices) / sizeof(*devices)) return;
+
+	struct vnet_device * dev = calloc(1, sizeof(struct vnet_device));
+	dev->pcidev = device;
+
+	snprintf(dev->eth.if_name, 31,
+		"enp%ds%d",
+		(int)pci_extract_bus(device),
+		(int)pci_extract_slot(device));
+
+	uint16_t command_reg = pci_read_field(device, PCI_COMMAND, 2);
+	command_reg |= (1 << 2) | (1 << 1) | (1 << 0);
+	command_reg &= ~(1 << 10);
+	pci_write_field(device, PCI_COMMAND, 2, command_reg);
+
+	dev->modern = vnet_find_caps(dev);
+	if (!dev->modern) {
+		uint32_t bar0 = pci_read_field(device, PCI_BAR0, 4);
+		if (!(bar0 & 1)) {
+			dprintf("virtio-net: device %#x has neither transport\n", device);
+			free(dev);
+			return;
+		}
+		dev->io_base = bar0 & 0xFFFFFFFC;
+	}
+
+	vnet_set_status(dev, 0);
+	if (dev->modern) while (vnet_get_status(dev));
+	vnet_set_status(dev, VIRTIO_STATUS_ACKNOWLEDGE);
+	vnet_set_status(dev, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
+
+	if (vnet_negotiate(dev)) goto _fail;
+
+	/* The header grows a buffer count with mergeable buffers, and always has it on the modern transport */
+	dev->hdr_len = (dev->features & (VIRTIO_NET_F_MRG_RXBUF | VIRTIO_F_VERSION_1)) ? sizeof(struct virtio_net_hdr) : sizeof(struct virtio_net_hdr) - sizeof(uint16_t);
+
+	int max_pairs = 1;
+	if (dev->features & VIRTIO_NET_F_MQ) {
+		max_pairs = vnet_cfg_read(dev, VIRTIO_NET_CFG_MAX_PAIRS, 2);
+		if (max_pairs < 1) max_pairs = 1;
+	}
+
+	dev->pair_count = processor_count;
+	if (dev->pair_count > max_pairs) dev->pair_count = max_pairs;
+	if (dev->pair_count > VNET_MAX_PAIRS) dev->pair_count = VNET_MAX_PAIRS;
+	dev->pairs = calloc(dev->pair_count, sizeof(struct vnet_pair));
+
+	for (int i = 0; i < dev->pair_count; ++i) {
+		struct vnet_pair * pair = &dev->pairs[i];
+		pair->dev = dev;
+		if (vnet_setup_queue(dev, &pair->rx, 2 * i) || vnet_setup_queue(dev, &pair->tx, 2 * i + 1)) goto _fail;
+		if (!(dev->features & (VIRTIO_F_ANY_LAYOUT | VIRTIO_F_VERSION_1))) {
+			/* Older hosts expect the header in a descriptor of its own */
+			pair->rx.split = dev->hdr_len;
+			pair->tx.split = dev->hdr_len;
+		}
+		/* Finished TX buffers are collected as we go; we never need to hear about them */
+		pair->tx.avail->flags = VIRTQ_AVAIL_F_NO_INTERRUPT;
+		pair->rx.avail->flags = VIRTQ_AVAIL_F_NO_INTERRUPT;
+		pair->polling = 1; /* The poller starts out running */
+		pair->rx_budget = VNET_BUDGET_MIN;
+	}
+
+	if (dev->features & VIRTIO_NET_F_CTRL_VQ) {
+		/* The control queue comes after every pair the device has, not just the ones we use */
+		if (vnet_setup_queue(dev, &dev->ctrl, 2 * max_pairs)) goto _fail;
+		dev->ctrl_mem = kvmalloc_p(0x1000, &dev->ctrl_phys);
+	}
+
+	if (dev->features & VIRTIO_NET_F_MAC) {
+		for (int i = 0; i < 6; ++i) {
+			dev->eth.mac[i] = vnet_cfg_read(dev, VIRTIO_NET_CFG_MAC + i, 1);
+		}
+	} else {
+		/* Make up a locally administered address */
+		dev->eth.mac[0] = 0x02;
+		dev->eth.mac[3] = pci_extract_bus(device);
+		dev->eth.mac[4] = pci_extract_slot(device);
+		dev->eth.mac[5] = pci_extract_func(device);
+	}
+
+	dev->link_up = 1;
+	if (dev->features & VIRTIO_NET_F_STATUS) {
+		dev->link_up = !!(vnet_cfg_read(dev, VIRTIO_NET_CFG_STATUS, 2) & VIRTIO_NET_S_LINK_UP);
+	}
+
+	int shared = 0;
+	dev->irq = pci_get_interrupt(device);
+	for (int i = 0; i < device_count; ++i) {
+		if (devices[i]->irq == dev->irq) shared = 1;
+	}
+	devices[device_count++] = dev;
+	if (!shared) irq_install_handler(dev->irq, vnet_irq_handler, "virtio-net");
+
+	vnet_set_status(dev, vnet_get_status(dev) | VIRTIO_STATUS_DRIVER_OK);
+
+	for (int i = 0; i < dev->pair_count; ++i) {
+		vnet_rx_fill(&dev->pairs[i].rx);
+		vnet_kick(dev, &dev->pairs[i].rx);
+	}
+
+	/* Until told otherwise the device only uses the first pair */
+	if (dev->pair_count > 1 && vnet_set_pairs(dev, dev->pair_count)) {
+		dprintf("virtio-net: %s: device refused %d queue pairs\n", dev->eth.if_name, dev->pair_count);
+		dev->pair_count = 1;
+	}
+
+	dev->eth.device_node = calloc(sizeof(fs_node_t),1);
+	snprintf(dev->eth.device_node->name, 100, "%s", dev->eth.if_name);
+	dev->eth.device_node->flags = FS_BLOCKDEVICE; /* NETDEVICE? */
+	dev->eth.device_node->mask  = 0644; /* temporary; shouldn't be doing this with these device files */
+	dev->eth.device_node->ioctl = ioctl_vnet;
+	dev->eth.device_node->write = write_vnet;
+	dev->eth.device_node->device = dev;
+	dev->eth.transmit = vnet_transmit;
+	if (dev->features & VIRTIO_NET_F_CSUM) dev->eth.offloads |= NETIF_OFFLOAD_TX_CSUM;
+
+	dev->eth.mtu = 1500;
+
+	net_add_interface(dev->eth.if_name, dev->eth.device_node);
+
+	for (int i = 0; i < dev->pair_count; ++i) {
+		char worker_name[34];
+		snprintf(worker_name, 33, "[%sq%d]", dev->eth.if_name, i);
+		dev->pairs[i].poller = spawn_worker_thread(vnet_poller, worker_name, &dev->pairs[i]);
+	}
+
+	dprintf("virtio-net: %s: %s transport, mac " MAC_FORMAT ", %d queue pair%s%s%s\n",
+		dev->eth.if_name, dev->modern ? "modern" : "legacy", FORMAT_MAC(dev->eth.mac),
+		dev->pair_count, dev->pair_count == 1 ? "" : "s",
+		(dev->features & VIRTIO_NET_F_MRG_RXBUF) ? ", mergeable buffers" : "",
+		(dev->features & VIRTIO_NET_F_CSUM) ? ", checksum offload" : "");
+
+	*(int*)found = 1;
+	return;
+
+_fail:
+	dprintf("virtio-net: device %#x could not be set up\n", device);
+	/* Make the device forget the rings before we give their memory back */
+	vnet_set_status(dev, 0);
+	if (dev->modern) while (vnet_get_status(dev));
+	vnet_set_status(dev, VIRTIO_STATUS_FAILED);
+	if (dev->pairs) {
+		for (int i = 0; i < dev->pair_count; ++i) {
+			vnet_queue_free(&dev->pairs[i].rx);
+			vnet_queue_free(&dev->pairs[i].tx);
+		}
+		free(dev->pairs);
+	}
+	vnet_queue_free(&dev->ctrl);
+	if (dev->ctrl_mem) mmu_frame_release(dev->ctrl_phys);
+	free(dev);
+}
+
+static int init(int argc, char * argv[]) {
+	int found = 0;
+	pci_scan(find_vnet, -1, &found);
+	return found ? 0 : -ENODEV;
+}
+
+static int fini(void) {
+	return 0;
+}
+
+struct Module metadata = {
+	.name = "virtio-net",
+	.init = init,
+	.fini = fini,
+};